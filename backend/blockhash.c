@@ -0,0 +1,323 @@
+#define _GNU_SOURCE
+#include "blockhash.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BLOCK_SUMS_MAGIC "wave-blocksums"
+
+#define ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+
+typedef enum {
+    JOB_IDLE,
+    JOB_QUEUED,
+    JOB_DONE
+} JobState;
+
+typedef struct {
+    const uint8_t* data;
+    uint64_t offset;
+    size_t length;
+    JobState state;
+    int result;
+} HashJob;
+
+struct BlockHasher {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;    // the thread waits for jobs
+    pthread_cond_t done;    // callers wait for their job
+    HashJob* jobs;
+    uint32_t* queue;        // slots in submission order
+    uint32_t max_jobs;
+    uint32_t queue_head;
+    uint32_t queue_length;
+    int busy;
+    int stop;
+    
+    uint64_t image_size;
+    uint32_t block_size;
+    uint64_t n_blocks;
+    uint8_t* digests;       // n_blocks * SHA256_DIGEST_SIZE
+    const uint8_t* expected;
+    size_t n_expected;
+    uint8_t zero_digest[SHA256_DIGEST_SIZE];
+    uint8_t tail_zero_digest[SHA256_DIGEST_SIZE];   // the last block may be shorter
+    
+    uint64_t bytes_hashed;
+    uint64_t busy_ns;
+};
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Accepts "<64 hex digits>" optionally followed by whitespace and anything
+// else, so sha256sum output can be used as it is
+static int parse_digest(const char* line, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        int high = hex_value(line[2 * i]);
+        int low = high < 0 ? -1 : hex_value(line[2 * i + 1]);
+        if (low < 0) {
+            return -EBADMSG;
+        }
+        digest[i] = (uint8_t)(high << 4 | low);
+    }
+    
+    char next = line[2 * SHA256_DIGEST_SIZE];
+    return next == '\0' || next == '\n' || next == ' ' || next == '\t' ? 0 : -EBADMSG;
+}
+
+int block_sums_load(const char* path, uint32_t* block_size, uint8_t** digests, size_t* n_digests) {
+    FILE* file = fopen(path, "re");
+    if (!file) {
+        return -errno;
+    }
+    
+    char line[256];
+    unsigned version;
+    unsigned long size;
+    if (!fgets(line, sizeof(line), file) ||
+        sscanf(line, BLOCK_SUMS_MAGIC " %u %lu", &version, &size) != 2 || version != 1 || size == 0 ||
+        size > UINT32_MAX) {
+        fclose(file);
+        return -EBADMSG;
+    }
+    
+    uint8_t* list = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    int result = 0;
+    
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '\n' || line[0] == '#') {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            uint8_t* grown = realloc(list, capacity * SHA256_DIGEST_SIZE);
+            if (!grown) {
+                result = -ENOMEM;
+                break;
+            }
+            list = grown;
+        }
+        result = parse_digest(line, list + count * SHA256_DIGEST_SIZE);
+        if (result < 0) {
+            break;
+        }
+        count++;
+    }
+    
+    if (result == 0 && ferror(file)) {
+        result = -EIO;
+    }
+    fclose(file);
+    if (result < 0) {
+        free(list);
+        return result;
+    }
+    
+    *block_size = (uint32_t)size;
+    *digests = list;
+    *n_digests = count;
+    return 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// Stores the digest of a block and compares it with the expected one
+static int record_digest(BlockHasher* hasher, uint64_t index, const uint8_t digest[SHA256_DIGEST_SIZE]) {
+    memcpy(hasher->digests + index * SHA256_DIGEST_SIZE, digest, SHA256_DIGEST_SIZE);
+    if (!hasher->expected) {
+        return 0;
+    }
+    if (index >= hasher->n_expected ||
+        memcmp(hasher->expected + index * SHA256_DIGEST_SIZE, digest, SHA256_DIGEST_SIZE) != 0) {
+        return -EBADMSG;
+    }
+    return 0;
+}
+
+static void* hash_thread(void* data) {
+    BlockHasher* hasher = data;
+    
+    pthread_mutex_lock(&hasher->lock);
+    for (;;) {
+        while (hasher->queue_length == 0 && !hasher->stop) {
+            pthread_cond_wait(&hasher->work, &hasher->lock);
+        }
+        if (hasher->queue_length == 0) {
+            break;
+        }
+        
+        uint32_t slot = hasher->queue[hasher->queue_head];
+        hasher->queue_head = (hasher->queue_head + 1) % hasher->max_jobs;
+        hasher->queue_length--;
+        hasher->busy = 1;
+        HashJob* job = &hasher->jobs[slot];
+        pthread_mutex_unlock(&hasher->lock);
+        
+        uint64_t start = now_ns();
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        sha256(job->data, job->length, digest);
+        int result = record_digest(hasher, job->offset / hasher->block_size, digest);
+        ATOMIC_ADD(&hasher->busy_ns, now_ns() - start);
+        ATOMIC_ADD(&hasher->bytes_hashed, job->length);
+        
+        pthread_mutex_lock(&hasher->lock);
+        job->result = result;
+        job->state = JOB_DONE;
+        hasher->busy = 0;
+        pthread_cond_broadcast(&hasher->done);
+    }
+    pthread_mutex_unlock(&hasher->lock);
+    return NULL;
+}
+
+BlockHasher* block_hasher_new(uint64_t image_size, uint32_t block_size, uint32_t max_jobs,
+                              const uint8_t* expected, size_t n_expected) {
+    BlockHasher* hasher = calloc(1, sizeof(BlockHasher));
+    if (!hasher || block_size == 0 || max_jobs == 0) {
+        free(hasher);
+        return NULL;
+    }
+    
+    hasher->image_size = image_size;
+    hasher->block_size = block_size;
+    hasher->n_blocks = (image_size + block_size - 1) / block_size;
+    hasher->max_jobs = max_jobs;
+    hasher->expected = expected;
+    hasher->n_expected = n_expected;
+    hasher->jobs = calloc(max_jobs, sizeof(HashJob));
+    hasher->queue = calloc(max_jobs, sizeof(uint32_t));
+    hasher->digests = calloc(hasher->n_blocks ? hasher->n_blocks : 1, SHA256_DIGEST_SIZE);
+    
+    uint8_t* zeros = calloc(1, block_size);
+    if (!hasher->jobs || !hasher->queue || !hasher->digests || !zeros) {
+        free(zeros);
+        free(hasher->jobs);
+        free(hasher->queue);
+        free(hasher->digests);
+        free(hasher);
+        return NULL;
+    }
+    sha256(zeros, block_size, hasher->zero_digest);
+    sha256(zeros, image_size % block_size ? image_size % block_size : block_size, hasher->tail_zero_digest);
+    free(zeros);
+    
+    pthread_mutex_init(&hasher->lock, NULL);
+    pthread_cond_init(&hasher->work, NULL);
+    pthread_cond_init(&hasher->done, NULL);
+    if (pthread_create(&hasher->thread, NULL, hash_thread, hasher) != 0) {
+        pthread_mutex_destroy(&hasher->lock);
+        pthread_cond_destroy(&hasher->work);
+        pthread_cond_destroy(&hasher->done);
+        free(hasher->jobs);
+        free(hasher->queue);
+        free(hasher->digests);
+        free(hasher);
+        return NULL;
+    }
+    return hasher;
+}
+
+void block_hasher_free(BlockHasher* hasher) {
+    if (!hasher) {
+        return;
+    }
+    
+    pthread_mutex_lock(&hasher->lock);
+    hasher->stop = 1;
+    pthread_cond_signal(&hasher->work);
+    pthread_mutex_unlock(&hasher->lock);
+    pthread_join(hasher->thread, NULL);
+    
+    pthread_mutex_destroy(&hasher->lock);
+    pthread_cond_destroy(&hasher->work);
+    pthread_cond_destroy(&hasher->done);
+    free(hasher->jobs);
+    free(hasher->queue);
+    free(hasher->digests);
+    free(hasher);
+}
+
+void block_hasher_submit(BlockHasher* hasher, uint32_t slot, const uint8_t* data, uint64_t offset, size_t length) {
+    pthread_mutex_lock(&hasher->lock);
+    HashJob* job = &hasher->jobs[slot];
+    job->data = data;
+    job->offset = offset;
+    job->length = length;
+    job->state = JOB_QUEUED;
+    job->result = 0;
+    
+    // Every slot has at most one job queued, so the queue cannot overflow
+    hasher->queue[(hasher->queue_head + hasher->queue_length) % hasher->max_jobs] = slot;
+    hasher->queue_length++;
+    pthread_cond_signal(&hasher->work);
+    pthread_mutex_unlock(&hasher->lock);
+}
+
+int block_hasher_wait(BlockHasher* hasher, uint32_t slot) {
+    pthread_mutex_lock(&hasher->lock);
+    HashJob* job = &hasher->jobs[slot];
+    while (job->state == JOB_QUEUED) {
+        pthread_cond_wait(&hasher->done, &hasher->lock);
+    }
+    int result = job->state == JOB_DONE ? job->result : 0;
+    job->state = JOB_IDLE;
+    pthread_mutex_unlock(&hasher->lock);
+    return result;
+}
+
+void block_hasher_drain(BlockHasher* hasher) {
+    pthread_mutex_lock(&hasher->lock);
+    while (hasher->queue_length > 0 || hasher->busy) {
+        pthread_cond_wait(&hasher->done, &hasher->lock);
+    }
+    pthread_mutex_unlock(&hasher->lock);
+}
+
+int block_hasher_add_zeros(BlockHasher* hasher, uint64_t offset, uint64_t length, uint64_t* failed_offset) {
+    uint64_t first = offset / hasher->block_size;
+    uint64_t end = (offset + length + hasher->block_size - 1) / hasher->block_size;
+    
+    for (uint64_t index = first; index < end; index++) {
+        const uint8_t* digest = index == hasher->n_blocks - 1 ? hasher->tail_zero_digest : hasher->zero_digest;
+        if (record_digest(hasher, index, digest) < 0) {
+            *failed_offset = index * hasher->block_size;
+            return -EBADMSG;
+        }
+    }
+    return 0;
+}
+
+const uint8_t* block_hasher_get_digest(BlockHasher* hasher, uint64_t offset) {
+    return hasher->digests + offset / hasher->block_size * SHA256_DIGEST_SIZE;
+}
+
+void block_hasher_get_image_digest(BlockHasher* hasher, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    sha256(hasher->digests, hasher->n_blocks * SHA256_DIGEST_SIZE, digest);
+}
+
+void block_hasher_get_stats(BlockHasher* hasher, uint64_t* bytes_hashed, uint64_t* busy_ns) {
+    *bytes_hashed = ATOMIC_LOAD(&hasher->bytes_hashed);
+    *busy_ns = ATOMIC_LOAD(&hasher->busy_ns);
+}
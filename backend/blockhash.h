@@ -0,0 +1,51 @@
+#ifndef BLOCKHASH_H
+#define BLOCKHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sha256.h"
+
+// Hashes the blocks of an image with SHA-256 on a thread of its own while
+// they are being written, and checks them against a list of expected block
+// digests when there is one. Blocks can arrive in any order; each one is
+// hashed separately, so a mismatch points at the block that is wrong.
+
+typedef struct BlockHasher BlockHasher;
+
+// Reads a block checksum list: a "wave-blocksums 1 <block size>" line
+// followed by one hex SHA-256 digest per block, in image order. Returns 0 or
+// a negative errno value (-EBADMSG for a malformed list).
+int block_sums_load(const char* path, uint32_t* block_size, uint8_t** digests, size_t* n_digests);
+
+// max_jobs is the number of buffers that can be in flight at once; jobs are
+// identified by their slot, 0 .. max_jobs - 1. expected may be NULL; it is
+// not copied.
+BlockHasher* block_hasher_new(uint64_t image_size, uint32_t block_size, uint32_t max_jobs,
+                              const uint8_t* expected, size_t n_expected);
+void block_hasher_free(BlockHasher* hasher);
+
+// Queues one block for hashing. The data must stay untouched until
+// block_hasher_wait() has returned for the slot.
+void block_hasher_submit(BlockHasher* hasher, uint32_t slot, const uint8_t* data, uint64_t offset, size_t length);
+
+// Waits for the slot's block. Returns 0, or -EBADMSG when it does not match
+// the expected digest.
+int block_hasher_wait(BlockHasher* hasher, uint32_t slot);
+
+// Waits until nothing is queued or being hashed
+void block_hasher_drain(BlockHasher* hasher);
+
+// Records whole blocks known to be zeros without hashing them. Returns 0, or
+// -EBADMSG with the offset of the first mismatching block.
+int block_hasher_add_zeros(BlockHasher* hasher, uint64_t offset, uint64_t length, uint64_t* failed_offset);
+
+// The digest of the block containing offset, once it has been hashed
+const uint8_t* block_hasher_get_digest(BlockHasher* hasher, uint64_t offset);
+
+// SHA-256 of all block digests in order, which identifies the whole image
+void block_hasher_get_image_digest(BlockHasher* hasher, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+// Bytes run through SHA-256 (zeros are not) and the time the thread spent on them
+void block_hasher_get_stats(BlockHasher* hasher, uint64_t* bytes_hashed, uint64_t* busy_ns);
+
+#endif // BLOCKHASH_H
@@ -0,0 +1,2434 @@
+#define _GNU_SOURCE
+#include "extract.h"
+#include "journal.h"
+#include "manifest.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <linux/openat2.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#define INPUT_BUFFER_SIZE (1024 * 1024)
+#define CHUNK_SIZE (4 * 1024 * 1024)        // files above this are written in pieces by several writers
+#define PREALLOCATE_MIN (64 * 1024)         // smaller files fit in a few extents anyway
+#define DEFAULT_MAX_BUFFERED (64 * 1024 * 1024)
+#define MAX_WRITERS 64
+#define MAX_HEADER_DATA (16 * 1024 * 1024)  // pax records and GNU long names
+#define LINK_BUCKETS 4096
+#define DEDUP_BUCKETS 4096
+#define DEDUP_MIN_SIZE 4096                 // a smaller file takes a block either way
+
+#define TAR_BLOCK 512
+#define CPIO_HEADER 110
+#define CPIO_MAGIC "070701"
+#define CPIO_MAGIC_CRC "070702"
+#define CPIO_TRAILER "TRAILER!!!"
+
+#define ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ATOMIC_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+
+typedef enum {
+    ENTRY_FILE,
+    ENTRY_DIRECTORY,
+    ENTRY_SYMLINK,
+    ENTRY_HARDLINK,
+    ENTRY_CHAR,
+    ENTRY_BLOCK,
+    ENTRY_FIFO
+} EntryType;
+
+typedef struct {
+    char* name;
+    uint8_t* value;
+    size_t size;
+} Xattr;
+
+// One archive member, with every field already resolved from pax records or
+// GNU long names
+typedef struct {
+    char* path;
+    char* link;             // symlink contents or hard link target
+    EntryType type;
+    mode_t mode;            // permission bits only
+    uid_t uid;
+    gid_t gid;
+    uint64_t size;
+    dev_t rdev;
+    struct timespec mtime;
+    struct timespec atime;
+    Xattr* xattrs;
+    size_t n_xattrs;
+} Entry;
+
+// A file too large for one job; the writers that fill its pieces share the
+// descriptor and the last one to finish applies the metadata
+typedef struct {
+    int fd;
+    int refs;
+    int failed;
+    Entry entry;
+} SharedFile;
+
+typedef struct Job {
+    struct Job* next;
+    Entry entry;            // everything but pieces of a SharedFile
+    SharedFile* file;
+    uint8_t* data;
+    size_t length;
+    uint64_t offset;
+    uint64_t epoch;         // checkpoint interval it was queued in
+} Job;
+
+// Last parent directory a thread resolved; consecutive members usually
+// share it
+typedef struct {
+    char* path;
+    int fd;
+} DirCache;
+
+// cpio newc stores the data of a hard-linked file with one of its names and
+// none with the others
+typedef struct LinkGroup {
+    struct LinkGroup* next;
+    uint64_t key;
+    char* path;             // the name the data is written to
+    Entry entry;            // metadata for when no name carries data
+    int written;
+} LinkGroup;
+
+typedef struct {
+    Entry* items;
+    size_t length;
+    size_t capacity;
+} EntryList;
+
+// First file written with a content, by its digest in the manifest
+typedef struct DedupBlob {
+    struct DedupBlob* next;
+    const uint8_t* digest;  // points into the manifest
+    char* path;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    struct timespec mtime;
+    int has_xattrs;
+} DedupBlob;
+
+struct Extractor {
+    char* archive_path;
+    char* root_path;
+    ExtractOptions options;
+    ExtractReadFunc read;
+    void* user_data;
+    const ExtractScanFuncs* scan;   // set while extractor_scan() runs
+    void* scan_data;
+    int archive_fd;
+    int root_fd;
+    int use_openat2;
+    
+    uint8_t* input;
+    size_t input_start;
+    size_t input_end;
+    int input_eof;
+    
+    // Jobs for the writers, bounded by the bytes of file data they hold
+    pthread_mutex_t lock;
+    pthread_cond_t jobs_ready;
+    pthread_cond_t space_ready;
+    Job* queue_head;
+    Job* queue_tail;
+    uint64_t buffered;
+    int reader_done;
+    
+    // Checkpoints. Jobs count against the epoch they were queued in; the
+    // reader closes an epoch between two members, and once its last job is
+    // done every member before that point is on disk, short of a flush.
+    // One epoch is closed at a time, so two counters are enough.
+    char* journal_path;
+    Journal* journal;
+    uint64_t resume_entries;    // members of an earlier run's last checkpoint
+    uint64_t epoch;
+    uint64_t outstanding[2];
+    int checkpoint_pending;     // an epoch has been closed and not journaled yet
+    int checkpoint_ready;       // its jobs are all done
+    uint64_t checkpoint_entries;
+    uint64_t checkpoint_offset;
+    uint64_t last_checkpoint_ns;
+    
+    DirCache reader_dirs;
+    EntryList directories;  // final mode, owner and times, applied last
+    EntryList hardlinks;
+    LinkGroup* link_groups[LINK_BUCKETS];
+    
+    // Deduplication. The first copy of a content is written as usual; the
+    // data of later ones is skipped and they are made from the first once
+    // every file is on disk.
+    char* manifest_path;
+    Manifest* manifest;
+    int reflinks;           // the root's filesystem shares extents with FICLONE
+    DedupBlob* blobs[DEDUP_BUCKETS];
+    EntryList clones;       // link is the path of the first copy
+    
+    // Read by extractor_get_stats() from other threads
+    uint64_t archive_bytes;
+    uint64_t archive_done;
+    uint64_t bytes_written;
+    uint64_t entries;
+    uint64_t files;
+    uint64_t files_resumed;
+    uint64_t bytes_resumed;
+    uint64_t files_deduplicated;
+    uint64_t bytes_deduplicated;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t pause_start_ns;
+    uint64_t paused_ns;     // time spent paused, not counted in the rate
+    uint32_t n_writers;
+    int tuned;
+    IoProfile profile;      // set once, before tuned
+    int syncing;
+    int finished;
+    int paused;
+    int cancelled;
+    int error;
+    char* error_path;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// Keeps the first error; the others are usually consequences of it
+static int set_error(Extractor* extractor, int error, const char* path) {
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&extractor->error, &expected, error, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        extractor->error_path = path ? strdup(path) : NULL;
+    }
+    return error;
+}
+
+static int should_stop(Extractor* extractor) {
+    return ATOMIC_LOAD(&extractor->cancelled) || ATOMIC_LOAD(&extractor->error);
+}
+
+static void entry_clear(Entry* entry) {
+    for (size_t i = 0; i < entry->n_xattrs; i++) {
+        free(entry->xattrs[i].name);
+        free(entry->xattrs[i].value);
+    }
+    free(entry->xattrs);
+    free(entry->path);
+    free(entry->link);
+    memset(entry, 0, sizeof(*entry));
+}
+
+static int entry_list_add(EntryList* list, Entry* entry) {
+    if (list->length == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 256;
+        Entry* items = realloc(list->items, capacity * sizeof(Entry));
+        if (!items) {
+            return -ENOMEM;
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    
+    // The list takes over the entry's allocations
+    list->items[list->length++] = *entry;
+    memset(entry, 0, sizeof(*entry));
+    return 0;
+}
+
+static void entry_list_clear(EntryList* list) {
+    for (size_t i = 0; i < list->length; i++) {
+        entry_clear(&list->items[i]);
+    }
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+static int add_xattr(Entry* entry, const char* name, size_t name_length, const void* value, size_t size) {
+    Xattr* xattrs = realloc(entry->xattrs, (entry->n_xattrs + 1) * sizeof(Xattr));
+    if (!xattrs) {
+        return -ENOMEM;
+    }
+    entry->xattrs = xattrs;
+    
+    Xattr* xattr = &xattrs[entry->n_xattrs];
+    xattr->name = strndup(name, name_length);
+    xattr->value = malloc(size ? size : 1);
+    xattr->size = size;
+    if (!xattr->name || !xattr->value) {
+        free(xattr->name);
+        free(xattr->value);
+        return -ENOMEM;
+    }
+    memcpy(xattr->value, value, size);
+    entry->n_xattrs++;
+    return 0;
+}
+
+// Archive paths are taken relative to the root: leading slashes and "."
+// components are dropped, and ".." is refused outright rather than
+// resolved. An empty result is the root itself, ".".
+static int sanitize_path(char* path) {
+    char* out = path;
+    const char* in = path;
+    
+    while (*in) {
+        while (*in == '/') {
+            in++;
+        }
+        const char* end = strchrnul(in, '/');
+        size_t length = (size_t)(end - in);
+        
+        if (length == 2 && in[0] == '.' && in[1] == '.') {
+            return -EPERM;
+        }
+        if (length > 0 && !(length == 1 && in[0] == '.')) {
+            if (out != path) {
+                *out++ = '/';
+            }
+            memmove(out, in, length);
+            out += length;
+        }
+        in = end;
+    }
+    
+    if (out == path) {
+        *out++ = '.';
+    }
+    *out = '\0';
+    return 0;
+}
+
+// Input: a buffered reader over the archive file or the read callback
+
+// The writers finish what has been read; the reader waits here until resumed
+static void wait_while_paused(Extractor* extractor) {
+    static const struct timespec interval = { 0, 10 * 1000 * 1000 };
+    while (ATOMIC_LOAD(&extractor->paused) && !should_stop(extractor)) {
+        nanosleep(&interval, NULL);
+    }
+}
+
+static ssize_t input_read_raw(Extractor* extractor, void* buffer, size_t length) {
+    wait_while_paused(extractor);
+    for (;;) {
+        ssize_t result = extractor->read
+            ? extractor->read(extractor->user_data, buffer, length)
+            : read(extractor->archive_fd, buffer, length);
+        if (result >= 0) {
+            return result;
+        }
+        if (extractor->read) {
+            return result;
+        }
+        if (errno != EINTR) {
+            return -errno;
+        }
+    }
+}
+
+// Makes sure at least length bytes are buffered; fewer only at the end
+static int input_fill(Extractor* extractor, size_t length) {
+    if (extractor->input_end - extractor->input_start >= length || extractor->input_eof) {
+        return 0;
+    }
+    
+    memmove(extractor->input, extractor->input + extractor->input_start,
+            extractor->input_end - extractor->input_start);
+    extractor->input_end -= extractor->input_start;
+    extractor->input_start = 0;
+    
+    while (extractor->input_end < length) {
+        ssize_t result = input_read_raw(extractor, extractor->input + extractor->input_end,
+                                        INPUT_BUFFER_SIZE - extractor->input_end);
+        if (result < 0) {
+            return (int)result;
+        }
+        if (result == 0) {
+            extractor->input_eof = 1;
+            break;
+        }
+        extractor->input_end += (size_t)result;
+    }
+    return 0;
+}
+
+// Reads exactly length bytes; a short archive is malformed. Long reads
+// bypass the buffer.
+static int input_read(Extractor* extractor, void* buffer, size_t length) {
+    uint8_t* out = buffer;
+    size_t buffered = extractor->input_end - extractor->input_start;
+    size_t from_buffer = buffered < length ? buffered : length;
+    
+    memcpy(out, extractor->input + extractor->input_start, from_buffer);
+    extractor->input_start += from_buffer;
+    size_t done = from_buffer;
+    
+    while (done < length) {
+        size_t left = length - done;
+        if (left >= INPUT_BUFFER_SIZE / 2) {
+            ssize_t result = input_read_raw(extractor, out + done, left);
+            if (result < 0) {
+                return (int)result;
+            }
+            if (result == 0) {
+                return -EBADMSG;
+            }
+            done += (size_t)result;
+        } else {
+            int result = input_fill(extractor, left);
+            if (result < 0) {
+                return result;
+            }
+            size_t available = extractor->input_end - extractor->input_start;
+            if (available == 0) {
+                return -EBADMSG;
+            }
+            size_t chunk = available < left ? available : left;
+            memcpy(out + done, extractor->input + extractor->input_start, chunk);
+            extractor->input_start += chunk;
+            done += chunk;
+        }
+    }
+    
+    ATOMIC_ADD(&extractor->archive_done, length);
+    return 0;
+}
+
+static int input_skip(Extractor* extractor, uint64_t length) {
+    while (length > 0) {
+        int result = input_fill(extractor, 1);
+        if (result < 0) {
+            return result;
+        }
+        size_t available = extractor->input_end - extractor->input_start;
+        if (available == 0) {
+            return -EBADMSG;
+        }
+        size_t chunk = available < length ? available : (size_t)length;
+        extractor->input_start += chunk;
+        ATOMIC_ADD(&extractor->archive_done, chunk);
+        length -= chunk;
+    }
+    return 0;
+}
+
+// Path resolution. Every lookup goes through openat2(RESOLVE_IN_ROOT), so
+// symlinks in the payload (absolute ones included) resolve inside the target
+// as they will once it boots, never into the running system. Kernels before
+// 5.6 fall back to plain openat().
+
+static int open_beneath(Extractor* extractor, int dir_fd, const char* path, int flags) {
+    if (ATOMIC_LOAD(&extractor->use_openat2)) {
+        struct open_how how;
+        memset(&how, 0, sizeof(how));
+        how.flags = (uint64_t)(flags | O_CLOEXEC);
+        how.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+        
+        for (;;) {
+            long fd = syscall(SYS_openat2, dir_fd, path, &how, sizeof(how));
+            if (fd >= 0) {
+                return (int)fd;
+            }
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            if (errno != ENOSYS) {
+                return -errno;
+            }
+            ATOMIC_STORE(&extractor->use_openat2, 0);
+            break;
+        }
+    }
+    
+    int fd = openat(dir_fd, path, flags | O_CLOEXEC);
+    return fd >= 0 ? fd : -errno;
+}
+
+// Creates the missing directories leading to path, for archives that leave
+// out directory members
+static int make_directories(Extractor* extractor, const char* path) {
+    char* copy = strdup(path);
+    if (!copy) {
+        return -ENOMEM;
+    }
+    
+    int result = 0;
+    for (char* end = copy; result == 0; end++) {
+        end = strchrnul(end, '/');
+        char saved = *end;
+        *end = '\0';
+        
+        char* name = strrchr(copy, '/');
+        int parent = extractor->root_fd;
+        if (name) {
+            *name = '\0';
+            parent = open_beneath(extractor, extractor->root_fd, copy, O_PATH | O_DIRECTORY);
+            *name++ = '/';
+        } else {
+            name = copy;
+        }
+        
+        if (parent < 0) {
+            result = parent;
+        } else {
+            if (mkdirat(parent, name, 0755) != 0 && errno != EEXIST) {
+                result = -errno;
+            }
+            if (parent != extractor->root_fd) {
+                close(parent);
+            }
+        }
+        
+        *end = saved;
+        if (saved == '\0') {
+            break;
+        }
+    }
+    free(copy);
+    return result;
+}
+
+// Returns a descriptor for the directory holding path, owned by the cache,
+// and points name at the last component
+static int open_parent(Extractor* extractor, DirCache* cache, const char* path, const char** name) {
+    const char* slash = strrchr(path, '/');
+    if (!slash) {
+        *name = path;
+        return extractor->root_fd;
+    }
+    *name = slash + 1;
+    
+    size_t length = (size_t)(slash - path);
+    if (cache->path && strlen(cache->path) == length && memcmp(cache->path, path, length) == 0) {
+        return cache->fd;
+    }
+    
+    char* dir = strndup(path, length);
+    if (!dir) {
+        return -ENOMEM;
+    }
+    int fd = open_beneath(extractor, extractor->root_fd, dir, O_PATH | O_DIRECTORY);
+    if (fd == -ENOENT) {
+        int result = make_directories(extractor, dir);
+        fd = result < 0 ? result : open_beneath(extractor, extractor->root_fd, dir, O_PATH | O_DIRECTORY);
+    }
+    if (fd < 0) {
+        free(dir);
+        return fd;
+    }
+    
+    if (cache->path) {
+        close(cache->fd);
+    }
+    free(cache->path);
+    cache->path = dir;
+    cache->fd = fd;
+    return fd;
+}
+
+static void dir_cache_clear(DirCache* cache) {
+    if (cache->path) {
+        close(cache->fd);
+    }
+    free(cache->path);
+    cache->path = NULL;
+    cache->fd = -1;
+}
+
+// Metadata. Order matters: chown() clears set-id bits, so the mode comes
+// after it, ACLs adjust the group bits of the mode, and writing anything
+// moves the timestamps, which therefore come last.
+
+static int ignorable_xattr_error(int error) {
+    return error == ENOTSUP || (error == EPERM && geteuid() != 0);
+}
+
+static int apply_xattrs(Extractor* extractor, const Entry* entry, int fd, const char* proc_path) {
+    if (!extractor->options.xattrs) {
+        return 0;
+    }
+    for (size_t i = 0; i < entry->n_xattrs; i++) {
+        const Xattr* xattr = &entry->xattrs[i];
+        int result = proc_path ? lsetxattr(proc_path, xattr->name, xattr->value, xattr->size, 0)
+                               : fsetxattr(fd, xattr->name, xattr->value, xattr->size, 0);
+        if (result != 0 && !ignorable_xattr_error(errno)) {
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+static int apply_metadata_fd(Extractor* extractor, int fd, const Entry* entry) {
+    if (extractor->options.same_owner && fchown(fd, entry->uid, entry->gid) != 0) {
+        return -errno;
+    }
+    if (fchmod(fd, entry->mode) != 0) {
+        return -errno;
+    }
+    int result = apply_xattrs(extractor, entry, fd, NULL);
+    if (result < 0) {
+        return result;
+    }
+    
+    struct timespec times[2] = {entry->atime, entry->mtime};
+    return futimens(fd, times) == 0 ? 0 : -errno;
+}
+
+// For symlinks and device nodes, which cannot be opened for writing
+static int apply_metadata_at(Extractor* extractor, int parent, const char* name, const Entry* entry) {
+    if (extractor->options.same_owner && fchownat(parent, name, entry->uid, entry->gid, AT_SYMLINK_NOFOLLOW) != 0) {
+        return -errno;
+    }
+    if (entry->type != ENTRY_SYMLINK && fchmodat(parent, name, entry->mode, 0) != 0) {
+        return -errno;
+    }
+    if (entry->n_xattrs > 0) {
+        char proc_path[64 + NAME_MAX];
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d/%s", parent, name);
+        int result = apply_xattrs(extractor, entry, -1, proc_path);
+        if (result < 0) {
+            return result;
+        }
+    }
+    
+    struct timespec times[2] = {entry->atime, entry->mtime};
+    return utimensat(parent, name, times, AT_SYMLINK_NOFOLLOW) == 0 ? 0 : -errno;
+}
+
+// Something left over at the path (a previous run, or an earlier member of
+// the same name) is replaced, as tar does
+static int replace_existing(int parent, const char* name) {
+    struct stat st;
+    if (fstatat(parent, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return errno == ENOENT ? 0 : -errno;
+    }
+    return unlinkat(parent, name, S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0) == 0 ? 0 : -errno;
+}
+
+// Data that is about to be cloned needs no room of its own
+static int create_file(Extractor* extractor, DirCache* cache, const Entry* entry, int preallocate) {
+    const char* name;
+    int parent = open_parent(extractor, cache, entry->path, &name);
+    if (parent < 0) {
+        return parent;
+    }
+    
+    for (int attempt = 0;; attempt++) {
+        int fd = openat(parent, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+        if (fd >= 0) {
+            ATOMIC_ADD(&extractor->files, 1);
+            if (preallocate && entry->size >= PREALLOCATE_MIN && fallocate(fd, 0, 0, (off_t)entry->size) != 0 &&
+                errno != EOPNOTSUPP) {
+                int result = -errno;
+                close(fd);
+                return result;
+            }
+            return fd;
+        }
+        if (errno != EEXIST || attempt > 0) {
+            return -errno;
+        }
+        int result = replace_existing(parent, name);
+        if (result < 0) {
+            return result;
+        }
+    }
+}
+
+static int write_all(int fd, const uint8_t* data, size_t length, uint64_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t result = pwrite(fd, data + done, length - done, (off_t)(offset + done));
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (result == 0) {
+            return -EIO;
+        }
+        done += (size_t)result;
+    }
+    return 0;
+}
+
+static int create_node(Extractor* extractor, DirCache* cache, const Entry* entry) {
+    const char* name;
+    int parent = open_parent(extractor, cache, entry->path, &name);
+    if (parent < 0) {
+        return parent;
+    }
+    
+    mode_t type = entry->type == ENTRY_CHAR ? S_IFCHR : entry->type == ENTRY_BLOCK ? S_IFBLK : S_IFIFO;
+    for (int attempt = 0;; attempt++) {
+        if (mknodat(parent, name, type | 0600, entry->rdev) == 0) {
+            break;
+        }
+        if (errno != EEXIST || attempt > 0) {
+            return -errno;
+        }
+        int result = replace_existing(parent, name);
+        if (result < 0) {
+            return result;
+        }
+    }
+    return apply_metadata_at(extractor, parent, name, entry);
+}
+
+// Writer threads
+
+static void release_buffered(Extractor* extractor, size_t length) {
+    pthread_mutex_lock(&extractor->lock);
+    extractor->buffered -= length;
+    pthread_cond_signal(&extractor->space_ready);
+    pthread_mutex_unlock(&extractor->lock);
+}
+
+// Gives back the job's share of the read-ahead and settles its epoch
+static void finish_job(Extractor* extractor, const Job* job) {
+    pthread_mutex_lock(&extractor->lock);
+    extractor->buffered -= job->length;
+    pthread_cond_signal(&extractor->space_ready);
+    if (--extractor->outstanding[job->epoch & 1] == 0 && extractor->checkpoint_pending &&
+        job->epoch + 1 == extractor->epoch) {
+        extractor->checkpoint_ready = 1;
+    }
+    pthread_mutex_unlock(&extractor->lock);
+}
+
+static void shared_file_unref(Extractor* extractor, SharedFile* file) {
+    if (__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    
+    if (!ATOMIC_LOAD(&file->failed) && !should_stop(extractor)) {
+        int result = apply_metadata_fd(extractor, file->fd, &file->entry);
+        if (result < 0) {
+            set_error(extractor, result, file->entry.path);
+        }
+    }
+    close(file->fd);
+    entry_clear(&file->entry);
+    free(file);
+}
+
+static int run_job(Extractor* extractor, DirCache* cache, Job* job) {
+    if (job->file) {
+        int result = write_all(job->file->fd, job->data, job->length, job->offset);
+        if (result < 0) {
+            ATOMIC_STORE(&job->file->failed, 1);
+            return set_error(extractor, result, job->file->entry.path);
+        }
+        ATOMIC_ADD(&extractor->bytes_written, job->length);
+        return 0;
+    }
+    
+    if (job->entry.type != ENTRY_FILE) {
+        int result = create_node(extractor, cache, &job->entry);
+        return result < 0 ? set_error(extractor, result, job->entry.path) : 0;
+    }
+    
+    int fd = create_file(extractor, cache, &job->entry, 1);
+    if (fd < 0) {
+        return set_error(extractor, fd, job->entry.path);
+    }
+    int result = write_all(fd, job->data, job->length, 0);
+    if (result == 0) {
+        ATOMIC_ADD(&extractor->bytes_written, job->length);
+        result = apply_metadata_fd(extractor, fd, &job->entry);
+    }
+    close(fd);
+    return result < 0 ? set_error(extractor, result, job->entry.path) : 0;
+}
+
+static void* writer_thread(void* data) {
+    Extractor* extractor = data;
+    DirCache cache = {NULL, -1};
+    
+    for (;;) {
+        pthread_mutex_lock(&extractor->lock);
+        while (!extractor->queue_head && !extractor->reader_done) {
+            pthread_cond_wait(&extractor->jobs_ready, &extractor->lock);
+        }
+        Job* job = extractor->queue_head;
+        if (job) {
+            extractor->queue_head = job->next;
+            if (!extractor->queue_head) {
+                extractor->queue_tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&extractor->lock);
+        if (!job) {
+            break;
+        }
+        
+        // After an error the queue is still emptied, to free what it holds
+        if (!should_stop(extractor)) {
+            run_job(extractor, &cache, job);
+        }
+        if (job->file) {
+            shared_file_unref(extractor, job->file);
+        }
+        finish_job(extractor, job);
+        entry_clear(&job->entry);
+        free(job->data);
+        free(job);
+    }
+    
+    dir_cache_clear(&cache);
+    return NULL;
+}
+
+// Waits until the writers have room for length more bytes. A single job
+// larger than the limit is let through once the queue is empty.
+static void reserve_buffered(Extractor* extractor, size_t length) {
+    pthread_mutex_lock(&extractor->lock);
+    while (extractor->buffered > 0 && extractor->buffered + length > extractor->options.max_buffered &&
+           !should_stop(extractor)) {
+        pthread_cond_wait(&extractor->space_ready, &extractor->lock);
+    }
+    extractor->buffered += length;
+    pthread_mutex_unlock(&extractor->lock);
+}
+
+static void submit_job(Extractor* extractor, Job* job) {
+    pthread_mutex_lock(&extractor->lock);
+    job->epoch = extractor->epoch;
+    extractor->outstanding[job->epoch & 1]++;
+    job->next = NULL;
+    if (extractor->queue_tail) {
+        extractor->queue_tail->next = job;
+    } else {
+        extractor->queue_head = job;
+    }
+    extractor->queue_tail = job;
+    pthread_cond_signal(&extractor->jobs_ready);
+    pthread_mutex_unlock(&extractor->lock);
+}
+
+// Reads size bytes of file data from the archive into a new job
+static Job* read_job(Extractor* extractor, size_t length, int* result) {
+    reserve_buffered(extractor, length);
+    Job* job = calloc(1, sizeof(Job));
+    uint8_t* data = malloc(length ? length : 1);
+    if (!job || !data) {
+        free(job);
+        free(data);
+        release_buffered(extractor, length);
+        *result = -ENOMEM;
+        return NULL;
+    }
+    
+    *result = input_read(extractor, data, length);
+    if (*result < 0) {
+        free(job);
+        free(data);
+        release_buffered(extractor, length);
+        return NULL;
+    }
+    job->data = data;
+    job->length = length;
+    return job;
+}
+
+// Large files are created by the reader and their pieces spread over the
+// writers, so a single big file does not hold up everything behind it
+static int extract_large_file(Extractor* extractor, Entry* entry) {
+    int fd = create_file(extractor, &extractor->reader_dirs, entry, 1);
+    if (fd < 0) {
+        return fd;
+    }
+    
+    SharedFile* file = calloc(1, sizeof(SharedFile));
+    if (!file) {
+        close(fd);
+        return -ENOMEM;
+    }
+    file->fd = fd;
+    file->refs = 1;     // the reader's, until every piece is queued
+    file->entry = *entry;
+    memset(entry, 0, sizeof(*entry));
+    
+    int result = 0;
+    for (uint64_t offset = 0; offset < file->entry.size && !should_stop(extractor); offset += CHUNK_SIZE) {
+        uint64_t left = file->entry.size - offset;
+        Job* job = read_job(extractor, left < CHUNK_SIZE ? (size_t)left : CHUNK_SIZE, &result);
+        if (!job) {
+            ATOMIC_STORE(&file->failed, 1);
+            break;
+        }
+        job->file = file;
+        job->offset = offset;
+        __atomic_add_fetch(&file->refs, 1, __ATOMIC_ACQ_REL);
+        submit_job(extractor, job);
+    }
+    
+    shared_file_unref(extractor, file);
+    return result;
+}
+
+// Reports a member to the scan callbacks instead of extracting it, passing
+// file data straight from the input buffer
+static int scan_entry(Extractor* extractor, Entry* entry) {
+    static const mode_t types[] = {
+        [ENTRY_FILE] = S_IFREG,
+        [ENTRY_DIRECTORY] = S_IFDIR,
+        [ENTRY_SYMLINK] = S_IFLNK,
+        [ENTRY_HARDLINK] = S_IFREG,
+        [ENTRY_CHAR] = S_IFCHR,
+        [ENTRY_BLOCK] = S_IFBLK,
+        [ENTRY_FIFO] = S_IFIFO
+    };
+    ExtractMember member = {
+        .path = entry->path,
+        .link = entry->type == ENTRY_SYMLINK || entry->type == ENTRY_HARDLINK ? entry->link : NULL,
+        .mode = (uint32_t)(types[entry->type] | entry->mode),
+        .uid = entry->uid,
+        .gid = entry->gid,
+        .mtime = entry->mtime.tv_sec,
+        .size = entry->type == ENTRY_FILE ? entry->size : 0,
+        .data_offset = ATOMIC_LOAD(&extractor->archive_done)
+    };
+    int result = extractor->scan->member(extractor->scan_data, &member);
+    if (result < 0 || entry->type != ENTRY_FILE || !extractor->scan->data) {
+        return result < 0 ? result : input_skip(extractor, entry->size);
+    }
+    
+    for (uint64_t left = entry->size; left > 0;) {
+        result = input_fill(extractor, left < INPUT_BUFFER_SIZE ? (size_t)left : INPUT_BUFFER_SIZE);
+        if (result < 0) {
+            return result;
+        }
+        size_t available = extractor->input_end - extractor->input_start;
+        if (available == 0) {
+            return -EBADMSG;
+        }
+        size_t chunk = available < left ? available : (size_t)left;
+        result = extractor->scan->data(extractor->scan_data, extractor->input + extractor->input_start, chunk);
+        if (result < 0) {
+            return result;
+        }
+        extractor->input_start += chunk;
+        ATOMIC_ADD(&extractor->archive_done, chunk);
+        left -= chunk;
+    }
+    return 0;
+}
+
+// Journal. A checkpoint says how many members were extracted, and is only
+// written after the filesystem has been flushed. A later run still reads
+// the whole archive, which is the only way through a compressed stream, but
+// writes no data for a file of the checkpoint that is in place already.
+// Everything else (directories, links, nodes, the final directory
+// metadata) is cheap and done again.
+
+// Called by the reader between two members
+static void close_epoch(Extractor* extractor) {
+    uint64_t now = now_ns();
+    if (!extractor->journal || now - extractor->last_checkpoint_ns < JOURNAL_DEFAULT_INTERVAL_MS * 1000000ull) {
+        return;
+    }
+    pthread_mutex_lock(&extractor->lock);
+    if (!extractor->checkpoint_pending) {
+        extractor->checkpoint_pending = 1;
+        extractor->checkpoint_ready = extractor->outstanding[extractor->epoch & 1] == 0;
+        extractor->checkpoint_entries = ATOMIC_LOAD(&extractor->entries) - 1;
+        extractor->checkpoint_offset = ATOMIC_LOAD(&extractor->archive_done);
+        extractor->epoch++;
+        extractor->last_checkpoint_ns = now;
+    }
+    pthread_mutex_unlock(&extractor->lock);
+}
+
+// A job that failed, or was dropped after a cancel, has settled its epoch
+// too; the error or the cancel was set before that, so it is seen here
+static int collect_checkpoint(void* data, Journal* journal) {
+    Extractor* extractor = data;
+    pthread_mutex_lock(&extractor->lock);
+    int ready = extractor->checkpoint_pending && extractor->checkpoint_ready && !should_stop(extractor);
+    uint64_t entries = extractor->checkpoint_entries;
+    uint64_t offset = extractor->checkpoint_offset;
+    if (ready) {
+        extractor->checkpoint_pending = 0;
+        extractor->checkpoint_ready = 0;
+    }
+    pthread_mutex_unlock(&extractor->lock);
+    return ready ? journal_append(journal, JOURNAL_RECORD_CHECKPOINT, entries, offset, NULL) : 0;
+}
+
+static int sync_root(void* data) {
+    Extractor* extractor = data;
+    return syncfs(extractor->root_fd) == 0 ? 0 : -errno;
+}
+
+static const JournalSource journal_source = { collect_checkpoint, sync_root };
+
+// The journal belongs to one archive; where the archive comes from a
+// reader, its size has to stand in for it. The root is not part of it: a
+// journal found in another root only costs the checks of is_extracted().
+static void journal_identity(Extractor* extractor, uint8_t identity[SHA256_DIGEST_SIZE]) {
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    if (extractor->archive_fd >= 0) {
+        fstat(extractor->archive_fd, &st);
+    }
+    uint64_t fields[] = {
+        ATOMIC_LOAD(&extractor->archive_bytes), (uint64_t)st.st_dev, (uint64_t)st.st_ino,
+        (uint64_t)st.st_mtim.tv_sec, (uint64_t)st.st_mtim.tv_nsec
+    };
+    Sha256Context context;
+    sha256_init(&context);
+    sha256_update(&context, "wave-extract", 12);
+    sha256_update(&context, fields, sizeof(fields));
+    sha256_final(&context, identity);
+}
+
+static int start_journal(Extractor* extractor) {
+    if (!extractor->journal_path) {
+        return 0;
+    }
+    uint8_t identity[SHA256_DIGEST_SIZE];
+    journal_identity(extractor, identity);
+    Journal* journal;
+    int result = journal_open(extractor->journal_path, identity, &journal);
+    if (result < 0) {
+        return result;
+    }
+    ATOMIC_STORE(&extractor->journal, journal);
+    
+    for (size_t i = 0; i < journal_get_n_replayed(journal); i++) {
+        const JournalRecord* record = journal_get_replayed(journal, i);
+        if (record->type == JOURNAL_RECORD_CHECKPOINT && record->start > extractor->resume_entries) {
+            extractor->resume_entries = record->start;
+        }
+    }
+    extractor->last_checkpoint_ns = now_ns();
+    return journal_start(journal, &journal_source, extractor, JOURNAL_DEFAULT_INTERVAL_MS);
+}
+
+// Checkpoints what got done, whether the run succeeded or not; after a
+// success that is every member
+static void finish_journal(Extractor* extractor, int result) {
+    if (!extractor->journal) {
+        return;
+    }
+    journal_stop(extractor->journal);
+    if (result == 0) {
+        journal_append(extractor->journal, JOURNAL_RECORD_CHECKPOINT, ATOMIC_LOAD(&extractor->entries),
+                       ATOMIC_LOAD(&extractor->archive_done), NULL);
+    }
+    journal_commit(extractor->journal);
+}
+
+// Whether a file of the last checkpoint is still what the archive says. Its
+// times are applied last, after the data and the rest of the metadata, so
+// matching times mean the file was finished.
+static int is_extracted(Extractor* extractor, const Entry* entry) {
+    const char* name;
+    int parent = open_parent(extractor, &extractor->reader_dirs, entry->path, &name);
+    struct stat st;
+    if (parent < 0 || fstatat(parent, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return 0;
+    }
+    if (extractor->options.same_owner && (st.st_uid != entry->uid || st.st_gid != entry->gid)) {
+        return 0;
+    }
+    return S_ISREG(st.st_mode) && (st.st_mode & 07777) == entry->mode && (uint64_t)st.st_size == entry->size &&
+           st.st_mtim.tv_sec == entry->mtime.tv_sec && st.st_mtim.tv_nsec == entry->mtime.tv_nsec;
+}
+
+// Deduplication. The manifest names the content of every file by its
+// digest, so copies are known before their data is read. Its word is only
+// taken for a file whose size and position agree with the archive.
+
+// Returns the first file with the same content in *original, or records
+// this one as the first; files of no use for sharing are left alone
+static int find_original(Extractor* extractor, const Entry* entry, const DedupBlob** original) {
+    *original = NULL;
+    if (!extractor->manifest || entry->size < DEDUP_MIN_SIZE) {
+        return 0;
+    }
+    const ManifestEntry* item = manifest_lookup(extractor->manifest, entry->path);
+    if (!item || !S_ISREG(item->mode) || (item->flags & MANIFEST_ENTRY_HARDLINK) || item->size != entry->size ||
+        item->data_offset != ATOMIC_LOAD(&extractor->archive_done)) {
+        return 0;
+    }
+    
+    uint64_t key;
+    memcpy(&key, item->digest, sizeof(key));
+    DedupBlob** bucket = &extractor->blobs[key % DEDUP_BUCKETS];
+    for (DedupBlob* blob = *bucket; blob; blob = blob->next) {
+        if (memcmp(blob->digest, item->digest, SHA256_DIGEST_SIZE) == 0) {
+            *original = blob;
+            return 0;
+        }
+    }
+    
+    DedupBlob* blob = calloc(1, sizeof(DedupBlob));
+    if (!blob || !(blob->path = strdup(entry->path))) {
+        free(blob);
+        return -ENOMEM;
+    }
+    blob->digest = item->digest;
+    blob->mode = entry->mode;
+    blob->uid = entry->uid;
+    blob->gid = entry->gid;
+    blob->mtime = entry->mtime;
+    blob->has_xattrs = entry->n_xattrs > 0;
+    blob->next = *bucket;
+    *bucket = blob;
+    return 0;
+}
+
+// A hard link only where nothing would tell the two names apart, a clone
+// where the filesystem can make one; NULL to write the copy as usual
+static EntryList* duplicate_list(Extractor* extractor, const Entry* entry, const DedupBlob* original) {
+    if (extractor->options.dedup == EXTRACT_DEDUP_HARDLINK && entry->mode == original->mode &&
+        entry->uid == original->uid && entry->gid == original->gid && entry->n_xattrs == 0 &&
+        !original->has_xattrs && entry->mtime.tv_sec == original->mtime.tv_sec &&
+        entry->mtime.tv_nsec == original->mtime.tv_nsec) {
+        return &extractor->hardlinks;
+    }
+    return extractor->reflinks ? &extractor->clones : NULL;
+}
+
+// Skips the copy's data; the file is made from the first copy later
+static int defer_duplicate(Extractor* extractor, Entry* entry, const DedupBlob* original, EntryList* list) {
+    uint64_t size = entry->size;
+    char* link = strdup(original->path);
+    if (!link) {
+        return -ENOMEM;
+    }
+    free(entry->link);
+    entry->link = link;
+    if (list == &extractor->hardlinks) {
+        entry->type = ENTRY_HARDLINK;
+        ATOMIC_ADD(&extractor->files_deduplicated, 1);
+        ATOMIC_ADD(&extractor->bytes_deduplicated, size);
+    }
+    int result = entry_list_add(list, entry);
+    return result < 0 ? result : input_skip(extractor, size);
+}
+
+// Hands one member to the writers, or creates it here when later members may
+// depend on it. The archive is positioned at the member's data, if any, and
+// is left just past it.
+static int extract_entry(Extractor* extractor, Entry* entry) {
+    int result = sanitize_path(entry->path);
+    if (result == 0 && entry->type == ENTRY_HARDLINK) {
+        result = sanitize_path(entry->link);
+    }
+    if (result < 0) {
+        return result;
+    }
+    if (extractor->scan) {
+        return scan_entry(extractor, entry);
+    }
+    close_epoch(extractor);
+    
+    if (entry->type == ENTRY_FILE) {
+        const DedupBlob* original;
+        result = find_original(extractor, entry, &original);
+        if (result < 0) {
+            return result;
+        }
+        if (ATOMIC_LOAD(&extractor->entries) <= extractor->resume_entries && is_extracted(extractor, entry)) {
+            ATOMIC_ADD(&extractor->files_resumed, 1);
+            ATOMIC_ADD(&extractor->bytes_resumed, entry->size);
+            return input_skip(extractor, entry->size);
+        }
+        EntryList* duplicates = original ? duplicate_list(extractor, entry, original) : NULL;
+        if (duplicates) {
+            return defer_duplicate(extractor, entry, original, duplicates);
+        }
+        if (entry->size > CHUNK_SIZE) {
+            return extract_large_file(extractor, entry);
+        }
+        Job* job = read_job(extractor, (size_t)entry->size, &result);
+        if (!job) {
+            return result;
+        }
+        job->entry = *entry;
+        memset(entry, 0, sizeof(*entry));
+        submit_job(extractor, job);
+        return 0;
+    }
+    
+    // Nothing else carries data we use
+    result = input_skip(extractor, entry->size);
+    if (result < 0) {
+        return result;
+    }
+    
+    if (entry->type == ENTRY_CHAR || entry->type == ENTRY_BLOCK || entry->type == ENTRY_FIFO) {
+        Job* job = calloc(1, sizeof(Job));
+        if (!job) {
+            return -ENOMEM;
+        }
+        job->entry = *entry;
+        memset(entry, 0, sizeof(*entry));
+        submit_job(extractor, job);
+        return 0;
+    }
+    
+    if (entry->type == ENTRY_HARDLINK) {
+        return entry_list_add(&extractor->hardlinks, entry);
+    }
+    
+    if (strcmp(entry->path, ".") == 0) {
+        return entry->type == ENTRY_DIRECTORY ? entry_list_add(&extractor->directories, entry) : -EPERM;
+    }
+    
+    const char* name;
+    int parent = open_parent(extractor, &extractor->reader_dirs, entry->path, &name);
+    if (parent < 0) {
+        return parent;
+    }
+    
+    if (entry->type == ENTRY_DIRECTORY) {
+        // Owner access until the end, when the real mode is applied
+        if (mkdirat(parent, name, 0700) != 0) {
+            struct stat st;
+            if (errno != EEXIST || fstatat(parent, name, &st, 0) != 0) {
+                return -errno;
+            }
+            if (!S_ISDIR(st.st_mode)) {
+                result = replace_existing(parent, name);
+                if (result < 0 || mkdirat(parent, name, 0700) != 0) {
+                    return result < 0 ? result : -errno;
+                }
+            }
+        }
+        return entry_list_add(&extractor->directories, entry);
+    }
+    
+    for (int attempt = 0;; attempt++) {
+        if (symlinkat(entry->link, parent, name) == 0) {
+            break;
+        }
+        if (errno != EEXIST || attempt > 0) {
+            return -errno;
+        }
+        result = replace_existing(parent, name);
+        if (result < 0) {
+            return result;
+        }
+    }
+    return apply_metadata_at(extractor, parent, name, entry);
+}
+
+// POSIX ACLs arrive as text (SCHILY.acl.*) and are stored as the kernel's
+// system.posix_acl_* xattr, without depending on libacl
+
+#define ACL_XATTR_VERSION 2
+#define ACL_USER_OBJ 0x01
+#define ACL_USER 0x02
+#define ACL_GROUP_OBJ 0x04
+#define ACL_GROUP 0x08
+#define ACL_MASK 0x10
+#define ACL_OTHER 0x20
+#define ACL_UNDEFINED_ID 0xffffffffu
+
+typedef struct {
+    uint16_t tag;
+    uint16_t perm;
+    uint32_t id;
+} AclEntry;
+
+static int compare_acl_entries(const void* a, const void* b) {
+    const AclEntry* left = a;
+    const AclEntry* right = b;
+    if (left->tag != right->tag) {
+        return left->tag < right->tag ? -1 : 1;
+    }
+    return left->id < right->id ? -1 : left->id > right->id;
+}
+
+static int parse_acl_id(const char* text, size_t length, int is_user, uint32_t* id) {
+    char buffer[256];
+    if (length == 0 || length >= sizeof(buffer)) {
+        return -EBADMSG;
+    }
+    memcpy(buffer, text, length);
+    buffer[length] = '\0';
+    
+    char* end;
+    unsigned long value = strtoul(buffer, &end, 10);
+    if (*end == '\0') {
+        *id = (uint32_t)value;
+        return 0;
+    }
+    
+    // Only names without a numeric id left; resolved on the running system
+    if (is_user) {
+        struct passwd* pw = getpwnam(buffer);
+        if (pw) {
+            *id = pw->pw_uid;
+            return 0;
+        }
+    } else {
+        struct group* gr = getgrnam(buffer);
+        if (gr) {
+            *id = gr->gr_gid;
+            return 0;
+        }
+    }
+    return -EBADMSG;
+}
+
+// Entries look like "user:alice:rw-:1000", separated by commas or newlines;
+// the trailing numeric id is preferred to the name when present
+static int add_acl(Entry* entry, const char* xattr_name, const char* text, size_t length) {
+    AclEntry acl[256];
+    size_t n_acl = 0;
+    const char* end = text + length;
+    
+    while (text < end) {
+        const char* stop = text;
+        while (stop < end && *stop != ',' && *stop != '\n') {
+            stop++;
+        }
+        
+        const char* fields[4] = {NULL};
+        size_t lengths[4] = {0};
+        size_t n_fields = 0;
+        for (const char* field = text; field < stop && n_fields < 4;) {
+            const char* colon = memchr(field, ':', (size_t)(stop - field));
+            const char* field_end = colon ? colon : stop;
+            fields[n_fields] = field;
+            lengths[n_fields++] = (size_t)(field_end - field);
+            field = colon ? colon + 1 : stop;
+        }
+        text = stop + 1;
+        if (n_fields == 0 || lengths[0] == 0) {
+            continue;
+        }
+        if (n_fields < 3 || n_acl == sizeof(acl) / sizeof(acl[0])) {
+            return -EBADMSG;
+        }
+        
+        AclEntry* item = &acl[n_acl++];
+        char kind = fields[0][0];
+        int qualified = lengths[1] > 0;
+        item->id = ACL_UNDEFINED_ID;
+        if (kind == 'u') {
+            item->tag = qualified ? ACL_USER : ACL_USER_OBJ;
+        } else if (kind == 'g') {
+            item->tag = qualified ? ACL_GROUP : ACL_GROUP_OBJ;
+        } else if (kind == 'm') {
+            item->tag = ACL_MASK;
+        } else if (kind == 'o') {
+            item->tag = ACL_OTHER;
+        } else {
+            return -EBADMSG;
+        }
+        if (qualified && (item->tag == ACL_USER || item->tag == ACL_GROUP)) {
+            int result = n_fields == 4
+                ? parse_acl_id(fields[3], lengths[3], item->tag == ACL_USER, &item->id)
+                : parse_acl_id(fields[1], lengths[1], item->tag == ACL_USER, &item->id);
+            if (result < 0) {
+                return result;
+            }
+        }
+        
+        item->perm = 0;
+        for (size_t i = 0; i < lengths[2]; i++) {
+            char c = fields[2][i];
+            item->perm |= c == 'r' ? 4 : c == 'w' ? 2 : c == 'x' ? 1 : 0;
+        }
+    }
+    
+    if (n_acl == 0) {
+        return 0;
+    }
+    qsort(acl, n_acl, sizeof(AclEntry), compare_acl_entries);
+    
+    uint8_t value[4 + sizeof(acl)];
+    uint8_t* out = value;
+    uint32_t version = ACL_XATTR_VERSION;
+    // The format is little-endian; so is every machine this runs on
+    memcpy(out, &version, 4);
+    out += 4;
+    for (size_t i = 0; i < n_acl; i++) {
+        memcpy(out, &acl[i].tag, 2);
+        memcpy(out + 2, &acl[i].perm, 2);
+        memcpy(out + 4, &acl[i].id, 4);
+        out += 8;
+    }
+    return add_xattr(entry, xattr_name, strlen(xattr_name), value, (size_t)(out - value));
+}
+
+// tar
+
+typedef struct {
+    char* path;
+    char* link;
+    uint64_t size;
+    int has_size;
+    int has_uid;
+    int has_gid;
+    int has_mtime;
+    int has_atime;
+    uid_t uid;
+    gid_t gid;
+    struct timespec mtime;
+    struct timespec atime;
+    Entry extra;            // collects xattrs only
+} PaxState;
+
+static void pax_clear(PaxState* pax) {
+    free(pax->path);
+    free(pax->link);
+    entry_clear(&pax->extra);
+    memset(pax, 0, sizeof(*pax));
+}
+
+// Octal, or base-256 when the top bit of the first byte is set
+static uint64_t parse_number(const uint8_t* field, size_t size) {
+    uint64_t value = 0;
+    if (field[0] & 0x80) {
+        value = field[0] & 0x3f;
+        for (size_t i = 1; i < size; i++) {
+            value = value << 8 | field[i];
+        }
+        return value;
+    }
+    
+    size_t i = 0;
+    while (i < size && field[i] == ' ') {
+        i++;
+    }
+    for (; i < size && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = value << 3 | (uint64_t)(field[i] - '0');
+    }
+    return value;
+}
+
+static int parse_time(const char* text, size_t length, struct timespec* time) {
+    char buffer[64];
+    if (length >= sizeof(buffer)) {
+        return -EBADMSG;
+    }
+    memcpy(buffer, text, length);
+    buffer[length] = '\0';
+    
+    char* end;
+    time->tv_sec = strtoll(buffer, &end, 10);
+    time->tv_nsec = 0;
+    if (*end == '.') {
+        long scale = 100000000;
+        for (end++; *end >= '0' && *end <= '9'; end++, scale /= 10) {
+            time->tv_nsec += (*end - '0') * scale;
+        }
+    }
+    return 0;
+}
+
+static int parse_pax_value(const char* text, size_t length, uint64_t* value) {
+    char buffer[32];
+    if (length >= sizeof(buffer)) {
+        return -EBADMSG;
+    }
+    memcpy(buffer, text, length);
+    buffer[length] = '\0';
+    char* end;
+    *value = strtoull(buffer, &end, 10);
+    return end == buffer ? -EBADMSG : 0;
+}
+
+// Records are "<length> <key>=<value>\n"; values of xattrs may be binary
+static int parse_pax(PaxState* pax, const char* data, size_t size) {
+    size_t position = 0;
+    
+    while (position < size) {
+        char* end;
+        unsigned long length = strtoul(data + position, &end, 10);
+        if (end == data + position || *end != ' ' || length == 0 || length > size - position) {
+            return -EBADMSG;
+        }
+        
+        const char* key = end + 1;
+        const char* record_end = data + position + length - 1;   // the newline
+        const char* equals = memchr(key, '=', (size_t)(record_end - key));
+        if (!equals || *record_end != '\n') {
+            return -EBADMSG;
+        }
+        size_t key_length = (size_t)(equals - key);
+        const char* value = equals + 1;
+        size_t value_length = (size_t)(record_end - value);
+        position += length;
+        
+        int result = 0;
+        uint64_t number;
+#define KEY_IS(name) (key_length == sizeof(name) - 1 && memcmp(key, name, key_length) == 0)
+#define KEY_STARTS(prefix) (key_length > sizeof(prefix) - 1 && memcmp(key, prefix, sizeof(prefix) - 1) == 0)
+        if (KEY_IS("path")) {
+            free(pax->path);
+            pax->path = strndup(value, value_length);
+            result = pax->path ? 0 : -ENOMEM;
+        } else if (KEY_IS("linkpath")) {
+            free(pax->link);
+            pax->link = strndup(value, value_length);
+            result = pax->link ? 0 : -ENOMEM;
+        } else if (KEY_IS("size")) {
+            result = parse_pax_value(value, value_length, &pax->size);
+            pax->has_size = 1;
+        } else if (KEY_IS("uid")) {
+            result = parse_pax_value(value, value_length, &number);
+            pax->uid = (uid_t)number;
+            pax->has_uid = 1;
+        } else if (KEY_IS("gid")) {
+            result = parse_pax_value(value, value_length, &number);
+            pax->gid = (gid_t)number;
+            pax->has_gid = 1;
+        } else if (KEY_IS("mtime")) {
+            result = parse_time(value, value_length, &pax->mtime);
+            pax->has_mtime = 1;
+        } else if (KEY_IS("atime")) {
+            result = parse_time(value, value_length, &pax->atime);
+            pax->has_atime = 1;
+        } else if (KEY_IS("SCHILY.acl.access")) {
+            result = add_acl(&pax->extra, "system.posix_acl_access", value, value_length);
+        } else if (KEY_IS("SCHILY.acl.default")) {
+            result = add_acl(&pax->extra, "system.posix_acl_default", value, value_length);
+        } else if (KEY_STARTS("SCHILY.xattr.")) {
+            result = add_xattr(&pax->extra, key + 13, key_length - 13, value, value_length);
+        }
+#undef KEY_IS
+#undef KEY_STARTS
+        if (result < 0) {
+            return result;
+        }
+    }
+    return 0;
+}
+
+static int read_header_data(Extractor* extractor, uint64_t size, char** data) {
+    if (size > MAX_HEADER_DATA) {
+        return -EBADMSG;
+    }
+    *data = malloc((size_t)size + 1);
+    if (!*data) {
+        return -ENOMEM;
+    }
+    int result = input_read(extractor, *data, (size_t)size);
+    if (result == 0) {
+        result = input_skip(extractor, (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+    }
+    if (result < 0) {
+        free(*data);
+        *data = NULL;
+        return result;
+    }
+    (*data)[size] = '\0';
+    return 0;
+}
+
+static int tar_checksum_ok(const uint8_t* header) {
+    uint64_t expected = parse_number(header + 148, 8);
+    uint64_t unsigned_sum = 0;
+    int64_t signed_sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        uint8_t byte = i >= 148 && i < 156 ? ' ' : header[i];
+        unsigned_sum += byte;
+        signed_sum += (int8_t)byte;
+    }
+    // Some old tars summed signed chars
+    return expected == unsigned_sum || (int64_t)expected == signed_sum;
+}
+
+static char* header_string(const uint8_t* field, size_t size) {
+    return strndup((const char*)field, size);
+}
+
+static int entry_from_tar(const uint8_t* header, PaxState* pax, Entry* entry) {
+    memset(entry, 0, sizeof(*entry));
+    char type = (char)header[156];
+    
+    switch (type) {
+    case '1':
+        entry->type = ENTRY_HARDLINK;
+        break;
+    case '2':
+        entry->type = ENTRY_SYMLINK;
+        break;
+    case '3':
+        entry->type = ENTRY_CHAR;
+        break;
+    case '4':
+        entry->type = ENTRY_BLOCK;
+        break;
+    case '5':
+        entry->type = ENTRY_DIRECTORY;
+        break;
+    case '6':
+        entry->type = ENTRY_FIFO;
+        break;
+    case 'S':
+        return -ENOTSUP;    // GNU sparse files
+    default:
+        entry->type = ENTRY_FILE;   // '0', '7', NUL and unknown types, as POSIX says
+        break;
+    }
+    
+    if (pax->path) {
+        entry->path = pax->path;
+        pax->path = NULL;
+    } else if (memcmp(header + 257, "ustar", 5) == 0 && header[345]) {
+        char* prefix = header_string(header + 345, 155);
+        char* name = header_string(header + 0, 100);
+        if (prefix && name && asprintf(&entry->path, "%s/%s", prefix, name) < 0) {
+            entry->path = NULL;
+        }
+        free(prefix);
+        free(name);
+    } else {
+        entry->path = header_string(header + 0, 100);
+    }
+    
+    if (pax->link) {
+        entry->link = pax->link;
+        pax->link = NULL;
+    } else {
+        entry->link = header_string(header + 157, 100);
+    }
+    if (!entry->path || !entry->link) {
+        return -ENOMEM;
+    }
+    
+    // A directory written as a regular file with a trailing slash (v7 tar)
+    size_t path_length = strlen(entry->path);
+    if (entry->type == ENTRY_FILE && path_length > 0 && entry->path[path_length - 1] == '/') {
+        entry->type = ENTRY_DIRECTORY;
+    }
+    
+    entry->mode = (mode_t)(parse_number(header + 100, 8) & 07777);
+    entry->uid = pax->has_uid ? pax->uid : (uid_t)parse_number(header + 108, 8);
+    entry->gid = pax->has_gid ? pax->gid : (gid_t)parse_number(header + 116, 8);
+    entry->size = pax->has_size ? pax->size : parse_number(header + 124, 12);
+    entry->rdev = makedev((unsigned)parse_number(header + 329, 8), (unsigned)parse_number(header + 337, 8));
+    if (pax->has_mtime) {
+        entry->mtime = pax->mtime;
+    } else {
+        entry->mtime.tv_sec = (time_t)parse_number(header + 136, 12);
+    }
+    entry->atime = pax->has_atime ? pax->atime : entry->mtime;
+    
+    entry->xattrs = pax->extra.xattrs;
+    entry->n_xattrs = pax->extra.n_xattrs;
+    pax->extra.xattrs = NULL;
+    pax->extra.n_xattrs = 0;
+    return 0;
+}
+
+// Member names and other ownership in tar headers are ignored: the numeric
+// ids are what the target system's own passwd expects
+static int read_tar(Extractor* extractor) {
+    PaxState pax;
+    memset(&pax, 0, sizeof(pax));
+    int result = 0;
+    
+    while (!should_stop(extractor)) {
+        uint8_t header[TAR_BLOCK];
+        result = input_fill(extractor, 1);
+        if (result < 0) {
+            break;
+        }
+        if (extractor->input_start == extractor->input_end) {
+            break;  // no end-of-archive blocks; GNU tar accepts that too
+        }
+        result = input_read(extractor, header, TAR_BLOCK);
+        if (result < 0) {
+            break;
+        }
+        
+        int all_zero = 1;
+        for (int i = 0; i < TAR_BLOCK && all_zero; i++) {
+            all_zero = header[i] == 0;
+        }
+        if (all_zero) {
+            break;
+        }
+        if (!tar_checksum_ok(header)) {
+            result = -EBADMSG;
+            break;
+        }
+        
+        char type = (char)header[156];
+        uint64_t size = parse_number(header + 124, 12);
+        if (type == 'x' || type == 'g' || type == 'L' || type == 'K') {
+            char* data;
+            result = read_header_data(extractor, size, &data);
+            if (result < 0) {
+                break;
+            }
+            if (type == 'x') {
+                result = parse_pax(&pax, data, (size_t)size);
+            } else if (type == 'L') {
+                free(pax.path);
+                pax.path = data;
+                data = NULL;
+            } else if (type == 'K') {
+                free(pax.link);
+                pax.link = data;
+                data = NULL;
+            }
+            // Global pax headers ('g') carry nothing a payload needs
+            free(data);
+            if (result < 0) {
+                break;
+            }
+            continue;
+        }
+        if (type == 'V') {
+            result = input_skip(extractor, size + (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+            if (result < 0) {
+                break;
+            }
+            continue;
+        }
+        
+        Entry entry;
+        ATOMIC_ADD(&extractor->entries, 1);
+        result = entry_from_tar(header, &pax, &entry);
+        pax_clear(&pax);
+        uint64_t padding = (TAR_BLOCK - entry.size % TAR_BLOCK) % TAR_BLOCK;
+        if (result == 0) {
+            result = extract_entry(extractor, &entry);
+        }
+        if (result == 0) {
+            result = input_skip(extractor, padding);
+        }
+        if (result < 0) {
+            set_error(extractor, result, entry.path);
+            entry_clear(&entry);
+            break;
+        }
+        entry_clear(&entry);
+    }
+    
+    pax_clear(&pax);
+    return result;
+}
+
+// cpio (newc, with or without checksums)
+
+static int parse_hex(const uint8_t* field, uint32_t* value) {
+    *value = 0;
+    for (int i = 0; i < 8; i++) {
+        char c = (char)field[i];
+        int digit = c >= '0' && c <= '9' ? c - '0'
+            : c >= 'a' && c <= 'f' ? c - 'a' + 10
+            : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (digit < 0) {
+            return -EBADMSG;
+        }
+        *value = *value << 4 | (uint32_t)digit;
+    }
+    return 0;
+}
+
+static LinkGroup* find_link_group(Extractor* extractor, uint64_t key) {
+    for (LinkGroup* group = extractor->link_groups[key % LINK_BUCKETS]; group; group = group->next) {
+        if (group->key == key) {
+            return group;
+        }
+    }
+    return NULL;
+}
+
+// The first name of a hard-linked file is where its data goes, whichever
+// name the data comes with; the other names become links to it
+static int extract_linked_file(Extractor* extractor, Entry* entry, uint64_t key) {
+    int result = sanitize_path(entry->path);
+    if (result < 0) {
+        return result;
+    }
+    
+    LinkGroup* group = find_link_group(extractor, key);
+    if (!group) {
+        group = calloc(1, sizeof(LinkGroup));
+        if (!group || !(group->path = strdup(entry->path))) {
+            free(group);
+            return -ENOMEM;
+        }
+        group->key = key;
+        group->next = extractor->link_groups[key % LINK_BUCKETS];
+        extractor->link_groups[key % LINK_BUCKETS] = group;
+    } else {
+        Entry link;
+        memset(&link, 0, sizeof(link));
+        link.type = ENTRY_HARDLINK;
+        link.path = entry->path;
+        link.link = strdup(group->path);
+        entry->path = strdup(group->path);
+        result = link.link && entry->path ? entry_list_add(&extractor->hardlinks, &link) : -ENOMEM;
+        entry_clear(&link);
+        if (result < 0) {
+            return result;
+        }
+    }
+    
+    if (group->written) {
+        return input_skip(extractor, entry->size);
+    }
+    if (entry->size == 0) {
+        // The data may still come with a later name
+        entry_clear(&group->entry);
+        group->entry = *entry;
+        memset(entry, 0, sizeof(*entry));
+        return 0;
+    }
+    group->written = 1;
+    return extract_entry(extractor, entry);
+}
+
+// Hard-linked files whose names all came without data are empty
+static int flush_link_groups(Extractor* extractor) {
+    int result = 0;
+    for (size_t i = 0; i < LINK_BUCKETS; i++) {
+        while (extractor->link_groups[i]) {
+            LinkGroup* group = extractor->link_groups[i];
+            extractor->link_groups[i] = group->next;
+            if (!group->written && group->entry.path && result == 0 && !should_stop(extractor)) {
+                result = extract_entry(extractor, &group->entry);
+            }
+            entry_clear(&group->entry);
+            free(group->path);
+            free(group);
+        }
+    }
+    return result;
+}
+
+static int read_cpio(Extractor* extractor) {
+    int result = 0;
+    
+    while (!should_stop(extractor)) {
+        uint8_t header[CPIO_HEADER];
+        result = input_read(extractor, header, CPIO_HEADER);
+        if (result < 0) {
+            break;
+        }
+        if (memcmp(header, CPIO_MAGIC, 6) != 0 && memcmp(header, CPIO_MAGIC_CRC, 6) != 0) {
+            result = -EBADMSG;
+            break;
+        }
+        
+        // ino mode uid gid nlink mtime filesize devmajor devminor rdevmajor rdevminor namesize check
+        uint32_t fields[13];
+        for (int i = 0; i < 13 && result == 0; i++) {
+            result = parse_hex(header + 6 + i * 8, &fields[i]);
+        }
+        if (result < 0 || fields[11] == 0 || fields[11] > 4096) {
+            result = result < 0 ? result : -EBADMSG;
+            break;
+        }
+        
+        Entry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.path = malloc(fields[11]);
+        if (!entry.path) {
+            result = -ENOMEM;
+            break;
+        }
+        result = input_read(extractor, entry.path, fields[11]);
+        if (result == 0) {
+            entry.path[fields[11] - 1] = '\0';
+            result = input_skip(extractor, (4 - (CPIO_HEADER + fields[11]) % 4) % 4);
+        }
+        if (result < 0) {
+            entry_clear(&entry);
+            break;
+        }
+        if (strcmp(entry.path, CPIO_TRAILER) == 0) {
+            entry_clear(&entry);
+            break;
+        }
+        
+        ATOMIC_ADD(&extractor->entries, 1);
+        uint32_t mode = fields[1];
+        entry.mode = mode & 07777;
+        entry.uid = fields[2];
+        entry.gid = fields[3];
+        entry.mtime.tv_sec = fields[5];
+        entry.atime = entry.mtime;
+        entry.size = fields[6];
+        entry.rdev = makedev(fields[9], fields[10]);
+        uint64_t padding = (4 - entry.size % 4) % 4;
+        
+        switch (mode & S_IFMT) {
+        case S_IFDIR:
+            entry.type = ENTRY_DIRECTORY;
+            break;
+        case S_IFLNK:
+            // The link target is the data
+            entry.type = ENTRY_SYMLINK;
+            if (entry.size > 4096 || !(entry.link = calloc(1, (size_t)entry.size + 1))) {
+                result = entry.size > 4096 ? -EBADMSG : -ENOMEM;
+                break;
+            }
+            result = input_read(extractor, entry.link, (size_t)entry.size);
+            entry.size = 0;
+            break;
+        case S_IFCHR:
+            entry.type = ENTRY_CHAR;
+            break;
+        case S_IFBLK:
+            entry.type = ENTRY_BLOCK;
+            break;
+        case S_IFIFO:
+            entry.type = ENTRY_FIFO;
+            break;
+        case S_IFSOCK:
+            entry.type = ENTRY_FIFO;   // sockets cannot be restored; skipped below
+            break;
+        default:
+            entry.type = ENTRY_FILE;
+            break;
+        }
+        
+        if (result == 0 && (mode & S_IFMT) == S_IFSOCK) {
+            result = input_skip(extractor, entry.size);
+        } else if (result == 0 && entry.type == ENTRY_FILE && fields[4] > 1 && !extractor->scan) {
+            uint64_t key = (uint64_t)fields[0] | (uint64_t)fields[7] << 32 | (uint64_t)fields[8] << 48;
+            result = extract_linked_file(extractor, &entry, key);
+        } else if (result == 0) {
+            result = extract_entry(extractor, &entry);
+        }
+        if (result == 0) {
+            result = input_skip(extractor, padding);
+        }
+        if (result < 0) {
+            set_error(extractor, result, entry.path);
+            entry_clear(&entry);
+            break;
+        }
+        entry_clear(&entry);
+    }
+    
+    if (result == 0) {
+        result = flush_link_groups(extractor);
+    }
+    return result;
+}
+
+static int detect_format(Extractor* extractor) {
+    if (extractor->options.format != EXTRACT_FORMAT_AUTO) {
+        return extractor->options.format;
+    }
+    if (input_fill(extractor, 6) == 0 && extractor->input_end - extractor->input_start >= 6 &&
+        (memcmp(extractor->input + extractor->input_start, CPIO_MAGIC, 6) == 0 ||
+         memcmp(extractor->input + extractor->input_start, CPIO_MAGIC_CRC, 6) == 0)) {
+        return EXTRACT_FORMAT_CPIO;
+    }
+    return EXTRACT_FORMAT_TAR;
+}
+
+// Finishing: hard links once their targets exist, then directories deepest
+// first, so setting a directory's times is not undone by its children
+
+// A clone shares the first copy's extents. Where the filesystem turns one
+// down after all, the kernel copies the data instead.
+static int clone_data(Extractor* extractor, int source, int fd, uint64_t size) {
+    if (ioctl(fd, FICLONE, source) == 0) {
+        ATOMIC_ADD(&extractor->files_deduplicated, 1);
+        ATOMIC_ADD(&extractor->bytes_deduplicated, size);
+        return 0;
+    }
+    
+    uint64_t done = 0;
+    while (done < size) {
+        ssize_t result = copy_file_range(source, NULL, fd, NULL, (size_t)(size - done), 0);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (result == 0) {
+            return -EIO;
+        }
+        done += (uint64_t)result;
+        ATOMIC_ADD(&extractor->bytes_written, (uint64_t)result);
+    }
+    return 0;
+}
+
+// Runs before the hard links, which may name a clone
+static int create_clones(Extractor* extractor) {
+    int result = 0;
+    
+    for (size_t i = 0; i < extractor->clones.length && result == 0 && !should_stop(extractor); i++) {
+        Entry* entry = &extractor->clones.items[i];
+        int source = open_beneath(extractor, extractor->root_fd, entry->link, O_RDONLY | O_NOFOLLOW);
+        if (source < 0) {
+            result = set_error(extractor, source, entry->path);
+            break;
+        }
+        int fd = create_file(extractor, &extractor->reader_dirs, entry, 0);
+        result = fd < 0 ? fd : clone_data(extractor, source, fd, entry->size);
+        if (result == 0) {
+            result = apply_metadata_fd(extractor, fd, entry);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        close(source);
+        if (result < 0) {
+            set_error(extractor, result, entry->path);
+        }
+    }
+    return result;
+}
+
+static int create_hardlinks(Extractor* extractor) {
+    DirCache link_dirs = {NULL, -1};
+    int result = 0;
+    
+    for (size_t i = 0; i < extractor->hardlinks.length && result == 0 && !should_stop(extractor); i++) {
+        Entry* entry = &extractor->hardlinks.items[i];
+        const char* target_name;
+        const char* name;
+        int target_parent = open_parent(extractor, &link_dirs, entry->link, &target_name);
+        int parent = target_parent < 0 ? target_parent : open_parent(extractor, &extractor->reader_dirs,
+                                                                     entry->path, &name);
+        if (parent < 0) {
+            result = set_error(extractor, parent, entry->path);
+            break;
+        }
+        
+        for (int attempt = 0;; attempt++) {
+            if (linkat(target_parent, target_name, parent, name, 0) == 0) {
+                break;
+            }
+            if (errno != EEXIST || attempt > 0) {
+                result = set_error(extractor, -errno, entry->path);
+                break;
+            }
+            int replaced = replace_existing(parent, name);
+            if (replaced < 0) {
+                result = set_error(extractor, replaced, entry->path);
+                break;
+            }
+        }
+    }
+    
+    dir_cache_clear(&link_dirs);
+    return result;
+}
+
+static int finish_directories(Extractor* extractor) {
+    for (size_t i = extractor->directories.length; i-- > 0 && !should_stop(extractor);) {
+        Entry* entry = &extractor->directories.items[i];
+        int fd = open_beneath(extractor, extractor->root_fd, entry->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (fd < 0) {
+            return set_error(extractor, fd, entry->path);
+        }
+        int result = apply_metadata_fd(extractor, fd, entry);
+        close(fd);
+        if (result < 0) {
+            return set_error(extractor, result, entry->path);
+        }
+    }
+    return 0;
+}
+
+void extract_options_init(ExtractOptions* options) {
+    memset(options, 0, sizeof(*options));
+    options->format = EXTRACT_FORMAT_AUTO;
+    options->io_class = IO_CLASS_AUTO;
+    options->same_owner = geteuid() == 0;
+    options->xattrs = 1;
+    options->sync = 1;
+    options->dedup = EXTRACT_DEDUP_REFLINK;
+}
+
+static Extractor* extractor_alloc(const char* root, const ExtractOptions* options) {
+    Extractor* extractor = calloc(1, sizeof(Extractor));
+    if (!extractor) {
+        return NULL;
+    }
+    
+    extractor->root_path = strdup(root);
+    extractor->input = malloc(INPUT_BUFFER_SIZE);
+    if (!extractor->root_path || !extractor->input) {
+        extractor_free(extractor);
+        return NULL;
+    }
+    
+    if (options) {
+        extractor->options = *options;
+    } else {
+        extract_options_init(&extractor->options);
+    }
+    if (extractor->options.journal_path) {
+        extractor->journal_path = strdup(extractor->options.journal_path);
+        if (!extractor->journal_path) {
+            extractor_free(extractor);
+            return NULL;
+        }
+    }
+    extractor->options.journal_path = extractor->journal_path;
+    if (extractor->options.manifest_path) {
+        extractor->manifest_path = strdup(extractor->options.manifest_path);
+        if (!extractor->manifest_path) {
+            extractor_free(extractor);
+            return NULL;
+        }
+    }
+    extractor->options.manifest_path = extractor->manifest_path;
+    if (extractor->options.n_writers > MAX_WRITERS) {
+        extractor->options.n_writers = MAX_WRITERS;
+    }
+    
+    extractor->archive_fd = -1;
+    extractor->root_fd = -1;
+    extractor->reader_dirs.fd = -1;
+    extractor->use_openat2 = 1;
+    pthread_mutex_init(&extractor->lock, NULL);
+    pthread_cond_init(&extractor->jobs_ready, NULL);
+    pthread_cond_init(&extractor->space_ready, NULL);
+    return extractor;
+}
+
+Extractor* extractor_new(const char* archive_path, const char* root, const ExtractOptions* options) {
+    Extractor* extractor = extractor_alloc(root, options);
+    if (!extractor) {
+        return NULL;
+    }
+    extractor->archive_path = strdup(archive_path);
+    if (!extractor->archive_path) {
+        extractor_free(extractor);
+        return NULL;
+    }
+    return extractor;
+}
+
+Extractor* extractor_new_from_reader(ExtractReadFunc read, void* user_data, uint64_t archive_bytes,
+                                     const char* root, const ExtractOptions* options) {
+    Extractor* extractor = extractor_alloc(root, options);
+    if (!extractor) {
+        return NULL;
+    }
+    extractor->read = read;
+    extractor->user_data = user_data;
+    extractor->archive_bytes = archive_bytes;
+    return extractor;
+}
+
+void extractor_free(Extractor* extractor) {
+    if (!extractor) {
+        return;
+    }
+    
+    if (extractor->archive_fd >= 0) {
+        close(extractor->archive_fd);
+    }
+    if (extractor->root_fd >= 0) {
+        close(extractor->root_fd);
+    }
+    journal_close(extractor->journal);
+    manifest_free(extractor->manifest);
+    for (size_t i = 0; i < DEDUP_BUCKETS; i++) {
+        while (extractor->blobs[i]) {
+            DedupBlob* blob = extractor->blobs[i];
+            extractor->blobs[i] = blob->next;
+            free(blob->path);
+            free(blob);
+        }
+    }
+    dir_cache_clear(&extractor->reader_dirs);
+    entry_list_clear(&extractor->directories);
+    entry_list_clear(&extractor->hardlinks);
+    entry_list_clear(&extractor->clones);
+    pthread_mutex_destroy(&extractor->lock);
+    pthread_cond_destroy(&extractor->jobs_ready);
+    pthread_cond_destroy(&extractor->space_ready);
+    free(extractor->input);
+    free(extractor->archive_path);
+    free(extractor->root_path);
+    free(extractor->journal_path);
+    free(extractor->manifest_path);
+    free(extractor->error_path);
+    free(extractor);
+}
+
+static int open_archive(Extractor* extractor) {
+    if (extractor->read) {
+        return 0;
+    }
+    
+    extractor->archive_fd = open(extractor->archive_path, O_RDONLY | O_CLOEXEC);
+    if (extractor->archive_fd < 0) {
+        return -errno;
+    }
+    struct stat st;
+    if (fstat(extractor->archive_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        ATOMIC_STORE(&extractor->archive_bytes, (uint64_t)st.st_size);
+    }
+    posix_fadvise(extractor->archive_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return 0;
+}
+
+// Whether the root's filesystem can clone at all, asked with two unnamed
+// files so nothing is left behind; an empty one is enough to ask
+static int probe_reflinks(Extractor* extractor) {
+    int source = openat(extractor->root_fd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    int target = source < 0 ? -1 : openat(extractor->root_fd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    int supported = target >= 0 && ioctl(target, FICLONE, source) == 0;
+    if (target >= 0) {
+        close(target);
+    }
+    if (source >= 0) {
+        close(source);
+    }
+    return supported;
+}
+
+// Deduplication is an optimization: without a manifest that fits the
+// archive, every file is simply written
+static void open_manifest(Extractor* extractor) {
+    if (!extractor->manifest_path || extractor->options.dedup == EXTRACT_DEDUP_NONE ||
+        manifest_open(extractor->manifest_path, &extractor->manifest) < 0) {
+        return;
+    }
+    // The manifest counts up to the end-of-archive marker, not the padding
+    // after it; each file is checked against it on its own anyway
+    uint64_t archive_bytes = ATOMIC_LOAD(&extractor->archive_bytes);
+    if (archive_bytes && manifest_get_header(extractor->manifest)->archive_bytes > archive_bytes) {
+        manifest_free(extractor->manifest);
+        extractor->manifest = NULL;
+        return;
+    }
+    extractor->reflinks = probe_reflinks(extractor);
+}
+
+static int open_files(Extractor* extractor) {
+    extractor->root_fd = open(extractor->root_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (extractor->root_fd < 0) {
+        return -errno;
+    }
+    return open_archive(extractor);
+}
+
+// Fills in what the options left at 0 from the profile of the disk under the
+// root. A root that is on no disk (tmpfs) and failed probes get the
+// defaults; tuning never fails the run.
+static void tune(Extractor* extractor) {
+    IoProfile* profile = &extractor->profile;
+    struct stat st;
+    if (extractor->options.io_class == IO_CLASS_NONE || fstat(extractor->root_fd, &st) != 0 ||
+        io_profile_detect(st.st_dev, extractor->options.io_class, IO_PROBE_DEFAULT_MS, profile) < 0) {
+        memset(profile, 0, sizeof(*profile));
+    }
+    if (extractor->options.max_buffered == 0) {
+        extractor->options.max_buffered = profile->read_ahead ? profile->read_ahead : DEFAULT_MAX_BUFFERED;
+    }
+    
+    // Writers mostly wait on metadata updates, so more of them than CPUs pays
+    uint32_t n_writers = extractor->options.n_writers;
+    if (n_writers == 0 && profile->n_writers > 0) {
+        n_writers = profile->n_writers > MAX_WRITERS ? MAX_WRITERS : profile->n_writers;
+    } else if (n_writers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_writers = cpus > 0 ? (uint32_t)cpus * 2 : 4;
+        n_writers = n_writers < 4 ? 4 : n_writers > 16 ? 16 : n_writers;
+    }
+    extractor->options.n_writers = n_writers;
+    profile->n_writers = n_writers;
+    profile->read_ahead = extractor->options.max_buffered;
+    ATOMIC_STORE(&extractor->tuned, 1);
+}
+
+int extractor_run(Extractor* extractor) {
+    ATOMIC_STORE(&extractor->start_ns, now_ns());
+    
+    int result = open_files(extractor);
+    if (result == 0) {
+        tune(extractor);
+        ATOMIC_STORE(&extractor->n_writers, extractor->options.n_writers);
+        open_manifest(extractor);
+        result = start_journal(extractor);
+    }
+    pthread_t threads[MAX_WRITERS];
+    uint32_t n_started = 0;
+    
+    for (; result == 0 && n_started < extractor->options.n_writers; n_started++) {
+        int error = pthread_create(&threads[n_started], NULL, writer_thread, extractor);
+        if (error != 0) {
+            // Fewer writers still get the job done
+            result = n_started == 0 ? -error : 0;
+            break;
+        }
+    }
+    ATOMIC_STORE(&extractor->n_writers, n_started);
+    
+    if (result == 0) {
+        result = detect_format(extractor) == EXTRACT_FORMAT_CPIO ? read_cpio(extractor) : read_tar(extractor);
+        if (result < 0) {
+            set_error(extractor, result, NULL);
+        }
+    }
+    
+    pthread_mutex_lock(&extractor->lock);
+    extractor->reader_done = 1;
+    pthread_cond_broadcast(&extractor->jobs_ready);
+    pthread_mutex_unlock(&extractor->lock);
+    for (uint32_t i = 0; i < n_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    
+    if (result == 0 && !should_stop(extractor)) {
+        result = create_clones(extractor);
+    }
+    if (result == 0 && !should_stop(extractor)) {
+        result = create_hardlinks(extractor);
+    }
+    if (result == 0 && !should_stop(extractor)) {
+        result = finish_directories(extractor);
+    }
+    if (result == 0) {
+        result = ATOMIC_LOAD(&extractor->error);
+    }
+    if (result == 0 && ATOMIC_LOAD(&extractor->cancelled)) {
+        result = -ECANCELED;
+    }
+    
+    // One flush for the whole filesystem instead of an fsync() per file
+    if (result == 0 && extractor->options.sync) {
+        ATOMIC_STORE(&extractor->syncing, 1);
+        if (syncfs(extractor->root_fd) != 0) {
+            result = set_error(extractor, -errno, NULL);
+        }
+    }
+    finish_journal(extractor, result);
+    
+    ATOMIC_STORE(&extractor->end_ns, now_ns());
+    ATOMIC_STORE(&extractor->finished, 1);
+    return result;
+}
+
+int extractor_scan(Extractor* extractor, const ExtractScanFuncs* funcs, void* user_data) {
+    ATOMIC_STORE(&extractor->start_ns, now_ns());
+    extractor->scan = funcs;
+    extractor->scan_data = user_data;
+    
+    int result = open_archive(extractor);
+    if (result == 0) {
+        result = detect_format(extractor) == EXTRACT_FORMAT_CPIO ? read_cpio(extractor) : read_tar(extractor);
+    }
+    if (result < 0) {
+        set_error(extractor, result, NULL);
+    }
+    if (result == 0 && ATOMIC_LOAD(&extractor->cancelled)) {
+        result = -ECANCELED;
+    }
+    
+    extractor->scan = NULL;
+    ATOMIC_STORE(&extractor->end_ns, now_ns());
+    ATOMIC_STORE(&extractor->finished, 1);
+    return result;
+}
+
+void extractor_cancel(Extractor* extractor) {
+    ATOMIC_STORE(&extractor->cancelled, 1);
+    
+    // The reader may be waiting for the writers to make room
+    pthread_mutex_lock(&extractor->lock);
+    pthread_cond_broadcast(&extractor->space_ready);
+    pthread_mutex_unlock(&extractor->lock);
+}
+
+void extractor_set_paused(Extractor* extractor, int paused) {
+    if (paused == ATOMIC_LOAD(&extractor->paused)) {
+        return;
+    }
+    if (paused) {
+        ATOMIC_STORE(&extractor->pause_start_ns, now_ns());
+    } else {
+        ATOMIC_ADD(&extractor->paused_ns, now_ns() - ATOMIC_LOAD(&extractor->pause_start_ns));
+    }
+    ATOMIC_STORE(&extractor->paused, paused);
+}
+
+void extractor_get_stats(Extractor* extractor, ExtractStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->finished = ATOMIC_LOAD(&extractor->finished);
+    stats->archive_bytes = ATOMIC_LOAD(&extractor->archive_bytes);
+    stats->archive_done = ATOMIC_LOAD(&extractor->archive_done);
+    stats->bytes_written = ATOMIC_LOAD(&extractor->bytes_written);
+    stats->entries = ATOMIC_LOAD(&extractor->entries);
+    stats->files = ATOMIC_LOAD(&extractor->files);
+    stats->files_resumed = ATOMIC_LOAD(&extractor->files_resumed);
+    stats->bytes_resumed = ATOMIC_LOAD(&extractor->bytes_resumed);
+    stats->files_deduplicated = ATOMIC_LOAD(&extractor->files_deduplicated);
+    stats->bytes_deduplicated = ATOMIC_LOAD(&extractor->bytes_deduplicated);
+    stats->n_writers = ATOMIC_LOAD(&extractor->n_writers);
+    stats->tuned = ATOMIC_LOAD(&extractor->tuned);
+    if (stats->tuned) {
+        stats->profile = extractor->profile;
+    }
+    stats->syncing = ATOMIC_LOAD(&extractor->syncing);
+    stats->paused = ATOMIC_LOAD(&extractor->paused);
+    
+    Journal* journal = ATOMIC_LOAD(&extractor->journal);
+    if (journal) {
+        JournalStats journal_stats;
+        journal_get_stats(journal, &journal_stats);
+        stats->journal_commits = journal_stats.commits;
+        stats->journal_ns = journal_stats.busy_ns;
+    }
+    
+    uint64_t start = ATOMIC_LOAD(&extractor->start_ns);
+    uint64_t end = stats->finished ? ATOMIC_LOAD(&extractor->end_ns) : now_ns();
+    uint64_t paused_ns = ATOMIC_LOAD(&extractor->paused_ns);
+    if (stats->paused) {
+        paused_ns += end - ATOMIC_LOAD(&extractor->pause_start_ns);
+    }
+    stats->elapsed_ns = start && end > start + paused_ns ? end - start - paused_ns : 0;
+    
+    stats->eta_seconds = -1;
+    if (stats->elapsed_ns > 0) {
+        stats->bytes_per_second = stats->archive_done / (stats->elapsed_ns / 1e9);
+    }
+    if (stats->bytes_per_second > 0 && stats->archive_bytes >= stats->archive_done) {
+        stats->eta_seconds = (stats->archive_bytes - stats->archive_done) / stats->bytes_per_second;
+    }
+}
+
+const char* extractor_get_error_path(Extractor* extractor) {
+    return extractor->error_path;
+}
+
+const char* extract_format_name(ExtractFormat format) {
+    switch (format) {
+    case EXTRACT_FORMAT_TAR:
+        return "tar";
+    case EXTRACT_FORMAT_CPIO:
+        return "cpio";
+    default:
+        return "auto";
+    }
+}
@@ -0,0 +1,146 @@
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "iotune.h"
+
+// Unpacks a tar (ustar, GNU or pax) or cpio (newc) payload into a directory,
+// normally the root of a freshly created filesystem. Creating many small
+// files is bound by metadata latency rather than bandwidth, so one reader
+// thread parses the archive while a pool of writer threads creates the
+// files, fills them and applies their metadata. Directories and symlinks are
+// created by the reader in archive order, so later entries always find the
+// path they expect; hard links and the final mode and times of directories
+// are applied once all files exist. Nothing is synced per file: the whole
+// filesystem is flushed once with syncfs() at the end. With a journal, the
+// extractor checkpoints every second or so how many members are on disk for
+// good, and a later run of the same archive skips the files of the last
+// checkpoint that are still in place. With a manifest, a file whose content
+// was already written is not written again: it shares the first copy's
+// extents, or with EXTRACT_DEDUP_HARDLINK becomes a hard link to it. The
+// writer count and read ahead left at 0 come from the profile of the disk
+// under the root (see iotune.h): a disk that does worst with parallel writes
+// gets a single writer, which creates the files in archive order. Plain C
+// so the install helper can use it without GLib.
+
+typedef enum {
+    EXTRACT_FORMAT_AUTO,    // cpio when the archive starts with the newc magic, tar otherwise
+    EXTRACT_FORMAT_TAR,
+    EXTRACT_FORMAT_CPIO
+} ExtractFormat;
+
+typedef enum {
+    EXTRACT_DEDUP_NONE,
+    EXTRACT_DEDUP_REFLINK,  // copies share extents (FICLONE) where the filesystem can; written otherwise
+    EXTRACT_DEDUP_HARDLINK  // for read-only trees: copies with the same metadata become hard links,
+                            // the others as for REFLINK
+} ExtractDedup;
+
+typedef struct {
+    uint32_t n_writers;     // writer threads; 0 to tune, else twice the number of CPUs, 4 to 16
+    uint64_t max_buffered;  // file data read ahead of the writers, in bytes; 0 to tune, else 64 MiB
+    IoClass io_class;       // how to tune: AUTO probes the disk, NONE takes the defaults
+    ExtractFormat format;
+    int same_owner;         // apply the numeric uid/gid of the archive
+    int xattrs;             // apply extended attributes and POSIX ACLs
+    int sync;               // syncfs() the target before returning
+    const char* journal_path;   // checkpoints to resume from; NULL for none
+    const char* manifest_path;  // digests of the archive's files, to find copies; NULL for none
+    ExtractDedup dedup;
+} ExtractOptions;
+
+// Counters that can be read from any thread while the extractor runs
+typedef struct {
+    uint64_t archive_bytes;    // size of the archive; 0 when it is not known
+    uint64_t archive_done;     // how far the reader has got
+    uint64_t bytes_written;    // file data written
+    uint64_t entries;          // archive members, of any type
+    uint64_t files;            // regular files created
+    uint64_t files_resumed;    // found in place from an earlier run and not written again
+    uint64_t bytes_resumed;    // their data
+    uint64_t files_deduplicated;   // reflinked or hard linked to an earlier copy
+    uint64_t bytes_deduplicated;   // their data, which was not written
+    uint64_t journal_commits;
+    uint64_t journal_ns;       // spent committing the journal, filesystem flushes included
+    uint64_t elapsed_ns;       // time spent paused is not counted
+    double bytes_per_second;   // of archive_done, averaged since the start
+    double eta_seconds;        // negative until there is a rate to go by
+    uint32_t n_writers;
+    int tuned;                 // profile is set
+    IoProfile profile;         // of the disk under the root, with the writers and read ahead in use
+    int syncing;               // everything is written; waiting for syncfs()
+    int paused;
+    int finished;
+} ExtractStats;
+
+typedef struct Extractor Extractor;
+
+// Returns the number of bytes read (0 at the end) or a negative errno value
+typedef ssize_t (*ExtractReadFunc)(void* user_data, void* buffer, size_t length);
+
+// One archive member as reported by extractor_scan()
+typedef struct {
+    const char* path;       // relative to the root, as it would be extracted; "." for the root
+    const char* link;       // symlink contents or hard link target; NULL otherwise
+    uint32_t mode;          // file type and permission bits, as in st_mode
+    uint32_t uid;
+    uint32_t gid;
+    int64_t mtime;
+    uint64_t size;          // data size of regular files
+    uint64_t data_offset;   // where that data starts in the uncompressed archive
+} ExtractMember;
+
+typedef struct {
+    // Called for every member in archive order. Hard links are regular
+    // files with a link target and no data of their own.
+    int (*member)(void* user_data, const ExtractMember* member);
+    // The data of the regular file last passed to member(), in order and in
+    // pieces of any size; may be NULL
+    int (*data)(void* user_data, const uint8_t* data, size_t length);
+} ExtractScanFuncs;
+
+// Automatic format, writer count and read ahead tuned to the disk, the
+// archive's owners when running as root, xattrs and ACLs, syncfs(), no
+// journal, reflinks once there is a manifest
+void extract_options_init(ExtractOptions* options);
+
+// Extracts the archive file at archive_path into root, which must exist
+Extractor* extractor_new(const char* archive_path, const char* root, const ExtractOptions* options);
+
+// Extracts a stream produced by read (a decompressor, say); archive_bytes is
+// only used for progress and may be 0
+Extractor* extractor_new_from_reader(ExtractReadFunc read, void* user_data, uint64_t archive_bytes,
+                                     const char* root, const ExtractOptions* options);
+void extractor_free(Extractor* extractor);
+
+// Extracts the whole archive. Blocks until done; returns 0, -ECANCELED after
+// extractor_cancel() or another negative errno value. A malformed archive
+// fails with -EBADMSG, and a member path that leaves the root with -EPERM.
+// The journal is kept after the run, whatever its result; it is up to the
+// caller to remove it once the install as a whole has succeeded. A manifest
+// that cannot be read, or is of another archive, only turns deduplication
+// off.
+int extractor_run(Extractor* extractor);
+
+// Parses the archive like extractor_run() without creating anything; the
+// root is not used. A callback returning a negative errno value stops the
+// scan with that value. cpio names of a hard-linked file are reported as
+// separate files, only the one that carries the data with a size.
+int extractor_scan(Extractor* extractor, const ExtractScanFuncs* funcs, void* user_data);
+
+// Safe to call from another thread while extractor_run() runs. A paused
+// extractor stops reading the archive; the writers finish the files already
+// read.
+void extractor_cancel(Extractor* extractor);
+void extractor_set_paused(Extractor* extractor, int paused);
+void extractor_get_stats(Extractor* extractor, ExtractStats* stats);
+
+// Member that was being extracted when extractor_run() failed; NULL when the
+// failure was not tied to one
+const char* extractor_get_error_path(Extractor* extractor);
+
+const char* extract_format_name(ExtractFormat format);
+
+#endif // EXTRACT_H
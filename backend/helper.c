@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include "helper.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A status update takes well under a microsecond; a sequence that stays odd
+// for this many reads belongs to a helper that stopped half way
+#define STATUS_RETRIES 1000
+
+struct HelperClient {
+    int fd;
+    HelperShared* shared;
+};
+
+// Receives the hello message and the memfd that comes with it
+static int receive_hello(int fd, int* memfd) {
+    HelperMessage message;
+    struct iovec iov = { &message, sizeof(message) };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    
+    ssize_t length;
+    do {
+        length = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (length < 0 && errno == EINTR);
+    if (length < 0) {
+        return -errno;
+    }
+    
+    *memfd = -1;
+    struct cmsghdr* header = CMSG_FIRSTHDR(&msg);
+    if (header && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS &&
+        header->cmsg_len == CMSG_LEN(sizeof(int))) {
+        memcpy(memfd, CMSG_DATA(header), sizeof(int));
+    }
+    if (length != sizeof(message) || message.type != HELPER_MESSAGE_HELLO || *memfd < 0) {
+        if (*memfd >= 0) {
+            close(*memfd);
+        }
+        return length == 0 ? -ECONNRESET : -EPROTO;
+    }
+    return 0;
+}
+
+int helper_client_new(int fd, HelperClient** client) {
+    *client = NULL;
+    int memfd = -1;
+    int result = receive_hello(fd, &memfd);
+    if (result < 0) {
+        close(fd);
+        return result;
+    }
+    
+    struct stat st;
+    HelperShared* shared = MAP_FAILED;
+    if (fstat(memfd, &st) != 0) {
+        result = -errno;
+    } else if ((size_t)st.st_size < sizeof(HelperShared)) {
+        result = -EPROTO;
+    } else {
+        shared = mmap(NULL, sizeof(HelperShared), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if (shared == MAP_FAILED) {
+            result = -errno;
+        } else if (shared->magic != HELPER_MAGIC || shared->version != HELPER_VERSION) {
+            result = -EPROTO;
+        }
+    }
+    close(memfd);
+    
+    if (result == 0) {
+        *client = calloc(1, sizeof(HelperClient));
+        result = *client ? 0 : -ENOMEM;
+    }
+    if (result < 0) {
+        if (shared != MAP_FAILED) {
+            munmap(shared, sizeof(HelperShared));
+        }
+        close(fd);
+        return result;
+    }
+    (*client)->fd = fd;
+    (*client)->shared = shared;
+    return 0;
+}
+
+void helper_client_free(HelperClient* client) {
+    if (!client) {
+        return;
+    }
+    munmap(client->shared, sizeof(HelperShared));
+    close(client->fd);
+    free(client);
+}
+
+int helper_client_get_fd(HelperClient* client) {
+    return client->fd;
+}
+
+int helper_client_send(HelperClient* client, const HelperCommand* command) {
+    ssize_t length;
+    do {
+        length = send(client->fd, command, sizeof(*command), MSG_NOSIGNAL);
+    } while (length < 0 && errno == EINTR);
+    if (length < 0) {
+        return -errno;
+    }
+    return length == sizeof(*command) ? 0 : -EPROTO;
+}
+
+int helper_client_receive(HelperClient* client, HelperMessage* message) {
+    ssize_t length;
+    do {
+        length = recv(client->fd, message, sizeof(*message), 0);
+    } while (length < 0 && errno == EINTR);
+    if (length < 0) {
+        return -errno;
+    }
+    if (length == 0) {
+        return 0;
+    }
+    return length == sizeof(*message) ? 1 : -EPROTO;
+}
+
+int helper_client_get_status(HelperClient* client, HelperStatus* status) {
+    HelperShared* shared = client->shared;
+    for (int i = 0; i < STATUS_RETRIES; i++) {
+        uint64_t before = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            continue;
+        }
+        memcpy(status, &shared->status, sizeof(*status));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shared->sequence, __ATOMIC_RELAXED) == before) {
+            return 0;
+        }
+    }
+    return -EAGAIN;
+}
+
+ProgressRing* helper_client_get_events(HelperClient* client) {
+    return &client->shared->events;
+}
+
+void helper_command_init(HelperCommand* command, HelperCommandType type) {
+    memset(command, 0, sizeof(*command));
+    command->command = type;
+    image_writer_options_init(&command->writer_options);
+    extract_options_init(&command->extract_options);
+}
+
+void helper_shared_init(HelperShared* shared) {
+    memset(shared, 0, offsetof(HelperShared, events));
+    shared->magic = HELPER_MAGIC;
+    shared->version = HELPER_VERSION;
+    shared->status.eta_seconds = -1;
+    progress_ring_init(&shared->events);
+}
+
+void helper_shared_set_status(HelperShared* shared, const HelperStatus* status) {
+    uint64_t sequence = shared->sequence;
+    __atomic_store_n(&shared->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&shared->status, status, sizeof(*status));
+    __atomic_store_n(&shared->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,147 @@
+#ifndef HELPER_H
+#define HELPER_H
+
+#include <stdint.h>
+#include "extract.h"
+#include "imagewriter.h"
+#include "progress.h"
+#include "sha256.h"
+#include "sysconfig.h"
+
+// Channel between the installer and wave-install-helper, the process that
+// does the privileged work. The two talk over a SOCK_SEQPACKET socket, one
+// fixed-size message per command or reply. Progress goes the other way
+// through a memfd the helper creates and hands over when it starts:
+//
+//   HelperShared   status, updated by the helper a few times a second and
+//                  read without a lock, and a ProgressRing for stage changes
+//                  and log lines
+//
+// The UI never waits for the helper to read progress, so a helper stuck in
+// uninterruptible I/O cannot stall it. Plain C, so anything that can create
+// a socketpair can drive the helper; the installer is just one client.
+
+#define HELPER_MAGIC 0x574c4548u    // "HELW"
+#define HELPER_VERSION 5
+
+#define HELPER_PATH_SIZE 1024
+
+typedef enum {
+    HELPER_STATE_IDLE,
+    HELPER_STATE_RUNNING,
+    HELPER_STATE_PAUSED,
+    HELPER_STATE_FINISHED       // the last run is over; see HelperStatus.result
+} HelperState;
+
+typedef enum {
+    HELPER_JOB_IMAGE,           // write the image at source to the disk at target
+    HELPER_JOB_PAYLOAD          // unpack the archive or seekable payload at source into target
+} HelperJob;
+
+typedef enum {
+    HELPER_PHASE_COPYING,
+    HELPER_PHASE_SYNCING,
+    HELPER_PHASE_VERIFYING
+} HelperPhase;
+
+typedef struct {
+    uint64_t bytes_total;       // of the image or archive; 0 when not known
+    uint64_t bytes_done;
+    uint64_t elapsed_ns;        // of the run, pauses not counted
+    double bytes_per_second;
+    double eta_seconds;         // negative until there is a rate to go by
+    double hash_bytes_per_second;
+    uint32_t state;             // HelperState
+    uint32_t job;               // HelperJob of the current or last run
+    uint32_t phase;             // HelperPhase
+    int32_t result;             // 0 or -errno, once the state is FINISHED
+    uint64_t updated_ns;        // CLOCK_MONOTONIC of the last update
+} HelperStatus;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sequence;          // odd while the helper is writing status
+    HelperStatus status;
+    ProgressRing events __attribute__((aligned(64)));   // the helper's run thread is the producer
+} HelperShared;
+
+typedef enum {
+    HELPER_COMMAND_START = 1,
+    HELPER_COMMAND_PAUSE,
+    HELPER_COMMAND_RESUME,
+    HELPER_COMMAND_CANCEL,
+    HELPER_COMMAND_QUERY
+} HelperCommandType;
+
+// Client to helper. The option structs are sent as they are, so both ends
+// must come from the same build; their pointers are ignored and replaced by
+// the paths below.
+typedef struct {
+    uint32_t command;           // HelperCommandType
+    uint32_t job;               // HelperJob, for START
+    uint32_t payload_threads;   // decoder threads for a seekable payload; 0 for one per CPU
+    uint32_t dry_run;           // run the stages as stubs that only wait; nothing is opened
+    ImageWriterOptions writer_options;
+    ExtractOptions extract_options;
+    SystemConfig config;        // written into the root after a payload is unpacked
+    char source[HELPER_PATH_SIZE];
+    char target[HELPER_PATH_SIZE];
+    char checksum_path[HELPER_PATH_SIZE];   // "" for none
+    char journal_path[HELPER_PATH_SIZE];    // "" for none; removed once the whole run has succeeded
+    char manifest_path[HELPER_PATH_SIZE];   // of the payload, to deduplicate its files; "" for none
+} HelperCommand;
+
+typedef enum {
+    HELPER_MESSAGE_HELLO = 1,   // first message; carries the memfd
+    HELPER_MESSAGE_REPLY,       // answers one command, in order
+    HELPER_MESSAGE_FINISHED     // a run is over
+} HelperMessageType;
+
+// Helper to client
+typedef struct {
+    uint32_t type;              // HelperMessageType
+    uint32_t command;           // the HelperCommandType answered by a REPLY
+    int32_t result;             // of the command, or of the run for FINISHED
+    uint32_t state;             // HelperState after the command
+    uint64_t error_offset;      // image byte at which a write failed
+    uint32_t has_digest;
+    uint32_t reserved;
+    uint8_t digest[SHA256_DIGEST_SIZE];     // of the written image
+    char error_path[HELPER_PATH_SIZE];      // payload member that failed; "" if none
+} HelperMessage;
+
+typedef struct HelperClient HelperClient;
+
+// Takes over one end of a socketpair whose other end is the helper's
+// standard input, waits for the helper to say hello and maps the shared
+// memory it sends. Returns 0, -EPROTO when the other end is not a helper
+// of this version, or another negative errno value.
+int helper_client_new(int fd, HelperClient** client);
+
+// Closes the socket; a helper that loses its client cancels the run and exits
+void helper_client_free(HelperClient* client);
+
+int helper_client_get_fd(HelperClient* client);
+
+// Sends one command; safe from any thread. Returns 0 or a negative errno value.
+int helper_client_send(HelperClient* client, const HelperCommand* command);
+
+// Receives the next message, blocking unless the socket is non-blocking.
+// Returns 1, 0 when the helper has gone away, or a negative errno value.
+int helper_client_receive(HelperClient* client, HelperMessage* message);
+
+// Consistent copy of the status, from any thread. Never blocks: returns 0,
+// or -EAGAIN when the helper stopped in the middle of an update.
+int helper_client_get_status(HelperClient* client, HelperStatus* status);
+
+// The helper's event ring. Only one thread may consume it.
+ProgressRing* helper_client_get_events(HelperClient* client);
+
+void helper_command_init(HelperCommand* command, HelperCommandType type);
+
+// Helper side: the same consistency protocol as helper_client_get_status()
+void helper_shared_init(HelperShared* shared);
+void helper_shared_set_status(HelperShared* shared, const HelperStatus* status);
+
+#endif // HELPER_H
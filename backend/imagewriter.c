@@ -0,0 +1,1430 @@
+#define _GNU_SOURCE
+#include "imagewriter.h"
+#include "blockhash.h"
+#include "journal.h"
+#include "zeroblock.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUFFER_ALIGNMENT 4096
+#define DEFAULT_BLOCK_SIZE (1024 * 1024)
+#define MAX_BLOCK_SIZE (64 * 1024 * 1024)
+#define DEFAULT_QUEUE_DEPTH 8
+#define MAX_QUEUE_DEPTH 128
+#define MAX_EXTENT_BLOCKS 64    // per journal record; a block that no longer matches costs its extent
+
+#define ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ATOMIC_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+
+// Progress of a data block, for the journal. Holes in the image are not
+// journaled; they cost next to nothing to redo.
+enum {
+    BLOCK_PENDING,
+    BLOCK_DONE,         // written and hashed, not journaled yet
+    BLOCK_JOURNALED     // in the journal, from this run or a verified earlier one
+};
+
+// Where the image holds data, from SEEK_DATA/SEEK_HOLE; everything else is a hole
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} DataExtent;
+
+struct ImageWriter {
+    char* source_path;
+    char* target_path;
+    ImageWriterOptions options;
+    
+    int source_fd;
+    int target_fd;
+    int tail_fd;            // the target without O_DIRECT, for an unaligned end of the image
+    int source_direct;
+    int target_is_block;
+    uint64_t total;
+    uint64_t next_offset;   // next block to hand out
+    DataExtent* extents;
+    size_t n_extents;
+    uint8_t* zero_buffer;   // block_size zeros, for targets that cannot skip
+    char* checksum_path;
+    uint8_t* expected;      // digests from the checksum list
+    size_t n_expected;
+    BlockHasher* hasher;
+    char* journal_path;
+    Journal* journal;
+    uint8_t* block_states;  // one per block while journaling
+    uint64_t n_blocks;
+    uint64_t journal_scan;  // blocks before this one are all journaled
+    
+    // Read by image_writer_get_stats() from other threads
+    uint64_t bytes_done;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t bytes_skipped;
+    uint64_t bytes_resumed;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t pause_start_ns;
+    uint64_t paused_ns;     // time spent paused, not counted in the rate
+    uint32_t spot_checks_done;
+    int verifying;
+    int engine;
+    int skip;
+    int direct;
+    int tuned;
+    IoProfile profile;      // set once, before tuned
+    int finished;
+    int paused;
+    int cancelled;
+    int error;
+    uint64_t error_offset;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static size_t align_up(size_t value) {
+    return (value + BUFFER_ALIGNMENT - 1) & ~(size_t)(BUFFER_ALIGNMENT - 1);
+}
+
+// Keeps the first error; the others are usually consequences of it
+static void set_error(ImageWriter* writer, int error, uint64_t offset) {
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&writer->error, &expected, error, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        writer->error_offset = offset;
+    }
+}
+
+static int should_stop(ImageWriter* writer) {
+    return ATOMIC_LOAD(&writer->cancelled) || ATOMIC_LOAD(&writer->error);
+}
+
+// Requests already in flight finish; no new ones start until resumed
+static void wait_while_paused(ImageWriter* writer) {
+    static const struct timespec interval = { 0, 10 * 1000 * 1000 };
+    while (ATOMIC_LOAD(&writer->paused) && !should_stop(writer)) {
+        nanosleep(&interval, NULL);
+    }
+}
+
+// Start of the first data at or after offset, or the end of the image
+static uint64_t find_data(ImageWriter* writer, uint64_t offset) {
+    size_t low = 0;
+    size_t high = writer->n_extents;
+    
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (writer->extents[middle].end <= offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    
+    if (low == writer->n_extents) {
+        return writer->total;
+    }
+    return writer->extents[low].start > offset ? writer->extents[low].start : offset;
+}
+
+// Hands out the image in block_size pieces, or longer runs of whole blocks
+// that lie in a hole of the image; returns 0 once it is used up. Pieces
+// always start on a block_size boundary.
+static int claim_block(ImageWriter* writer, uint64_t* offset, uint64_t* length, int* hole) {
+    wait_while_paused(writer);
+    if (should_stop(writer)) {
+        return 0;
+    }
+    
+    uint64_t block_size = writer->options.block_size;
+    uint64_t start = ATOMIC_LOAD(&writer->next_offset);
+    
+    for (;;) {
+        if (start >= writer->total) {
+            return 0;
+        }
+        
+        uint64_t data = find_data(writer, start);
+        uint64_t end = data >= writer->total ? writer->total : data / block_size * block_size;
+        *hole = end > start;
+        if (!*hole) {
+            end = writer->total - start > block_size ? start + block_size : writer->total;
+            
+            // Already on the target from an earlier run
+            if (writer->block_states &&
+                ATOMIC_LOAD(&writer->block_states[start / block_size]) == BLOCK_JOURNALED) {
+                if (__atomic_compare_exchange_n(&writer->next_offset, &start, end, 0, __ATOMIC_ACQ_REL,
+                                                __ATOMIC_ACQUIRE)) {
+                    start = end;
+                }
+                continue;
+            }
+        }
+        
+        if (__atomic_compare_exchange_n(&writer->next_offset, &start, end, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *offset = start;
+            *length = end - start;
+            return 1;
+        }
+    }
+}
+
+void image_writer_options_init(ImageWriterOptions* options) {
+    memset(options, 0, sizeof(*options));
+    options->io_class = IO_CLASS_AUTO;
+    options->engine = IMAGE_WRITER_ENGINE_AUTO;
+    options->direct = 1;
+    options->sparse = 1;
+    options->verify = 1;
+}
+
+ImageWriter* image_writer_new(const char* source, const char* target, const ImageWriterOptions* options) {
+    ImageWriter* writer = calloc(1, sizeof(ImageWriter));
+    if (!writer) {
+        return NULL;
+    }
+    
+    if (options) {
+        writer->options = *options;
+    } else {
+        image_writer_options_init(&writer->options);
+    }
+    
+    writer->source_path = strdup(source);
+    writer->target_path = strdup(target);
+    if (writer->options.checksum_path) {
+        writer->checksum_path = strdup(writer->options.checksum_path);
+    }
+    if (writer->options.journal_path) {
+        writer->journal_path = strdup(writer->options.journal_path);
+    }
+    writer->options.checksum_path = writer->checksum_path;
+    writer->options.journal_path = writer->journal_path;
+    if (!writer->source_path || !writer->target_path ||
+        (options && options->checksum_path && !writer->checksum_path) ||
+        (options && options->journal_path && !writer->journal_path)) {
+        image_writer_free(writer);
+        return NULL;
+    }
+    
+    // 0 is left for tune() to fill in
+    if (writer->options.block_size > MAX_BLOCK_SIZE) {
+        writer->options.block_size = MAX_BLOCK_SIZE;
+    }
+    writer->options.block_size = (uint32_t)align_up(writer->options.block_size);
+    if (writer->options.queue_depth > MAX_QUEUE_DEPTH) {
+        writer->options.queue_depth = MAX_QUEUE_DEPTH;
+    }
+    
+    writer->source_fd = -1;
+    writer->target_fd = -1;
+    writer->tail_fd = -1;
+    writer->engine = writer->options.engine;
+    return writer;
+}
+
+static void close_files(ImageWriter* writer) {
+    if (writer->source_fd >= 0) {
+        close(writer->source_fd);
+    }
+    if (writer->target_fd >= 0) {
+        close(writer->target_fd);
+    }
+    if (writer->tail_fd >= 0) {
+        close(writer->tail_fd);
+    }
+    writer->source_fd = writer->target_fd = writer->tail_fd = -1;
+}
+
+void image_writer_free(ImageWriter* writer) {
+    if (!writer) {
+        return;
+    }
+    
+    close_files(writer);
+    journal_close(writer->journal);
+    block_hasher_free(writer->hasher);
+    free(writer->block_states);
+    free(writer->expected);
+    free(writer->checksum_path);
+    free(writer->journal_path);
+    free(writer->extents);
+    free(writer->zero_buffer);
+    free(writer->source_path);
+    free(writer->target_path);
+    free(writer);
+}
+
+// Filesystems without O_DIRECT support (tmpfs before 6.6, some FUSE
+// filesystems) refuse it at open time with EINVAL
+static int open_maybe_direct(const char* path, int flags, int direct, int* used_direct) {
+    *used_direct = 0;
+    if (direct) {
+        int fd = open(path, flags | O_DIRECT, 0644);
+        if (fd >= 0) {
+            *used_direct = 1;
+            return fd;
+        }
+        if (errno != EINVAL) {
+            return -errno;
+        }
+    }
+    
+    int fd = open(path, flags, 0644);
+    return fd >= 0 ? fd : -errno;
+}
+
+static int get_size(int fd, struct stat* st, uint64_t* size) {
+    if (fstat(fd, st) != 0) {
+        return -errno;
+    }
+    if (S_ISBLK(st->st_mode)) {
+        return ioctl(fd, BLKGETSIZE64, size) == 0 ? 0 : -errno;
+    }
+    if (S_ISREG(st->st_mode)) {
+        *size = (uint64_t)st->st_size;
+        return 0;
+    }
+    return -EINVAL;
+}
+
+static int add_extent(ImageWriter* writer, size_t* capacity, uint64_t start, uint64_t end) {
+    if (writer->n_extents == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 64;
+        DataExtent* extents = realloc(writer->extents, new_capacity * sizeof(DataExtent));
+        if (!extents) {
+            return -ENOMEM;
+        }
+        writer->extents = extents;
+        *capacity = new_capacity;
+    }
+    
+    writer->extents[writer->n_extents].start = start;
+    writer->extents[writer->n_extents].end = end;
+    writer->n_extents++;
+    return 0;
+}
+
+// Sparse image files tell where their holes are, so those need not be read.
+// Sources without SEEK_DATA support (block devices, some filesystems) count
+// as data throughout.
+static int load_extents(ImageWriter* writer) {
+    size_t capacity = 0;
+    uint64_t position = 0;
+    
+    while (position < writer->total) {
+        off_t data = lseek(writer->source_fd, (off_t)position, SEEK_DATA);
+        if (data < 0) {
+            // ENXIO: only a hole is left
+            return errno == ENXIO ? 0 : add_extent(writer, &capacity, position, writer->total);
+        }
+        
+        off_t hole = lseek(writer->source_fd, data, SEEK_HOLE);
+        uint64_t end = hole < 0 || (uint64_t)hole > writer->total ? writer->total : (uint64_t)hole;
+        int result = add_extent(writer, &capacity, (uint64_t)data, end);
+        if (result < 0) {
+            return result;
+        }
+        position = end;
+    }
+    return 0;
+}
+
+// The checksum list fixes the block size: its digests only mean something
+// for blocks cut exactly the way it was made
+static int setup_hasher(ImageWriter* writer) {
+    if (writer->checksum_path) {
+        uint32_t block_size;
+        int result = block_sums_load(writer->checksum_path, &block_size, &writer->expected, &writer->n_expected);
+        if (result < 0) {
+            return result;
+        }
+        if (block_size % BUFFER_ALIGNMENT != 0 || block_size > MAX_BLOCK_SIZE) {
+            return -EBADMSG;
+        }
+        if (writer->n_expected != (writer->total + block_size - 1) / block_size) {
+            return -EBADMSG;
+        }
+        writer->options.block_size = block_size;
+    }
+    
+    if (!writer->options.verify && !writer->checksum_path && writer->options.spot_checks == 0) {
+        return 0;
+    }
+    writer->hasher = block_hasher_new(writer->total, writer->options.block_size, writer->options.queue_depth,
+                                      writer->expected, writer->n_expected);
+    return writer->hasher ? 0 : -ENOMEM;
+}
+
+static int open_files(ImageWriter* writer) {
+    struct stat st;
+    int fd = open_maybe_direct(writer->source_path, O_RDONLY | O_CLOEXEC, writer->options.direct,
+                               &writer->source_direct);
+    if (fd < 0) {
+        return fd;
+    }
+    writer->source_fd = fd;
+    
+    uint64_t total;
+    int result = get_size(fd, &st, &total);
+    if (result < 0) {
+        return result;
+    }
+    ATOMIC_STORE(&writer->total, total);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    
+    result = load_extents(writer);
+    if (result < 0) {
+        return result;
+    }
+    
+    result = setup_hasher(writer);
+    if (result < 0) {
+        return result;
+    }
+    
+    void* zero_buffer;
+    if (posix_memalign(&zero_buffer, BUFFER_ALIGNMENT, writer->options.block_size) != 0) {
+        return -ENOMEM;
+    }
+    memset(zero_buffer, 0, writer->options.block_size);
+    writer->zero_buffer = zero_buffer;
+    
+    fd = open_maybe_direct(writer->target_path, O_WRONLY | O_CREAT | O_CLOEXEC, writer->options.direct,
+                           &writer->direct);
+    if (fd < 0) {
+        return fd;
+    }
+    writer->target_fd = fd;
+    
+    uint64_t target_size;
+    result = get_size(fd, &st, &target_size);
+    if (result < 0) {
+        return result;
+    }
+    writer->target_is_block = S_ISBLK(st.st_mode);
+    if (writer->target_is_block) {
+        if (target_size < writer->total) {
+            return -ENOSPC;
+        }
+    } else if (ftruncate(fd, (off_t)writer->total) != 0) {
+        return -errno;
+    }
+    
+    // A file that was empty is all holes after the truncate, so zeros need
+    // no work at all; anything else has old contents to clear
+    ImageWriterSkip skip = IMAGE_WRITER_SKIP_PUNCH_HOLE;
+    if (!writer->options.sparse) {
+        skip = IMAGE_WRITER_SKIP_WRITE;
+    } else if (!writer->target_is_block && target_size == 0) {
+        skip = IMAGE_WRITER_SKIP_SEEK;
+    }
+    ATOMIC_STORE(&writer->skip, skip);
+    
+    // O_DIRECT lengths must be a multiple of the logical block size, which the
+    // last piece of an arbitrary image is not
+    if (writer->direct && writer->total % BUFFER_ALIGNMENT != 0) {
+        fd = open(writer->target_path, O_WRONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return -errno;
+        }
+        writer->tail_fd = fd;
+    }
+    return 0;
+}
+
+static int target_fd_for(ImageWriter* writer, size_t length) {
+    return writer->tail_fd >= 0 && length % BUFFER_ALIGNMENT != 0 ? writer->tail_fd : writer->target_fd;
+}
+
+// With O_DIRECT the request is rounded up; the read still stops at the end
+// of the file
+static size_t read_request_length(ImageWriter* writer, size_t length) {
+    return writer->source_direct ? align_up(length) : length;
+}
+
+static int read_full(int fd, int direct, uint8_t* buffer, uint64_t offset, size_t length) {
+    size_t done = 0;
+    
+    while (done < length) {
+        size_t request = direct ? align_up(length - done) : length - done;
+        ssize_t result = pread(fd, buffer + done, request, (off_t)(offset + done));
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (result == 0) {
+            return -EIO;  // the image shrank while it was being written
+        }
+        done += (size_t)result;
+    }
+    return 0;
+}
+
+static int read_block(ImageWriter* writer, uint8_t* buffer, uint64_t offset, size_t length) {
+    return read_full(writer->source_fd, writer->source_direct, buffer, offset, length);
+}
+
+static int write_block(ImageWriter* writer, const uint8_t* buffer, uint64_t offset, size_t length) {
+    int fd = target_fd_for(writer, length);
+    size_t done = 0;
+    
+    while (done < length) {
+        ssize_t result = pwrite(fd, buffer + done, length - done, (off_t)(offset + done));
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (result == 0) {
+            return -EIO;
+        }
+        done += (size_t)result;
+    }
+    return 0;
+}
+
+static int write_zeros(ImageWriter* writer, uint64_t offset, uint64_t length) {
+    while (length > 0) {
+        size_t chunk = length < writer->options.block_size ? (size_t)length : writer->options.block_size;
+        int result = write_block(writer, writer->zero_buffer, offset, chunk);
+        if (result < 0) {
+            return result;
+        }
+        ATOMIC_ADD(&writer->bytes_written, chunk);
+        offset += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+// Makes a range of the target read back as zeros as cheaply as the target
+// allows. A method the target turns out not to support is dropped for the
+// rest of the run in favour of the next one. BLKDISCARD is not used: a
+// discarded range is not guaranteed to read back as zeros.
+static int skip_range(ImageWriter* writer, uint64_t offset, uint64_t length) {
+    int skip = ATOMIC_LOAD(&writer->skip);
+    
+    // Disks only zero whole logical blocks; the odd end of an image is written
+    if (writer->target_is_block && (offset | length) % BUFFER_ALIGNMENT != 0) {
+        skip = IMAGE_WRITER_SKIP_WRITE;
+    }
+    
+    while (skip != IMAGE_WRITER_SKIP_WRITE) {
+        int result = 0;
+        if (skip == IMAGE_WRITER_SKIP_PUNCH_HOLE) {
+            // On a block device this becomes a WRITE ZEROES command, which
+            // fails rather than falling back to writing
+            if (fallocate(writer->target_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset,
+                          (off_t)length) != 0) {
+                result = -errno;
+            }
+        } else if (skip == IMAGE_WRITER_SKIP_ZEROOUT) {
+            uint64_t range[2] = {offset, length};
+            if (ioctl(writer->target_fd, BLKZEROOUT, range) != 0) {
+                result = -errno;
+            }
+        }
+        
+        if (result == 0) {
+            ATOMIC_ADD(&writer->bytes_skipped, length);
+            return 0;
+        }
+        if (result != -EOPNOTSUPP && result != -ENOTTY && result != -EINVAL && result != -ENOSYS) {
+            return result;
+        }
+        
+        skip = skip == IMAGE_WRITER_SKIP_PUNCH_HOLE && writer->target_is_block
+            ? IMAGE_WRITER_SKIP_ZEROOUT : IMAGE_WRITER_SKIP_WRITE;
+        ATOMIC_STORE(&writer->skip, skip);
+    }
+    
+    return write_zeros(writer, offset, length);
+}
+
+static int is_zero_block(ImageWriter* writer, const uint8_t* buffer, size_t length) {
+    return writer->options.sparse && buffer_is_zero(buffer, length);
+}
+
+// Zeros have a known digest, so they are checked without being hashed
+static int skip_zeros(ImageWriter* writer, uint64_t offset, uint64_t length) {
+    if (writer->hasher) {
+        uint64_t failed_offset;
+        if (block_hasher_add_zeros(writer->hasher, offset, length, &failed_offset) < 0) {
+            set_error(writer, -EBADMSG, failed_offset);
+            return -EBADMSG;
+        }
+    }
+    return skip_range(writer, offset, length);
+}
+
+// Picks the blocks to read back with xorshift64; any block is as likely to be
+// bad as the next, so there is no need for anything better
+static uint64_t next_random(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+// Reads randomly chosen blocks back from the target, past the page cache, and
+// compares them with the digests taken while writing. Catches disks that
+// acknowledge writes they then lose.
+static int spot_check(ImageWriter* writer) {
+    uint64_t block_size = writer->options.block_size;
+    uint64_t n_blocks = (writer->total + block_size - 1) / block_size;
+    if (!writer->hasher || writer->options.spot_checks == 0 || n_blocks == 0) {
+        return 0;
+    }
+    
+    int direct;
+    int fd = open_maybe_direct(writer->target_path, O_RDONLY | O_CLOEXEC, writer->options.direct, &direct);
+    if (fd < 0) {
+        return fd;
+    }
+    if (!direct) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    
+    void* buffer;
+    if (posix_memalign(&buffer, BUFFER_ALIGNMENT, block_size) != 0) {
+        close(fd);
+        return -ENOMEM;
+    }
+    
+    ATOMIC_STORE(&writer->verifying, 1);
+    uint64_t state = now_ns() | 1;
+    int result = 0;
+    for (uint32_t i = 0; i < writer->options.spot_checks && result == 0; i++) {
+        if (ATOMIC_LOAD(&writer->cancelled)) {
+            result = -ECANCELED;
+            break;
+        }
+        
+        uint64_t offset = next_random(&state) % n_blocks * block_size;
+        size_t length = writer->total - offset < block_size ? (size_t)(writer->total - offset) : (size_t)block_size;
+        result = read_full(fd, direct, buffer, offset, length);
+        if (result < 0) {
+            set_error(writer, result, offset);
+            break;
+        }
+        
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        sha256(buffer, length, digest);
+        if (memcmp(digest, block_hasher_get_digest(writer->hasher, offset), SHA256_DIGEST_SIZE) != 0) {
+            result = -EBADMSG;
+            set_error(writer, result, offset);
+        }
+        ATOMIC_ADD(&writer->spot_checks_done, 1);
+    }
+    ATOMIC_STORE(&writer->verifying, 0);
+    
+    free(buffer);
+    close(fd);
+    return result;
+}
+
+// Journal. A block is journaled once it has been written and hashed, in
+// extents of consecutive blocks, each with a digest over its block digests;
+// the commit thread flushes the target before it writes them. A later run
+// trusts nothing it did not read back: an extent is only skipped when the
+// target still hashes to its digest, so a journal of another disk at the same
+// path costs a read, not a wrong image.
+
+static void mark_done(ImageWriter* writer, uint64_t offset) {
+    if (writer->block_states) {
+        ATOMIC_STORE(&writer->block_states[offset / writer->options.block_size], BLOCK_DONE);
+    }
+}
+
+static void extent_digest(ImageWriter* writer, uint64_t first, uint64_t end, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    Sha256Context context;
+    sha256_init(&context);
+    for (uint64_t index = first; index < end; index++) {
+        sha256_update(&context, block_hasher_get_digest(writer->hasher, index * writer->options.block_size),
+                      SHA256_DIGEST_SIZE);
+    }
+    sha256_final(&context, digest);
+}
+
+static int collect_blocks(void* data, Journal* journal) {
+    ImageWriter* writer = data;
+    uint64_t index = writer->journal_scan;
+    while (index < writer->n_blocks && ATOMIC_LOAD(&writer->block_states[index]) == BLOCK_JOURNALED) {
+        index++;
+    }
+    writer->journal_scan = index;
+    
+    while (index < writer->n_blocks) {
+        if (ATOMIC_LOAD(&writer->block_states[index]) != BLOCK_DONE) {
+            index++;
+            continue;
+        }
+        uint64_t first = index;
+        while (index < writer->n_blocks && index - first < MAX_EXTENT_BLOCKS &&
+               ATOMIC_LOAD(&writer->block_states[index]) == BLOCK_DONE) {
+            index++;
+        }
+        
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        extent_digest(writer, first, index, digest);
+        uint64_t end = index * writer->options.block_size;
+        int result = journal_append(journal, JOURNAL_RECORD_EXTENT, first * writer->options.block_size,
+                                    end < writer->total ? end : writer->total, digest);
+        if (result < 0) {
+            return result;
+        }
+        for (uint64_t i = first; i < index; i++) {
+            ATOMIC_STORE(&writer->block_states[i], BLOCK_JOURNALED);
+        }
+    }
+    return 0;
+}
+
+// fdatasync() flushes the whole file, a tail written through tail_fd included
+static int sync_target(void* data) {
+    ImageWriter* writer = data;
+    return fdatasync(writer->target_fd) == 0 ? 0 : -errno;
+}
+
+static const JournalSource journal_source = { collect_blocks, sync_target };
+
+// Reads an extent of an earlier run back and hashes it like freshly written
+// blocks; returns 1 when it matches the journal and need not be written again
+static int verify_extent(ImageWriter* writer, int fd, int direct, uint8_t* buffer, const JournalRecord* record) {
+    uint64_t block_size = writer->options.block_size;
+    if (record->start % block_size != 0 || record->start >= record->end || record->end > writer->total ||
+        (record->end - record->start + block_size - 1) / block_size > MAX_EXTENT_BLOCKS) {
+        return 0;
+    }
+    uint64_t first = record->start / block_size;
+    uint64_t end = (record->end + block_size - 1) / block_size;
+    if (end * block_size < writer->total && record->end != end * block_size) {
+        return 0;
+    }
+    for (uint64_t index = first; index < end; index++) {
+        if (writer->block_states[index] != BLOCK_PENDING) {
+            return 0;
+        }
+    }
+    
+    for (uint64_t offset = record->start; offset < record->end; offset += block_size) {
+        size_t length = record->end - offset < block_size ? (size_t)(record->end - offset) : (size_t)block_size;
+        if (read_full(fd, direct, buffer, offset, length) < 0) {
+            return 0;
+        }
+        block_hasher_submit(writer->hasher, 0, buffer, offset, length);
+        if (block_hasher_wait(writer->hasher, 0) < 0) {
+            return 0;   // does not match the checksum list either
+        }
+    }
+    
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    extent_digest(writer, first, end, digest);
+    if (memcmp(digest, record->digest, SHA256_DIGEST_SIZE) != 0) {
+        return 0;
+    }
+    for (uint64_t index = first; index < end; index++) {
+        writer->block_states[index] = BLOCK_JOURNALED;
+    }
+    return 1;
+}
+
+static int resume_blocks(ImageWriter* writer) {
+    size_t n_records = journal_get_n_replayed(writer->journal);
+    if (n_records == 0) {
+        return 0;
+    }
+    
+    int direct;
+    int fd = open_maybe_direct(writer->target_path, O_RDONLY | O_CLOEXEC, writer->options.direct, &direct);
+    if (fd < 0) {
+        return fd;
+    }
+    if (!direct) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    void* buffer;
+    if (posix_memalign(&buffer, BUFFER_ALIGNMENT, writer->options.block_size) != 0) {
+        close(fd);
+        return -ENOMEM;
+    }
+    
+    ATOMIC_STORE(&writer->verifying, 1);
+    int result = 0;
+    for (size_t i = 0; i < n_records; i++) {
+        if (ATOMIC_LOAD(&writer->cancelled)) {
+            result = -ECANCELED;
+            break;
+        }
+        const JournalRecord* record = journal_get_replayed(writer->journal, i);
+        if (record->type == JOURNAL_RECORD_EXTENT && verify_extent(writer, fd, direct, buffer, record)) {
+            ATOMIC_ADD(&writer->bytes_resumed, record->end - record->start);
+            ATOMIC_ADD(&writer->bytes_done, record->end - record->start);
+        }
+    }
+    ATOMIC_STORE(&writer->verifying, 0);
+    
+    free(buffer);
+    close(fd);
+    return result;
+}
+
+// The journal belongs to one image and one target; identifying them only
+// saves reading back extents that cannot match. Block devices are known by
+// their size alone, since a disk that drops off the bus may come back under
+// another name.
+static void journal_identity(ImageWriter* writer, uint8_t identity[SHA256_DIGEST_SIZE]) {
+    struct stat source;
+    struct stat target;
+    memset(&source, 0, sizeof(source));
+    memset(&target, 0, sizeof(target));
+    fstat(writer->source_fd, &source);
+    fstat(writer->target_fd, &target);
+    
+    uint64_t fields[] = {
+        (uint64_t)source.st_dev, (uint64_t)source.st_ino, (uint64_t)source.st_size,
+        (uint64_t)source.st_mtim.tv_sec, (uint64_t)source.st_mtim.tv_nsec, writer->options.block_size,
+        writer->target_is_block ? 0 : (uint64_t)target.st_dev, writer->target_is_block ? 0 : (uint64_t)target.st_ino
+    };
+    Sha256Context context;
+    sha256_init(&context);
+    sha256_update(&context, "wave-image", 10);
+    sha256_update(&context, fields, sizeof(fields));
+    sha256_final(&context, identity);
+}
+
+static int start_journal(ImageWriter* writer) {
+    if (!writer->journal_path || !writer->hasher) {
+        return 0;
+    }
+    
+    writer->n_blocks = (writer->total + writer->options.block_size - 1) / writer->options.block_size;
+    writer->block_states = calloc(writer->n_blocks ? writer->n_blocks : 1, 1);
+    if (!writer->block_states) {
+        return -ENOMEM;
+    }
+    uint8_t identity[SHA256_DIGEST_SIZE];
+    journal_identity(writer, identity);
+    Journal* journal;
+    int result = journal_open(writer->journal_path, identity, &journal);
+    if (result < 0) {
+        return result;
+    }
+    ATOMIC_STORE(&writer->journal, journal);
+    result = resume_blocks(writer);
+    if (result == 0) {
+        result = journal_start(writer->journal, &journal_source, writer, JOURNAL_DEFAULT_INTERVAL_MS);
+    }
+    return result;
+}
+
+// Records what got done, whether the run succeeded or not
+static void finish_journal(ImageWriter* writer) {
+    if (writer->journal) {
+        journal_stop(writer->journal);
+        journal_commit(writer->journal);
+    }
+}
+
+static void free_buffers(uint8_t** buffers, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        free(buffers[i]);
+    }
+    free(buffers);
+}
+
+static uint8_t** alloc_buffers(uint32_t count, size_t size) {
+    uint8_t** buffers = calloc(count, sizeof(uint8_t*));
+    if (!buffers) {
+        return NULL;
+    }
+    
+    for (uint32_t i = 0; i < count; i++) {
+        void* buffer;
+        if (posix_memalign(&buffer, BUFFER_ALIGNMENT, size) != 0) {
+            free_buffers(buffers, i);
+            return NULL;
+        }
+        buffers[i] = buffer;
+    }
+    return buffers;
+}
+
+// Thread engine: every thread reads a block and writes it back out, so with
+// N threads up to N requests are in flight in either direction
+
+typedef struct {
+    ImageWriter* writer;
+    uint8_t* buffer;
+    uint32_t index;     // the worker's slot in the hasher
+} Worker;
+
+// The hash thread works on the block while this thread is blocked in pwrite()
+static int write_and_hash(Worker* worker, uint64_t offset, size_t length) {
+    ImageWriter* writer = worker->writer;
+    if (writer->hasher) {
+        block_hasher_submit(writer->hasher, worker->index, worker->buffer, offset, length);
+    }
+    
+    int result = write_block(writer, worker->buffer, offset, length);
+    ATOMIC_ADD(&writer->bytes_written, result == 0 ? length : 0);
+    
+    if (writer->hasher && block_hasher_wait(writer->hasher, worker->index) < 0 && result == 0) {
+        result = -EBADMSG;
+    }
+    return result;
+}
+
+static void* worker_thread(void* data) {
+    Worker* worker = data;
+    ImageWriter* writer = worker->writer;
+    uint64_t offset;
+    uint64_t length;
+    int hole;
+    
+    while (!should_stop(writer) && claim_block(writer, &offset, &length, &hole)) {
+        int result;
+        if (hole) {
+            result = skip_zeros(writer, offset, length);
+        } else {
+            result = read_block(writer, worker->buffer, offset, (size_t)length);
+            if (result == 0) {
+                ATOMIC_ADD(&writer->bytes_read, length);
+                if (is_zero_block(writer, worker->buffer, (size_t)length)) {
+                    result = skip_zeros(writer, offset, length);
+                } else {
+                    result = write_and_hash(worker, offset, (size_t)length);
+                }
+                if (result == 0) {
+                    mark_done(writer, offset);
+                }
+            }
+        }
+        if (result < 0) {
+            set_error(writer, result, offset);
+            break;
+        }
+        ATOMIC_ADD(&writer->bytes_done, length);
+    }
+    return NULL;
+}
+
+static int run_threads(ImageWriter* writer) {
+    uint32_t n_workers = writer->options.queue_depth;
+    uint8_t** buffers = alloc_buffers(n_workers, writer->options.block_size);
+    Worker* workers = calloc(n_workers, sizeof(Worker));
+    pthread_t* threads = calloc(n_workers, sizeof(pthread_t));
+    uint32_t n_started = 0;
+    
+    if (!buffers || !workers || !threads) {
+        set_error(writer, -ENOMEM, 0);
+    } else {
+        for (; n_started < n_workers; n_started++) {
+            workers[n_started].writer = writer;
+            workers[n_started].buffer = buffers[n_started];
+            workers[n_started].index = n_started;
+            int result = pthread_create(&threads[n_started], NULL, worker_thread, &workers[n_started]);
+            if (result != 0) {
+                // Fewer threads still get the job done
+                if (n_started == 0) {
+                    set_error(writer, -result, 0);
+                }
+                break;
+            }
+        }
+    }
+    
+    for (uint32_t i = 0; i < n_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    
+    if (buffers) {
+        free_buffers(buffers, n_workers);
+    }
+    free(workers);
+    free(threads);
+    return ATOMIC_LOAD(&writer->error);
+}
+
+// io_uring engine, driven with the raw system calls. Each buffer moves
+// through read -> write -> next read on its own, so reads of later blocks
+// overlap writes of earlier ones at the configured queue depth.
+
+typedef struct {
+    int fd;
+    unsigned sq_entries;
+    unsigned sq_mask;
+    unsigned cq_mask;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned to_submit;
+} Ring;
+
+static void ring_exit(Ring* ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+}
+
+static int ring_init(Ring* ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    
+    // Containers commonly block io_uring with seccomp (EPERM) or sysctl
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        return -errno;
+    }
+    ring->fd = fd;
+    
+    // IORING_OP_READ and IORING_OP_WRITE arrived together with this feature (5.6)
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(fd);
+        return -ENOSYS;
+    }
+    
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        ring_exit(ring);
+        return -ENOMEM;
+    }
+    
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            ring_exit(ring);
+            return -ENOMEM;
+        }
+    }
+    
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        ring_exit(ring);
+        return -ENOMEM;
+    }
+    
+    uint8_t* sq = ring->sq_ring;
+    uint8_t* cq = ring->cq_ring;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void ring_queue(Ring* ring, int opcode, int fd, void* buffer, size_t length, uint64_t offset,
+                       uint64_t user_data) {
+    // The ring has at least as many entries as there are buffers, so it
+    // cannot be full here
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (uint8_t)opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = (uint32_t)length;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    
+    ATOMIC_STORE(ring->sq_tail, tail + 1);
+    ring->to_submit++;
+}
+
+static int ring_submit_and_wait(Ring* ring) {
+    for (;;) {
+        long result = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (result >= 0) {
+            ring->to_submit -= (unsigned)result;
+            return 0;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return -errno;
+        }
+    }
+}
+
+typedef struct {
+    uint8_t* buffer;
+    uint64_t offset;
+    size_t length;
+    size_t done;
+    int writing;
+} Slot;
+
+static void queue_slot(ImageWriter* writer, Ring* ring, Slot* slot, uint64_t index) {
+    if (slot->writing) {
+        ring_queue(ring, IORING_OP_WRITE, target_fd_for(writer, slot->length), slot->buffer + slot->done,
+                   slot->length - slot->done, slot->offset + slot->done, index);
+    } else {
+        ring_queue(ring, IORING_OP_READ, writer->source_fd, slot->buffer + slot->done,
+                   read_request_length(writer, slot->length - slot->done), slot->offset + slot->done, index);
+    }
+}
+
+// Starts reading the next block into the slot; returns 0 when there is none.
+// Holes in the image are skipped on the way without involving the ring.
+static int start_slot(ImageWriter* writer, Ring* ring, Slot* slot, uint64_t index) {
+    uint64_t offset;
+    uint64_t length;
+    int hole;
+    
+    while (!should_stop(writer) && claim_block(writer, &offset, &length, &hole)) {
+        if (!hole) {
+            slot->offset = offset;
+            slot->length = (size_t)length;
+            slot->done = 0;
+            slot->writing = 0;
+            queue_slot(writer, ring, slot, index);
+            return 1;
+        }
+        
+        int result = skip_zeros(writer, offset, length);
+        if (result < 0) {
+            set_error(writer, result, offset);
+            return 0;
+        }
+        ATOMIC_ADD(&writer->bytes_done, length);
+    }
+    return 0;
+}
+
+// Handles one completion; returns the number of requests it queued (0 or 1)
+static int complete_slot(ImageWriter* writer, Ring* ring, Slot* slot, uint64_t index, int result) {
+    if (result == -EAGAIN || result == -EINTR) {
+        queue_slot(writer, ring, slot, index);
+        return 1;
+    }
+    if (result <= 0) {
+        set_error(writer, result < 0 ? result : -EIO, slot->offset + slot->done);
+        return 0;
+    }
+    
+    slot->done += (size_t)result;
+    if (slot->done < slot->length) {
+        queue_slot(writer, ring, slot, index);
+        return 1;
+    }
+    
+    if (!slot->writing) {
+        ATOMIC_ADD(&writer->bytes_read, slot->length);
+        if (should_stop(writer)) {
+            return 0;
+        }
+        if (is_zero_block(writer, slot->buffer, slot->length)) {
+            int skip_result = skip_zeros(writer, slot->offset, slot->length);
+            if (skip_result < 0) {
+                set_error(writer, skip_result, slot->offset);
+                return 0;
+            }
+            mark_done(writer, slot->offset);
+            ATOMIC_ADD(&writer->bytes_done, slot->length);
+            return start_slot(writer, ring, slot, index);
+        }
+        if (writer->hasher) {
+            block_hasher_submit(writer->hasher, (uint32_t)index, slot->buffer, slot->offset, slot->length);
+        }
+        slot->writing = 1;
+        slot->done = 0;
+        queue_slot(writer, ring, slot, index);
+        return 1;
+    }
+    
+    // The hash has had the whole write to finish; the buffer is reused next
+    if (writer->hasher && block_hasher_wait(writer->hasher, (uint32_t)index) < 0) {
+        set_error(writer, -EBADMSG, slot->offset);
+        return 0;
+    }
+    mark_done(writer, slot->offset);
+    ATOMIC_ADD(&writer->bytes_written, slot->length);
+    ATOMIC_ADD(&writer->bytes_done, slot->length);
+    return start_slot(writer, ring, slot, index);
+}
+
+static int run_io_uring(ImageWriter* writer, Ring* ring) {
+    uint32_t n_slots = writer->options.queue_depth;
+    uint8_t** buffers = alloc_buffers(n_slots, writer->options.block_size);
+    Slot* slots = calloc(n_slots, sizeof(Slot));
+    unsigned in_flight = 0;
+    
+    if (!buffers || !slots) {
+        if (buffers) {
+            free_buffers(buffers, n_slots);
+        }
+        free(slots);
+        return -ENOMEM;
+    }
+    
+    for (uint32_t i = 0; i < n_slots; i++) {
+        slots[i].buffer = buffers[i];
+        in_flight += (unsigned)start_slot(writer, ring, &slots[i], i);
+    }
+    
+    while (in_flight > 0) {
+        int result = ring_submit_and_wait(ring);
+        if (result < 0) {
+            // The kernel may still own the buffers, so they are leaked rather
+            // than freed under it
+            set_error(writer, result, 0);
+            free(slots);
+            free(buffers);
+            return result;
+        }
+        
+        unsigned head = *ring->cq_head;
+        unsigned tail = ATOMIC_LOAD(ring->cq_tail);
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+            uint64_t index = cqe->user_data;
+            in_flight--;
+            in_flight += (unsigned)complete_slot(writer, ring, &slots[index], index, cqe->res);
+        }
+        ATOMIC_STORE(ring->cq_head, head);
+    }
+    
+    // Slots that stopped on an error may still have a block being hashed
+    if (writer->hasher) {
+        block_hasher_drain(writer->hasher);
+    }
+    free_buffers(buffers, n_slots);
+    free(slots);
+    return ATOMIC_LOAD(&writer->error);
+}
+
+// Fills in what the options left at 0 from the profile of the target disk.
+// Targets that are no disk (a file on tmpfs) and failed probes get the
+// defaults; tuning never fails the run.
+static void tune(ImageWriter* writer) {
+    IoProfile* profile = &writer->profile;
+    dev_t device;
+    if (writer->options.io_class == IO_CLASS_NONE || io_get_device(writer->target_path, &device) < 0 ||
+        io_profile_detect(device, writer->options.io_class, IO_PROBE_DEFAULT_MS, profile) < 0) {
+        memset(profile, 0, sizeof(*profile));
+        profile->block_size = DEFAULT_BLOCK_SIZE;
+        profile->queue_depth = DEFAULT_QUEUE_DEPTH;
+    }
+    if (writer->options.block_size == 0) {
+        uint32_t block_size = profile->block_size > MAX_BLOCK_SIZE ? MAX_BLOCK_SIZE : profile->block_size;
+        writer->options.block_size = (uint32_t)align_up(block_size);
+    }
+    if (writer->options.queue_depth == 0) {
+        uint32_t depth = profile->queue_depth > MAX_QUEUE_DEPTH ? MAX_QUEUE_DEPTH : profile->queue_depth;
+        writer->options.queue_depth = depth > 0 ? depth : 1;
+    }
+}
+
+int image_writer_run(ImageWriter* writer) {
+    ATOMIC_STORE(&writer->start_ns, now_ns());
+    
+    tune(writer);
+    int result = open_files(writer);
+    if (result == 0) {
+        // A checksum list may have changed the block size
+        writer->profile.block_size = writer->options.block_size;
+        writer->profile.queue_depth = writer->options.queue_depth;
+        ATOMIC_STORE(&writer->tuned, 1);
+        result = start_journal(writer);
+    }
+    if (result == 0) {
+        Ring ring;
+        int ring_result = writer->options.engine == IMAGE_WRITER_ENGINE_THREADS
+            ? -ENOSYS : ring_init(&ring, writer->options.queue_depth);
+        
+        if (ring_result == 0) {
+            ATOMIC_STORE(&writer->engine, IMAGE_WRITER_ENGINE_IO_URING);
+            result = run_io_uring(writer, &ring);
+            ring_exit(&ring);
+        } else if (writer->options.engine == IMAGE_WRITER_ENGINE_IO_URING) {
+            result = ring_result;
+        } else {
+            ATOMIC_STORE(&writer->engine, IMAGE_WRITER_ENGINE_THREADS);
+            result = run_threads(writer);
+        }
+    }
+    
+    // fsync() flushes the page cache of the whole file, so this also covers
+    // a tail written through tail_fd
+    if (result == 0 && ATOMIC_LOAD(&writer->cancelled)) {
+        result = -ECANCELED;
+    } else if (result == 0 && fdatasync(writer->target_fd) != 0) {
+        result = -errno;
+        set_error(writer, result, writer->total);
+    }
+    if (result == 0) {
+        result = spot_check(writer);
+    }
+    
+    finish_journal(writer);
+    close_files(writer);
+    ATOMIC_STORE(&writer->end_ns, now_ns());
+    ATOMIC_STORE(&writer->finished, 1);
+    return result;
+}
+
+void image_writer_cancel(ImageWriter* writer) {
+    ATOMIC_STORE(&writer->cancelled, 1);
+}
+
+void image_writer_set_paused(ImageWriter* writer, int paused) {
+    if (paused == ATOMIC_LOAD(&writer->paused)) {
+        return;
+    }
+    if (paused) {
+        ATOMIC_STORE(&writer->pause_start_ns, now_ns());
+    } else {
+        ATOMIC_ADD(&writer->paused_ns, now_ns() - ATOMIC_LOAD(&writer->pause_start_ns));
+    }
+    ATOMIC_STORE(&writer->paused, paused);
+}
+
+void image_writer_get_stats(ImageWriter* writer, ImageWriterStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->finished = ATOMIC_LOAD(&writer->finished);
+    stats->bytes_total = ATOMIC_LOAD(&writer->total);
+    stats->bytes_done = ATOMIC_LOAD(&writer->bytes_done);
+    stats->bytes_read = ATOMIC_LOAD(&writer->bytes_read);
+    stats->bytes_written = ATOMIC_LOAD(&writer->bytes_written);
+    stats->bytes_skipped = ATOMIC_LOAD(&writer->bytes_skipped);
+    stats->bytes_resumed = ATOMIC_LOAD(&writer->bytes_resumed);
+    stats->engine = (ImageWriterEngine)ATOMIC_LOAD(&writer->engine);
+    stats->skip = (ImageWriterSkip)ATOMIC_LOAD(&writer->skip);
+    stats->direct = ATOMIC_LOAD(&writer->direct);
+    stats->tuned = ATOMIC_LOAD(&writer->tuned);
+    if (stats->tuned) {
+        stats->profile = writer->profile;
+    }
+    stats->spot_checks_done = ATOMIC_LOAD(&writer->spot_checks_done);
+    stats->verifying = ATOMIC_LOAD(&writer->verifying);
+    stats->paused = ATOMIC_LOAD(&writer->paused);
+    
+    Journal* journal = ATOMIC_LOAD(&writer->journal);
+    if (journal) {
+        JournalStats journal_stats;
+        journal_get_stats(journal, &journal_stats);
+        stats->journal_commits = journal_stats.commits;
+        stats->journal_ns = journal_stats.busy_ns;
+    }
+    if (writer->hasher) {
+        uint64_t busy_ns;
+        block_hasher_get_stats(writer->hasher, &stats->bytes_hashed, &busy_ns);
+        if (busy_ns > 0) {
+            stats->hash_bytes_per_second = stats->bytes_hashed / (busy_ns / 1e9);
+        }
+    }
+    
+    uint64_t start = ATOMIC_LOAD(&writer->start_ns);
+    uint64_t end = stats->finished ? ATOMIC_LOAD(&writer->end_ns) : now_ns();
+    uint64_t paused_ns = ATOMIC_LOAD(&writer->paused_ns);
+    if (stats->paused) {
+        paused_ns += end - ATOMIC_LOAD(&writer->pause_start_ns);
+    }
+    stats->elapsed_ns = start && end > start + paused_ns ? end - start - paused_ns : 0;
+    
+    stats->eta_seconds = -1;
+    if (stats->elapsed_ns > 0) {
+        stats->bytes_per_second = (stats->bytes_done - stats->bytes_resumed) / (stats->elapsed_ns / 1e9);
+    }
+    if (stats->bytes_per_second > 0 && stats->bytes_total >= stats->bytes_done) {
+        stats->eta_seconds = (stats->bytes_total - stats->bytes_done) / stats->bytes_per_second;
+    }
+}
+
+uint64_t image_writer_get_error_offset(ImageWriter* writer) {
+    return writer->error_offset;
+}
+
+int image_writer_get_image_digest(ImageWriter* writer, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    if (!writer->hasher || !ATOMIC_LOAD(&writer->finished) || ATOMIC_LOAD(&writer->error) ||
+        ATOMIC_LOAD(&writer->cancelled)) {
+        return -ENODATA;
+    }
+    block_hasher_get_image_digest(writer->hasher, digest);
+    return 0;
+}
+
+const char* image_writer_engine_name(ImageWriterEngine engine) {
+    switch (engine) {
+    case IMAGE_WRITER_ENGINE_IO_URING:
+        return "io_uring";
+    case IMAGE_WRITER_ENGINE_THREADS:
+        return "threads";
+    default:
+        return "auto";
+    }
+}
+
+const char* image_writer_skip_name(ImageWriterSkip skip) {
+    switch (skip) {
+    case IMAGE_WRITER_SKIP_SEEK:
+        return "seek";
+    case IMAGE_WRITER_SKIP_PUNCH_HOLE:
+        return "punch-hole";
+    case IMAGE_WRITER_SKIP_ZEROOUT:
+        return "zeroout";
+    default:
+        return "write";
+    }
+}
@@ -0,0 +1,110 @@
+#ifndef IMAGEWRITER_H
+#define IMAGEWRITER_H
+
+#include <stdint.h>
+#include "iotune.h"
+#include "sha256.h"
+
+// Copies a raw OS image onto a disk, partition, loop device or regular file.
+// Reads and writes go through aligned buffers with O_DIRECT when both ends
+// allow it, and are kept overlapped: with io_uring every buffer cycles
+// read -> write -> read on its own, otherwise a small pool of threads does
+// the same with pread()/pwrite(). Every block is hashed with SHA-256 on a
+// separate thread while its write is in flight, so verifying the image needs
+// no second pass over the target. With a journal, finished blocks are
+// recorded as the run goes, and a later run of the same image onto the same
+// target reads them back and skips those whose digests still match. Block
+// size and queue depth left at 0 come from the profile of the target disk
+// (see iotune.h). Plain C so the install helper can use it without GLib.
+
+typedef enum {
+    IMAGE_WRITER_ENGINE_AUTO,       // io_uring, or threads when the kernel refuses it
+    IMAGE_WRITER_ENGINE_IO_URING,
+    IMAGE_WRITER_ENGINE_THREADS
+} ImageWriterEngine;
+
+// How ranges that are all zeros in the image reach the target
+typedef enum {
+    IMAGE_WRITER_SKIP_WRITE,        // written like any other data
+    IMAGE_WRITER_SKIP_SEEK,         // nothing to do: the target is a freshly created, sparse file
+    IMAGE_WRITER_SKIP_PUNCH_HOLE,   // fallocate(PUNCH_HOLE): deallocates file blocks, or has the disk zero them
+    IMAGE_WRITER_SKIP_ZEROOUT       // BLKZEROOUT, for disks that cannot zero without writing
+} ImageWriterSkip;
+
+typedef struct {
+    uint32_t block_size;    // bytes per request; rounded up to a multiple of 4096; 0 to tune
+    uint32_t queue_depth;   // buffers (or threads) in flight; 0 to tune
+    IoClass io_class;       // how to tune: AUTO probes the target, NONE takes 1 MiB and 8
+    ImageWriterEngine engine;
+    int direct;             // try O_DIRECT; files on tmpfs and similar fall back silently
+    int sparse;             // skip all-zero blocks and holes in the image instead of writing them
+    int verify;             // hash every block as it is written
+    const char* checksum_path;  // block checksum list to compare against; its block size wins
+    const char* journal_path;   // records finished blocks to resume from; needs hashing; NULL for none
+    uint32_t spot_checks;   // blocks read back from the target at random after the final flush
+} ImageWriterOptions;
+
+// Counters that can be read from any thread while the writer runs
+typedef struct {
+    uint64_t bytes_total;      // size of the image
+    uint64_t bytes_done;       // how far the image has got, written or skipped
+    uint64_t bytes_read;       // read from the image; holes in it are not read
+    uint64_t bytes_written;    // actually written to the target
+    uint64_t bytes_skipped;    // zeros that were not written
+    uint64_t bytes_hashed;     // run through SHA-256; known zeros are not
+    uint64_t bytes_resumed;    // found on the target from an earlier run and not written again
+    uint64_t journal_commits;
+    uint64_t journal_ns;       // spent committing the journal, target flushes included
+    uint64_t elapsed_ns;       // time spent paused is not counted
+    double bytes_per_second;   // of bytes_done less bytes_resumed, averaged since the start
+    double eta_seconds;        // negative until there is a rate to go by
+    double hash_bytes_per_second;  // of the hash thread while it was busy; 0 without hashing
+    uint32_t spot_checks_done;
+    int verifying;             // reading blocks back, after the flush or before resuming
+    int paused;
+    ImageWriterEngine engine;  // the engine actually in use
+    ImageWriterSkip skip;      // how zeros are being handled
+    int direct;                // whether the target was opened with O_DIRECT
+    int tuned;                 // profile is set
+    IoProfile profile;         // of the target disk, with the block size and queue depth in use
+    int finished;
+} ImageWriterStats;
+
+typedef struct ImageWriter ImageWriter;
+
+// Block size and queue depth tuned to the target, any engine, O_DIRECT,
+// sparse, hashed, no checksum list, no spot checks and no journal
+void image_writer_options_init(ImageWriterOptions* options);
+
+ImageWriter* image_writer_new(const char* source, const char* target, const ImageWriterOptions* options);
+void image_writer_free(ImageWriter* writer);
+
+// Writes the whole image and flushes it to stable storage. Blocks until done;
+// returns 0, -ECANCELED after image_writer_cancel() or another negative
+// errno value. A target smaller than the image fails with -ENOSPC before
+// anything is written; a regular file target is resized to the image. A
+// block that does not match the checksum list, a spot check that reads back
+// something else, or a list that does not fit the image fail with -EBADMSG.
+// The journal is kept after the run, whatever its result; it is up to the
+// caller to remove it once the install as a whole has succeeded.
+int image_writer_run(ImageWriter* writer);
+
+// Safe to call from another thread while image_writer_run() runs. A paused
+// writer lets the requests in flight finish and starts no new ones until it
+// is resumed; pausing does not stop the final flush or the spot checks.
+void image_writer_cancel(ImageWriter* writer);
+void image_writer_set_paused(ImageWriter* writer, int paused);
+void image_writer_get_stats(ImageWriter* writer, ImageWriterStats* stats);
+
+// Byte offset of the request that failed, once image_writer_run() has
+// returned an error other than -ECANCELED
+uint64_t image_writer_get_error_offset(ImageWriter* writer);
+
+// SHA-256 over the digests of all blocks in order, once image_writer_run()
+// has succeeded with hashing on. Returns 0 or -ENODATA.
+int image_writer_get_image_digest(ImageWriter* writer, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+const char* image_writer_engine_name(ImageWriterEngine engine);
+const char* image_writer_skip_name(ImageWriterSkip skip);
+
+#endif // IMAGEWRITER_H
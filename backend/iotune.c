@@ -0,0 +1,400 @@
+#define _GNU_SOURCE
+#include "iotune.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROBE_BLOCK 4096
+#define MAX_BLOCK_SIZE (64 * 1024 * 1024)
+
+// Spinning disks manage a few hundred random reads a second; a "rotational"
+// device far above that is a VM disk or a loop device that only says so
+#define MAX_ROTATIONAL_IOPS 1000
+
+// Parallel over serial reads: below the first, concurrency buys nothing;
+// above the second, the device has queues worth filling
+#define FLAT_SCALING 1.5
+#define DEEP_SCALING 4.0
+
+// Cheap flash manages a few thousand random reads a second at best. Flat
+// scaling on anything faster is the limit of whatever sits in between (the
+// one worker of a loop device, a hypervisor), not of the medium.
+#define MAX_FLASH_IOPS 5000
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+int io_get_device(const char* path, dev_t* device) {
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        *device = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+        return 0;
+    }
+    if (errno != ENOENT) {
+        return -errno;
+    }
+    
+    char* copy = strdup(path);
+    if (!copy) {
+        return -ENOMEM;
+    }
+    int result = stat(dirname(copy), &st) == 0 ? 0 : -errno;
+    free(copy);
+    if (result == 0) {
+        *device = st.st_dev;
+    }
+    return result;
+}
+
+// -1 when the attribute is missing or not a number
+static int64_t read_number(const char* dir, const char* name) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE* file = fopen(path, "re");
+    if (!file) {
+        return -1;
+    }
+    long long value;
+    int matched = fscanf(file, "%lld", &value);
+    fclose(file);
+    return matched == 1 ? (int64_t)value : -1;
+}
+
+// The sysfs directory of the whole disk, which is the one with a queue/
+static int find_disk(dev_t device, char* dir) {
+    char link[64];
+    snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", major(device), minor(device));
+    if (!realpath(link, dir)) {
+        return -ENODEV;
+    }
+    if (read_number(dir, "partition") > 0) {
+        char* slash = strrchr(dir, '/');
+        if (!slash || slash == dir) {
+            return -ENODEV;
+        }
+        *slash = '\0';
+    }
+    return 0;
+}
+
+// USB disks and card readers sit below a USB controller in the device tree
+static IoClass classify(const char* name, const char* dir, int rotational) {
+    if (strncmp(name, "nvme", 4) == 0) {
+        return IO_CLASS_NVME;
+    }
+    if (rotational) {
+        return IO_CLASS_ROTATIONAL;
+    }
+    if (strstr(dir, "/usb") || strncmp(name, "mmcblk", 6) == 0) {
+        return IO_CLASS_FLASH;
+    }
+    return IO_CLASS_SSD;
+}
+
+// The block size goes by what sysfs claims alone: the journal of an
+// interrupted image write is only good for the same block size, and a probe
+// on a busy disk can come out differently the next time
+static void choose(IoProfile* profile, IoClass claimed) {
+    switch (profile->io_class) {
+    case IO_CLASS_ROTATIONAL:
+        profile->queue_depth = 4;
+        profile->read_ahead = 64 * 1024 * 1024;
+        profile->ordered = 1;
+        break;
+    case IO_CLASS_FLASH:
+        profile->queue_depth = 2;
+        profile->read_ahead = 32 * 1024 * 1024;
+        profile->ordered = 1;
+        break;
+    case IO_CLASS_NVME:
+        profile->queue_depth = 32;
+        profile->n_writers = 16;
+        profile->read_ahead = 128 * 1024 * 1024;
+        break;
+    default:
+        profile->queue_depth = 16;
+        profile->read_ahead = 64 * 1024 * 1024;
+        break;
+    }
+    profile->block_size = claimed == IO_CLASS_ROTATIONAL ? 4 * 1024 * 1024 : 1024 * 1024;
+    
+    // What the device does wins over what it says it is. A disk that gains
+    // nothing from parallel reads is driven like a USB stick; a stick that
+    // gains a lot (an SSD in a USB enclosure) like an SSD.
+    if (profile->serial_iops > 0 && profile->parallel_iops > 0 && profile->io_class != IO_CLASS_ROTATIONAL) {
+        double scaling = profile->parallel_iops / profile->serial_iops;
+        if (scaling < FLAT_SCALING && profile->serial_iops < MAX_FLASH_IOPS) {
+            profile->queue_depth = profile->queue_depth < 4 ? profile->queue_depth : 4;
+            profile->n_writers = 0;
+            profile->ordered = 1;
+        } else if (scaling >= DEEP_SCALING && profile->queue_depth < 32) {
+            profile->queue_depth = 32;
+            profile->ordered = 0;
+        }
+    }
+    if (profile->ordered) {
+        profile->n_writers = 1;
+    }
+    if (profile->nr_requests > 0 && profile->queue_depth > profile->nr_requests) {
+        profile->queue_depth = profile->nr_requests;
+    }
+    
+    // Whole stripes of a RAID, or whatever the device asks requests to be
+    // multiples of
+    uint32_t optimal = profile->optimal_io_size;
+    if (optimal > profile->block_size && optimal % PROBE_BLOCK == 0 && optimal <= MAX_BLOCK_SIZE) {
+        profile->block_size = optimal;
+    } else if (optimal > 0 && optimal % PROBE_BLOCK == 0 && profile->block_size % optimal != 0) {
+        profile->block_size = (profile->block_size / optimal + 1) * optimal;
+    }
+}
+
+int io_profile_detect(dev_t device, IoClass io_class, uint32_t probe_ms, IoProfile* profile) {
+    memset(profile, 0, sizeof(*profile));
+    if (io_class == IO_CLASS_NONE) {
+        return 0;
+    }
+    if (io_class != IO_CLASS_AUTO) {
+        profile->io_class = io_class;
+        choose(profile, io_class);
+        return 0;
+    }
+    
+    char dir[PATH_MAX];
+    int result = find_disk(device, dir);
+    if (result < 0) {
+        return result;
+    }
+    const char* name = strrchr(dir, '/') + 1;
+    snprintf(profile->disk, sizeof(profile->disk), "%s", name);
+    profile->rotational = read_number(dir, "queue/rotational") > 0;
+    profile->usb = strstr(dir, "/usb") != NULL;
+    int64_t nr_requests = read_number(dir, "queue/nr_requests");
+    int64_t optimal_io_size = read_number(dir, "queue/optimal_io_size");
+    profile->nr_requests = nr_requests > 0 ? (uint32_t)nr_requests : 0;
+    profile->optimal_io_size = optimal_io_size > 0 ? (uint32_t)optimal_io_size : 0;
+    IoClass claimed = classify(name, dir, profile->rotational);
+    profile->io_class = claimed;
+    
+    // Half the time for each; a probe that cannot run leaves sysfs to decide.
+    // NVMe needs no probe to tell what it is.
+    if (probe_ms > 0 && claimed != IO_CLASS_NVME) {
+        char node[PATH_MAX];
+        snprintf(node, sizeof(node), "/dev/%s", name);
+        uint64_t start = now_ns();
+        result = io_probe_random_reads(node, 1, probe_ms / 2, &profile->serial_iops);
+        if (result == 0) {
+            result = io_probe_random_reads(node, IO_PROBE_THREADS, probe_ms / 2, &profile->parallel_iops);
+        }
+        if (result < 0) {
+            profile->serial_iops = profile->parallel_iops = 0;
+            profile->probe_error = result;
+        }
+        profile->probe_ns = now_ns() - start;
+    }
+    if (profile->io_class == IO_CLASS_ROTATIONAL && profile->serial_iops > MAX_ROTATIONAL_IOPS) {
+        profile->io_class = IO_CLASS_SSD;
+    }
+    choose(profile, claimed);
+    return 0;
+}
+
+typedef struct {
+    int fd;
+    uint64_t n_blocks;
+    uint64_t deadline;
+    uint64_t state;         // xorshift64
+    uint64_t reads;
+    int error;
+    pthread_t thread;
+} ProbeWorker;
+
+static void* probe_thread(void* data) {
+    ProbeWorker* worker = data;
+    void* buffer;
+    if (posix_memalign(&buffer, PROBE_BLOCK, PROBE_BLOCK) != 0) {
+        worker->error = -ENOMEM;
+        return NULL;
+    }
+    
+    // The clock is only read every few reads; a read takes microseconds at best
+    while (worker->reads % 8 != 0 || now_ns() < worker->deadline) {
+        worker->state ^= worker->state << 13;
+        worker->state ^= worker->state >> 7;
+        worker->state ^= worker->state << 17;
+        off_t offset = (off_t)(worker->state % worker->n_blocks * PROBE_BLOCK);
+        ssize_t result = pread(worker->fd, buffer, PROBE_BLOCK, offset);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result < 0) {
+            worker->error = -errno;
+            break;
+        }
+        worker->reads++;
+    }
+    free(buffer);
+    return NULL;
+}
+
+// Opens a device or file to probe and finds its size. Filesystems without
+// O_DIRECT still give a number, if a flattering one.
+static int open_probe(const char* path, uint64_t* size) {
+    int fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+    if (fd < 0 && errno == EINVAL) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        return -errno;
+    }
+    struct stat st;
+    *size = 0;
+    if (fstat(fd, &st) != 0) {
+        int result = -errno;
+        close(fd);
+        return result;
+    }
+    if (S_ISBLK(st.st_mode)) {
+        if (ioctl(fd, BLKGETSIZE64, size) != 0) {
+            *size = 0;
+        }
+    } else if (S_ISREG(st.st_mode)) {
+        *size = (uint64_t)st.st_size;
+    }
+    if (*size < PROBE_BLOCK) {
+        close(fd);
+        return -EINVAL;
+    }
+    return fd;
+}
+
+int io_probe_random_reads(const char* path, uint32_t n_threads, uint32_t duration_ms, double* iops) {
+    *iops = 0;
+    if (n_threads == 0 || n_threads > IO_PROBE_THREADS) {
+        return -EINVAL;
+    }
+    uint64_t size;
+    int fd = open_probe(path, &size);
+    if (fd < 0) {
+        return fd;
+    }
+    
+    ProbeWorker workers[IO_PROBE_THREADS];
+    uint64_t start = now_ns();
+    uint32_t n_started = 0;
+    int result = 0;
+    for (uint32_t i = 0; i < n_threads; i++) {
+        memset(&workers[i], 0, sizeof(workers[i]));
+        workers[i].fd = fd;
+        workers[i].n_blocks = size / PROBE_BLOCK;
+        workers[i].deadline = start + (uint64_t)duration_ms * 1000000u;
+        workers[i].state = (start ^ (0x9e3779b97f4a7c15ull * (i + 1))) | 1;
+    }
+    if (n_threads == 1) {
+        probe_thread(&workers[0]);
+        n_started = 1;
+    } else {
+        for (; n_started < n_threads; n_started++) {
+            int error = pthread_create(&workers[n_started].thread, NULL, probe_thread, &workers[n_started]);
+            if (error != 0) {
+                result = -error;
+                break;
+            }
+        }
+        for (uint32_t i = 0; i < n_started; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+    uint64_t elapsed = now_ns() - start;
+    close(fd);
+    
+    uint64_t reads = 0;
+    for (uint32_t i = 0; i < n_started; i++) {
+        if (workers[i].error < 0 && result == 0) {
+            result = workers[i].error;
+        }
+        reads += workers[i].reads;
+    }
+    if (result < 0) {
+        return result;
+    }
+    *iops = elapsed ? reads * 1e9 / elapsed : 0;
+    return 0;
+}
+
+int io_probe_sequential_reads(const char* path, uint32_t duration_ms, double* bytes_per_second) {
+    *bytes_per_second = 0;
+    uint64_t size;
+    int fd = open_probe(path, &size);
+    if (fd < 0) {
+        return fd;
+    }
+    void* buffer;
+    if (posix_memalign(&buffer, PROBE_BLOCK, IO_PROBE_SEQUENTIAL_BLOCK) != 0) {
+        close(fd);
+        return -ENOMEM;
+    }
+    
+    // Whole blocks only, so every read stays aligned for O_DIRECT
+    uint64_t end = size / PROBE_BLOCK * PROBE_BLOCK;
+    uint64_t start = now_ns();
+    uint64_t deadline = start + (uint64_t)duration_ms * 1000000u;
+    uint64_t offset = 0;
+    int result = 0;
+    while (offset < end && now_ns() < deadline) {
+        size_t length = end - offset < IO_PROBE_SEQUENTIAL_BLOCK ? (size_t)(end - offset) : IO_PROBE_SEQUENTIAL_BLOCK;
+        ssize_t done = pread(fd, buffer, length, (off_t)offset);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            result = done < 0 ? -errno : 0;
+            break;
+        }
+        offset += (uint64_t)done;
+    }
+    uint64_t elapsed = now_ns() - start;
+    free(buffer);
+    close(fd);
+    if (result < 0) {
+        return result;
+    }
+    *bytes_per_second = elapsed ? offset * 1e9 / elapsed : 0;
+    return 0;
+}
+
+static const char* const class_names[] = {
+    [IO_CLASS_NONE] = "none",
+    [IO_CLASS_AUTO] = "auto",
+    [IO_CLASS_ROTATIONAL] = "rotational",
+    [IO_CLASS_FLASH] = "flash",
+    [IO_CLASS_SSD] = "ssd",
+    [IO_CLASS_NVME] = "nvme"
+};
+
+const char* io_class_name(IoClass io_class) {
+    return (size_t)io_class < sizeof(class_names) / sizeof(class_names[0]) ? class_names[io_class] : "none";
+}
+
+int io_class_from_name(const char* name) {
+    for (size_t i = 0; i < sizeof(class_names) / sizeof(class_names[0]); i++) {
+        if (strcmp(name, class_names[i]) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,81 @@
+#ifndef IOTUNE_H
+#define IOTUNE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Picks how hard to drive the disk an install writes to. A spinning disk
+// does best with few, large requests in order; NVMe wants deep queues and
+// many writers; USB sticks and SD cards often collapse under parallel
+// writes. The class of the whole disk comes from sysfs (queue/rotational,
+// the transport, queue/nr_requests and queue/optimal_io_size), and a short
+// calibration probe of random O_DIRECT reads, first one at a time and then
+// several at once, shows whether the device gets any faster with
+// concurrency. The probe only reads. Plain C so the install helper can use
+// it without GLib.
+
+#define IO_PROBE_DEFAULT_MS 200
+#define IO_PROBE_THREADS 8
+#define IO_PROBE_SEQUENTIAL_BLOCK (1024 * 1024)
+
+typedef enum {
+    IO_CLASS_NONE,          // untuned: the options are used as they are
+    IO_CLASS_AUTO,          // as an option: detect the target's class and probe it
+    IO_CLASS_ROTATIONAL,
+    IO_CLASS_FLASH,         // USB sticks, SD cards, eMMC
+    IO_CLASS_SSD,
+    IO_CLASS_NVME
+} IoClass;
+
+typedef struct {
+    IoClass io_class;
+    char disk[32];              // kernel name of the whole disk; "" when the class was forced
+    int rotational;
+    int usb;
+    uint32_t nr_requests;
+    uint32_t optimal_io_size;   // bytes; 0 when the device states none
+    
+    // Calibration: 4 KiB random reads; 0 when the probe could not run (not
+    // root, say) or the class was forced
+    double serial_iops;         // one at a time
+    double parallel_iops;       // IO_PROBE_THREADS at once
+    uint64_t probe_ns;
+    int probe_error;            // negative errno value when the probe failed; 0 otherwise
+    
+    // The choice
+    uint32_t queue_depth;       // image writer requests in flight
+    uint32_t block_size;        // image writer request size; never depends on the probe
+    uint32_t n_writers;         // extraction writer threads; 0 for the extractor's own default
+    uint64_t read_ahead;        // extraction file data buffered for the writers
+    int ordered;                // extract with one writer, in archive order, instead of in parallel
+} IoProfile;
+
+// The block device an install to path ends up on: path itself for a device
+// node, otherwise the filesystem holding path, or holding the directory it
+// is to be created in. Returns 0 or a negative errno value.
+int io_get_device(const char* path, dev_t* device);
+
+// Profile of the whole disk behind device (a disk or one of its
+// partitions). io_class AUTO detects the class and probes for up to
+// probe_ms (NVMe is not probed); any other class is taken as it is, with
+// neither. Returns 0, or -ENODEV when device is no block device sysfs knows
+// (tmpfs, say), leaving the class NONE.
+int io_profile_detect(dev_t device, IoClass io_class, uint32_t probe_ms, IoProfile* profile);
+
+// Random 4 KiB O_DIRECT reads of the device or file at path on n_threads
+// threads until duration_ms is over. Returns 0 with the reads per second,
+// or a negative errno value.
+int io_probe_random_reads(const char* path, uint32_t n_threads, uint32_t duration_ms, double* iops);
+
+// Reads the device or file at path from the start in IO_PROBE_SEQUENTIAL_BLOCK
+// O_DIRECT requests until duration_ms is over or the end is reached. Returns
+// 0 with the bytes read per second, or a negative errno value. A read that
+// was started is finished, so a stalling device can overrun the time by one.
+int io_probe_sequential_reads(const char* path, uint32_t duration_ms, double* bytes_per_second);
+
+const char* io_class_name(IoClass io_class);
+
+// Parses the names io_class_name() returns; -1 for anything else
+int io_class_from_name(const char* name);
+
+#endif // IOTUNE_H
@@ -0,0 +1,351 @@
+#define _GNU_SOURCE
+#include "journal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define JOURNAL_VERSION 1
+#define MAX_JOURNAL_SIZE (64 * 1024 * 1024)  // a million records; more means it is not a journal
+
+#define ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ATOMIC_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+
+struct Journal {
+    int fd;
+    uint64_t end;               // where the next record goes
+    uint32_t sequence;          // of the next record
+    JournalRecord* replayed;
+    size_t n_replayed;
+    JournalRecord* pending;     // appended, not yet written
+    size_t n_pending;
+    size_t pending_capacity;
+    
+    const JournalSource* source;
+    void* user_data;
+    uint32_t interval_ms;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int thread_running;
+    int stop;
+    
+    // Read by journal_get_stats() from other threads
+    uint64_t commits;
+    uint64_t records;
+    uint64_t busy_ns;
+    int error;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t record_check(const JournalRecord* record) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    sha256(record, offsetof(JournalRecord, check), digest);
+    uint64_t check;
+    memcpy(&check, digest, sizeof(check));
+    return check;
+}
+
+static void fill_record(JournalRecord* record, uint32_t type, uint32_t sequence, uint64_t start, uint64_t end,
+                        const uint8_t digest[SHA256_DIGEST_SIZE]) {
+    memset(record, 0, sizeof(*record));
+    record->type = type;
+    record->sequence = sequence;
+    record->start = start;
+    record->end = end;
+    if (digest) {
+        memcpy(record->digest, digest, SHA256_DIGEST_SIZE);
+    }
+    record->check = record_check(record);
+}
+
+static int write_all(int fd, const void* data, size_t length, uint64_t offset) {
+    const uint8_t* bytes = data;
+    size_t done = 0;
+    while (done < length) {
+        ssize_t result = pwrite(fd, bytes + done, length - done, (off_t)(offset + done));
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (result == 0) {
+            return -EIO;
+        }
+        done += (size_t)result;
+    }
+    return 0;
+}
+
+// Keeps the valid records of the same job; returns how many bytes of the
+// file they take, 0 when it has to be started over
+static uint64_t load_records(Journal* journal, const uint8_t identity[SHA256_DIGEST_SIZE]) {
+    struct stat st;
+    if (fstat(journal->fd, &st) != 0 || st.st_size < JOURNAL_RECORD_SIZE || st.st_size > MAX_JOURNAL_SIZE) {
+        return 0;
+    }
+    size_t size = (size_t)st.st_size / JOURNAL_RECORD_SIZE * JOURNAL_RECORD_SIZE;
+    JournalRecord* records = malloc(size);
+    if (!records) {
+        return 0;
+    }
+    
+    size_t done = 0;
+    while (done < size) {
+        ssize_t result = pread(journal->fd, (uint8_t*)records + done, size - done, (off_t)done);
+        if (result <= 0 && !(result < 0 && errno == EINTR)) {
+            break;
+        }
+        done += result > 0 ? (size_t)result : 0;
+    }
+    
+    size_t n_records = done / JOURNAL_RECORD_SIZE;
+    const JournalRecord* header = &records[0];
+    if (n_records == 0 || header->type != JOURNAL_RECORD_HEADER || header->sequence != 0 ||
+        header->start != JOURNAL_VERSION || record_check(header) != header->check ||
+        memcmp(header->digest, identity, SHA256_DIGEST_SIZE) != 0) {
+        free(records);
+        return 0;
+    }
+    
+    // The first record that does not check out ends the journal: a commit
+    // that was torn, or garbage past the end
+    size_t n_valid = 1;
+    while (n_valid < n_records && records[n_valid].sequence == n_valid &&
+           records[n_valid].type != JOURNAL_RECORD_HEADER && record_check(&records[n_valid]) == records[n_valid].check) {
+        n_valid++;
+    }
+    
+    memmove(records, records + 1, (n_valid - 1) * sizeof(JournalRecord));
+    journal->replayed = records;
+    journal->n_replayed = n_valid - 1;
+    journal->sequence = (uint32_t)n_valid;
+    return (uint64_t)n_valid * JOURNAL_RECORD_SIZE;
+}
+
+// A new journal has to survive a crash itself, name included
+static int sync_directory(const char* path) {
+    char* copy = strdup(path);
+    if (!copy) {
+        return -ENOMEM;
+    }
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(copy);
+    if (fd < 0) {
+        return -errno;
+    }
+    int result = fsync(fd) == 0 ? 0 : -errno;
+    close(fd);
+    return result;
+}
+
+int journal_open(const char* path, const uint8_t identity[SHA256_DIGEST_SIZE], Journal** journal) {
+    *journal = NULL;
+    Journal* own = calloc(1, sizeof(Journal));
+    if (!own) {
+        return -ENOMEM;
+    }
+    own->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (own->fd < 0) {
+        int result = -errno;
+        free(own);
+        return result;
+    }
+    pthread_mutex_init(&own->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&own->changed, &attr);
+    pthread_condattr_destroy(&attr);
+    
+    int result = 0;
+    own->end = load_records(own, identity);
+    if (own->end == 0) {
+        JournalRecord header;
+        fill_record(&header, JOURNAL_RECORD_HEADER, 0, JOURNAL_VERSION, 0, identity);
+        if (ftruncate(own->fd, 0) != 0) {
+            result = -errno;
+        }
+        if (result == 0) {
+            result = write_all(own->fd, &header, sizeof(header), 0);
+        }
+        if (result == 0 && fdatasync(own->fd) != 0) {
+            result = -errno;
+        }
+        if (result == 0) {
+            result = sync_directory(path);
+        }
+        own->end = JOURNAL_RECORD_SIZE;
+        own->sequence = 1;
+    } else if (ftruncate(own->fd, (off_t)own->end) != 0) {
+        // A torn tail would otherwise sit between the old records and the new ones
+        result = -errno;
+    }
+    
+    if (result < 0) {
+        journal_close(own);
+        return result;
+    }
+    *journal = own;
+    return 0;
+}
+
+void journal_close(Journal* journal) {
+    if (!journal) {
+        return;
+    }
+    journal_stop(journal);
+    close(journal->fd);
+    pthread_mutex_destroy(&journal->lock);
+    pthread_cond_destroy(&journal->changed);
+    free(journal->replayed);
+    free(journal->pending);
+    free(journal);
+}
+
+size_t journal_get_n_replayed(Journal* journal) {
+    return journal->n_replayed;
+}
+
+const JournalRecord* journal_get_replayed(Journal* journal, size_t index) {
+    return &journal->replayed[index];
+}
+
+int journal_append(Journal* journal, JournalRecordType type, uint64_t start, uint64_t end,
+                   const uint8_t digest[SHA256_DIGEST_SIZE]) {
+    if (journal->n_pending == journal->pending_capacity) {
+        size_t capacity = journal->pending_capacity ? journal->pending_capacity * 2 : 64;
+        JournalRecord* pending = realloc(journal->pending, capacity * sizeof(JournalRecord));
+        if (!pending) {
+            return -ENOMEM;
+        }
+        journal->pending = pending;
+        journal->pending_capacity = capacity;
+    }
+    fill_record(&journal->pending[journal->n_pending], type, journal->sequence + (uint32_t)journal->n_pending,
+                start, end, digest);
+    journal->n_pending++;
+    return 0;
+}
+
+int journal_commit(Journal* journal) {
+    int result = ATOMIC_LOAD(&journal->error);
+    if (result < 0) {
+        return result;
+    }
+    
+    uint64_t start = now_ns();
+    if (journal->source) {
+        result = journal->source->collect(journal->user_data, journal);
+    }
+    if (result == 0 && journal->n_pending == 0) {
+        return 0;
+    }
+    
+    // The work first, then the records that say it is done
+    if (result == 0 && journal->source) {
+        result = journal->source->sync(journal->user_data);
+    }
+    size_t length = journal->n_pending * sizeof(JournalRecord);
+    if (result == 0) {
+        result = write_all(journal->fd, journal->pending, length, journal->end);
+    }
+    if (result == 0 && fdatasync(journal->fd) != 0) {
+        result = -errno;
+    }
+    
+    if (result < 0) {
+        ATOMIC_STORE(&journal->error, result);
+        return result;
+    }
+    journal->end += length;
+    journal->sequence += (uint32_t)journal->n_pending;
+    ATOMIC_ADD(&journal->records, journal->n_pending);
+    ATOMIC_ADD(&journal->commits, 1);
+    ATOMIC_ADD(&journal->busy_ns, now_ns() - start);
+    journal->n_pending = 0;
+    return 0;
+}
+
+static void* commit_thread(void* data) {
+    Journal* journal = data;
+    
+    pthread_mutex_lock(&journal->lock);
+    while (!journal->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        uint64_t nanoseconds = (uint64_t)deadline.tv_nsec + (uint64_t)journal->interval_ms * 1000000u;
+        deadline.tv_sec += (time_t)(nanoseconds / 1000000000u);
+        deadline.tv_nsec = (long)(nanoseconds % 1000000000u);
+        int timed_out = 0;
+        while (!journal->stop && !timed_out) {
+            timed_out = pthread_cond_timedwait(&journal->changed, &journal->lock, &deadline) == ETIMEDOUT;
+        }
+        if (journal->stop) {
+            break;
+        }
+        
+        pthread_mutex_unlock(&journal->lock);
+        // A failed commit stops journaling, not the install
+        journal_commit(journal);
+        pthread_mutex_lock(&journal->lock);
+    }
+    pthread_mutex_unlock(&journal->lock);
+    return NULL;
+}
+
+int journal_start(Journal* journal, const JournalSource* source, void* user_data, uint32_t interval_ms) {
+    if (journal->thread_running) {
+        return -EBUSY;
+    }
+    journal->source = source;
+    journal->user_data = user_data;
+    journal->interval_ms = interval_ms ? interval_ms : JOURNAL_DEFAULT_INTERVAL_MS;
+    journal->stop = 0;
+    int result = pthread_create(&journal->thread, NULL, commit_thread, journal);
+    if (result != 0) {
+        return -result;
+    }
+    journal->thread_running = 1;
+    return 0;
+}
+
+void journal_stop(Journal* journal) {
+    if (!journal->thread_running) {
+        return;
+    }
+    pthread_mutex_lock(&journal->lock);
+    journal->stop = 1;
+    pthread_cond_signal(&journal->changed);
+    pthread_mutex_unlock(&journal->lock);
+    pthread_join(journal->thread, NULL);
+    journal->thread_running = 0;
+}
+
+void journal_get_stats(Journal* journal, JournalStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->commits = ATOMIC_LOAD(&journal->commits);
+    stats->records = ATOMIC_LOAD(&journal->records);
+    stats->replayed = journal->n_replayed;
+    stats->busy_ns = ATOMIC_LOAD(&journal->busy_ns);
+    stats->error = ATOMIC_LOAD(&journal->error);
+}
+
+int journal_remove(const char* path) {
+    if (unlink(path) != 0 && errno != ENOENT) {
+        return -errno;
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sha256.h"
+
+// Append-only record of the work an install has finished, so a run that
+// was cut short (power loss, a USB disk that dropped off the bus) can be
+// started again against the same target and pick up where it stopped.
+// Records are only ever written after the work they describe has been
+// flushed to the target, and they are written in batches: a thread commits
+// every second or so, with one flush of the target and one of the journal
+// per commit, never one per record. Each record carries its own check, so a
+// torn write at the end of the journal only loses that last batch. Plain C
+// so the install helper can use it without GLib.
+
+#define JOURNAL_RECORD_SIZE 64
+#define JOURNAL_DEFAULT_INTERVAL_MS 1000
+
+typedef enum {
+    JOURNAL_RECORD_HEADER = 1,  // first record: digest identifies the job
+    JOURNAL_RECORD_EXTENT,      // image bytes start .. end are on the target; digest is
+                                // SHA-256 over the digests of their blocks
+    JOURNAL_RECORD_CHECKPOINT   // the first start archive members are extracted; end is how far
+                                // the archive had been read by then
+} JournalRecordType;
+
+typedef struct {
+    uint32_t type;              // JournalRecordType
+    uint32_t sequence;          // position in the journal
+    uint64_t start;
+    uint64_t end;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    uint64_t check;             // first bytes of SHA-256 over the fields above
+} JournalRecord;
+
+typedef struct {
+    uint64_t commits;           // commits that wrote at least one record
+    uint64_t records;           // written by this run
+    uint64_t replayed;          // left by earlier runs of the same job
+    uint64_t busy_ns;           // spent committing: flushing the target, writing and flushing the journal
+    int error;                  // first commit that failed; journaling stops there
+} JournalStats;
+
+typedef struct Journal Journal;
+
+// What the commit thread calls, in this order, every interval. collect()
+// appends records for work finished since the last call with
+// journal_append(); sync() then makes that work durable on the target
+// before the records are written. Both return 0 or a negative errno value.
+typedef struct {
+    int (*collect)(void* user_data, Journal* journal);
+    int (*sync)(void* user_data);
+} JournalSource;
+
+// Opens the journal at path, creating it if needed. The records of an
+// earlier run are kept for journal_get_replayed() when its header carries
+// the same identity; a journal of another job, or one that cannot be read,
+// is started over. Returns 0 or a negative errno value.
+int journal_open(const char* path, const uint8_t identity[SHA256_DIGEST_SIZE], Journal** journal);
+
+// Stops the commit thread if it still runs and closes the file; what has
+// not been committed is lost
+void journal_close(Journal* journal);
+
+// Records of earlier runs, in the order they were written, headers left out
+size_t journal_get_n_replayed(Journal* journal);
+const JournalRecord* journal_get_replayed(Journal* journal, size_t index);
+
+// Queues a record for the next commit. Only from collect(), or while the
+// commit thread is not running.
+int journal_append(Journal* journal, JournalRecordType type, uint64_t start, uint64_t end,
+                   const uint8_t digest[SHA256_DIGEST_SIZE]);
+
+// Starts committing every interval_ms (0 for the default) on a thread of
+// its own. source is not copied.
+int journal_start(Journal* journal, const JournalSource* source, void* user_data, uint32_t interval_ms);
+
+// Stops the commit thread; waits for a commit in progress
+void journal_stop(Journal* journal);
+
+// Collects, flushes and writes once, on the calling thread, with the source
+// of the last journal_start(). Only while the commit thread is not running.
+// Returns 0 or a negative errno value; after a failure nothing more is
+// written.
+int journal_commit(Journal* journal);
+
+void journal_get_stats(Journal* journal, JournalStats* stats);
+
+// Deletes the journal of a job that has finished; a missing one is fine
+int journal_remove(const char* path);
+
+#endif // JOURNAL_H
@@ -0,0 +1,494 @@
+#define _GNU_SOURCE
+#include "manifest.h"
+#include "extract.h"
+#include "payload.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define READ_CHUNK_SIZE (1024 * 1024)
+
+_Static_assert(sizeof(ManifestHeader) == 64, "ManifestHeader is part of the file format");
+_Static_assert(sizeof(ManifestEntry) == 80, "ManifestEntry is part of the file format");
+
+struct Manifest {
+    uint8_t* data;
+    size_t length;
+    const ManifestHeader* header;
+    const ManifestEntry* entries;
+    const char* strings;
+};
+
+static int write_all(int fd, const void* data, size_t length) {
+    const uint8_t* bytes = data;
+    while (length > 0) {
+        ssize_t result = write(fd, bytes, length);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        bytes += result;
+        length -= (size_t)result;
+    }
+    return 0;
+}
+
+// Reading
+
+int manifest_open(const char* path, Manifest** out) {
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    (void)path;
+    (void)out;
+    return -ENOTSUP;
+#else
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int error = -errno;
+        close(fd);
+        return error;
+    }
+    if ((uint64_t)st.st_size < sizeof(ManifestHeader)) {
+        close(fd);
+        return -EBADMSG;
+    }
+    
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int error = data == MAP_FAILED ? -errno : 0;
+    close(fd);
+    if (error < 0) {
+        return error;
+    }
+    
+    Manifest* manifest = calloc(1, sizeof(Manifest));
+    if (!manifest) {
+        munmap(data, (size_t)st.st_size);
+        return -ENOMEM;
+    }
+    manifest->data = data;
+    manifest->length = (size_t)st.st_size;
+    manifest->header = data;
+    
+    // The header is 64 bytes and the mapping is page aligned, so the records are aligned too
+    const ManifestHeader* header = manifest->header;
+    uint64_t records_size = (uint64_t)header->n_entries * sizeof(ManifestEntry);
+    if (memcmp(header->magic, MANIFEST_MAGIC, sizeof(header->magic)) != 0 || header->strings_size == 0 ||
+        manifest->length != sizeof(ManifestHeader) + records_size + header->strings_size) {
+        manifest_free(manifest);
+        return -EBADMSG;
+    }
+    manifest->entries = (const ManifestEntry*)(manifest->data + sizeof(ManifestHeader));
+    manifest->strings = (const char*)manifest->data + sizeof(ManifestHeader) + records_size;
+    
+    // Every string then ends inside the pool
+    if (manifest->strings[0] != '\0' || manifest->strings[header->strings_size - 1] != '\0') {
+        manifest_free(manifest);
+        return -EBADMSG;
+    }
+    for (uint32_t i = 0; i < header->n_entries; i++) {
+        if (manifest->entries[i].path >= header->strings_size || manifest->entries[i].link >= header->strings_size) {
+            manifest_free(manifest);
+            return -EBADMSG;
+        }
+    }
+    
+    *out = manifest;
+    return 0;
+#endif
+}
+
+void manifest_free(Manifest* manifest) {
+    if (!manifest) {
+        return;
+    }
+    munmap(manifest->data, manifest->length);
+    free(manifest);
+}
+
+const ManifestHeader* manifest_get_header(const Manifest* manifest) {
+    return manifest->header;
+}
+
+const ManifestEntry* manifest_get_entry(const Manifest* manifest, uint32_t index) {
+    return index < manifest->header->n_entries ? &manifest->entries[index] : NULL;
+}
+
+const char* manifest_entry_get_path(const Manifest* manifest, const ManifestEntry* entry) {
+    return manifest->strings + entry->path;
+}
+
+const char* manifest_entry_get_link(const Manifest* manifest, const ManifestEntry* entry) {
+    return manifest->strings + entry->link;
+}
+
+const ManifestEntry* manifest_lookup(const Manifest* manifest, const char* path) {
+    uint32_t low = 0;
+    uint32_t high = manifest->header->n_entries;
+    
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        int order = strcmp(manifest->strings + manifest->entries[middle].path, path);
+        if (order == 0) {
+            return &manifest->entries[middle];
+        }
+        if (order < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return NULL;
+}
+
+// Reads from a plain archive with pread(), or from a seekable payload one
+// frame at a time, so a file costs at most the frames it overlaps
+static int read_payload(int fd, PayloadReader* reader, uint8_t* buffer, uint64_t offset, size_t length) {
+    if (!reader) {
+        size_t done = 0;
+        while (done < length) {
+            ssize_t result = pread(fd, buffer + done, length - done, (off_t)(offset + done));
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                return result < 0 ? -errno : -EBADMSG;
+            }
+            done += (size_t)result;
+        }
+        return 0;
+    }
+    
+    // length never crosses a frame boundary
+    uint32_t frame = payload_reader_find_frame(reader, offset);
+    uint64_t frame_start = (uint64_t)frame * payload_reader_get_frame_size(reader);
+    size_t frame_length;
+    int result = payload_reader_decode_frame(reader, frame, buffer, &frame_length);
+    if (result < 0) {
+        return result;
+    }
+    if (offset - frame_start + length > frame_length) {
+        return -EBADMSG;
+    }
+    memmove(buffer, buffer + (offset - frame_start), length);
+    return 0;
+}
+
+int manifest_extract_file(const ManifestEntry* entry, const char* payload_path, int fd) {
+    if ((entry->mode & S_IFMT) != S_IFREG) {
+        return -EINVAL;
+    }
+    
+    PayloadReader* reader = NULL;
+    int payload_fd = -1;
+    int result = payload_is_seekable(payload_path);
+    if (result == 1) {
+        result = payload_reader_open(payload_path, 1, &reader);
+    } else if (result == 0) {
+        payload_fd = open(payload_path, O_RDONLY | O_CLOEXEC);
+        result = payload_fd < 0 ? -errno : 0;
+    }
+    if (result < 0) {
+        return result;
+    }
+    
+    size_t buffer_size = reader ? payload_reader_get_frame_size(reader) : READ_CHUNK_SIZE;
+    uint8_t* buffer = malloc(buffer_size);
+    result = buffer ? 0 : -ENOMEM;
+    
+    Sha256Context context;
+    sha256_init(&context);
+    uint64_t offset = entry->data_offset;
+    uint64_t end = entry->data_offset + entry->size;
+    while (offset < end && result == 0) {
+        size_t chunk = buffer_size - (size_t)(offset % buffer_size);
+        if (chunk > end - offset) {
+            chunk = (size_t)(end - offset);
+        }
+        result = read_payload(payload_fd, reader, buffer, offset, chunk);
+        if (result == 0) {
+            sha256_update(&context, buffer, chunk);
+            result = write_all(fd, buffer, chunk);
+        }
+        offset += chunk;
+    }
+    
+    if (result == 0) {
+        uint8_t digest[SHA256_DIGEST_SIZE];
+        sha256_final(&context, digest);
+        result = memcmp(digest, entry->digest, SHA256_DIGEST_SIZE) == 0 ? 0 : -EBADMSG;
+    }
+    
+    free(buffer);
+    payload_reader_free(reader);
+    if (payload_fd >= 0) {
+        close(payload_fd);
+    }
+    return result;
+}
+
+// Writing
+
+typedef struct {
+    ManifestEntry entry;
+    const char* path;       // into the finished pool, for sorting
+    uint32_t order;         // position in the archive
+} BuildEntry;
+
+typedef struct {
+    BuildEntry* entries;
+    size_t n_entries;
+    size_t capacity;
+    char* strings;
+    size_t strings_size;
+    size_t strings_capacity;
+    Sha256Context context;  // of the file being scanned
+    int hashing;
+} Builder;
+
+static int add_string(Builder* builder, const char* string, uint32_t* offset) {
+    size_t length = strlen(string) + 1;
+    if (builder->strings_size + length > UINT32_MAX) {
+        return -E2BIG;
+    }
+    if (builder->strings_size + length > builder->strings_capacity) {
+        size_t capacity = builder->strings_capacity ? builder->strings_capacity * 2 : 64 * 1024;
+        while (capacity < builder->strings_size + length) {
+            capacity *= 2;
+        }
+        char* strings = realloc(builder->strings, capacity);
+        if (!strings) {
+            return -ENOMEM;
+        }
+        builder->strings = strings;
+        builder->strings_capacity = capacity;
+    }
+    memcpy(builder->strings + builder->strings_size, string, length);
+    *offset = (uint32_t)builder->strings_size;
+    builder->strings_size += length;
+    return 0;
+}
+
+static void finish_digest(Builder* builder) {
+    if (builder->hashing) {
+        sha256_final(&builder->context, builder->entries[builder->n_entries - 1].entry.digest);
+        builder->hashing = 0;
+    }
+}
+
+static int on_member(void* user_data, const ExtractMember* member) {
+    Builder* builder = user_data;
+    finish_digest(builder);
+    
+    if (builder->n_entries == builder->capacity) {
+        size_t capacity = builder->capacity ? builder->capacity * 2 : 1024;
+        BuildEntry* entries = capacity <= UINT32_MAX ? realloc(builder->entries, capacity * sizeof(BuildEntry)) : NULL;
+        if (!entries) {
+            return capacity <= UINT32_MAX ? -ENOMEM : -E2BIG;
+        }
+        builder->entries = entries;
+        builder->capacity = capacity;
+    }
+    
+    BuildEntry* build = &builder->entries[builder->n_entries];
+    memset(build, 0, sizeof(*build));
+    build->order = (uint32_t)builder->n_entries;
+    ManifestEntry* entry = &build->entry;
+    entry->mode = member->mode;
+    entry->uid = member->uid;
+    entry->gid = member->gid;
+    entry->mtime = member->mtime;
+    entry->size = member->size;
+    entry->data_offset = member->data_offset;
+    int result = add_string(builder, member->path, &entry->path);
+    if (result == 0 && member->link) {
+        result = add_string(builder, member->link, &entry->link);
+    }
+    if (result < 0) {
+        return result;
+    }
+    if (S_ISREG(member->mode) && member->link) {
+        entry->flags |= MANIFEST_ENTRY_HARDLINK;
+    }
+    builder->n_entries++;
+    
+    if (S_ISREG(member->mode) && !member->link) {
+        sha256_init(&builder->context);
+        builder->hashing = 1;
+    }
+    return 0;
+}
+
+static int on_data(void* user_data, const uint8_t* data, size_t length) {
+    Builder* builder = user_data;
+    sha256_update(&builder->context, data, length);
+    return 0;
+}
+
+static int compare_build_entries_by_path(const void* a, const void* b) {
+    return strcmp(((const BuildEntry*)a)->path, ((const BuildEntry*)b)->path);
+}
+
+static int compare_build_entries(const void* a, const void* b) {
+    int order = compare_build_entries_by_path(a, b);
+    if (order != 0) {
+        return order;
+    }
+    uint32_t first = ((const BuildEntry*)a)->order;
+    uint32_t second = ((const BuildEntry*)b)->order;
+    return first < second ? -1 : first > second;
+}
+
+static int scan_payload(const char* payload_path, Builder* builder, uint64_t* archive_bytes) {
+    PayloadReader* reader = NULL;
+    Extractor* extractor = NULL;
+    int result = payload_is_seekable(payload_path);
+    if (result == 1) {
+        result = payload_reader_open(payload_path, 0, &reader);
+        if (result == 0) {
+            extractor = extractor_new_from_reader(payload_reader_read, reader, payload_reader_get_size(reader),
+                                                  ".", NULL);
+        }
+    } else if (result == 0) {
+        extractor = extractor_new(payload_path, ".", NULL);
+    }
+    if (result == 0 && !extractor) {
+        result = -ENOMEM;
+    }
+    
+    if (result == 0) {
+        static const ExtractScanFuncs funcs = { on_member, on_data };
+        result = extractor_scan(extractor, &funcs, builder);
+        finish_digest(builder);
+        
+        ExtractStats stats;
+        extractor_get_stats(extractor, &stats);
+        *archive_bytes = stats.archive_done;
+    }
+    
+    extractor_free(extractor);
+    payload_reader_free(reader);
+    return result;
+}
+
+// Sorts the records, keeps the last of several members with the same path
+// (the one extraction leaves behind), points hard links at their targets'
+// data and adds up the totals
+static void finish_entries(Builder* builder, ManifestHeader* header) {
+    for (size_t i = 0; i < builder->n_entries; i++) {
+        builder->entries[i].path = builder->strings + builder->entries[i].entry.path;
+    }
+    qsort(builder->entries, builder->n_entries, sizeof(BuildEntry), compare_build_entries);
+    
+    size_t kept = 0;
+    for (size_t i = 0; i < builder->n_entries; i++) {
+        if (i + 1 < builder->n_entries && strcmp(builder->entries[i].path, builder->entries[i + 1].path) == 0) {
+            continue;
+        }
+        builder->entries[kept++] = builder->entries[i];
+    }
+    builder->n_entries = kept;
+    
+    for (size_t i = 0; i < builder->n_entries; i++) {
+        ManifestEntry* entry = &builder->entries[i].entry;
+        if (entry->flags & MANIFEST_ENTRY_HARDLINK) {
+            BuildEntry key = { .path = builder->strings + entry->link };
+            BuildEntry* target = bsearch(&key, builder->entries, builder->n_entries, sizeof(BuildEntry),
+                                         compare_build_entries_by_path);
+            if (target && S_ISREG(target->entry.mode) && !(target->entry.flags & MANIFEST_ENTRY_HARDLINK)) {
+                entry->size = target->entry.size;
+                entry->data_offset = target->entry.data_offset;
+                memcpy(entry->digest, target->entry.digest, SHA256_DIGEST_SIZE);
+            }
+        }
+        
+        switch (entry->mode & S_IFMT) {
+        case S_IFREG:
+            header->n_files++;
+            if (!(entry->flags & MANIFEST_ENTRY_HARDLINK)) {
+                header->total_bytes += entry->size;
+                header->allocated_bytes += (entry->size + MANIFEST_BLOCK_SIZE - 1) / MANIFEST_BLOCK_SIZE *
+                                           MANIFEST_BLOCK_SIZE;
+            }
+            break;
+        case S_IFDIR:
+            header->n_directories++;
+            break;
+        case S_IFLNK:
+            header->n_symlinks++;
+            break;
+        default:
+            header->n_other++;
+            break;
+        }
+    }
+}
+
+static int write_manifest(const char* path, Builder* builder, const ManifestHeader* header) {
+    // Written next to the target and renamed into place, so a reader never
+    // maps a half-written manifest
+    size_t path_length = strlen(path);
+    char* temporary = malloc(path_length + 5);
+    if (!temporary) {
+        return -ENOMEM;
+    }
+    memcpy(temporary, path, path_length);
+    memcpy(temporary + path_length, ".tmp", 5);
+    
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int result = fd < 0 ? -errno : 0;
+    if (result == 0) {
+        result = write_all(fd, header, sizeof(*header));
+    }
+    for (size_t i = 0; i < builder->n_entries && result == 0; i++) {
+        result = write_all(fd, &builder->entries[i].entry, sizeof(ManifestEntry));
+    }
+    if (result == 0) {
+        result = write_all(fd, builder->strings, builder->strings_size);
+    }
+    if (fd >= 0 && close(fd) != 0 && result == 0) {
+        result = -errno;
+    }
+    if (result == 0 && rename(temporary, path) != 0) {
+        result = -errno;
+    }
+    if (result < 0 && fd >= 0) {
+        unlink(temporary);
+    }
+    
+    free(temporary);
+    return result;
+}
+
+int manifest_create(const char* payload_path, const char* manifest_path) {
+    Builder builder;
+    memset(&builder, 0, sizeof(builder));
+    uint32_t empty;
+    int result = add_string(&builder, "", &empty);
+    
+    ManifestHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+    if (result == 0) {
+        result = scan_payload(payload_path, &builder, &header.archive_bytes);
+    }
+    if (result == 0) {
+        finish_entries(&builder, &header);
+        header.n_entries = (uint32_t)builder.n_entries;
+        header.strings_size = (uint32_t)builder.strings_size;
+        result = write_manifest(manifest_path, &builder, &header);
+    }
+    
+    free(builder.entries);
+    free(builder.strings);
+    return result;
+}
@@ -0,0 +1,80 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sha256.h"
+
+// Binary manifest shipped next to a payload: the totals of the whole payload
+// and one record per member, sorted by path. The file is memory-mapped and
+// used in place, so the totals cost nothing and a path is found by binary
+// search without parsing the payload.
+//
+// Layout, all integers little-endian (the only byte order it is read on):
+//   header   ManifestHeader, 64 bytes
+//   entries  n_entries ManifestEntry records, 80 bytes each, sorted by path
+//            with strcmp()
+//   strings  pool of NUL-terminated strings; offset 0 is ""
+// Plain C so wave-pack can write it without GLib.
+
+// Bump the trailing digit whenever the layout changes
+#define MANIFEST_MAGIC "WAVEMAN1"
+
+// Allocation unit used for allocated_bytes
+#define MANIFEST_BLOCK_SIZE 4096
+
+typedef struct {
+    char magic[8];
+    uint32_t n_entries;
+    uint32_t strings_size;
+    uint64_t archive_bytes;     // size of the uncompressed archive
+    uint64_t total_bytes;       // data of all regular files, hard links counted once
+    uint64_t allocated_bytes;   // the same, each file rounded up to MANIFEST_BLOCK_SIZE
+    uint32_t n_files;           // regular files, hard links included
+    uint32_t n_directories;
+    uint32_t n_symlinks;
+    uint32_t n_other;           // devices and FIFOs
+    uint64_t reserved;
+} ManifestHeader;
+
+#define MANIFEST_ENTRY_HARDLINK 0x1   // shares the data of the file named by link
+
+typedef struct {
+    uint32_t path;              // string pool offsets
+    uint32_t link;              // symlink contents or hard link target
+    uint32_t mode;              // file type and permission bits, as in st_mode
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t flags;
+    int64_t mtime;
+    uint64_t size;
+    uint64_t data_offset;       // of the data in the uncompressed archive
+    uint8_t digest[SHA256_DIGEST_SIZE];  // SHA-256 of the data of regular files
+} ManifestEntry;
+
+typedef struct Manifest Manifest;
+
+// Maps a manifest and checks its header and string offsets. Returns 0,
+// -EBADMSG for a damaged or foreign file, or another negative errno value.
+int manifest_open(const char* path, Manifest** manifest);
+void manifest_free(Manifest* manifest);
+
+const ManifestHeader* manifest_get_header(const Manifest* manifest);
+const ManifestEntry* manifest_get_entry(const Manifest* manifest, uint32_t index);
+const char* manifest_entry_get_path(const Manifest* manifest, const ManifestEntry* entry);
+const char* manifest_entry_get_link(const Manifest* manifest, const ManifestEntry* entry);
+
+// Binary search by path as stored ("usr/bin/sh"); NULL when it is not there
+const ManifestEntry* manifest_lookup(const Manifest* manifest, const char* path);
+
+// Writes the data of one regular file to fd, reading only the part of the
+// payload that holds it (a single frame or two of a seekable payload), and
+// checks it against the digest. Returns 0, -EBADMSG on a digest mismatch, or
+// another negative errno value.
+int manifest_extract_file(const ManifestEntry* entry, const char* payload_path, int fd);
+
+// Scans the archive or seekable payload at payload_path and writes its
+// manifest to manifest_path. Returns 0 or a negative errno value.
+int manifest_create(const char* payload_path, const char* manifest_path);
+
+#endif // MANIFEST_H
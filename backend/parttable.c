@@ -0,0 +1,607 @@
+#define _GNU_SOURCE
+#include "parttable.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef BLKGETDISKSEQ
+#define BLKGETDISKSEQ _IOR(0x12, 128, uint64_t)
+#endif
+
+#define MBR_SIZE 512
+#define MBR_ENTRIES_OFFSET 446
+#define MBR_ENTRY_SIZE 16
+#define GPT_HEADER_MIN_SIZE 92
+#define GPT_ENTRY_MIN_SIZE 128
+#define GPT_MAX_ENTRIES_BYTES (1024 * 1024)
+#define PROBE_BLOCK_SIZE 4096
+#define BTRFS_SUPER_OFFSET (64 * 1024)
+#define CACHE_SIZE 32
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void init_crc_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320u : 0);
+        }
+        crc_table[i] = crc;
+    }
+}
+
+// The zlib/GPT CRC32: pass 0 to start, feed the result back in to continue
+uint32_t parttable_crc32(uint32_t crc, const void* data, size_t length) {
+    const uint8_t* bytes = data;
+    pthread_once(&crc_table_once, init_crc_table);
+    
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = crc_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint16_t le16(const uint8_t* p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t le32(const uint8_t* p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t le64(const uint8_t* p) {
+    return (uint64_t)le32(p) | (uint64_t)le32(p + 4) << 32;
+}
+
+static int read_exact(int fd, void* buffer, size_t length, uint64_t offset) {
+    size_t done = 0;
+    
+    while (done < length) {
+        ssize_t n = pread(fd, (char*)buffer + done, length - done, (off_t)(offset + done));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (n == 0) {
+            return -EIO;
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+// Copies a fixed-size, possibly unterminated and space-padded label
+static void copy_label(char* dest, size_t dest_size, const uint8_t* source, size_t source_size) {
+    size_t length = 0;
+    while (length < source_size && source[length] != '\0') {
+        length++;
+    }
+    while (length > 0 && source[length - 1] == ' ') {
+        length--;
+    }
+    if (length >= dest_size) {
+        length = dest_size - 1;
+    }
+    memcpy(dest, source, length);
+    dest[length] = '\0';
+}
+
+static const char* probe_ext(const uint8_t* block, char* label, size_t label_size) {
+    const uint8_t* super = block + 1024;
+    if (le16(super + 0x38) != 0xEF53) {
+        return NULL;
+    }
+    
+    copy_label(label, label_size, super + 0x78, 16);
+    uint32_t compat = le32(super + 0x5C);
+    uint32_t incompat = le32(super + 0x60);
+    
+    // extents, 64bit or flex_bg mean ext4; a journal alone means ext3
+    if (incompat & (0x40 | 0x80 | 0x200)) {
+        return "ext4";
+    }
+    return compat & 0x4 ? "ext3" : "ext2";
+}
+
+static const char* probe_fat(const uint8_t* block, char* label, size_t label_size) {
+    if (block[510] != 0x55 || block[511] != 0xAA) {
+        return NULL;
+    }
+    
+    const uint8_t* volume_label;
+    if (memcmp(block + 0x52, "FAT32   ", 8) == 0) {
+        volume_label = block + 0x47;
+    } else if (memcmp(block + 0x36, "FAT12   ", 8) == 0 || memcmp(block + 0x36, "FAT16   ", 8) == 0) {
+        volume_label = block + 0x2B;
+    } else {
+        return NULL;
+    }
+    
+    copy_label(label, label_size, volume_label, 11);
+    if (strcmp(label, "NO NAME") == 0) {
+        label[0] = '\0';
+    }
+    return "vfat";
+}
+
+const char* partition_probe_filesystem(int fd, uint64_t offset, uint64_t size, char* label, size_t label_size) {
+    uint8_t block[PROBE_BLOCK_SIZE];
+    label[0] = '\0';
+    
+    if (size != 0 && size < PROBE_BLOCK_SIZE) {
+        return NULL;
+    }
+    if (read_exact(fd, block, sizeof(block), offset) != 0) {
+        return NULL;
+    }
+    
+    if (memcmp(block, "LUKS\xba\xbe", 6) == 0) {
+        // Only LUKS2 headers carry a label
+        if (((uint16_t)block[6] << 8 | block[7]) == 2) {
+            copy_label(label, label_size, block + 24, 48);
+        }
+        return "crypto_LUKS";
+    }
+    if (memcmp(block, "XFSB", 4) == 0) {
+        copy_label(label, label_size, block + 0x6C, 12);
+        return "xfs";
+    }
+    if (memcmp(block + 3, "NTFS    ", 8) == 0) {
+        return "ntfs";
+    }
+    
+    const char* filesystem = probe_ext(block, label, label_size);
+    if (!filesystem) {
+        filesystem = probe_fat(block, label, label_size);
+    }
+    if (filesystem) {
+        return filesystem;
+    }
+    
+    // The swap signature ends the first page; 4 KiB pages cover almost every system
+    if (memcmp(block + PROBE_BLOCK_SIZE - 10, "SWAPSPACE2", 10) == 0 ||
+        memcmp(block + PROBE_BLOCK_SIZE - 10, "SWAP-SPACE", 10) == 0) {
+        copy_label(label, label_size, block + 1024 + 28, 16);
+        return "swap";
+    }
+    
+    if (size == 0 || size >= BTRFS_SUPER_OFFSET + PROBE_BLOCK_SIZE) {
+        if (read_exact(fd, block, PROBE_BLOCK_SIZE, offset + BTRFS_SUPER_OFFSET) == 0 &&
+            memcmp(block + 0x40, "_BHRfS_M", 8) == 0) {
+            copy_label(label, label_size, block + 0x12B, 256);
+            return "btrfs";
+        }
+    }
+    return NULL;
+}
+
+// GPT names are UTF-16LE; surrogate pairs are combined, unpaired ones dropped
+static void utf16le_to_utf8(char* dest, size_t dest_size, const uint8_t* source, size_t units) {
+    size_t out = 0;
+    
+    for (size_t i = 0; i < units; i++) {
+        uint32_t c = le16(source + 2 * i);
+        if (c == 0) {
+            break;
+        }
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < units) {
+            uint32_t low = le16(source + 2 * (i + 1));
+            if (low >= 0xDC00 && low < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                i++;
+            }
+        }
+        if (c >= 0xD800 && c < 0xE000) {
+            continue;
+        }
+        
+        uint8_t bytes[4];
+        size_t n;
+        if (c < 0x80) {
+            bytes[0] = (uint8_t)c;
+            n = 1;
+        } else if (c < 0x800) {
+            bytes[0] = (uint8_t)(0xC0 | c >> 6);
+            bytes[1] = (uint8_t)(0x80 | (c & 0x3F));
+            n = 2;
+        } else if (c < 0x10000) {
+            bytes[0] = (uint8_t)(0xE0 | c >> 12);
+            bytes[1] = (uint8_t)(0x80 | ((c >> 6) & 0x3F));
+            bytes[2] = (uint8_t)(0x80 | (c & 0x3F));
+            n = 3;
+        } else {
+            bytes[0] = (uint8_t)(0xF0 | c >> 18);
+            bytes[1] = (uint8_t)(0x80 | ((c >> 12) & 0x3F));
+            bytes[2] = (uint8_t)(0x80 | ((c >> 6) & 0x3F));
+            bytes[3] = (uint8_t)(0x80 | (c & 0x3F));
+            n = 4;
+        }
+        if (out + n >= dest_size) {
+            break;
+        }
+        memcpy(dest + out, bytes, n);
+        out += n;
+    }
+    dest[out] = '\0';
+}
+
+typedef struct {
+    uint64_t my_lba;
+    uint64_t alternate_lba;
+    uint64_t entries_lba;
+    uint32_t n_entries;
+    uint32_t entry_size;
+    uint32_t entries_crc;
+} GptHeader;
+
+static int read_gpt_header(int fd, uint64_t lba, uint32_t sector_size, GptHeader* header) {
+    uint8_t sector[PROBE_BLOCK_SIZE];
+    if (sector_size > sizeof(sector) || read_exact(fd, sector, sector_size, lba * sector_size) != 0) {
+        return 0;
+    }
+    if (memcmp(sector, "EFI PART", 8) != 0) {
+        return 0;
+    }
+    
+    uint32_t header_size = le32(sector + 12);
+    uint32_t stored_crc = le32(sector + 16);
+    if (header_size < GPT_HEADER_MIN_SIZE || header_size > sector_size) {
+        return 0;
+    }
+    memset(sector + 16, 0, 4);
+    if (parttable_crc32(0, sector, header_size) != stored_crc) {
+        return 0;
+    }
+    
+    header->my_lba = le64(sector + 24);
+    header->alternate_lba = le64(sector + 32);
+    header->entries_lba = le64(sector + 72);
+    header->n_entries = le32(sector + 80);
+    header->entry_size = le32(sector + 84);
+    header->entries_crc = le32(sector + 88);
+    
+    return header->my_lba == lba && header->entry_size >= GPT_ENTRY_MIN_SIZE && header->entry_size % 8 == 0 &&
+           (uint64_t)header->n_entries * header->entry_size <= GPT_MAX_ENTRIES_BYTES;
+}
+
+static int read_gpt_entries(int fd, const GptHeader* header, PartitionTable* table) {
+    size_t length = (size_t)header->n_entries * header->entry_size;
+    uint8_t* entries = malloc(length ? length : 1);
+    if (!entries) {
+        return 0;
+    }
+    
+    if (read_exact(fd, entries, length, header->entries_lba * table->sector_size) != 0 ||
+        parttable_crc32(0, entries, length) != header->entries_crc) {
+        free(entries);
+        return 0;
+    }
+    
+    static const uint8_t unused_type[16] = {0};
+    table->n_partitions = 0;
+    for (uint32_t i = 0; i < header->n_entries && table->n_partitions < PARTTABLE_MAX_PARTITIONS; i++) {
+        const uint8_t* entry = entries + (size_t)i * header->entry_size;
+        if (memcmp(entry, unused_type, 16) == 0) {
+            continue;
+        }
+        
+        uint64_t first_lba = le64(entry + 32);
+        uint64_t last_lba = le64(entry + 40);
+        if (last_lba < first_lba) {
+            continue;
+        }
+        
+        PartitionInfo* info = &table->partitions[table->n_partitions++];
+        memset(info, 0, sizeof(*info));
+        info->number = i + 1;
+        info->start = first_lba * table->sector_size;
+        info->size = (last_lba - first_lba + 1) * table->sector_size;
+        memcpy(info->type_guid, entry, 16);
+        utf16le_to_utf8(info->name, sizeof(info->name), entry + 56, 36);
+    }
+    
+    free(entries);
+    return 1;
+}
+
+// Tries the primary header first and falls back to the backup at the end of the disk
+static int read_gpt(int fd, PartitionTable* table) {
+    GptHeader header;
+    uint64_t last_lba = table->disk_size / table->sector_size - 1;
+    int have_primary = read_gpt_header(fd, 1, table->sector_size, &header);
+    
+    if (have_primary && read_gpt_entries(fd, &header, table)) {
+        return 1;
+    }
+    
+    uint64_t backup_lba = have_primary && header.alternate_lba <= last_lba ? header.alternate_lba : last_lba;
+    if (read_gpt_header(fd, backup_lba, table->sector_size, &header) && read_gpt_entries(fd, &header, table)) {
+        table->gpt_from_backup = 1;
+        return 1;
+    }
+    return 0;
+}
+
+static int is_extended_type(uint8_t type) {
+    return type == 0x05 || type == 0x0F || type == 0x85;
+}
+
+int partition_is_extended(const PartitionInfo* partition) {
+    return is_extended_type(partition->mbr_type);
+}
+
+// Rejects boot sectors of unpartitioned FAT/NTFS disks, whose boot code
+// fills the area where the partition entries would be
+static int mbr_entries_valid(const uint8_t* mbr, uint64_t n_sectors) {
+    int n_used = 0;
+    
+    for (int i = 0; i < 4; i++) {
+        const uint8_t* entry = mbr + MBR_ENTRIES_OFFSET + i * MBR_ENTRY_SIZE;
+        if (entry[4] == 0) {
+            continue;
+        }
+        if ((entry[0] != 0x00 && entry[0] != 0x80) || le32(entry + 8) == 0 ||
+            (uint64_t)le32(entry + 8) + le32(entry + 12) > n_sectors) {
+            return 0;
+        }
+        n_used++;
+    }
+    return n_used > 0;
+}
+
+static void add_mbr_partition(PartitionTable* table, uint32_t number, uint8_t type, uint64_t start_lba,
+                              uint64_t n_sectors) {
+    if (table->n_partitions >= PARTTABLE_MAX_PARTITIONS) {
+        return;
+    }
+    
+    PartitionInfo* info = &table->partitions[table->n_partitions++];
+    memset(info, 0, sizeof(*info));
+    info->number = number;
+    info->mbr_type = type;
+    info->start = start_lba * table->sector_size;
+    info->size = n_sectors * table->sector_size;
+}
+
+// Logical partitions form a chain of EBRs. Each EBR describes one logical
+// partition relative to itself and links to the next EBR relative to the
+// start of the extended partition.
+static void read_ebr_chain(int fd, PartitionTable* table, uint64_t extended_lba) {
+    uint8_t ebr[MBR_SIZE];
+    uint64_t ebr_lba = extended_lba;
+    uint32_t number = 5;
+    
+    for (int i = 0; i < PARTTABLE_MAX_PARTITIONS; i++) {
+        if (read_exact(fd, ebr, sizeof(ebr), ebr_lba * table->sector_size) != 0 ||
+            ebr[510] != 0x55 || ebr[511] != 0xAA) {
+            return;
+        }
+        
+        const uint8_t* logical = ebr + MBR_ENTRIES_OFFSET;
+        const uint8_t* next = logical + MBR_ENTRY_SIZE;
+        if (logical[4] != 0 && le32(logical + 12) != 0) {
+            add_mbr_partition(table, number++, logical[4], ebr_lba + le32(logical + 8), le32(logical + 12));
+        }
+        
+        if (!is_extended_type(next[4]) || le32(next + 8) == 0) {
+            return;
+        }
+        uint64_t next_lba = extended_lba + le32(next + 8);
+        if (next_lba <= ebr_lba) {
+            return;
+        }
+        ebr_lba = next_lba;
+    }
+}
+
+static void read_mbr(int fd, const uint8_t* mbr, PartitionTable* table) {
+    table->n_partitions = 0;
+    
+    for (int i = 0; i < 4; i++) {
+        const uint8_t* entry = mbr + MBR_ENTRIES_OFFSET + i * MBR_ENTRY_SIZE;
+        uint8_t type = entry[4];
+        if (type == 0) {
+            continue;
+        }
+        
+        add_mbr_partition(table, (uint32_t)i + 1, type, le32(entry + 8), le32(entry + 12));
+        if (is_extended_type(type)) {
+            read_ebr_chain(fd, table, le32(entry + 8));
+        }
+    }
+}
+
+static int get_disk_geometry(int fd, uint64_t* size, uint32_t* sector_size) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -errno;
+    }
+    
+    if (S_ISBLK(st.st_mode)) {
+        int logical_size = 0;
+        if (ioctl(fd, BLKGETSIZE64, size) != 0) {
+            return -errno;
+        }
+        *sector_size = ioctl(fd, BLKSSZGET, &logical_size) == 0 && logical_size > 0 ? (uint32_t)logical_size : 512;
+    } else {
+        *size = (uint64_t)st.st_size;
+        *sector_size = 0;
+    }
+    return 0;
+}
+
+int partition_table_read(int fd, PartitionTable* table) {
+    uint8_t mbr[MBR_SIZE];
+    uint32_t sector_size = 0;
+    int result;
+    
+    memset(table, 0, offsetof(PartitionTable, partitions));
+    if ((result = get_disk_geometry(fd, &table->disk_size, &sector_size)) != 0) {
+        return result;
+    }
+    if (table->disk_size < MBR_SIZE) {
+        return 0;
+    }
+    if ((result = read_exact(fd, mbr, sizeof(mbr), 0)) != 0) {
+        return result;
+    }
+    
+    // Image files do not know their sector size, so look for a GPT header at
+    // both common ones
+    static const uint32_t image_sector_sizes[] = {512, 4096};
+    for (size_t i = 0; i < sizeof(image_sector_sizes) / sizeof(image_sector_sizes[0]); i++) {
+        table->sector_size = sector_size ? sector_size : image_sector_sizes[i];
+        if (table->disk_size >= 2 * (uint64_t)table->sector_size && read_gpt(fd, table)) {
+            table->scheme = PARTITION_SCHEME_GPT;
+            break;
+        }
+        if (sector_size) {
+            break;
+        }
+    }
+    
+    if (table->scheme == PARTITION_SCHEME_NONE) {
+        table->sector_size = sector_size ? sector_size : 512;
+        if (mbr[510] == 0x55 && mbr[511] == 0xAA &&
+            mbr_entries_valid(mbr, table->disk_size / table->sector_size)) {
+            table->scheme = PARTITION_SCHEME_MBR;
+            read_mbr(fd, mbr, table);
+        }
+    }
+    
+    if (table->scheme == PARTITION_SCHEME_NONE) {
+        table->filesystem = partition_probe_filesystem(fd, 0, table->disk_size, table->label, sizeof(table->label));
+        return 0;
+    }
+    
+    for (uint32_t i = 0; i < table->n_partitions; i++) {
+        PartitionInfo* info = &table->partitions[i];
+        if (!is_extended_type(info->mbr_type) && info->start + info->size <= table->disk_size) {
+            info->filesystem = partition_probe_filesystem(fd, info->start, info->size, info->label, sizeof(info->label));
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    dev_t rdev;
+    uint64_t size;
+    uint64_t generation;
+    uint64_t version;     // disk sequence number or modification time
+    uint64_t last_used;
+    PartitionTable table;
+} CacheEntry;
+
+struct PartitionCache {
+    pthread_mutex_t lock;
+    CacheEntry* entries[CACHE_SIZE];
+    uint64_t clock;
+};
+
+PartitionCache* partition_cache_new(void) {
+    PartitionCache* cache = calloc(1, sizeof(PartitionCache));
+    if (cache) {
+        pthread_mutex_init(&cache->lock, NULL);
+    }
+    return cache;
+}
+
+void partition_cache_free(PartitionCache* cache) {
+    if (!cache) {
+        return;
+    }
+    
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        free(cache->entries[i]);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+static int cache_entry_matches(const CacheEntry* entry, const CacheEntry* key) {
+    return entry && entry->dev == key->dev && entry->ino == key->ino && entry->rdev == key->rdev;
+}
+
+int partition_cache_read(PartitionCache* cache, const char* path, uint64_t generation, PartitionTable* table) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    
+    struct stat st;
+    CacheEntry key = {0};
+    if (fstat(fd, &st) != 0) {
+        int error = -errno;
+        close(fd);
+        return error;
+    }
+    
+    key.dev = st.st_dev;
+    key.ino = st.st_ino;
+    key.rdev = st.st_rdev;
+    key.generation = generation;
+    if (S_ISBLK(st.st_mode)) {
+        // Bumped by the kernel whenever the media changes
+        if (ioctl(fd, BLKGETSIZE64, &key.size) != 0 || ioctl(fd, BLKGETDISKSEQ, &key.version) != 0) {
+            key.version = 0;
+        }
+    } else {
+        key.size = (uint64_t)st.st_size;
+        key.version = (uint64_t)st.st_mtim.tv_sec * 1000000000u + (uint64_t)st.st_mtim.tv_nsec;
+    }
+    
+    pthread_mutex_lock(&cache->lock);
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        CacheEntry* entry = cache->entries[i];
+        if (cache_entry_matches(entry, &key) && entry->size == key.size &&
+            entry->generation == key.generation && entry->version == key.version) {
+            entry->last_used = ++cache->clock;
+            memcpy(table, &entry->table, sizeof(*table));
+            pthread_mutex_unlock(&cache->lock);
+            close(fd);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    
+    int result = partition_table_read(fd, table);
+    close(fd);
+    if (result != 0) {
+        return result;
+    }
+    
+    // Replace the stale entry for this device, or else the least recently used one
+    pthread_mutex_lock(&cache->lock);
+    int slot = 0;
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        if (cache_entry_matches(cache->entries[i], &key)) {
+            slot = i;
+            break;
+        }
+        if (!cache->entries[i] || (cache->entries[slot] && cache->entries[i]->last_used < cache->entries[slot]->last_used)) {
+            slot = i;
+        }
+    }
+    if (!cache->entries[slot]) {
+        cache->entries[slot] = malloc(sizeof(CacheEntry));
+    }
+    if (cache->entries[slot]) {
+        *cache->entries[slot] = key;
+        cache->entries[slot]->last_used = ++cache->clock;
+        memcpy(&cache->entries[slot]->table, table, sizeof(*table));
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return 0;
+}
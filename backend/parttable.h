@@ -0,0 +1,70 @@
+#ifndef PARTTABLE_H
+#define PARTTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Reads partition tables and filesystem signatures straight from a disk or
+// disk image with pread(). Only the sectors that hold the tables and the
+// superblocks are read; no external tools are involved. Plain C so the
+// install helper can use it without GLib.
+
+#define PARTTABLE_MAX_PARTITIONS 128
+#define PARTTABLE_LABEL_SIZE 64
+#define PARTTABLE_NAME_SIZE 112   // GPT names are 36 UTF-16 units
+
+typedef enum {
+    PARTITION_SCHEME_NONE,   // no table; the filesystem may cover the whole disk
+    PARTITION_SCHEME_MBR,
+    PARTITION_SCHEME_GPT
+} PartitionScheme;
+
+typedef struct {
+    uint32_t number;              // as the kernel numbers it; logical MBR partitions start at 5
+    uint64_t start;               // in bytes
+    uint64_t size;                // in bytes
+    uint8_t mbr_type;             // MBR only
+    uint8_t type_guid[16];        // GPT only, in on-disk byte order
+    char name[PARTTABLE_NAME_SIZE];   // GPT partition name
+    const char* filesystem;       // "ext4", "vfat", "swap", ...; NULL when not recognised
+    char label[PARTTABLE_LABEL_SIZE]; // filesystem label
+} PartitionInfo;
+
+typedef struct {
+    PartitionScheme scheme;
+    uint32_t sector_size;
+    uint64_t disk_size;
+    int gpt_from_backup;          // the primary GPT header or entries failed their CRC
+    const char* filesystem;       // filesystem found at offset 0 when there is no table
+    char label[PARTTABLE_LABEL_SIZE];
+    uint32_t n_partitions;
+    PartitionInfo partitions[PARTTABLE_MAX_PARTITIONS];
+} PartitionTable;
+
+// Fills in the table for an open disk or image file. Returns 0 or a negative
+// errno value; a disk without any table is not an error.
+int partition_table_read(int fd, PartitionTable* table);
+
+// Detects the filesystem starting at the given byte offset. Returns its name
+// or NULL, and copies its label (possibly empty) into label.
+const char* partition_probe_filesystem(int fd, uint64_t offset, uint64_t size, char* label, size_t label_size);
+
+// True for the MBR container that holds the logical partitions
+int partition_is_extended(const PartitionInfo* partition);
+
+uint32_t parttable_crc32(uint32_t crc, const void* data, size_t length);
+
+// Results are kept per device, keyed by device identity, size and a
+// generation number. For block devices the kernel's disk sequence number is
+// folded in; for image files the modification time. Callers pass their own
+// generation, e.g. a counter bumped on every uevent for the device.
+typedef struct PartitionCache PartitionCache;
+
+PartitionCache* partition_cache_new(void);
+void partition_cache_free(PartitionCache* cache);
+
+// Opens path read-only and fills in its table, reusing the cached result
+// when the device has not changed. Returns 0 or a negative errno value.
+int partition_cache_read(PartitionCache* cache, const char* path, uint64_t generation, PartitionTable* table);
+
+#endif // PARTTABLE_H
@@ -0,0 +1,581 @@
+#define _GNU_SOURCE
+#include "payload.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <lzma.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SLOTS_PER_THREAD 2
+#define MAX_THREADS 64
+
+#define ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+
+typedef struct {
+    uint64_t offset;
+    uint32_t compressed;
+    uint32_t uncompressed;
+} FrameInfo;
+
+struct PayloadWriter {
+    int fd;
+    uint32_t frame_size;
+    uint64_t offset;
+    FrameInfo* frames;
+    size_t n_frames;
+    size_t capacity;
+    uint64_t total;
+};
+
+typedef enum {
+    SLOT_EMPTY,
+    SLOT_DECODING,
+    SLOT_READY
+} SlotState;
+
+// Frame n is decoded into slot n % n_slots, which frees up again once
+// payload_reader_read() has handed all of it out
+typedef struct {
+    uint8_t* buffer;
+    size_t length;
+    uint32_t frame;
+    SlotState state;
+    int result;
+} Slot;
+
+struct PayloadReader {
+    int fd;
+    uint32_t frame_size;
+    uint32_t n_frames;
+    uint64_t total;
+    FrameInfo* frames;
+    uint64_t* starts;           // uncompressed offset of each frame, plus the total
+    uint32_t max_compressed;
+    
+    pthread_mutex_t lock;
+    pthread_cond_t slot_ready;
+    pthread_cond_t slot_free;
+    Slot* slots;
+    uint32_t n_slots;
+    uint32_t next_frame;        // next frame for a decoder to claim
+    int stop;
+    pthread_t threads[MAX_THREADS];
+    uint32_t n_threads;
+    uint32_t wanted_threads;    // started by the first payload_reader_read()
+    int started;
+    int start_error;
+    
+    // Only touched by the thread calling payload_reader_read()
+    uint32_t current_frame;
+    size_t position;            // within the current frame
+    
+    uint64_t compressed_bytes;
+    uint64_t bytes_decoded;
+    uint64_t busy_ns;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void put_le32(uint8_t* out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static void put_le64(uint8_t* out, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        out[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static uint32_t get_le32(const uint8_t* in) {
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--) {
+        value = value << 8 | in[i];
+    }
+    return value;
+}
+
+static uint64_t get_le64(const uint8_t* in) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = value << 8 | in[i];
+    }
+    return value;
+}
+
+static int write_all(int fd, const uint8_t* data, size_t length) {
+    while (length > 0) {
+        ssize_t result = write(fd, data, length);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        data += result;
+        length -= (size_t)result;
+    }
+    return 0;
+}
+
+static int read_all(int fd, uint8_t* data, size_t length, uint64_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t result = pread(fd, data + done, length - done, (off_t)(offset + done));
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (result == 0) {
+            return -EBADMSG;   // the index points past the end of the file
+        }
+        done += (size_t)result;
+    }
+    return 0;
+}
+
+// Packing
+
+size_t payload_frame_bound(size_t length) {
+    return lzma_stream_buffer_bound(length);
+}
+
+int payload_encode_frame(const uint8_t* data, size_t length, uint32_t level, uint8_t* out, size_t* out_length) {
+    size_t position = 0;
+    lzma_ret result = lzma_easy_buffer_encode(level, LZMA_CHECK_CRC32, NULL, data, length, out, &position,
+                                              payload_frame_bound(length));
+    if (result != LZMA_OK) {
+        return result == LZMA_MEM_ERROR ? -ENOMEM : -EINVAL;
+    }
+    *out_length = position;
+    return 0;
+}
+
+PayloadWriter* payload_writer_new(int fd, uint32_t frame_size) {
+    if (frame_size == 0 || frame_size > PAYLOAD_MAX_FRAME_SIZE) {
+        errno = EINVAL;
+        return NULL;
+    }
+    PayloadWriter* writer = calloc(1, sizeof(PayloadWriter));
+    if (!writer) {
+        return NULL;
+    }
+    
+    uint8_t header[PAYLOAD_HEADER_SIZE];
+    memcpy(header, PAYLOAD_MAGIC, 8);
+    put_le32(header + 8, PAYLOAD_VERSION);
+    put_le32(header + 12, frame_size);
+    int result = write_all(fd, header, sizeof(header));
+    if (result < 0) {
+        free(writer);
+        errno = -result;
+        return NULL;
+    }
+    
+    writer->fd = fd;
+    writer->frame_size = frame_size;
+    writer->offset = PAYLOAD_HEADER_SIZE;
+    return writer;
+}
+
+int payload_writer_add_frame(PayloadWriter* writer, const uint8_t* frame, size_t length, size_t uncompressed) {
+    if (uncompressed == 0 || uncompressed > writer->frame_size || length > UINT32_MAX) {
+        return -EINVAL;
+    }
+    // Only the last frame may be short
+    if (writer->n_frames > 0 && writer->frames[writer->n_frames - 1].uncompressed != writer->frame_size) {
+        return -EINVAL;
+    }
+    
+    if (writer->n_frames == writer->capacity) {
+        size_t capacity = writer->capacity ? writer->capacity * 2 : 256;
+        FrameInfo* frames = realloc(writer->frames, capacity * sizeof(FrameInfo));
+        if (!frames) {
+            return -ENOMEM;
+        }
+        writer->frames = frames;
+        writer->capacity = capacity;
+    }
+    
+    int result = write_all(writer->fd, frame, length);
+    if (result < 0) {
+        return result;
+    }
+    FrameInfo* info = &writer->frames[writer->n_frames++];
+    info->offset = writer->offset;
+    info->compressed = (uint32_t)length;
+    info->uncompressed = (uint32_t)uncompressed;
+    writer->offset += length;
+    writer->total += uncompressed;
+    return 0;
+}
+
+int payload_writer_finish(PayloadWriter* writer) {
+    size_t index_size = writer->n_frames * PAYLOAD_INDEX_ENTRY_SIZE;
+    uint8_t* index = malloc(index_size + PAYLOAD_FOOTER_SIZE);
+    if (!index) {
+        return -ENOMEM;
+    }
+    
+    for (size_t i = 0; i < writer->n_frames; i++) {
+        uint8_t* entry = index + i * PAYLOAD_INDEX_ENTRY_SIZE;
+        put_le64(entry, writer->frames[i].offset);
+        put_le32(entry + 8, writer->frames[i].compressed);
+        put_le32(entry + 12, writer->frames[i].uncompressed);
+    }
+    
+    uint8_t* footer = index + index_size;
+    put_le64(footer, writer->offset);
+    put_le64(footer + 8, writer->n_frames);
+    put_le64(footer + 16, writer->total);
+    put_le32(footer + 24, lzma_crc32(index, index_size, 0));
+    put_le32(footer + 28, 0);
+    memcpy(footer + 32, PAYLOAD_INDEX_MAGIC, 8);
+    
+    int result = write_all(writer->fd, index, index_size + PAYLOAD_FOOTER_SIZE);
+    free(index);
+    return result;
+}
+
+void payload_writer_free(PayloadWriter* writer) {
+    if (!writer) {
+        return;
+    }
+    free(writer->frames);
+    free(writer);
+}
+
+// Reading
+
+int payload_is_seekable(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -errno;
+    }
+    uint8_t magic[8];
+    int result = read_all(fd, magic, sizeof(magic), 0);
+    close(fd);
+    if (result == -EBADMSG) {
+        return 0;   // shorter than the magic
+    }
+    return result < 0 ? result : memcmp(magic, PAYLOAD_MAGIC, 8) == 0;
+}
+
+static int load_index(PayloadReader* reader) {
+    struct stat st;
+    if (fstat(reader->fd, &st) != 0) {
+        return -errno;
+    }
+    uint64_t file_size = (uint64_t)st.st_size;
+    if (file_size < PAYLOAD_HEADER_SIZE + PAYLOAD_FOOTER_SIZE) {
+        return -EBADMSG;
+    }
+    
+    uint8_t header[PAYLOAD_HEADER_SIZE];
+    uint8_t footer[PAYLOAD_FOOTER_SIZE];
+    int result = read_all(reader->fd, header, sizeof(header), 0);
+    if (result == 0) {
+        result = read_all(reader->fd, footer, sizeof(footer), file_size - PAYLOAD_FOOTER_SIZE);
+    }
+    if (result < 0) {
+        return result;
+    }
+    if (memcmp(header, PAYLOAD_MAGIC, 8) != 0 || get_le32(header + 8) != PAYLOAD_VERSION ||
+        memcmp(footer + 32, PAYLOAD_INDEX_MAGIC, 8) != 0) {
+        return -EBADMSG;
+    }
+    
+    reader->frame_size = get_le32(header + 12);
+    uint64_t index_offset = get_le64(footer);
+    uint64_t n_frames = get_le64(footer + 8);
+    reader->total = get_le64(footer + 16);
+    if (reader->frame_size == 0 || reader->frame_size > PAYLOAD_MAX_FRAME_SIZE || n_frames > UINT32_MAX ||
+        index_offset < PAYLOAD_HEADER_SIZE ||
+        index_offset + n_frames * PAYLOAD_INDEX_ENTRY_SIZE != file_size - PAYLOAD_FOOTER_SIZE) {
+        return -EBADMSG;
+    }
+    reader->n_frames = (uint32_t)n_frames;
+    
+    size_t index_size = reader->n_frames * PAYLOAD_INDEX_ENTRY_SIZE;
+    uint8_t* index = malloc(index_size ? index_size : 1);
+    reader->frames = calloc(reader->n_frames ? reader->n_frames : 1, sizeof(FrameInfo));
+    reader->starts = calloc((size_t)reader->n_frames + 1, sizeof(uint64_t));
+    if (!index || !reader->frames || !reader->starts) {
+        free(index);
+        return -ENOMEM;
+    }
+    result = read_all(reader->fd, index, index_size, index_offset);
+    if (result == 0 && lzma_crc32(index, index_size, 0) != get_le32(footer + 24)) {
+        result = -EBADMSG;
+    }
+    
+    // Frames must follow each other without gaps and add up to the total
+    uint64_t expected_offset = PAYLOAD_HEADER_SIZE;
+    for (uint32_t i = 0; i < reader->n_frames && result == 0; i++) {
+        FrameInfo* frame = &reader->frames[i];
+        const uint8_t* entry = index + (size_t)i * PAYLOAD_INDEX_ENTRY_SIZE;
+        frame->offset = get_le64(entry);
+        frame->compressed = get_le32(entry + 8);
+        frame->uncompressed = get_le32(entry + 12);
+        
+        int short_frame = frame->uncompressed != reader->frame_size;
+        if (frame->offset != expected_offset || frame->compressed == 0 || frame->uncompressed == 0 ||
+            frame->uncompressed > reader->frame_size || (short_frame && i + 1 != reader->n_frames)) {
+            result = -EBADMSG;
+            break;
+        }
+        expected_offset += frame->compressed;
+        reader->starts[i + 1] = reader->starts[i] + frame->uncompressed;
+        if (frame->compressed > reader->max_compressed) {
+            reader->max_compressed = frame->compressed;
+        }
+    }
+    if (result == 0 && (expected_offset != index_offset || reader->starts[reader->n_frames] != reader->total)) {
+        result = -EBADMSG;
+    }
+    
+    free(index);
+    return result;
+}
+
+int payload_reader_decode_frame(PayloadReader* reader, uint32_t index, uint8_t* out, size_t* length) {
+    if (index >= reader->n_frames) {
+        return -EINVAL;
+    }
+    const FrameInfo* frame = &reader->frames[index];
+    uint8_t* input = malloc(frame->compressed);
+    if (!input) {
+        return -ENOMEM;
+    }
+    
+    int result = read_all(reader->fd, input, frame->compressed, frame->offset);
+    if (result == 0) {
+        ATOMIC_ADD(&reader->compressed_bytes, frame->compressed);
+        uint64_t memory_limit = UINT64_MAX;
+        size_t in_position = 0;
+        size_t out_position = 0;
+        lzma_ret decoded = lzma_stream_buffer_decode(&memory_limit, 0, NULL, input, &in_position, frame->compressed,
+                                                     out, &out_position, frame->uncompressed);
+        if (decoded == LZMA_MEM_ERROR) {
+            result = -ENOMEM;
+        } else if (decoded != LZMA_OK || in_position != frame->compressed || out_position != frame->uncompressed) {
+            result = -EBADMSG;
+        } else {
+            *length = out_position;
+        }
+    }
+    
+    free(input);
+    return result;
+}
+
+static void* decoder_thread(void* data) {
+    PayloadReader* reader = data;
+    
+    for (;;) {
+        pthread_mutex_lock(&reader->lock);
+        while (!reader->stop && reader->next_frame < reader->n_frames &&
+               reader->slots[reader->next_frame % reader->n_slots].state != SLOT_EMPTY) {
+            pthread_cond_wait(&reader->slot_free, &reader->lock);
+        }
+        if (reader->stop || reader->next_frame >= reader->n_frames) {
+            pthread_mutex_unlock(&reader->lock);
+            break;
+        }
+        uint32_t frame = reader->next_frame++;
+        Slot* slot = &reader->slots[frame % reader->n_slots];
+        slot->state = SLOT_DECODING;
+        slot->frame = frame;
+        pthread_mutex_unlock(&reader->lock);
+        
+        uint64_t start = now_ns();
+        size_t length = 0;
+        int result = payload_reader_decode_frame(reader, frame, slot->buffer, &length);
+        ATOMIC_ADD(&reader->busy_ns, now_ns() - start);
+        ATOMIC_ADD(&reader->bytes_decoded, length);
+        
+        pthread_mutex_lock(&reader->lock);
+        slot->length = length;
+        slot->result = result;
+        slot->state = SLOT_READY;
+        pthread_cond_broadcast(&reader->slot_ready);
+        pthread_mutex_unlock(&reader->lock);
+    }
+    return NULL;
+}
+
+static int start_decoders(PayloadReader* reader, uint32_t n_threads) {
+    if (n_threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+    if (n_threads > MAX_THREADS) {
+        n_threads = MAX_THREADS;
+    }
+    // More decoders than frames would only sit idle
+    if (n_threads > reader->n_frames) {
+        n_threads = reader->n_frames ? reader->n_frames : 1;
+    }
+    
+    reader->n_slots = n_threads * SLOTS_PER_THREAD;
+    reader->slots = calloc(reader->n_slots, sizeof(Slot));
+    if (!reader->slots) {
+        return -ENOMEM;
+    }
+    for (uint32_t i = 0; i < reader->n_slots; i++) {
+        reader->slots[i].buffer = malloc(reader->frame_size);
+        if (!reader->slots[i].buffer) {
+            return -ENOMEM;
+        }
+    }
+    
+    for (; reader->n_threads < n_threads; reader->n_threads++) {
+        int error = pthread_create(&reader->threads[reader->n_threads], NULL, decoder_thread, reader);
+        if (error != 0) {
+            // Fewer decoders still get the job done
+            return reader->n_threads == 0 ? -error : 0;
+        }
+    }
+    return 0;
+}
+
+int payload_reader_open(const char* path, uint32_t n_threads, PayloadReader** out) {
+    PayloadReader* reader = calloc(1, sizeof(PayloadReader));
+    if (!reader) {
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->slot_ready, NULL);
+    pthread_cond_init(&reader->slot_free, NULL);
+    
+    reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+    int result = reader->fd >= 0 ? 0 : -errno;
+    if (result == 0) {
+        posix_fadvise(reader->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        result = load_index(reader);
+    }
+    if (result < 0) {
+        payload_reader_free(reader);
+        return result;
+    }
+    
+    reader->wanted_threads = n_threads;
+    *out = reader;
+    return 0;
+}
+
+void payload_reader_free(PayloadReader* reader) {
+    if (!reader) {
+        return;
+    }
+    
+    pthread_mutex_lock(&reader->lock);
+    reader->stop = 1;
+    pthread_cond_broadcast(&reader->slot_free);
+    pthread_mutex_unlock(&reader->lock);
+    for (uint32_t i = 0; i < reader->n_threads; i++) {
+        pthread_join(reader->threads[i], NULL);
+    }
+    
+    if (reader->slots) {
+        for (uint32_t i = 0; i < reader->n_slots; i++) {
+            free(reader->slots[i].buffer);
+        }
+    }
+    if (reader->fd >= 0) {
+        close(reader->fd);
+    }
+    pthread_mutex_destroy(&reader->lock);
+    pthread_cond_destroy(&reader->slot_ready);
+    pthread_cond_destroy(&reader->slot_free);
+    free(reader->slots);
+    free(reader->frames);
+    free(reader->starts);
+    free(reader);
+}
+
+uint64_t payload_reader_get_size(PayloadReader* reader) {
+    return reader->total;
+}
+
+uint32_t payload_reader_get_n_frames(PayloadReader* reader) {
+    return reader->n_frames;
+}
+
+uint32_t payload_reader_get_frame_size(PayloadReader* reader) {
+    return reader->frame_size;
+}
+
+ssize_t payload_reader_read(void* data, void* buffer, size_t length) {
+    PayloadReader* reader = data;
+    if (reader->current_frame >= reader->n_frames || length == 0) {
+        return 0;
+    }
+    if (!reader->started) {
+        // Readers that only want single frames never pay for the threads
+        reader->started = 1;
+        reader->start_error = start_decoders(reader, reader->wanted_threads);
+    }
+    if (reader->start_error < 0) {
+        return reader->start_error;
+    }
+    
+    Slot* slot = &reader->slots[reader->current_frame % reader->n_slots];
+    pthread_mutex_lock(&reader->lock);
+    while (slot->state != SLOT_READY || slot->frame != reader->current_frame) {
+        pthread_cond_wait(&reader->slot_ready, &reader->lock);
+    }
+    pthread_mutex_unlock(&reader->lock);
+    if (slot->result < 0) {
+        return slot->result;
+    }
+    
+    size_t left = slot->length - reader->position;
+    size_t chunk = left < length ? left : length;
+    memcpy(buffer, slot->buffer + reader->position, chunk);
+    reader->position += chunk;
+    
+    if (reader->position == slot->length) {
+        pthread_mutex_lock(&reader->lock);
+        slot->state = SLOT_EMPTY;
+        pthread_cond_broadcast(&reader->slot_free);
+        pthread_mutex_unlock(&reader->lock);
+        reader->current_frame++;
+        reader->position = 0;
+    }
+    return (ssize_t)chunk;
+}
+
+uint32_t payload_reader_find_frame(PayloadReader* reader, uint64_t offset) {
+    uint32_t low = 0;
+    uint32_t high = reader->n_frames;
+    
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (reader->starts[middle + 1] <= offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+void payload_reader_get_stats(PayloadReader* reader, PayloadStats* stats) {
+    stats->compressed_bytes = ATOMIC_LOAD(&reader->compressed_bytes);
+    stats->bytes_decoded = ATOMIC_LOAD(&reader->bytes_decoded);
+    stats->busy_ns = ATOMIC_LOAD(&reader->busy_ns);
+    stats->n_threads = reader->n_threads;
+}
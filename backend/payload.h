@@ -0,0 +1,87 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Seekable payload format: the data is cut into frames of a fixed size, each
+// compressed on its own as a complete xz stream, followed by an index of the
+// frames. Any frame can be decompressed without the others, so reading the
+// payload fans out over all cores while the output still comes out in order.
+//
+// Layout, all integers little-endian:
+//   header   "WAVEPAK1", u32 version (1), u32 frame size
+//   frames   one xz stream each
+//   index    per frame: u64 offset in the file, u32 compressed size,
+//            u32 uncompressed size
+//   footer   u64 index offset, u64 frame count, u64 uncompressed size,
+//            u32 CRC-32 of the index, u32 reserved, "WAVEIDX1"
+// Every frame holds exactly frame size bytes of data except the last.
+// Plain C so the install helper can use it without GLib.
+
+#define PAYLOAD_MAGIC "WAVEPAK1"
+#define PAYLOAD_INDEX_MAGIC "WAVEIDX1"
+#define PAYLOAD_VERSION 1
+#define PAYLOAD_HEADER_SIZE 16
+#define PAYLOAD_INDEX_ENTRY_SIZE 16
+#define PAYLOAD_FOOTER_SIZE 40
+#define PAYLOAD_DEFAULT_FRAME_SIZE (4 * 1024 * 1024)
+#define PAYLOAD_MAX_FRAME_SIZE (64 * 1024 * 1024)
+
+// Packing, for the wave-pack tool
+
+// Compresses one frame into out, which must hold payload_frame_bound(length)
+// bytes. Returns 0 or a negative errno value. Safe to call from several
+// threads at once.
+size_t payload_frame_bound(size_t length);
+int payload_encode_frame(const uint8_t* data, size_t length, uint32_t level, uint8_t* out, size_t* out_length);
+
+typedef struct PayloadWriter PayloadWriter;
+
+// Writes the header to fd, which must be empty. Frames are then appended in
+// order and the index is written by payload_writer_finish().
+PayloadWriter* payload_writer_new(int fd, uint32_t frame_size);
+int payload_writer_add_frame(PayloadWriter* writer, const uint8_t* frame, size_t length, size_t uncompressed);
+int payload_writer_finish(PayloadWriter* writer);
+void payload_writer_free(PayloadWriter* writer);
+
+// Reading
+
+typedef struct PayloadReader PayloadReader;
+
+typedef struct {
+    uint64_t compressed_bytes;  // read from the payload file so far
+    uint64_t bytes_decoded;     // produced by the decoder threads
+    uint64_t busy_ns;           // time all decoder threads together spent decoding
+    uint32_t n_threads;
+} PayloadStats;
+
+// Returns 1 when path starts with the payload header, 0 when it does not, or
+// a negative errno value
+int payload_is_seekable(const char* path);
+
+// Opens and checks the index of a payload. The first payload_reader_read()
+// starts n_threads decoder threads (0: one per CPU) that run ahead of it by
+// up to two frames each. Returns 0, -EBADMSG for a damaged payload, or
+// another negative errno value.
+int payload_reader_open(const char* path, uint32_t n_threads, PayloadReader** reader);
+void payload_reader_free(PayloadReader* reader);
+
+uint64_t payload_reader_get_size(PayloadReader* reader);
+uint32_t payload_reader_get_n_frames(PayloadReader* reader);
+uint32_t payload_reader_get_frame_size(PayloadReader* reader);
+
+// Returns the next bytes of the uncompressed payload in order, 0 at the end,
+// or a negative errno value. Takes a void* so it fits ExtractReadFunc.
+ssize_t payload_reader_read(void* reader, void* buffer, size_t length);
+
+// Random access: the frame holding an uncompressed offset, and decoding one
+// frame into out, which must hold the frame size. Safe to call from any
+// thread, independently of payload_reader_read().
+uint32_t payload_reader_find_frame(PayloadReader* reader, uint64_t offset);
+int payload_reader_decode_frame(PayloadReader* reader, uint32_t index, uint8_t* out, size_t* length);
+
+void payload_reader_get_stats(PayloadReader* reader, PayloadStats* stats);
+
+#endif // PAYLOAD_H
@@ -0,0 +1,101 @@
+#define _GNU_SOURCE
+#include "progress.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define ATOMIC_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+
+_Static_assert((PROGRESS_RING_SIZE & (PROGRESS_RING_SIZE - 1)) == 0, "PROGRESS_RING_SIZE must be a power of two");
+_Static_assert(offsetof(ProgressRing, tail) == 64, "the consumer's index needs a cache line of its own");
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+void progress_ring_init(ProgressRing* ring) {
+    memset(ring, 0, offsetof(ProgressRing, events));
+}
+
+// Claims the next free event, or returns NULL when the ring is full
+static ProgressEvent* reserve(ProgressRing* ring) {
+    uint64_t head = ring->head;
+    if (head - ring->cached_tail == PROGRESS_RING_SIZE) {
+        ring->cached_tail = ATOMIC_LOAD(&ring->tail);
+        if (head - ring->cached_tail == PROGRESS_RING_SIZE) {
+            ATOMIC_ADD(&ring->dropped, 1);
+            return NULL;
+        }
+    }
+    return &ring->events[head & (PROGRESS_RING_SIZE - 1)];
+}
+
+// The event's contents become visible to the consumer together with the index
+static void publish(ProgressRing* ring, ProgressEvent* event, ProgressEventKind kind) {
+    event->time_ns = now_ns();
+    event->kind = kind;
+    ATOMIC_STORE(&ring->head, ring->head + 1);
+}
+
+int progress_ring_push(ProgressRing* ring, ProgressEventKind kind, const char* text) {
+    ProgressEvent* event = reserve(ring);
+    if (!event) {
+        return -EAGAIN;
+    }
+    
+    size_t length = strlen(text);
+    if (length >= PROGRESS_TEXT_SIZE) {
+        length = PROGRESS_TEXT_SIZE - 1;
+    }
+    memcpy(event->text, text, length);
+    event->text[length] = '\0';
+    event->length = (uint32_t)length;
+    publish(ring, event, kind);
+    return 0;
+}
+
+int progress_ring_pushf(ProgressRing* ring, ProgressEventKind kind, const char* format, ...) {
+    ProgressEvent* event = reserve(ring);
+    if (!event) {
+        return -EAGAIN;
+    }
+    
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(event->text, PROGRESS_TEXT_SIZE, format, args);
+    va_end(args);
+    event->length = length < 0 ? 0 : length >= PROGRESS_TEXT_SIZE ? PROGRESS_TEXT_SIZE - 1 : (uint32_t)length;
+    if (length < 0) {
+        event->text[0] = '\0';
+    }
+    publish(ring, event, kind);
+    return 0;
+}
+
+int progress_ring_pop(ProgressRing* ring, ProgressEvent* event) {
+    uint64_t tail = ring->tail;
+    if (tail == ring->cached_head) {
+        ring->cached_head = ATOMIC_LOAD(&ring->head);
+        if (tail == ring->cached_head) {
+            return 0;
+        }
+    }
+    
+    const ProgressEvent* slot = &ring->events[tail & (PROGRESS_RING_SIZE - 1)];
+    event->time_ns = slot->time_ns;
+    event->kind = slot->kind;
+    event->length = slot->length;
+    memcpy(event->text, slot->text, slot->length + 1);
+    ATOMIC_STORE(&ring->tail, tail + 1);
+    return 1;
+}
+
+uint64_t progress_ring_get_dropped(ProgressRing* ring) {
+    return ATOMIC_LOAD(&ring->dropped);
+}
@@ -0,0 +1,58 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Single-producer, single-consumer ring that carries stage changes and log
+// lines from an install worker to the UI. Neither side takes a lock or
+// blocks: when the consumer falls behind, new events are dropped and
+// counted rather than slowing the worker down. Byte counters stay with the
+// backends, which keep them as plain atomics. The ring holds no pointers,
+// so it can live in memory shared between processes as well. Plain C so
+// the install helper can use it without GLib.
+
+#define PROGRESS_RING_SIZE 1024     // events; a power of two
+#define PROGRESS_TEXT_SIZE 112
+
+typedef enum {
+    PROGRESS_EVENT_STAGE,   // text names the stage that starts now
+    PROGRESS_EVENT_LOG
+} ProgressEventKind;
+
+typedef struct {
+    uint64_t time_ns;               // CLOCK_MONOTONIC
+    uint32_t kind;                  // ProgressEventKind
+    uint32_t length;
+    char text[PROGRESS_TEXT_SIZE];  // NUL-terminated, truncated if longer
+} ProgressEvent;
+
+// Each side's index sits on a cache line of its own, next to its cached
+// copy of the other side's index, so the two threads only touch each
+// other's line when the cached copy says the ring is full or empty
+typedef struct {
+    uint64_t head;                  // next event the producer writes
+    uint64_t cached_tail;
+    uint64_t dropped;
+    uint8_t producer_padding[40];
+    uint64_t tail;                  // next event the consumer reads
+    uint64_t cached_head;
+    uint8_t consumer_padding[48];
+    ProgressEvent events[PROGRESS_RING_SIZE];
+} ProgressRing;
+
+void progress_ring_init(ProgressRing* ring);
+
+// Producer side. Returns 0, or -EAGAIN when the ring was full and the event
+// was dropped.
+int progress_ring_push(ProgressRing* ring, ProgressEventKind kind, const char* text);
+int progress_ring_pushf(ProgressRing* ring, ProgressEventKind kind, const char* format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+// Consumer side. Returns 1 when an event was taken, 0 when the ring is empty.
+int progress_ring_pop(ProgressRing* ring, ProgressEvent* event);
+
+// Events dropped so far; safe from either side
+uint64_t progress_ring_get_dropped(ProgressRing* ring);
+
+#endif // PROGRESS_H
@@ -0,0 +1,268 @@
+#define _GNU_SOURCE
+#include "sha256.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_SHA_NI 1
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+// Only when the compiler was told the target has the crypto extensions
+// (-march=armv8-a+crypto); the kernel is still asked whether this CPU does
+#include <arm_neon.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#define HAVE_ARMV8_CRYPTO 1
+#endif
+
+static const uint32_t round_constants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static uint32_t load_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void store_be32(uint8_t* p, uint32_t value) {
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+static void compress_portable(uint32_t state[8], const uint8_t* data, size_t n_blocks) {
+    for (; n_blocks > 0; n_blocks--, data += SHA256_BLOCK_SIZE) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = load_be32(data + 4 * i);
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) +
+                          round_constants[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#ifdef HAVE_SHA_NI
+// Each group of four rounds takes its message words from msg[i % 4]; the
+// schedule for group i + 1 is finished (sha256msg2) and the one for group
+// i + 3 started (sha256msg1) while the rounds run
+__attribute__((target("sha,sse4.1,ssse3")))
+static void compress_sha_ni(uint32_t state[8], const uint8_t* data, size_t n_blocks) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    
+    // The instructions want the state as ABEF and CDGH
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+    
+    for (; n_blocks > 0; n_blocks--, data += SHA256_BLOCK_SIZE) {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i msg[4];
+        
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) {
+                msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * i)), byte_swap);
+            }
+            
+            __m128i words = _mm_add_epi32(msg[i & 3], _mm_loadu_si128((const __m128i*)&round_constants[4 * i]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, words);
+            if (i >= 3 && i < 15) {
+                __m128i shifted = _mm_alignr_epi8(msg[i & 3], msg[(i + 3) & 3], 4);
+                msg[(i + 1) & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(msg[(i + 1) & 3], shifted), msg[i & 3]);
+            }
+            words = _mm_shuffle_epi32(words, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, words);
+            if (i >= 1 && i < 13) {
+                msg[(i + 3) & 3] = _mm_sha256msg1_epu32(msg[(i + 3) & 3], msg[i & 3]);
+            }
+        }
+        
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+    
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+    _mm_storeu_si128((__m128i*)&state[0], state0);
+    _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+static int cpu_has_sha_ni(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1) || !(ecx & bit_SSSE3)) {
+        return 0;
+    }
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return (ebx & (1u << 29)) != 0;
+}
+#endif
+
+#ifdef HAVE_ARMV8_CRYPTO
+static void compress_armv8(uint32_t state[8], const uint8_t* data, size_t n_blocks) {
+    uint32x4_t state0 = vld1q_u32(&state[0]);
+    uint32x4_t state1 = vld1q_u32(&state[4]);
+    
+    for (; n_blocks > 0; n_blocks--, data += SHA256_BLOCK_SIZE) {
+        uint32x4_t abcd = state0;
+        uint32x4_t efgh = state1;
+        uint32x4_t msg[4];
+        
+        for (int i = 0; i < 4; i++) {
+            msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+        }
+        
+        for (int i = 0; i < 16; i++) {
+            uint32x4_t words = vaddq_u32(msg[i & 3], vld1q_u32(&round_constants[4 * i]));
+            uint32x4_t previous = state0;
+            if (i < 12) {
+                msg[i & 3] = vsha256su0q_u32(msg[i & 3], msg[(i + 1) & 3]);
+            }
+            state0 = vsha256hq_u32(state0, state1, words);
+            state1 = vsha256h2q_u32(state1, previous, words);
+            if (i < 12) {
+                msg[i & 3] = vsha256su1q_u32(msg[i & 3], msg[(i + 2) & 3], msg[(i + 3) & 3]);
+            }
+        }
+        
+        state0 = vaddq_u32(state0, abcd);
+        state1 = vaddq_u32(state1, efgh);
+    }
+    
+    vst1q_u32(&state[0], state0);
+    vst1q_u32(&state[4], state1);
+}
+#endif
+
+typedef void (*CompressFunc)(uint32_t state[8], const uint8_t* data, size_t n_blocks);
+
+static CompressFunc compress = compress_portable;
+static const char* compress_name = "portable";
+static pthread_once_t compress_once = PTHREAD_ONCE_INIT;
+
+static void select_compress(void) {
+#if defined(HAVE_SHA_NI)
+    if (cpu_has_sha_ni()) {
+        compress = compress_sha_ni;
+        compress_name = "sha-ni";
+    }
+#elif defined(HAVE_ARMV8_CRYPTO)
+    if (getauxval(AT_HWCAP) & HWCAP_SHA2) {
+        compress = compress_armv8;
+        compress_name = "armv8-crypto";
+    }
+#endif
+}
+
+void sha256_init(Sha256Context* context) {
+    static const uint32_t initial_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    
+    pthread_once(&compress_once, select_compress);
+    memcpy(context->state, initial_state, sizeof(initial_state));
+    context->length = 0;
+    context->buffered = 0;
+}
+
+void sha256_update(Sha256Context* context, const void* data, size_t length) {
+    const uint8_t* p = data;
+    context->length += length;
+    
+    if (context->buffered > 0) {
+        size_t take = SHA256_BLOCK_SIZE - context->buffered;
+        if (take > length) {
+            take = length;
+        }
+        memcpy(context->buffer + context->buffered, p, take);
+        context->buffered += take;
+        p += take;
+        length -= take;
+        if (context->buffered < SHA256_BLOCK_SIZE) {
+            return;
+        }
+        compress(context->state, context->buffer, 1);
+        context->buffered = 0;
+    }
+    
+    size_t n_blocks = length / SHA256_BLOCK_SIZE;
+    if (n_blocks > 0) {
+        compress(context->state, p, n_blocks);
+        p += n_blocks * SHA256_BLOCK_SIZE;
+        length -= n_blocks * SHA256_BLOCK_SIZE;
+    }
+    
+    memcpy(context->buffer, p, length);
+    context->buffered = length;
+}
+
+void sha256_final(Sha256Context* context, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint64_t bit_length = context->length * 8;
+    uint8_t padding[SHA256_BLOCK_SIZE * 2] = {0x80};
+    size_t padding_length = (context->buffered < 56 ? 56 : 120) - context->buffered;
+    
+    for (int i = 0; i < 8; i++) {
+        padding[padding_length + i] = (uint8_t)(bit_length >> (56 - 8 * i));
+    }
+    sha256_update(context, padding, padding_length + 8);
+    
+    for (int i = 0; i < 8; i++) {
+        store_be32(digest + 4 * i, context->state[i]);
+    }
+}
+
+void sha256(const void* data, size_t length, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    Sha256Context context;
+    sha256_init(&context);
+    sha256_update(&context, data, length);
+    sha256_final(&context, digest);
+}
+
+const char* sha256_implementation(void) {
+    pthread_once(&compress_once, select_compress);
+    return compress_name;
+}
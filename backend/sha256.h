@@ -0,0 +1,31 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming SHA-256. The compression function uses the x86 SHA extensions
+// or the ARMv8 crypto extensions when the CPU has them (checked once at run
+// time) and portable C otherwise.
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t length;                    // bytes hashed so far
+    uint8_t buffer[SHA256_BLOCK_SIZE];  // partial block
+    size_t buffered;
+} Sha256Context;
+
+void sha256_init(Sha256Context* context);
+void sha256_update(Sha256Context* context, const void* data, size_t length);
+void sha256_final(Sha256Context* context, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+// One-shot helper
+void sha256(const void* data, size_t length, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+// "sha-ni", "armv8-crypto" or "portable"
+const char* sha256_implementation(void);
+
+#endif // SHA256_H
@@ -0,0 +1,468 @@
+#define _GNU_SOURCE
+#include "stages.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_RESOURCES 8     // per stage, inputs and outputs each
+
+typedef struct {
+    Stage stage;            // strings point into names
+    char* names;            // name, title, inputs and outputs, one allocation
+    char* inputs[MAX_RESOURCES];
+    char* outputs[MAX_RESOURCES];
+    uint32_t n_inputs;
+    uint32_t n_outputs;
+    uint32_t* depends;      // indices of the stages producing the inputs
+    uint32_t n_depends;
+    
+    StageState state;
+    int result;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    pthread_t thread;
+    int joinable;
+    struct StageScheduler* scheduler;
+} StageEntry;
+
+struct StageScheduler {
+    StageEntry* entries;
+    uint32_t n_entries;
+    uint32_t capacity;
+    int dry_run;
+    ProgressRing* events;
+    
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // a stage finished, or the run was cancelled
+    int cancelled;
+    uint32_t running;
+    uint32_t max_running;
+    uint64_t run_start_ns;
+    uint64_t elapsed_ns;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+StageScheduler* stage_scheduler_new(int dry_run) {
+    StageScheduler* scheduler = calloc(1, sizeof(StageScheduler));
+    if (!scheduler) {
+        return NULL;
+    }
+    scheduler->dry_run = dry_run;
+    pthread_mutex_init(&scheduler->lock, NULL);
+    
+    // Dry runs wait on the same condition with a deadline
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&scheduler->changed, &attr);
+    pthread_condattr_destroy(&attr);
+    return scheduler;
+}
+
+void stage_scheduler_free(StageScheduler* scheduler) {
+    if (!scheduler) {
+        return;
+    }
+    for (uint32_t i = 0; i < scheduler->n_entries; i++) {
+        free(scheduler->entries[i].names);
+        free(scheduler->entries[i].depends);
+    }
+    free(scheduler->entries);
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_cond_destroy(&scheduler->changed);
+    free(scheduler);
+}
+
+// Splits a copy of a space-separated list in place
+static int split_resources(char* list, char** names, uint32_t* n_names) {
+    char* save = NULL;
+    *n_names = 0;
+    for (char* name = strtok_r(list, " ", &save); name; name = strtok_r(NULL, " ", &save)) {
+        if (*n_names == MAX_RESOURCES) {
+            return -E2BIG;
+        }
+        names[(*n_names)++] = name;
+    }
+    return 0;
+}
+
+int stage_scheduler_add(StageScheduler* scheduler, const Stage* stage) {
+    if (!stage->name || !stage->run) {
+        return -EINVAL;
+    }
+    if (scheduler->n_entries == scheduler->capacity) {
+        uint32_t capacity = scheduler->capacity ? scheduler->capacity * 2 : 8;
+        StageEntry* entries = realloc(scheduler->entries, capacity * sizeof(StageEntry));
+        if (!entries) {
+            return -ENOMEM;
+        }
+        scheduler->entries = entries;
+        scheduler->capacity = capacity;
+    }
+    
+    const char* strings[4] = { stage->name, stage->title ? stage->title : stage->name,
+                               stage->inputs ? stage->inputs : "", stage->outputs ? stage->outputs : "" };
+    size_t lengths[4];
+    size_t total = 0;
+    for (int i = 0; i < 4; i++) {
+        lengths[i] = strlen(strings[i]) + 1;
+        total += lengths[i];
+    }
+    char* names = malloc(total);
+    if (!names) {
+        return -ENOMEM;
+    }
+    char* copies[4];
+    char* next = names;
+    for (int i = 0; i < 4; i++) {
+        copies[i] = memcpy(next, strings[i], lengths[i]);
+        next += lengths[i];
+    }
+    
+    StageEntry* entry = &scheduler->entries[scheduler->n_entries];
+    memset(entry, 0, sizeof(*entry));
+    entry->stage = *stage;
+    entry->stage.name = copies[0];
+    entry->stage.title = copies[1];
+    entry->names = names;
+    entry->scheduler = scheduler;
+    if (split_resources(copies[2], entry->inputs, &entry->n_inputs) < 0 ||
+        split_resources(copies[3], entry->outputs, &entry->n_outputs) < 0) {
+        free(names);
+        return -E2BIG;
+    }
+    // Only the split lists are kept
+    entry->stage.inputs = NULL;
+    entry->stage.outputs = NULL;
+    scheduler->n_entries++;
+    return 0;
+}
+
+void stage_scheduler_set_events(StageScheduler* scheduler, ProgressRing* events) {
+    scheduler->events = events;
+}
+
+static int find_producer(StageScheduler* scheduler, const char* resource, uint32_t* index) {
+    int found = 0;
+    for (uint32_t i = 0; i < scheduler->n_entries; i++) {
+        StageEntry* entry = &scheduler->entries[i];
+        for (uint32_t j = 0; j < entry->n_outputs; j++) {
+            if (strcmp(entry->outputs[j], resource) == 0) {
+                *index = i;
+                found++;
+            }
+        }
+    }
+    return found;
+}
+
+// Turns the resources into edges and rejects plans that cannot run
+static int resolve_plan(StageScheduler* scheduler) {
+    for (uint32_t i = 0; i < scheduler->n_entries; i++) {
+        StageEntry* entry = &scheduler->entries[i];
+        free(entry->depends);
+        entry->depends = entry->n_inputs ? malloc(entry->n_inputs * sizeof(uint32_t)) : NULL;
+        entry->n_depends = 0;
+        if (entry->n_inputs && !entry->depends) {
+            return -ENOMEM;
+        }
+        for (uint32_t j = 0; j < entry->n_outputs; j++) {
+            uint32_t producer;
+            if (find_producer(scheduler, entry->outputs[j], &producer) != 1) {
+                return -EINVAL;
+            }
+        }
+        for (uint32_t j = 0; j < entry->n_inputs; j++) {
+            uint32_t producer;
+            if (find_producer(scheduler, entry->inputs[j], &producer) != 1) {
+                return -EINVAL;
+            }
+            entry->depends[entry->n_depends++] = producer;
+        }
+    }
+    
+    // Kahn's algorithm: whatever is never freed of its dependencies is in a cycle
+    uint32_t n = scheduler->n_entries;
+    uint32_t* remaining = calloc(n ? n : 1, sizeof(uint32_t));
+    uint32_t* queue = malloc((n ? n : 1) * sizeof(uint32_t));
+    if (!remaining || !queue) {
+        free(remaining);
+        free(queue);
+        return -ENOMEM;
+    }
+    uint32_t queued = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        remaining[i] = scheduler->entries[i].n_depends;
+        if (remaining[i] == 0) {
+            queue[queued++] = i;
+        }
+    }
+    for (uint32_t head = 0; head < queued; head++) {
+        for (uint32_t i = 0; i < n; i++) {
+            StageEntry* entry = &scheduler->entries[i];
+            for (uint32_t j = 0; j < entry->n_depends; j++) {
+                if (entry->depends[j] == queue[head] && --remaining[i] == 0) {
+                    queue[queued++] = i;
+                }
+            }
+        }
+    }
+    free(remaining);
+    free(queue);
+    return queued == n ? 0 : -ELOOP;
+}
+
+// Called with the lock held
+static int stub_run(StageEntry* entry) {
+    StageScheduler* scheduler = entry->scheduler;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    uint64_t nanoseconds = (uint64_t)deadline.tv_nsec + (uint64_t)entry->stage.dry_run_ms * 1000000u;
+    deadline.tv_sec += (time_t)(nanoseconds / 1000000000u);
+    deadline.tv_nsec = (long)(nanoseconds % 1000000000u);
+    while (!scheduler->cancelled) {
+        if (pthread_cond_timedwait(&scheduler->changed, &scheduler->lock, &deadline) == ETIMEDOUT) {
+            return 0;
+        }
+    }
+    return -ECANCELED;
+}
+
+static void* stage_thread(void* data) {
+    StageEntry* entry = data;
+    StageScheduler* scheduler = entry->scheduler;
+    int result;
+    if (scheduler->dry_run) {
+        pthread_mutex_lock(&scheduler->lock);
+        result = stub_run(entry);
+    } else {
+        result = entry->stage.run(entry->stage.user_data);
+        pthread_mutex_lock(&scheduler->lock);
+    }
+    
+    entry->result = result;
+    if (result == 0) {
+        entry->state = STAGE_DONE;
+    } else {
+        entry->state = result == -ECANCELED && scheduler->cancelled ? STAGE_SKIPPED : STAGE_FAILED;
+    }
+    entry->end_ns = now_ns() - scheduler->run_start_ns;
+    scheduler->running--;
+    pthread_cond_broadcast(&scheduler->changed);
+    pthread_mutex_unlock(&scheduler->lock);
+    return NULL;
+}
+
+// Called with the lock held. Stage cancel functions only set flags, so
+// calling them under the lock cannot deadlock.
+static void cancel_locked(StageScheduler* scheduler) {
+    if (scheduler->cancelled) {
+        return;
+    }
+    scheduler->cancelled = 1;
+    for (uint32_t i = 0; i < scheduler->n_entries; i++) {
+        StageEntry* entry = &scheduler->entries[i];
+        if (entry->state == STAGE_RUNNING && entry->stage.cancel && !scheduler->dry_run) {
+            entry->stage.cancel(entry->stage.user_data);
+        }
+    }
+    pthread_cond_broadcast(&scheduler->changed);
+}
+
+void stage_scheduler_cancel(StageScheduler* scheduler) {
+    pthread_mutex_lock(&scheduler->lock);
+    cancel_locked(scheduler);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+// 1 when every dependency is done, 0 while one is still to come, -1 when
+// one failed or was skipped
+static int dependencies_state(StageScheduler* scheduler, const StageEntry* entry) {
+    int ready = 1;
+    for (uint32_t i = 0; i < entry->n_depends; i++) {
+        StageState state = scheduler->entries[entry->depends[i]].state;
+        if (state == STAGE_FAILED || state == STAGE_SKIPPED) {
+            return -1;
+        }
+        if (state != STAGE_DONE) {
+            ready = 0;
+        }
+    }
+    return ready;
+}
+
+// The titles of the running stages, for the stage line of the UI. Called
+// with the lock held.
+static void push_running_titles(StageScheduler* scheduler) {
+    char text[PROGRESS_TEXT_SIZE];
+    size_t length = 0;
+    text[0] = '\0';
+    for (uint32_t i = 0; i < scheduler->n_entries; i++) {
+        StageEntry* entry = &scheduler->entries[i];
+        if (entry->state == STAGE_RUNNING && length < sizeof(text)) {
+            int written = snprintf(text + length, sizeof(text) - length, "%s%s", length ? ", " : "",
+                                   entry->stage.title);
+            length += written > 0 ? (size_t)written : 0;
+        }
+    }
+    if (length) {
+        progress_ring_push(scheduler->events, PROGRESS_EVENT_STAGE, text);
+    }
+}
+
+static void log_finished(StageScheduler* scheduler, const StageEntry* entry) {
+    double seconds = (entry->end_ns - entry->start_ns) / 1e9;
+    if (entry->state == STAGE_DONE) {
+        progress_ring_pushf(scheduler->events, PROGRESS_EVENT_LOG, "%s done in %.2f s", entry->stage.name, seconds);
+    } else {
+        progress_ring_pushf(scheduler->events, PROGRESS_EVENT_LOG, "%s failed after %.2f s: %s", entry->stage.name,
+                            seconds, strerror(-entry->result));
+    }
+}
+
+int stage_scheduler_run(StageScheduler* scheduler) {
+    int result = resolve_plan(scheduler);
+    if (result < 0) {
+        return result;
+    }
+    
+    // A cancel that came before the run is kept, so nothing starts
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->running = 0;
+    scheduler->max_running = 0;
+    scheduler->run_start_ns = now_ns();
+    for (uint32_t i = 0; i < scheduler->n_entries; i++) {
+        StageEntry* entry = &scheduler->entries[i];
+        entry->state = STAGE_PENDING;
+        entry->result = 0;
+        entry->start_ns = 0;
+        entry->end_ns = 0;
+        entry->joinable = 0;
+    }
+    
+    uint32_t* reported = calloc(scheduler->n_entries ? scheduler->n_entries : 1, sizeof(uint32_t));
+    int first_error = reported ? 0 : -ENOMEM;
+    for (;;) {
+        // Report what finished since the last pass; the first failure cancels the rest
+        for (uint32_t i = 0; reported && i < scheduler->n_entries; i++) {
+            StageEntry* entry = &scheduler->entries[i];
+            if ((entry->state == STAGE_DONE || entry->state == STAGE_FAILED) && !reported[i]) {
+                reported[i] = 1;
+                if (scheduler->events) {
+                    log_finished(scheduler, entry);
+                }
+                if (entry->state == STAGE_FAILED && first_error == 0) {
+                    first_error = entry->result;
+                    cancel_locked(scheduler);
+                }
+            }
+        }
+        if (first_error && !scheduler->cancelled) {
+            cancel_locked(scheduler);
+        }
+        
+        int started = 0;
+        for (uint32_t i = 0; i < scheduler->n_entries; i++) {
+            StageEntry* entry = &scheduler->entries[i];
+            if (entry->state != STAGE_PENDING) {
+                continue;
+            }
+            int ready = scheduler->cancelled ? -1 : dependencies_state(scheduler, entry);
+            if (ready < 0) {
+                entry->state = STAGE_SKIPPED;
+                entry->result = -ECANCELED;
+            } else if (ready) {
+                entry->state = STAGE_RUNNING;
+                entry->start_ns = now_ns() - scheduler->run_start_ns;
+                int error = pthread_create(&entry->thread, NULL, stage_thread, entry);
+                if (error != 0) {
+                    entry->state = STAGE_FAILED;
+                    entry->result = -error;
+                    entry->end_ns = entry->start_ns;
+                    continue;
+                }
+                entry->joinable = 1;
+                scheduler->running++;
+                if (scheduler->running > scheduler->max_running) {
+                    scheduler->max_running = scheduler->running;
+                }
+                started = 1;
+            }
+        }
+        if (started && scheduler->events) {
+            push_running_titles(scheduler);
+        }
+        
+        int pending = 0;
+        for (uint32_t i = 0; i < scheduler->n_entries; i++) {
+            StageState state = scheduler->entries[i].state;
+            pending |= state == STAGE_PENDING || ((state == STAGE_DONE || state == STAGE_FAILED) &&
+                                                  reported && !reported[i]);
+        }
+        if (scheduler->running == 0 && !pending) {
+            break;
+        }
+        if (scheduler->running > 0 && !started) {
+            pthread_cond_wait(&scheduler->changed, &scheduler->lock);
+        }
+    }
+    scheduler->elapsed_ns = now_ns() - scheduler->run_start_ns;
+    int cancelled = scheduler->cancelled;
+    pthread_mutex_unlock(&scheduler->lock);
+    
+    for (uint32_t i = 0; i < scheduler->n_entries; i++) {
+        if (scheduler->entries[i].joinable) {
+            pthread_join(scheduler->entries[i].thread, NULL);
+        }
+    }
+    free(reported);
+    if (first_error) {
+        return first_error;
+    }
+    return cancelled ? -ECANCELED : 0;
+}
+
+void stage_scheduler_get_timing(StageScheduler* scheduler, uint32_t index, StageTiming* timing) {
+    memset(timing, 0, sizeof(*timing));
+    if (index >= scheduler->n_entries) {
+        return;
+    }
+    const StageEntry* entry = &scheduler->entries[index];
+    timing->name = entry->stage.name;
+    timing->state = entry->state;
+    timing->result = entry->result;
+    timing->start_ns = entry->start_ns;
+    timing->end_ns = entry->end_ns;
+}
+
+void stage_scheduler_get_stats(StageScheduler* scheduler, StageStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->elapsed_ns = scheduler->elapsed_ns;
+    stats->n_stages = scheduler->n_entries;
+    stats->max_running = scheduler->max_running;
+    for (uint32_t i = 0; i < scheduler->n_entries; i++) {
+        const StageEntry* entry = &scheduler->entries[i];
+        if (entry->end_ns > entry->start_ns) {
+            stats->busy_ns += entry->end_ns - entry->start_ns;
+        }
+    }
+}
+
+const char* stage_state_name(StageState state) {
+    switch (state) {
+    case STAGE_PENDING: return "pending";
+    case STAGE_RUNNING: return "running";
+    case STAGE_DONE: return "done";
+    case STAGE_FAILED: return "failed";
+    case STAGE_SKIPPED: return "skipped";
+    }
+    return "unknown";
+}
@@ -0,0 +1,84 @@
+#ifndef STAGES_H
+#define STAGES_H
+
+#include <stdint.h>
+#include "progress.h"
+
+// Runs the stages of an install as a dependency graph. Each stage names the
+// resources it needs and the ones it produces ("root-files", "config"...);
+// a stage starts on a thread of its own as soon as every stage producing
+// its inputs has finished, so independent work overlaps instead of waiting
+// its turn. The first failure cancels the stages still running and skips
+// the rest. A dry run replaces every stage with a stub that only waits, so a
+// plan can be checked and timed without touching a disk. Plain C so the
+// install helper can use it without GLib.
+
+typedef int (*StageRunFunc)(void* user_data);
+typedef void (*StageCancelFunc)(void* user_data);
+
+typedef struct {
+    const char* name;       // unique; used for timings and the log
+    const char* title;      // shown while the stage runs
+    const char* inputs;     // space-separated resources it needs; NULL for none
+    const char* outputs;    // space-separated resources it produces; NULL for none
+    StageRunFunc run;       // returns 0 or a negative errno value
+    StageCancelFunc cancel; // asks run() to return early; may be NULL; must not block
+    void* user_data;
+    uint32_t dry_run_ms;    // how long the stub takes in a dry run
+} Stage;
+
+typedef enum {
+    STAGE_PENDING,
+    STAGE_RUNNING,
+    STAGE_DONE,
+    STAGE_FAILED,
+    STAGE_SKIPPED           // cancelled, or something it depends on failed
+} StageState;
+
+typedef struct {
+    const char* name;
+    StageState state;
+    int result;
+    uint64_t start_ns;      // since the start of the run
+    uint64_t end_ns;
+} StageTiming;
+
+typedef struct {
+    uint64_t elapsed_ns;    // of the whole run
+    uint64_t busy_ns;       // sum over the stages; busy / elapsed is the overlap achieved
+    uint32_t n_stages;
+    uint32_t max_running;   // most stages that ran at the same time
+} StageStats;
+
+typedef struct StageScheduler StageScheduler;
+
+StageScheduler* stage_scheduler_new(int dry_run);
+void stage_scheduler_free(StageScheduler* scheduler);
+
+// Copies the stage, strings included. Returns 0 or -ENOMEM.
+int stage_scheduler_add(StageScheduler* scheduler, const Stage* stage);
+
+// Stage changes and a line per finished stage go to events. They are pushed
+// by the thread that calls stage_scheduler_run(), which must be the ring's
+// only producer while it runs.
+void stage_scheduler_set_events(StageScheduler* scheduler, ProgressRing* events);
+
+// Runs every stage and blocks until all have finished or been skipped.
+// Returns 0, the result of the first stage that failed, -ECANCELED after
+// stage_scheduler_cancel(), -EINVAL when an input has no producer or a
+// resource more than one, or -ELOOP when the stages depend on each other in
+// a cycle. Nothing runs when the plan itself is wrong.
+int stage_scheduler_run(StageScheduler* scheduler);
+
+// Safe from any thread, before or while stage_scheduler_run() runs. The
+// scheduler stays cancelled: a run that starts afterwards skips every stage
+// and returns -ECANCELED.
+void stage_scheduler_cancel(StageScheduler* scheduler);
+
+// Once stage_scheduler_run() has returned; stages in the order they were added
+void stage_scheduler_get_timing(StageScheduler* scheduler, uint32_t index, StageTiming* timing);
+void stage_scheduler_get_stats(StageScheduler* scheduler, StageStats* stats);
+
+const char* stage_state_name(StageState state);
+
+#endif // STAGES_H
@@ -0,0 +1,275 @@
+#define _GNU_SOURCE
+#include "sysconfig.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define MAX_FILES 6
+#define FILE_TEXT_SIZE 512
+
+typedef struct {
+    const char* path;           // below the root, without a leading slash
+    int is_link;                // text is the symlink target
+    char text[FILE_TEXT_SIZE];
+} ConfigFile;
+
+struct SystemConfigStages {
+    SystemConfig config;
+    char* root;
+    ConfigFile files[MAX_FILES];
+    uint32_t n_files;           // set by render-config, read by install-config after it
+};
+
+// Letters, digits and the punctuation locale, zone and XKB names use
+static int is_safe_value(const char* value) {
+    for (const char* c = value; *c; c++) {
+        if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') ||
+              strchr("._-+@/", *c))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int copy_field(char* field, const char* value) {
+    if (!value) {
+        field[0] = '\0';
+        return 0;
+    }
+    if (strlen(value) >= SYSTEM_CONFIG_FIELD_SIZE || !is_safe_value(value)) {
+        return -EINVAL;
+    }
+    strcpy(field, value);
+    return 0;
+}
+
+int system_config_set(SystemConfig* config, const char* locale, const char* timezone,
+                      const char* keyboard_layout, const char* keyboard_variant) {
+    memset(config, 0, sizeof(*config));
+    if (copy_field(config->locale, locale) < 0 || copy_field(config->timezone, timezone) < 0 ||
+        copy_field(config->keyboard_layout, keyboard_layout) < 0 ||
+        copy_field(config->keyboard_variant, keyboard_variant) < 0) {
+        memset(config, 0, sizeof(*config));
+        return -EINVAL;
+    }
+    // Only the zone name may have slashes, and only inside the zoneinfo tree
+    if (strchr(config->locale, '/') || strchr(config->keyboard_layout, '/') ||
+        strchr(config->keyboard_variant, '/') || config->timezone[0] == '/' || strstr(config->timezone, "..")) {
+        memset(config, 0, sizeof(*config));
+        return -EINVAL;
+    }
+    return 0;
+}
+
+int system_config_is_empty(const SystemConfig* config) {
+    return !config->locale[0] && !config->timezone[0] && !config->keyboard_layout[0];
+}
+
+static ConfigFile* add_file(SystemConfigStages* stages, const char* path, int is_link) {
+    ConfigFile* file = &stages->files[stages->n_files++];
+    file->path = path;
+    file->is_link = is_link;
+    file->text[0] = '\0';
+    return file;
+}
+
+// render-config: everything that does not need the target
+static int render_config(void* data) {
+    SystemConfigStages* stages = data;
+    const SystemConfig* config = &stages->config;
+    stages->n_files = 0;
+    
+    if (config->locale[0]) {
+        ConfigFile* file = add_file(stages, "etc/locale.conf", 0);
+        snprintf(file->text, sizeof(file->text), "LANG=%s\n", config->locale);
+    }
+    if (config->keyboard_layout[0]) {
+        // The console keymap names follow XKB for most layouts, and systemd
+        // converts the XKB settings for the rest
+        ConfigFile* file = add_file(stages, "etc/vconsole.conf", 0);
+        snprintf(file->text, sizeof(file->text), "KEYMAP=%s%s%s\nXKBLAYOUT=%s\nXKBVARIANT=%s\n",
+                 config->keyboard_layout, config->keyboard_variant[0] ? "-" : "", config->keyboard_variant,
+                 config->keyboard_layout, config->keyboard_variant);
+        file = add_file(stages, "etc/X11/xorg.conf.d/00-keyboard.conf", 0);
+        snprintf(file->text, sizeof(file->text),
+                 "Section \"InputClass\"\n"
+                 "        Identifier \"system-keyboard\"\n"
+                 "        MatchIsKeyboard \"on\"\n"
+                 "        Option \"XkbLayout\" \"%s\"\n"
+                 "%s%s%s"
+                 "EndSection\n",
+                 config->keyboard_layout, config->keyboard_variant[0] ? "        Option \"XkbVariant\" \"" : "",
+                 config->keyboard_variant, config->keyboard_variant[0] ? "\"\n" : "");
+    }
+    if (config->timezone[0]) {
+        ConfigFile* file = add_file(stages, "etc/localtime", 1);
+        snprintf(file->text, sizeof(file->text), "../usr/share/zoneinfo/%s", config->timezone);
+        file = add_file(stages, "etc/timezone", 0);
+        snprintf(file->text, sizeof(file->text), "%s\n", config->timezone);
+    }
+    return 0;
+}
+
+// Symlinks in the target resolve inside it, as they will once it boots
+static int open_in_root(int root_fd, const char* path, int flags, mode_t mode) {
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = (uint64_t)(flags | O_CLOEXEC);
+    how.mode = (flags & O_CREAT) ? mode : 0;
+    how.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+    long fd;
+    do {
+        fd = syscall(SYS_openat2, root_fd, path, &how, sizeof(how));
+    } while (fd < 0 && (errno == EAGAIN || errno == EINTR));
+    if (fd < 0 && errno == ENOSYS) {
+        fd = openat(root_fd, path, flags | O_CLOEXEC, mode);
+    }
+    return fd >= 0 ? (int)fd : -errno;
+}
+
+// Opens the directory a file goes into, creating what is missing of it
+static int open_parent(int root_fd, const char* path, const char** name) {
+    int dir_fd = dup(root_fd);
+    if (dir_fd < 0) {
+        return -errno;
+    }
+    const char* start = path;
+    for (const char* slash = strchr(start, '/'); slash; slash = strchr(start, '/')) {
+        char component[FILE_TEXT_SIZE];
+        snprintf(component, sizeof(component), "%.*s", (int)(slash - start), start);
+        if (mkdirat(dir_fd, component, 0755) != 0 && errno != EEXIST) {
+            int result = -errno;
+            close(dir_fd);
+            return result;
+        }
+        int next = open_in_root(dir_fd, component, O_PATH | O_DIRECTORY, 0);
+        close(dir_fd);
+        if (next < 0) {
+            return next;
+        }
+        dir_fd = next;
+        start = slash + 1;
+    }
+    *name = start;
+    return dir_fd;
+}
+
+// Replaces the file in one rename, so a crash leaves the old one or the new one
+static int install_file(int root_fd, const ConfigFile* file) {
+    const char* name = file->path;
+    int dir_fd = open_parent(root_fd, file->path, &name);
+    if (dir_fd < 0) {
+        return dir_fd;
+    }
+    char temporary[FILE_TEXT_SIZE];
+    snprintf(temporary, sizeof(temporary), ".%s.wave-new", name);
+    unlinkat(dir_fd, temporary, 0);
+    
+    int result = 0;
+    if (file->is_link) {
+        if (symlinkat(file->text, dir_fd, temporary) != 0) {
+            result = -errno;
+        }
+    } else {
+        int fd = openat(dir_fd, temporary, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            result = -errno;
+        } else {
+            size_t length = strlen(file->text);
+            ssize_t written = write(fd, file->text, length);
+            if (written < 0 || fsync(fd) != 0) {
+                result = -errno;
+            } else if ((size_t)written != length) {
+                result = -EIO;
+            }
+            close(fd);
+        }
+    }
+    if (result == 0 && renameat(dir_fd, temporary, dir_fd, name) != 0) {
+        result = -errno;
+    }
+    if (result < 0) {
+        unlinkat(dir_fd, temporary, 0);
+    } else {
+        // The rename itself has to reach the disk too
+        int sync_fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (sync_fd >= 0) {
+            fsync(sync_fd);
+            close(sync_fd);
+        }
+    }
+    close(dir_fd);
+    return result;
+}
+
+// install-config: runs once the root filesystem is filled
+static int install_config(void* data) {
+    SystemConfigStages* stages = data;
+    int root_fd = open(stages->root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0) {
+        return -errno;
+    }
+    int result = 0;
+    for (uint32_t i = 0; i < stages->n_files && result == 0; i++) {
+        result = install_file(root_fd, &stages->files[i]);
+    }
+    close(root_fd);
+    return result;
+}
+
+int system_config_add_stages(StageScheduler* scheduler, const SystemConfig* config, const char* root,
+                             const char* root_resource, SystemConfigStages** stages) {
+    *stages = calloc(1, sizeof(SystemConfigStages));
+    if (!*stages) {
+        return -ENOMEM;
+    }
+    (*stages)->config = *config;
+    (*stages)->root = strdup(root);
+    char inputs[FILE_TEXT_SIZE];
+    if (!(*stages)->root || snprintf(inputs, sizeof(inputs), "config %s", root_resource) >= (int)sizeof(inputs)) {
+        system_config_stages_free(*stages);
+        *stages = NULL;
+        return -ENOMEM;
+    }
+    
+    Stage render = { 0 };
+    render.name = "render-config";
+    render.title = "Preparing the system settings";
+    render.outputs = "config";
+    render.run = render_config;
+    render.user_data = *stages;
+    render.dry_run_ms = 20;
+    
+    Stage install = { 0 };
+    install.name = "install-config";
+    install.title = "Applying the system settings";
+    install.inputs = inputs;
+    install.outputs = "configured-root";
+    install.run = install_config;
+    install.user_data = *stages;
+    install.dry_run_ms = 50;
+    
+    int result = stage_scheduler_add(scheduler, &render);
+    if (result == 0) {
+        result = stage_scheduler_add(scheduler, &install);
+    }
+    if (result < 0) {
+        system_config_stages_free(*stages);
+        *stages = NULL;
+    }
+    return result;
+}
+
+void system_config_stages_free(SystemConfigStages* stages) {
+    if (!stages) {
+        return;
+    }
+    free(stages->root);
+    free(stages);
+}
@@ -0,0 +1,42 @@
+#ifndef SYSCONFIG_H
+#define SYSCONFIG_H
+
+#include "stages.h"
+
+// The settings chosen in the installer, written into the installed system:
+// /etc/locale.conf, /etc/vconsole.conf, the X11 keyboard configuration and
+// /etc/localtime. The files are rendered in memory first, which needs
+// nothing from the target, and written once the root filesystem is in
+// place; as two stages they overlap with the copy instead of following it.
+// Plain C so the install helper can use it without GLib.
+
+#define SYSTEM_CONFIG_FIELD_SIZE 64
+
+// Fixed buffers, so the settings can travel in a helper command. An empty
+// field leaves that part of the configuration alone.
+typedef struct {
+    char locale[SYSTEM_CONFIG_FIELD_SIZE];              // "de_DE.UTF-8"
+    char timezone[SYSTEM_CONFIG_FIELD_SIZE];            // "Europe/Berlin"
+    char keyboard_layout[SYSTEM_CONFIG_FIELD_SIZE];     // XKB names: "de"
+    char keyboard_variant[SYSTEM_CONFIG_FIELD_SIZE];    // "nodeadkeys", or ""
+} SystemConfig;
+
+// Copies the settings, any of which may be NULL. Returns 0, or -EINVAL
+// when one is too long or could not be written into a configuration file
+// safely (quotes, newlines, or a time zone that leaves the zoneinfo tree).
+int system_config_set(SystemConfig* config, const char* locale, const char* timezone,
+                      const char* keyboard_layout, const char* keyboard_variant);
+
+int system_config_is_empty(const SystemConfig* config);
+
+typedef struct SystemConfigStages SystemConfigStages;
+
+// Adds "render-config", which produces "config" and needs nothing, and
+// "install-config", which writes it below root once root_resource, the
+// resource of the stage that fills the root filesystem, is ready and
+// produces "configured-root". config is copied.
+int system_config_add_stages(StageScheduler* scheduler, const SystemConfig* config, const char* root,
+                             const char* root_resource, SystemConfigStages** stages);
+void system_config_stages_free(SystemConfigStages* stages);
+
+#endif // SYSCONFIG_H
@@ -0,0 +1,130 @@
+#define _GNU_SOURCE
+#include "zeroblock.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+// Bytes checked per loop iteration by the vector versions; anything left
+// over goes through the scalar loop
+#define CHUNK_SIZE 128
+
+static int is_zero_scalar(const uint8_t* p, size_t length) {
+    while (length > 0 && ((uintptr_t)p & (sizeof(uint64_t) - 1))) {
+        if (*p) {
+            return 0;
+        }
+        p++;
+        length--;
+    }
+    
+    for (; length >= 4 * sizeof(uint64_t); p += 4 * sizeof(uint64_t), length -= 4 * sizeof(uint64_t)) {
+        uint64_t words[4];
+        memcpy(words, p, sizeof(words));
+        if (words[0] | words[1] | words[2] | words[3]) {
+            return 0;
+        }
+    }
+    
+    for (; length > 0; p++, length--) {
+        if (*p) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#ifdef HAVE_X86_SIMD
+// SSE2 is part of x86-64, so this one needs no run-time check there
+__attribute__((target("sse2")))
+static int is_zero_sse2(const uint8_t* p, size_t length) {
+    const __m128i zero = _mm_setzero_si128();
+    
+    for (; length >= CHUNK_SIZE; p += CHUNK_SIZE, length -= CHUNK_SIZE) {
+        const __m128i* v = (const __m128i*)p;
+        __m128i acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(v), _mm_loadu_si128(v + 1)),
+                                   _mm_or_si128(_mm_loadu_si128(v + 2), _mm_loadu_si128(v + 3)));
+        acc = _mm_or_si128(acc, _mm_or_si128(_mm_or_si128(_mm_loadu_si128(v + 4), _mm_loadu_si128(v + 5)),
+                                             _mm_or_si128(_mm_loadu_si128(v + 6), _mm_loadu_si128(v + 7))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF) {
+            return 0;
+        }
+    }
+    return is_zero_scalar(p, length);
+}
+
+__attribute__((target("avx2")))
+static int is_zero_avx2(const uint8_t* p, size_t length) {
+    for (; length >= CHUNK_SIZE; p += CHUNK_SIZE, length -= CHUNK_SIZE) {
+        const __m256i* v = (const __m256i*)p;
+        __m256i acc = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(v), _mm256_loadu_si256(v + 1)),
+                                      _mm256_or_si256(_mm256_loadu_si256(v + 2), _mm256_loadu_si256(v + 3)));
+        if (!_mm256_testz_si256(acc, acc)) {
+            return 0;
+        }
+    }
+    return is_zero_scalar(p, length);
+}
+#endif
+
+#ifdef HAVE_NEON
+static int is_zero_neon(const uint8_t* p, size_t length) {
+    for (; length >= CHUNK_SIZE; p += CHUNK_SIZE, length -= CHUNK_SIZE) {
+        uint8x16_t acc = vorrq_u8(vorrq_u8(vld1q_u8(p), vld1q_u8(p + 16)),
+                                  vorrq_u8(vld1q_u8(p + 32), vld1q_u8(p + 48)));
+        acc = vorrq_u8(acc, vorrq_u8(vorrq_u8(vld1q_u8(p + 64), vld1q_u8(p + 80)),
+                                     vorrq_u8(vld1q_u8(p + 96), vld1q_u8(p + 112))));
+        if (vmaxvq_u8(acc) != 0) {
+            return 0;
+        }
+    }
+    return is_zero_scalar(p, length);
+}
+#endif
+
+typedef int (*ZeroCheckFunc)(const uint8_t* p, size_t length);
+
+static ZeroCheckFunc zero_check = is_zero_scalar;
+static const char* zero_check_name = "scalar";
+static pthread_once_t zero_check_once = PTHREAD_ONCE_INIT;
+
+static void select_zero_check(void) {
+#if defined(HAVE_X86_SIMD)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        zero_check = is_zero_avx2;
+        zero_check_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        zero_check = is_zero_sse2;
+        zero_check_name = "sse2";
+    }
+#elif defined(HAVE_NEON)
+    zero_check = is_zero_neon;
+    zero_check_name = "neon";
+#endif
+}
+
+int buffer_is_zero(const void* data, size_t length) {
+    const uint8_t* p = data;
+    
+    // Most data blocks fail on their first bytes, before any set-up cost
+    size_t head = length < 16 ? length : 16;
+    if (!is_zero_scalar(p, head)) {
+        return 0;
+    }
+    
+    pthread_once(&zero_check_once, select_zero_check);
+    return zero_check(p + head, length - head);
+}
+
+const char* buffer_is_zero_implementation(void) {
+    pthread_once(&zero_check_once, select_zero_check);
+    return zero_check_name;
+}
@@ -0,0 +1,14 @@
+#ifndef ZEROBLOCK_H
+#define ZEROBLOCK_H
+
+#include <stddef.h>
+
+// Returns 1 when every byte of the buffer is zero. Uses AVX2 or SSE2 on x86
+// (picked at run time), NEON on 64-bit ARM and a word-at-a-time loop
+// elsewhere. Data blocks are usually rejected within the first 64 bytes.
+int buffer_is_zero(const void* data, size_t length);
+
+// "avx2", "sse2", "neon" or "scalar"
+const char* buffer_is_zero_implementation(void);
+
+#endif // ZEROBLOCK_H
@@ -1,20 +1,54 @@
 #include "installer.h"
+#include "trace.h"
 #include <stdio.h>
 
-void apply_custom_css(void) {
-    GtkCssProvider* provider = gtk_css_provider_new();
-    GError* error = NULL;
-    
-    // Load CSS from external file
-    const char* css_file_path = "/home/l/WaveInstaller/style.css";
-    
-    gtk_css_provider_load_from_path(provider, css_file_path);
-    
+// Stylesheets are compiled into the binary (see wave-installer.gresource.xml)
+#define CSS_RESOURCE_PREFIX "/org/waveinstaller/installer/style"
+
+static void add_css_provider(GtkCssProvider* provider) {
     gtk_style_context_add_provider_for_display(
         gdk_display_get_default(),
         GTK_STYLE_PROVIDER(provider),
         GTK_STYLE_PROVIDER_PRIORITY_APPLICATION
     );
+}
+
+void apply_custom_css(void) {
+    TRACE_BEGIN("apply_custom_css");
+    GtkCssProvider* provider = gtk_css_provider_new();
+    gint64 start = g_get_monotonic_time();
+    
+    // WAVE_INSTALLER_CSS loads a complete stylesheet from disk instead of the
+    // embedded base sheet, which is handy while editing styles
+    const char* css_file_path = g_getenv("WAVE_INSTALLER_CSS");
+    if (css_file_path) {
+        gtk_css_provider_load_from_path(provider, css_file_path);
+    } else {
+        gtk_css_provider_load_from_resource(provider, CSS_RESOURCE_PREFIX "/base.css");
+    }
     
+    add_css_provider(provider);
     g_object_unref(provider);
+    
+    g_debug("Loaded %s stylesheet in %.2f ms", css_file_path ? css_file_path : "embedded",
+            (g_get_monotonic_time() - start) / 1000.0);
+    TRACE_END("apply_custom_css");
+}
+
+void apply_page_css(const char* page_name) {
+    // An external stylesheet already covers every page
+    if (g_getenv("WAVE_INSTALLER_CSS")) {
+        return;
+    }
+    
+    char* resource_path = g_strdup_printf(CSS_RESOURCE_PREFIX "/%s.css", page_name);
+    
+    if (g_resources_get_info(resource_path, G_RESOURCE_LOOKUP_FLAGS_NONE, NULL, NULL, NULL)) {
+        GtkCssProvider* provider = gtk_css_provider_new();
+        gtk_css_provider_load_from_resource(provider, resource_path);
+        add_css_provider(provider);
+        g_object_unref(provider);
+    }
+    
+    g_free(resource_path);
 }
@@ -0,0 +1,747 @@
+// wave-install-helper: does the privileged part of an install, writing an
+// image to a disk or unpacking a payload into the target filesystem, so the
+// installer UI can run as an ordinary user.
+//
+//   wave-install-helper -s
+//   wave-install-helper [-n] [-j journal] [-c checksums] -i image target
+//   wave-install-helper [-n] [-j journal] [-T threads] [-l locale] [-z zone] [-k layout[:variant]]
+//                       [-m manifest [-d reflink|hardlink|none]] -p payload root
+//
+// -s serves one client on standard input, which must be a SOCK_SEQPACKET
+// socket (see backend/helper.h); the installer starts it that way through
+// pkexec. The other forms run a single install and report on stderr, for
+// scripted installs. Either way the install runs on a thread of its own,
+// so the helper keeps answering commands and updating the status even while
+// that thread is stuck in the kernel.
+//
+// An install is a set of stages (backend/stages.h): a payload is unpacked
+// while the settings given with -l, -z and -k are rendered, and those are
+// written into the root once it is filled. -n runs the stages as stubs that
+// only wait, opens nothing, and prints how they were scheduled.
+//
+// With -j, finished work is recorded in a journal (backend/journal.h). A run
+// that is interrupted can be started again with the same arguments and
+// skips what the journal shows to be on the target already; the journal is
+// removed once a run succeeds.
+//
+// With -m, the payload's manifest (backend/manifest.h) tells which files
+// have the same content, and only the first of them is written; the others
+// are reflinked to it where the filesystem allows, or with -d hardlink made
+// hard links to it where their metadata is the same.
+
+#define _GNU_SOURCE
+#include "../backend/helper.h"
+#include "../backend/journal.h"
+#include "../backend/payload.h"
+#include "../backend/stages.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// How often the status in shared memory is refreshed while a run is going
+#define STATUS_INTERVAL_MS 50
+
+typedef struct {
+    HelperShared* shared;
+    HelperState state;
+    HelperCommand command;      // of the current or last run
+    ImageWriter* writer;
+    Extractor* extractor;
+    PayloadReader* payload;
+    StageScheduler* scheduler;
+    SystemConfigStages* config_stages;
+    pthread_t thread;
+    int running;                // the run thread has not been joined yet
+    int done_fd;                // eventfd the run thread signals when it returns
+    
+    // Written by the run thread before it signals done_fd
+    int result;
+    uint64_t error_offset;
+    int has_digest;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+} Helper;
+
+static volatile sig_atomic_t interrupted = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: wave-install-helper -s\n"
+                    "       wave-install-helper [-n] [-j journal] [-P profile] [-c checksums] -i image target\n"
+                    "       wave-install-helper [-n] [-j journal] [-P profile] [-T threads] [-l locale] [-z zone]\n"
+                    "                           [-k layout[:variant]] [-m manifest [-d reflink|hardlink|none]]\n"
+                    "                           -p payload root\n");
+    exit(2);
+}
+
+static void on_interrupt(int signal_number) {
+    (void)signal_number;
+    interrupted = 1;
+}
+
+static void publish_status(Helper* helper) {
+    HelperStatus status = { 0 };
+    status.state = helper->state;
+    status.job = helper->command.job;
+    status.result = helper->state == HELPER_STATE_FINISHED ? helper->result : 0;
+    status.eta_seconds = -1;
+    
+    if (helper->writer) {
+        ImageWriterStats stats;
+        image_writer_get_stats(helper->writer, &stats);
+        status.bytes_total = stats.bytes_total;
+        status.bytes_done = stats.bytes_done;
+        status.elapsed_ns = stats.elapsed_ns;
+        status.bytes_per_second = stats.bytes_per_second;
+        status.eta_seconds = stats.eta_seconds;
+        status.hash_bytes_per_second = stats.hash_bytes_per_second;
+        if (stats.verifying) {
+            status.phase = HELPER_PHASE_VERIFYING;
+        } else if (!stats.finished && stats.bytes_total > 0 && stats.bytes_done == stats.bytes_total) {
+            status.phase = HELPER_PHASE_SYNCING;
+        }
+    } else if (helper->extractor) {
+        ExtractStats stats;
+        extractor_get_stats(helper->extractor, &stats);
+        status.bytes_total = stats.archive_bytes;
+        status.bytes_done = stats.archive_done;
+        status.elapsed_ns = stats.elapsed_ns;
+        status.bytes_per_second = stats.bytes_per_second;
+        status.eta_seconds = stats.eta_seconds;
+        status.phase = stats.syncing && !stats.finished ? HELPER_PHASE_SYNCING : HELPER_PHASE_COPYING;
+    }
+    status.updated_ns = now_ns();
+    helper_shared_set_status(helper->shared, &status);
+}
+
+// Stage bodies. They run on threads of the scheduler and leave the event
+// ring to the run thread, its only producer.
+
+static int write_image(void* data) {
+    Helper* helper = data;
+    return image_writer_run(helper->writer);
+}
+
+static void cancel_write(void* data) {
+    Helper* helper = data;
+    image_writer_cancel(helper->writer);
+}
+
+static int extract_payload(void* data) {
+    Helper* helper = data;
+    return extractor_run(helper->extractor);
+}
+
+static void cancel_extract(void* data) {
+    Helper* helper = data;
+    extractor_cancel(helper->extractor);
+}
+
+static void log_journal(Helper* helper, uint64_t bytes_resumed, uint64_t commits, uint64_t journal_ns,
+                        uint64_t elapsed_ns) {
+    if (!helper->command.journal_path[0]) {
+        return;
+    }
+    progress_ring_pushf(&helper->shared->events, PROGRESS_EVENT_LOG,
+                        "Journal: %llu bytes resumed, %llu commits taking %.1f%% of the run",
+                        (unsigned long long)bytes_resumed, (unsigned long long)commits,
+                        elapsed_ns ? journal_ns * 100.0 / elapsed_ns : 0.0);
+}
+
+static void log_profile(Helper* helper, const IoProfile* profile, const char* choice) {
+    if (profile->io_class == IO_CLASS_NONE) {
+        progress_ring_pushf(&helper->shared->events, PROGRESS_EVENT_LOG, "I/O profile: untuned, %s", choice);
+        return;
+    }
+    const char* disk = profile->disk[0] ? profile->disk : "forced";
+    if (profile->serial_iops == 0 && profile->parallel_iops == 0) {
+        // Without a probe the choice is only the default for the class sysfs claims
+        progress_ring_pushf(&helper->shared->events, PROGRESS_EVENT_LOG,
+                            "I/O profile: %s %s default, not probed%s%s, %s", disk, io_class_name(profile->io_class),
+                            profile->probe_error ? ": " : "",
+                            profile->probe_error ? strerror(-profile->probe_error) : "", choice);
+        return;
+    }
+    progress_ring_pushf(&helper->shared->events, PROGRESS_EVENT_LOG,
+                        "I/O profile: %s %s, %.0f/%.0f random reads/s serial/parallel, %s",
+                        disk, io_class_name(profile->io_class), profile->serial_iops, profile->parallel_iops, choice);
+}
+
+static void log_image_result(Helper* helper) {
+    ProgressRing* events = &helper->shared->events;
+    ImageWriterStats stats;
+    image_writer_get_stats(helper->writer, &stats);
+    progress_ring_pushf(events, PROGRESS_EVENT_LOG, "%llu bytes written in %.1f s (%.1f MB/s, %s%s)",
+                        (unsigned long long)stats.bytes_written, stats.elapsed_ns / 1e9,
+                        stats.bytes_per_second / 1e6, image_writer_engine_name(stats.engine),
+                        stats.direct ? ", O_DIRECT" : "");
+    if (stats.tuned) {
+        char choice[64];
+        snprintf(choice, sizeof(choice), "%u KiB blocks, %u in flight", stats.profile.block_size / 1024,
+                 stats.profile.queue_depth);
+        log_profile(helper, &stats.profile, choice);
+    }
+    log_journal(helper, stats.bytes_resumed, stats.journal_commits, stats.journal_ns, stats.elapsed_ns);
+    
+    helper->error_offset = image_writer_get_error_offset(helper->writer);
+    helper->has_digest = image_writer_get_image_digest(helper->writer, helper->digest) == 0;
+    if (helper->has_digest) {
+        char hex[SHA256_DIGEST_SIZE * 2 + 1];
+        for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+            snprintf(hex + i * 2, 3, "%02x", helper->digest[i]);
+        }
+        progress_ring_pushf(events, PROGRESS_EVENT_LOG, "Image digest %.16s...", hex);
+    }
+}
+
+static void log_extract_result(Helper* helper) {
+    ExtractStats stats;
+    extractor_get_stats(helper->extractor, &stats);
+    progress_ring_pushf(&helper->shared->events, PROGRESS_EVENT_LOG, "%llu entries, %llu files in %.1f s (%.1f MB/s)",
+                        (unsigned long long)stats.entries, (unsigned long long)stats.files,
+                        stats.elapsed_ns / 1e9, stats.bytes_per_second / 1e6);
+    if (stats.tuned) {
+        char choice[64];
+        snprintf(choice, sizeof(choice), "%u writers, %llu MiB read ahead", stats.profile.n_writers,
+                 (unsigned long long)(stats.profile.read_ahead >> 20));
+        log_profile(helper, &stats.profile, choice);
+    }
+    if (stats.files_resumed > 0) {
+        progress_ring_pushf(&helper->shared->events, PROGRESS_EVENT_LOG, "%llu files already in place",
+                            (unsigned long long)stats.files_resumed);
+    }
+    if (stats.files_deduplicated > 0) {
+        // What writing the copies would have cost at the rate of this run
+        double seconds = stats.bytes_written ? stats.bytes_deduplicated * (stats.elapsed_ns / 1e9) /
+                                               stats.bytes_written : 0.0;
+        progress_ring_pushf(&helper->shared->events, PROGRESS_EVENT_LOG,
+                            "%llu copies deduplicated: %llu bytes not written, about %.1f s saved",
+                            (unsigned long long)stats.files_deduplicated,
+                            (unsigned long long)stats.bytes_deduplicated, seconds);
+    }
+    log_journal(helper, stats.bytes_resumed, stats.journal_commits, stats.journal_ns, stats.elapsed_ns);
+}
+
+static void* run_thread(void* data) {
+    Helper* helper = data;
+    ProgressRing* events = &helper->shared->events;
+    progress_ring_pushf(events, PROGRESS_EVENT_LOG, "%s %s %s %s%s",
+                        helper->command.job == HELPER_JOB_IMAGE ? "Writing" : "Unpacking", helper->command.source,
+                        helper->command.job == HELPER_JOB_IMAGE ? "to" : "into", helper->command.target,
+                        helper->command.dry_run ? " (dry run)" : "");
+    helper->result = stage_scheduler_run(helper->scheduler);
+    if (helper->result == 0 && helper->command.journal_path[0] && !helper->command.dry_run) {
+        journal_remove(helper->command.journal_path);
+    }
+    
+    if (helper->writer) {
+        log_image_result(helper);
+    } else if (helper->extractor) {
+        log_extract_result(helper);
+    }
+    StageStats stats;
+    stage_scheduler_get_stats(helper->scheduler, &stats);
+    progress_ring_pushf(events, PROGRESS_EVENT_LOG, "%u stages in %.2f s, %.2f s of work, up to %u at once",
+                        stats.n_stages, stats.elapsed_ns / 1e9, stats.busy_ns / 1e9, stats.max_running);
+    
+    uint64_t one = 1;
+    if (write(helper->done_fd, &one, sizeof(one)) != sizeof(one)) {
+        // Cannot happen with an eventfd that is only ever read back to zero
+        abort();
+    }
+    return NULL;
+}
+
+// The stages of a run. The estimates only set the pace of a dry run.
+static int plan_run(Helper* helper) {
+    const HelperCommand* command = &helper->command;
+    helper->scheduler = stage_scheduler_new((int)command->dry_run);
+    if (!helper->scheduler) {
+        return -ENOMEM;
+    }
+    stage_scheduler_set_events(helper->scheduler, &helper->shared->events);
+    
+    Stage stage = { 0 };
+    stage.user_data = helper;
+    if (command->job == HELPER_JOB_IMAGE) {
+        stage.name = "write-image";
+        stage.title = "Writing the system image";
+        stage.outputs = "disk";
+        stage.run = write_image;
+        stage.cancel = cancel_write;
+        stage.dry_run_ms = 2000;
+        return stage_scheduler_add(helper->scheduler, &stage);
+    }
+    
+    stage.name = "unpack";
+    stage.title = "Unpacking the system";
+    stage.outputs = "root-files";
+    stage.run = extract_payload;
+    stage.cancel = cancel_extract;
+    stage.dry_run_ms = 2000;
+    int result = stage_scheduler_add(helper->scheduler, &stage);
+    if (result == 0 && !system_config_is_empty(&command->config)) {
+        result = system_config_add_stages(helper->scheduler, &command->config, command->target, "root-files",
+                                          &helper->config_stages);
+    }
+    return result;
+}
+
+// Frees what the last run left behind
+static void clear_run(Helper* helper) {
+    image_writer_free(helper->writer);
+    extractor_free(helper->extractor);
+    payload_reader_free(helper->payload);
+    stage_scheduler_free(helper->scheduler);
+    system_config_stages_free(helper->config_stages);
+    helper->writer = NULL;
+    helper->extractor = NULL;
+    helper->payload = NULL;
+    helper->scheduler = NULL;
+    helper->config_stages = NULL;
+}
+
+static int start_run(Helper* helper, const HelperCommand* command) {
+    if (helper->running) {
+        return -EBUSY;
+    }
+    clear_run(helper);
+    
+    // Paths arrive as fixed buffers; a missing terminator is a client bug
+    helper->command = *command;
+    HelperCommand* own = &helper->command;
+    if (!memchr(own->source, '\0', HELPER_PATH_SIZE) || !memchr(own->target, '\0', HELPER_PATH_SIZE) ||
+        !memchr(own->checksum_path, '\0', HELPER_PATH_SIZE) || !memchr(own->journal_path, '\0', HELPER_PATH_SIZE) ||
+        !memchr(own->manifest_path, '\0', HELPER_PATH_SIZE) || !own->source[0] || !own->target[0]) {
+        return -EINVAL;
+    }
+    SystemConfig config;
+    if (system_config_set(&config, own->config.locale, own->config.timezone, own->config.keyboard_layout,
+                          own->config.keyboard_variant) < 0 || memcmp(&config, &own->config, sizeof(config)) != 0) {
+        return -EINVAL;
+    }
+    
+    // A dry run opens nothing
+    if (own->dry_run) {
+        if (own->job != HELPER_JOB_IMAGE && own->job != HELPER_JOB_PAYLOAD) {
+            return -EINVAL;
+        }
+    } else if (own->job == HELPER_JOB_IMAGE) {
+        own->writer_options.checksum_path = own->checksum_path[0] ? own->checksum_path : NULL;
+        own->writer_options.journal_path = own->journal_path[0] ? own->journal_path : NULL;
+        helper->writer = image_writer_new(own->source, own->target, &own->writer_options);
+        if (!helper->writer) {
+            return -ENOMEM;
+        }
+    } else if (own->job == HELPER_JOB_PAYLOAD) {
+        own->extract_options.journal_path = own->journal_path[0] ? own->journal_path : NULL;
+        own->extract_options.manifest_path = own->manifest_path[0] ? own->manifest_path : NULL;
+        int seekable = payload_is_seekable(own->source);
+        if (seekable < 0) {
+            return seekable;
+        }
+        if (seekable) {
+            int result = payload_reader_open(own->source, own->payload_threads, &helper->payload);
+            if (result < 0) {
+                return result;
+            }
+            helper->extractor = extractor_new_from_reader(payload_reader_read, helper->payload,
+                                                          payload_reader_get_size(helper->payload),
+                                                          own->target, &own->extract_options);
+        } else {
+            helper->extractor = extractor_new(own->source, own->target, &own->extract_options);
+        }
+        if (!helper->extractor) {
+            return -ENOMEM;
+        }
+    } else {
+        return -EINVAL;
+    }
+    int result = plan_run(helper);
+    if (result < 0) {
+        return result;
+    }
+    
+    helper->result = 0;
+    helper->error_offset = 0;
+    helper->has_digest = 0;
+    result = pthread_create(&helper->thread, NULL, run_thread, helper);
+    if (result != 0) {
+        return -result;
+    }
+    helper->running = 1;
+    helper->state = HELPER_STATE_RUNNING;
+    publish_status(helper);
+    return 0;
+}
+
+static int set_paused(Helper* helper, int paused) {
+    if (!helper->running) {
+        return -EINVAL;
+    }
+    if (helper->writer) {
+        image_writer_set_paused(helper->writer, paused);
+    } else if (helper->extractor) {
+        extractor_set_paused(helper->extractor, paused);
+    }
+    helper->state = paused ? HELPER_STATE_PAUSED : HELPER_STATE_RUNNING;
+    publish_status(helper);
+    return 0;
+}
+
+static int cancel_run(Helper* helper) {
+    if (!helper->running) {
+        return -EINVAL;
+    }
+    stage_scheduler_cancel(helper->scheduler);
+    return 0;
+}
+
+// Joins the run thread once it has signalled that it is done
+static void finish_run(Helper* helper) {
+    uint64_t count;
+    if (read(helper->done_fd, &count, sizeof(count)) != sizeof(count)) {
+        return;
+    }
+    pthread_join(helper->thread, NULL);
+    helper->running = 0;
+    helper->state = HELPER_STATE_FINISHED;
+    publish_status(helper);
+}
+
+static int send_message(int fd, const HelperMessage* message) {
+    ssize_t length;
+    do {
+        length = send(fd, message, sizeof(*message), MSG_NOSIGNAL);
+    } while (length < 0 && errno == EINTR);
+    return length == sizeof(*message) ? 0 : -errno;
+}
+
+static int send_hello(int fd, int memfd) {
+    HelperMessage message = { 0 };
+    message.type = HELPER_MESSAGE_HELLO;
+    struct iovec iov = { &message, sizeof(message) };
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = { 0 };
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    
+    struct cmsghdr* header = CMSG_FIRSTHDR(&msg);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &memfd, sizeof(int));
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(message) ? 0 : -errno;
+}
+
+static void handle_command(Helper* helper, int fd, const HelperCommand* command) {
+    HelperMessage reply = { 0 };
+    reply.type = HELPER_MESSAGE_REPLY;
+    reply.command = command->command;
+    
+    switch (command->command) {
+    case HELPER_COMMAND_START: reply.result = start_run(helper, command); break;
+    case HELPER_COMMAND_PAUSE: reply.result = set_paused(helper, 1); break;
+    case HELPER_COMMAND_RESUME: reply.result = set_paused(helper, 0); break;
+    case HELPER_COMMAND_CANCEL: reply.result = cancel_run(helper); break;
+    case HELPER_COMMAND_QUERY: reply.result = 0; break;
+    default: reply.result = -EOPNOTSUPP; break;
+    }
+    reply.state = helper->state;
+    send_message(fd, &reply);
+}
+
+static void send_finished(Helper* helper, int fd) {
+    HelperMessage message = { 0 };
+    message.type = HELPER_MESSAGE_FINISHED;
+    message.command = HELPER_COMMAND_START;
+    message.result = helper->result;
+    message.state = helper->state;
+    message.error_offset = helper->error_offset;
+    message.has_digest = (uint32_t)helper->has_digest;
+    memcpy(message.digest, helper->digest, sizeof(message.digest));
+    const char* path = helper->extractor ? extractor_get_error_path(helper->extractor) : NULL;
+    if (path) {
+        snprintf(message.error_path, sizeof(message.error_path), "%s", path);
+    }
+    send_message(fd, &message);
+}
+
+static void helper_clear(Helper* helper) {
+    if (helper->running) {
+        cancel_run(helper);
+        pthread_join(helper->thread, NULL);
+    }
+    clear_run(helper);
+    close(helper->done_fd);
+}
+
+// Answers commands on fd until the client closes it. A client that goes
+// away cancels the run, since nobody is left to report to.
+static int serve(int fd) {
+    int type;
+    socklen_t type_length = sizeof(type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &type_length) != 0 || type != SOCK_SEQPACKET) {
+        fprintf(stderr, "wave-install-helper: standard input is not a SOCK_SEQPACKET socket\n");
+        return 1;
+    }
+    
+    // Sealed, so the client cannot shrink it under the helper
+    int memfd = memfd_create("wave-install-helper", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0 || ftruncate(memfd, sizeof(HelperShared)) != 0 ||
+        fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        fprintf(stderr, "wave-install-helper: shared memory: %s\n", strerror(errno));
+        return 1;
+    }
+    HelperShared* shared = mmap(NULL, sizeof(HelperShared), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "wave-install-helper: shared memory: %s\n", strerror(errno));
+        return 1;
+    }
+    helper_shared_init(shared);
+    
+    Helper helper = { 0 };
+    helper.shared = shared;
+    helper.done_fd = eventfd(0, EFD_CLOEXEC);
+    int result = helper.done_fd < 0 ? -errno : send_hello(fd, memfd);
+    close(memfd);
+    if (result < 0) {
+        fprintf(stderr, "wave-install-helper: %s\n", strerror(-result));
+        return 1;
+    }
+    
+    for (;;) {
+        struct pollfd fds[2] = {
+            { fd, POLLIN, 0 },
+            { helper.done_fd, POLLIN, 0 }
+        };
+        int ready = poll(fds, 2, helper.running ? STATUS_INTERVAL_MS : -1);
+        if (ready < 0 && errno != EINTR) {
+            break;
+        }
+        if (helper.running) {
+            publish_status(&helper);
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        
+        if (fds[1].revents & POLLIN) {
+            finish_run(&helper);
+            send_finished(&helper, fd);
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            HelperCommand command;
+            ssize_t length = recv(fd, &command, sizeof(command), 0);
+            if (length == 0 || (length < 0 && errno != EINTR && errno != EAGAIN)) {
+                break;
+            }
+            if (length == sizeof(command)) {
+                handle_command(&helper, fd, &command);
+            } else if (length > 0) {
+                HelperMessage reply = { 0 };
+                reply.type = HELPER_MESSAGE_REPLY;
+                reply.result = -EPROTO;
+                reply.state = helper.state;
+                send_message(fd, &reply);
+            }
+        }
+    }
+    
+    helper_clear(&helper);
+    munmap(shared, sizeof(HelperShared));
+    return 0;
+}
+
+static void print_schedule(StageScheduler* scheduler) {
+    StageStats stats;
+    stage_scheduler_get_stats(scheduler, &stats);
+    fprintf(stderr, "%-16s %-8s %8s %8s %8s\n", "stage", "state", "start", "end", "seconds");
+    for (uint32_t i = 0; i < stats.n_stages; i++) {
+        StageTiming timing;
+        stage_scheduler_get_timing(scheduler, i, &timing);
+        fprintf(stderr, "%-16s %-8s %8.3f %8.3f %8.3f\n", timing.name, stage_state_name(timing.state),
+                timing.start_ns / 1e9, timing.end_ns / 1e9, (timing.end_ns - timing.start_ns) / 1e9);
+    }
+    fprintf(stderr, "%.3f s in all, %.3f s if the stages ran one after another\n", stats.elapsed_ns / 1e9,
+            stats.busy_ns / 1e9);
+}
+
+// Runs one install and prints its progress, log and schedule on stderr
+static int run_once(const HelperCommand* command) {
+    HelperShared* shared = malloc(sizeof(HelperShared));
+    if (!shared) {
+        fprintf(stderr, "wave-install-helper: %s\n", strerror(ENOMEM));
+        return 1;
+    }
+    helper_shared_init(shared);
+    
+    struct sigaction action = { 0 };
+    action.sa_handler = on_interrupt;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    
+    Helper helper = { 0 };
+    helper.shared = shared;
+    helper.done_fd = eventfd(0, EFD_CLOEXEC);
+    int result = helper.done_fd < 0 ? -errno : start_run(&helper, command);
+    if (result < 0) {
+        fprintf(stderr, "wave-install-helper: %s: %s\n", command->source,
+                result == -EBADMSG ? "the frame index is damaged" : strerror(-result));
+        free(shared);
+        return 1;
+    }
+    
+    int tty = isatty(STDERR_FILENO);
+    uint64_t last_report = 0;
+    while (helper.running) {
+        struct pollfd done = { helper.done_fd, POLLIN, 0 };
+        if (poll(&done, 1, STATUS_INTERVAL_MS) > 0) {
+            finish_run(&helper);
+        }
+        if (interrupted && helper.running) {
+            cancel_run(&helper);
+            interrupted = 0;
+        }
+        
+        ProgressEvent event;
+        while (progress_ring_pop(&shared->events, &event)) {
+            fprintf(stderr, "%s%s%s\n", tty ? "\r\033[K" : "", event.kind == PROGRESS_EVENT_STAGE ? "== " : "",
+                    event.text);
+        }
+        if (helper.running && tty && now_ns() - last_report >= 1000000000u / 4) {
+            publish_status(&helper);
+            const HelperStatus* status = &shared->status;
+            fprintf(stderr, "\r\033[K%3d%%  %.1f MB/s", status->bytes_total
+                    ? (int)(status->bytes_done * 100 / status->bytes_total) : 0, status->bytes_per_second / 1e6);
+            last_report = now_ns();
+        }
+    }
+    
+    print_schedule(helper.scheduler);
+    result = helper.result;
+    if (result < 0) {
+        const char* path = helper.extractor ? extractor_get_error_path(helper.extractor) : NULL;
+        fprintf(stderr, "wave-install-helper: %s%s%s: %s\n", command->source, path ? " member " : "",
+                path ? path : "", result == -EBADMSG ? "damaged or does not match its checksums"
+                                                     : strerror(-result));
+    }
+    helper_clear(&helper);
+    free(shared);
+    return result < 0;
+}
+
+int main(int argc, char** argv) {
+    const char* image = NULL;
+    const char* payload = NULL;
+    const char* checksums = NULL;
+    const char* journal = NULL;
+    const char* manifest = NULL;
+    const char* dedup = NULL;
+    const char* profile = NULL;
+    const char* locale = NULL;
+    const char* timezone = NULL;
+    char* layout = NULL;
+    uint32_t n_threads = 0;
+    int serving = 0;
+    int dry_run = 0;
+    
+    int option;
+    while ((option = getopt(argc, argv, "c:d:i:j:k:l:m:np:P:sT:z:h")) != -1) {
+        switch (option) {
+        case 'c': checksums = optarg; break;
+        case 'd': dedup = optarg; break;
+        case 'i': image = optarg; break;
+        case 'j': journal = optarg; break;
+        case 'k': layout = optarg; break;
+        case 'l': locale = optarg; break;
+        case 'm': manifest = optarg; break;
+        case 'n': dry_run = 1; break;
+        case 'p': payload = optarg; break;
+        case 'P': profile = optarg; break;
+        case 's': serving = 1; break;
+        case 'T': n_threads = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'z': timezone = optarg; break;
+        default: usage();
+        }
+    }
+    
+    if (serving) {
+        if (image || payload || optind < argc) {
+            usage();
+        }
+        return serve(STDIN_FILENO);
+    }
+    if (!image == !payload || optind + 1 != argc || (image && (locale || timezone || layout || manifest)) ||
+        (dedup && !manifest)) {
+        usage();
+    }
+    
+    HelperCommand command;
+    helper_command_init(&command, HELPER_COMMAND_START);
+    command.job = image ? HELPER_JOB_IMAGE : HELPER_JOB_PAYLOAD;
+    command.payload_threads = n_threads;
+    command.dry_run = (uint32_t)dry_run;
+    if (dedup) {
+        if (strcmp(dedup, "reflink") == 0) {
+            command.extract_options.dedup = EXTRACT_DEDUP_REFLINK;
+        } else if (strcmp(dedup, "hardlink") == 0) {
+            command.extract_options.dedup = EXTRACT_DEDUP_HARDLINK;
+        } else if (strcmp(dedup, "none") == 0) {
+            command.extract_options.dedup = EXTRACT_DEDUP_NONE;
+        } else {
+            usage();
+        }
+    }
+    if (profile) {
+        int io_class = io_class_from_name(profile);
+        if (io_class < 0) {
+            usage();
+        }
+        command.writer_options.io_class = (IoClass)io_class;
+        command.extract_options.io_class = (IoClass)io_class;
+    }
+    char* variant = layout ? strchr(layout, ':') : NULL;
+    if (variant) {
+        *variant++ = '\0';
+    }
+    if (system_config_set(&command.config, locale, timezone, layout, variant) < 0) {
+        fprintf(stderr, "wave-install-helper: the locale, time zone or keyboard layout is not valid\n");
+        return 1;
+    }
+    const char* paths[5] = {
+        image ? image : payload, argv[optind], checksums ? checksums : "", journal ? journal : "",
+        manifest ? manifest : ""
+    };
+    char* fields[5] = {
+        command.source, command.target, command.checksum_path, command.journal_path, command.manifest_path
+    };
+    for (int i = 0; i < 5; i++) {
+        if (strlen(paths[i]) >= HELPER_PATH_SIZE) {
+            fprintf(stderr, "wave-install-helper: %s: %s\n", paths[i], strerror(ENAMETOOLONG));
+            return 1;
+        }
+        strcpy(fields[i], paths[i]);
+    }
+    return run_once(&command);
+}
@@ -0,0 +1,96 @@
+#include "index-model.h"
+
+struct _WaveIndexItem {
+    GObject parent_instance;
+    guint index;
+};
+
+G_DEFINE_TYPE(WaveIndexItem, wave_index_item, G_TYPE_OBJECT)
+
+static void wave_index_item_class_init(WaveIndexItemClass* klass) {
+}
+
+static void wave_index_item_init(WaveIndexItem* item) {
+}
+
+guint wave_index_item_get_index(WaveIndexItem* item) {
+    return item->index;
+}
+
+struct _WaveIndexModel {
+    GObject parent_instance;
+    guint n_items;
+    GPtrArray* items;   // n_items slots, filled the first time a row is asked for
+};
+
+static void wave_index_model_list_model_init(GListModelInterface* iface);
+
+G_DEFINE_TYPE_WITH_CODE(WaveIndexModel, wave_index_model, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(G_TYPE_LIST_MODEL, wave_index_model_list_model_init))
+
+static GType wave_index_model_get_item_type(GListModel* list) {
+    return WAVE_TYPE_INDEX_ITEM;
+}
+
+static guint wave_index_model_get_n_items(GListModel* list) {
+    return WAVE_INDEX_MODEL(list)->n_items;
+}
+
+static gpointer wave_index_model_get_item(GListModel* list, guint position) {
+    WaveIndexModel* model = WAVE_INDEX_MODEL(list);
+    if (position >= model->n_items) {
+        return NULL;
+    }
+    
+    // Scrolling back and forth and every filter change ask for the same rows again
+    WaveIndexItem* item = g_ptr_array_index(model->items, position);
+    if (!item) {
+        item = g_object_new(WAVE_TYPE_INDEX_ITEM, NULL);
+        item->index = position;
+        g_ptr_array_index(model->items, position) = item;
+    }
+    return g_object_ref(item);
+}
+
+static void wave_index_model_list_model_init(GListModelInterface* iface) {
+    iface->get_item_type = wave_index_model_get_item_type;
+    iface->get_n_items = wave_index_model_get_n_items;
+    iface->get_item = wave_index_model_get_item;
+}
+
+// Slots for rows that were never asked for are still NULL
+static void free_item(gpointer item) {
+    if (item) {
+        g_object_unref(item);
+    }
+}
+
+static void wave_index_model_finalize(GObject* object) {
+    g_ptr_array_unref(WAVE_INDEX_MODEL(object)->items);
+    G_OBJECT_CLASS(wave_index_model_parent_class)->finalize(object);
+}
+
+static void wave_index_model_class_init(WaveIndexModelClass* klass) {
+    G_OBJECT_CLASS(klass)->finalize = wave_index_model_finalize;
+}
+
+static void wave_index_model_init(WaveIndexModel* model) {
+    model->items = g_ptr_array_new_with_free_func(free_item);
+}
+
+WaveIndexModel* wave_index_model_new(guint n_items) {
+    WaveIndexModel* model = g_object_new(WAVE_TYPE_INDEX_MODEL, NULL);
+    model->n_items = n_items;
+    g_ptr_array_set_size(model->items, n_items);
+    return model;
+}
+
+void wave_index_model_set_n_items(WaveIndexModel* model, guint n_items) {
+    guint removed = model->n_items;
+    model->n_items = n_items;
+    // A row number now points at different data, so every row needs a new
+    // item; the list view keeps and does not re-bind items it already has
+    g_ptr_array_set_size(model->items, 0);
+    g_ptr_array_set_size(model->items, n_items);
+    g_list_model_items_changed(G_LIST_MODEL(model), 0, removed, n_items);
+}
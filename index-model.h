@@ -0,0 +1,24 @@
+#ifndef INDEX_MODEL_H
+#define INDEX_MODEL_H
+
+#include <gio/gio.h>
+
+// GListModel whose items are just row numbers into a table owned by the
+// caller (locales, time zones, keyboard layouts). Items are created the
+// first time a row is asked for and then kept until the rows are replaced,
+// so no per-row objects exist for rows that have never been shown.
+#define WAVE_TYPE_INDEX_ITEM (wave_index_item_get_type())
+G_DECLARE_FINAL_TYPE(WaveIndexItem, wave_index_item, WAVE, INDEX_ITEM, GObject)
+
+#define WAVE_TYPE_INDEX_MODEL (wave_index_model_get_type())
+G_DECLARE_FINAL_TYPE(WaveIndexModel, wave_index_model, WAVE, INDEX_MODEL, GObject)
+
+guint wave_index_item_get_index(WaveIndexItem* item);
+
+WaveIndexModel* wave_index_model_new(guint n_items);
+
+// Replaces every row, e.g. after the backing table has been reloaded. All
+// items are made anew, so list views bind every visible row again.
+void wave_index_model_set_n_items(WaveIndexModel* model, guint n_items);
+
+#endif // INDEX_MODEL_H
@@ -0,0 +1,911 @@
+#include "install.h"
+#include "backend/helper.h"
+#include "backend/iotune.h"
+#include "backend/journal.h"
+#include "backend/manifest.h"
+#include "backend/payload.h"
+#include "backend/progress.h"
+#include "backend/stages.h"
+#include "trace.h"
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#define DEFAULT_IMAGE_PATH "/run/wave/wave-os.img"
+#define DEFAULT_ROOT_PATH "/mnt/wave"
+#define JOURNAL_NAME ".wave-install-journal"
+
+#ifndef WAVE_HELPER_PATH
+#define WAVE_HELPER_PATH "/usr/local/libexec/wave-install-helper"
+#endif
+
+// Used to estimate the space a payload takes once unpacked
+#define INODE_SIZE 256
+#define JOURNAL_SIZE (128 * 1024 * 1024)
+#define RESERVED_PERCENT 5
+
+// Owned by the main thread; kept after the run so its final stats stay
+// readable. At most one of them is set.
+static ImageWriter* current_writer = NULL;
+static Extractor* current_extractor = NULL;
+static gboolean running = FALSE;
+
+// The helper is started by the first run that needs it and serves the later
+// ones too. The install thread creates the client and the main thread only
+// reads status through it; a client whose helper has gone away is freed by
+// the next run.
+static HelperClient* helper_client = NULL;
+static gboolean helper_lost = FALSE;
+static gboolean use_helper = FALSE;
+static guint64 helper_dropped_base = 0;     // the helper's ring outlives runs
+
+// Stage changes and log lines from the install thread, the only producer.
+// Allocated on the first run and reset for each one.
+static ProgressRing* events = NULL;
+static char current_stage[PROGRESS_TEXT_SIZE];
+
+static Manifest* payload_manifest = NULL;
+static gboolean manifest_loaded = FALSE;
+
+const char* install_get_image_path(void) {
+    const char* path = g_getenv("WAVE_INSTALL_IMAGE");
+    return path ? path : DEFAULT_IMAGE_PATH;
+}
+
+const char* install_get_payload_path(void) {
+    const char* path = g_getenv("WAVE_INSTALL_PAYLOAD");
+    return path && *path ? path : NULL;
+}
+
+const char* install_get_root_path(void) {
+    const char* path = g_getenv("WAVE_INSTALL_ROOT");
+    return path ? path : DEFAULT_ROOT_PATH;
+}
+
+// WAVE_INSTALL_MANIFEST, or the manifest shipped next to the payload
+static char* get_manifest_path(void) {
+    const char* path = g_getenv("WAVE_INSTALL_MANIFEST");
+    if (path) {
+        return g_strdup(path);
+    }
+    return install_get_payload_path() ? g_strconcat(install_get_payload_path(), ".manifest", NULL) : NULL;
+}
+
+static Manifest* get_manifest(void) {
+    if (manifest_loaded) {
+        return payload_manifest;
+    }
+    manifest_loaded = TRUE;
+    
+    char* path = get_manifest_path();
+    if (!path) {
+        return NULL;
+    }
+    
+    TRACE_BEGIN("manifest_load");
+    gint64 start = g_get_monotonic_time();
+    int result = manifest_open(path, &payload_manifest);
+    TRACE_END("manifest_load");
+    
+    if (result == 0) {
+        const ManifestHeader* header = manifest_get_header(payload_manifest);
+        g_debug("Mapped manifest %s in %.2f ms: %u files, %u directories, %" G_GUINT64_FORMAT " bytes",
+                path, (g_get_monotonic_time() - start) / 1000.0, header->n_files, header->n_directories,
+                header->total_bytes);
+    } else if (result != -ENOENT || g_getenv("WAVE_INSTALL_MANIFEST")) {
+        g_warning("Could not read manifest %s: %s", path,
+                  result == -EBADMSG ? "not a valid manifest" : g_strerror(-result));
+    }
+    g_free(path);
+    return payload_manifest;
+}
+
+// Whole blocks of data, a block per directory and an inode per member
+static guint64 get_unpacked_size(const ManifestHeader* header) {
+    return header->allocated_bytes + (guint64)header->n_directories * MANIFEST_BLOCK_SIZE +
+           (guint64)header->n_entries * INODE_SIZE;
+}
+
+guint64 install_get_required_size(void) {
+    if (!install_get_payload_path()) {
+        GStatBuf st;
+        return g_stat(install_get_image_path(), &st) == 0 ? (guint64)st.st_size : 0;
+    }
+    
+    Manifest* manifest = get_manifest();
+    if (!manifest) {
+        return 0;
+    }
+    
+    // Plus the journal and the blocks ext4 keeps back for root
+    guint64 used = get_unpacked_size(manifest_get_header(manifest)) + JOURNAL_SIZE;
+    return used * 100 / (100 - RESERVED_PERCENT);
+}
+
+// A payload goes into whatever filesystem is mounted at the root, whichever
+// disk was picked, so the room left there is what has to be enough. A run
+// resuming from a journal already has part of the payload in place and is
+// let through.
+static gboolean check_root_space(const char* journal_path, GError** error) {
+    const char* root = install_get_root_path();
+    struct statvfs st;
+    if (statvfs(root, &st) != 0) {
+        int saved_errno = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved_errno), "Cannot read the free space of %s: %s",
+                    root, g_strerror(saved_errno));
+        return FALSE;
+    }
+    
+    Manifest* manifest = get_manifest();
+    if (!manifest || (journal_path && g_file_test(journal_path, G_FILE_TEST_EXISTS))) {
+        return TRUE;
+    }
+    
+    const ManifestHeader* header = manifest_get_header(manifest);
+    guint64 needed = get_unpacked_size(header);
+    guint64 available = (guint64)st.f_bavail * st.f_frsize;
+    if (available < needed) {
+        char* needed_text = g_format_size(needed);
+        char* available_text = g_format_size(available);
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE, "Not enough space in %s: Wave OS needs %s, %s is free",
+                    root, needed_text, available_text);
+        g_free(needed_text);
+        g_free(available_text);
+        return FALSE;
+    }
+    // Filesystems without a fixed inode count, such as btrfs, report none
+    if (st.f_files > 0 && st.f_favail < header->n_entries) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+                    "Not enough inodes in %s: Wave OS has %u files, there is room for %" G_GUINT64_FORMAT, root,
+                    header->n_entries, (guint64)st.f_favail);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// WAVE_IO_PROFILE: none, auto (the default) or a class to drive the target
+// disk as, skipping detection
+static IoClass get_io_class(void) {
+    const char* name = g_getenv("WAVE_IO_PROFILE");
+    int io_class = name ? io_class_from_name(name) : -1;
+    if (name && io_class < 0) {
+        g_warning("Unknown WAVE_IO_PROFILE %s", name);
+    }
+    return io_class < 0 ? IO_CLASS_AUTO : (IoClass)io_class;
+}
+
+static void load_writer_options(ImageWriterOptions* options) {
+    image_writer_options_init(options);
+    options->io_class = get_io_class();
+    
+    const char* engine = g_getenv("WAVE_WRITER_ENGINE");
+    if (g_strcmp0(engine, "io_uring") == 0) {
+        options->engine = IMAGE_WRITER_ENGINE_IO_URING;
+    } else if (g_strcmp0(engine, "threads") == 0) {
+        options->engine = IMAGE_WRITER_ENGINE_THREADS;
+    }
+    
+    const char* depth = g_getenv("WAVE_WRITER_QUEUE_DEPTH");
+    if (depth) {
+        options->queue_depth = (guint32)g_ascii_strtoull(depth, NULL, 10);
+    }
+    const char* block_size = g_getenv("WAVE_WRITER_BLOCK_SIZE");
+    if (block_size) {
+        options->block_size = (guint32)g_ascii_strtoull(block_size, NULL, 10);
+    }
+    if (g_strcmp0(g_getenv("WAVE_WRITER_SPARSE"), "0") == 0) {
+        options->sparse = FALSE;
+    }
+    if (g_strcmp0(g_getenv("WAVE_WRITER_VERIFY"), "0") == 0) {
+        options->verify = FALSE;
+    }
+    const char* spot_checks = g_getenv("WAVE_WRITER_SPOT_CHECKS");
+    if (spot_checks) {
+        options->spot_checks = (guint32)g_ascii_strtoull(spot_checks, NULL, 10);
+    }
+}
+
+// WAVE_INSTALL_CHECKSUMS, or the block checksum list shipped next to the
+// image when there is one
+static char* get_checksum_path(void) {
+    const char* path = g_getenv("WAVE_INSTALL_CHECKSUMS");
+    if (path) {
+        return *path ? g_strdup(path) : NULL;
+    }
+    
+    char* default_path = g_strconcat(install_get_image_path(), ".blocksums", NULL);
+    if (!g_file_test(default_path, G_FILE_TEST_EXISTS)) {
+        g_clear_pointer(&default_path, g_free);
+    }
+    return default_path;
+}
+
+// WAVE_INSTALL_JOURNAL, or for a payload a journal in the root it fills, so
+// an install cut short by a power loss resumes when it is started again.
+// Images get none by default: the live system has nowhere that survives a
+// power loss.
+static char* get_journal_path(gboolean dry_run) {
+    if (dry_run) {
+        return NULL;
+    }
+    const char* path = g_getenv("WAVE_INSTALL_JOURNAL");
+    if (path) {
+        return *path ? g_strdup(path) : NULL;
+    }
+    return install_get_payload_path() ? g_build_filename(install_get_root_path(), JOURNAL_NAME, NULL) : NULL;
+}
+
+static void load_extract_options(ExtractOptions* options) {
+    extract_options_init(options);
+    options->io_class = get_io_class();
+    
+    const char* writers = g_getenv("WAVE_EXTRACT_WRITERS");
+    if (writers) {
+        options->n_writers = (guint32)g_ascii_strtoull(writers, NULL, 10);
+    }
+    if (g_strcmp0(g_getenv("WAVE_EXTRACT_SYNC"), "0") == 0) {
+        options->sync = FALSE;
+    }
+    const char* dedup = g_getenv("WAVE_EXTRACT_DEDUP");
+    if (g_strcmp0(dedup, "none") == 0) {
+        options->dedup = EXTRACT_DEDUP_NONE;
+    } else if (g_strcmp0(dedup, "hardlink") == 0) {
+        options->dedup = EXTRACT_DEDUP_HARDLINK;
+    }
+}
+
+// The manifest the extractor finds copies with: the one the disk page read,
+// if it could be read
+static char* get_dedup_manifest_path(void) {
+    return get_manifest() ? get_manifest_path() : NULL;
+}
+
+// WAVE_INSTALL_HELPER, or the installed helper; NULL to install in process
+static const char* get_helper_path(void) {
+    const char* path = g_getenv("WAVE_INSTALL_HELPER");
+    if (path) {
+        return *path ? path : NULL;
+    }
+    return g_file_test(WAVE_HELPER_PATH, G_FILE_TEST_IS_EXECUTABLE) ? WAVE_HELPER_PATH : NULL;
+}
+
+static guint32 get_payload_threads(void) {
+    const char* threads = g_getenv("WAVE_PAYLOAD_THREADS");
+    return threads ? (guint32)g_ascii_strtoull(threads, NULL, 10) : 0;
+}
+
+// A payload packed by wave-pack is decompressed frame by frame on
+// WAVE_PAYLOAD_THREADS threads (default one per CPU) before it is extracted.
+// Leaves *payload NULL for a plain archive.
+static int open_payload(PayloadReader** payload) {
+    *payload = NULL;
+    int seekable = payload_is_seekable(install_get_payload_path());
+    if (seekable <= 0) {
+        return seekable;
+    }
+    
+    return payload_reader_open(install_get_payload_path(), get_payload_threads(), payload);
+}
+
+typedef struct {
+    ImageWriter* writer;
+    Extractor* extractor;
+    PayloadReader* payload;     // set when the payload is in the seekable format
+    char* target_path;
+    char* journal_path;         // removed once the install has succeeded
+    HelperCommand* command;     // set when the helper does the work
+    char* helper_path;
+    StageScheduler* scheduler;  // set when this process does the work
+    SystemConfigStages* config_stages;
+} InstallJob;
+
+static void install_job_free(InstallJob* job) {
+    g_clear_pointer(&job->scheduler, stage_scheduler_free);
+    g_clear_pointer(&job->config_stages, system_config_stages_free);
+    g_clear_pointer(&job->payload, payload_reader_free);
+    g_free(job->command);
+    g_free(job->helper_path);
+    g_free(job->target_path);
+    g_free(job->journal_path);
+    g_free(job);
+}
+
+static void send_helper_command(HelperCommandType type) {
+    HelperClient* client = g_atomic_pointer_get(&helper_client);
+    if (client) {
+        HelperCommand command;
+        helper_command_init(&command, type);
+        helper_client_send(client, &command);
+    }
+}
+
+static void on_cancelled(GCancellable* cancellable, gpointer user_data) {
+    InstallJob* job = user_data;
+    if (job->command) {
+        send_helper_command(HELPER_COMMAND_CANCEL);
+    } else if (job->scheduler) {
+        stage_scheduler_cancel(job->scheduler);
+    }
+}
+
+// Shared by installs in this process and in the helper
+static void return_extract_result(GTask* task, InstallJob* job, int result, const char* member) {
+    if (result == 0) {
+        g_task_return_boolean(task, TRUE);
+    } else if (result == -ECANCELED) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_CANCELLED, "The installation was cancelled");
+    } else if (result == -EBADMSG) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "%s is not a valid tar or cpio archive or is damaged",
+                                install_get_payload_path());
+    } else {
+        g_task_return_new_error(task, G_IO_ERROR, g_io_error_from_errno(-result),
+                                "Extracting %s%s%s into %s failed: %s", install_get_payload_path(),
+                                member ? " member " : "", member ? member : "", job->target_path,
+                                g_strerror(-result));
+    }
+}
+
+static void return_write_result(GTask* task, InstallJob* job, int result, guint64 error_offset) {
+    if (result == 0) {
+        g_task_return_boolean(task, TRUE);
+    } else if (result == -ECANCELED) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_CANCELLED, "The installation was cancelled");
+    } else if (result == -ENOSPC) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_NO_SPACE, "%s is smaller than the image %s",
+                                job->target_path, install_get_image_path());
+    } else if (result == -EBADMSG) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                "Checksum mismatch at byte %" G_GUINT64_FORMAT " writing %s to %s",
+                                error_offset, install_get_image_path(), job->target_path);
+    } else {
+        g_task_return_new_error(task, G_IO_ERROR, g_io_error_from_errno(-result),
+                                "Writing %s to %s failed at byte %" G_GUINT64_FORMAT ": %s",
+                                install_get_image_path(), job->target_path, error_offset, g_strerror(-result));
+    }
+}
+
+static void log_image_digest(const guint8* digest) {
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        g_snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    }
+    g_debug("Image digest %s", hex);
+}
+
+// Stage bodies; they run on the scheduler's threads, so they leave the
+// event ring to the install thread
+static int run_extractor(gpointer data) {
+    InstallJob* job = data;
+    return extractor_run(job->extractor);
+}
+
+static void cancel_extractor(gpointer data) {
+    InstallJob* job = data;
+    extractor_cancel(job->extractor);
+}
+
+static int run_writer(gpointer data) {
+    InstallJob* job = data;
+    return image_writer_run(job->writer);
+}
+
+static void cancel_writer(gpointer data) {
+    InstallJob* job = data;
+    image_writer_cancel(job->writer);
+}
+
+// The same stages as in the helper: the image is written in one stage, and
+// a payload is unpacked while the settings are rendered
+static int plan_stages(InstallJob* job, const SystemConfig* config, gboolean dry_run) {
+    job->scheduler = stage_scheduler_new(dry_run);
+    if (!job->scheduler) {
+        return -ENOMEM;
+    }
+    stage_scheduler_set_events(job->scheduler, events);
+    
+    Stage stage = { 0 };
+    stage.user_data = job;
+    stage.dry_run_ms = 2000;
+    if (job->writer) {
+        stage.name = "write-image";
+        stage.title = "Writing the system image";
+        stage.outputs = "disk";
+        stage.run = run_writer;
+        stage.cancel = cancel_writer;
+        return stage_scheduler_add(job->scheduler, &stage);
+    }
+    
+    stage.name = "unpack";
+    stage.title = "Unpacking the system";
+    stage.outputs = "root-files";
+    stage.run = run_extractor;
+    stage.cancel = cancel_extractor;
+    int result = stage_scheduler_add(job->scheduler, &stage);
+    if (result == 0 && config && !system_config_is_empty(config)) {
+        result = system_config_add_stages(job->scheduler, config, job->target_path, "root-files",
+                                          &job->config_stages);
+    }
+    return result;
+}
+
+static void log_stage_timings(StageScheduler* scheduler) {
+    StageStats stats;
+    stage_scheduler_get_stats(scheduler, &stats);
+    for (guint i = 0; i < stats.n_stages; i++) {
+        StageTiming timing;
+        stage_scheduler_get_timing(scheduler, i, &timing);
+        g_debug("Stage %s: %s, %.3f s to %.3f s", timing.name, stage_state_name(timing.state),
+                timing.start_ns / 1e9, timing.end_ns / 1e9);
+    }
+    g_debug("%u stages in %.3f s, %.3f s of work, up to %u at once", stats.n_stages, stats.elapsed_ns / 1e9,
+            stats.busy_ns / 1e9, stats.max_running);
+    // Time saved by running stages side by side
+    TRACE_COUNTER("install_stage_overlap_ms", (gint64)(stats.busy_ns - MIN(stats.busy_ns, stats.elapsed_ns)) / 1000000);
+}
+
+static void log_profile(const IoProfile* profile) {
+    if (profile->io_class == IO_CLASS_NONE) {
+        g_debug("I/O profile: untuned");
+        return;
+    }
+    const char* disk = profile->disk[0] ? profile->disk : "forced";
+    if (profile->serial_iops == 0 && profile->parallel_iops == 0) {
+        // Without a probe the choice is only the default for the class sysfs claims
+        g_debug("I/O profile: %s %s default (rotational %d, usb %d, nr_requests %u, optimal_io_size %u), "
+                "not probed%s%s", disk, io_class_name(profile->io_class), profile->rotational, profile->usb,
+                profile->nr_requests, profile->optimal_io_size, profile->probe_error ? ": " : "",
+                profile->probe_error ? g_strerror(-profile->probe_error) : "");
+    } else {
+        g_debug("I/O profile: %s %s (rotational %d, usb %d, nr_requests %u, optimal_io_size %u), %.0f/%.0f "
+                "random reads/s serial/parallel probed in %.1f ms", disk, io_class_name(profile->io_class),
+                profile->rotational, profile->usb, profile->nr_requests, profile->optimal_io_size,
+                profile->serial_iops, profile->parallel_iops, profile->probe_ns / 1e6);
+    }
+    TRACE_COUNTER("io_probe_ms", (gint64)(profile->probe_ns / 1000000));
+}
+
+// What the journal cost, against the run it protects
+static void log_journal(InstallJob* job, guint64 bytes_resumed, guint64 commits, guint64 journal_ns,
+                        guint64 elapsed_ns) {
+    if (!job->journal_path) {
+        return;
+    }
+    g_debug("Journal %s: %" G_GUINT64_FORMAT " bytes resumed, %" G_GUINT64_FORMAT " commits in %.1f ms "
+            "(%.1f%% of the run)", job->journal_path, bytes_resumed, commits, journal_ns / 1e6,
+            elapsed_ns ? journal_ns * 100.0 / elapsed_ns : 0.0);
+    TRACE_COUNTER("install_journal_ms", (gint64)(journal_ns / 1000000));
+}
+
+static void extract_payload(GTask* task, InstallJob* job) {
+    progress_ring_pushf(events, PROGRESS_EVENT_LOG, "Unpacking %s into %s", install_get_payload_path(),
+                        job->target_path);
+    TRACE_BEGIN("payload_extract");
+    int result = stage_scheduler_run(job->scheduler);
+    TRACE_END("payload_extract");
+    log_stage_timings(job->scheduler);
+    
+    ExtractStats stats;
+    extractor_get_stats(job->extractor, &stats);
+    g_debug("Extracted %" G_GUINT64_FORMAT " entries (%" G_GUINT64_FORMAT " files, %" G_GUINT64_FORMAT
+            " bytes) into %s in %.2f s with %u writers (%.1f MB/s)",
+            stats.entries, stats.files, stats.bytes_written, job->target_path, stats.elapsed_ns / 1e9,
+            stats.n_writers, stats.bytes_per_second / 1e6);
+    if (stats.tuned) {
+        log_profile(&stats.profile);
+        g_debug("Extracting with %u writers%s, %" G_GUINT64_FORMAT " MiB read ahead", stats.profile.n_writers,
+                stats.profile.n_writers == 1 ? " in archive order" : "", stats.profile.read_ahead >> 20);
+        TRACE_COUNTER("io_writers", (gint64)stats.profile.n_writers);
+    }
+    progress_ring_pushf(events, PROGRESS_EVENT_LOG, "%" G_GUINT64_FORMAT " entries, %" G_GUINT64_FORMAT
+                        " files in %.1f s (%.1f MB/s)", stats.entries, stats.files, stats.elapsed_ns / 1e9,
+                        stats.bytes_per_second / 1e6);
+    if (stats.files_resumed > 0) {
+        progress_ring_pushf(events, PROGRESS_EVENT_LOG, "%" G_GUINT64_FORMAT " files already in place",
+                            stats.files_resumed);
+    }
+    if (stats.files_deduplicated > 0) {
+        // What writing the copies would have cost at the rate of this run
+        double seconds = stats.bytes_written ? stats.bytes_deduplicated * (stats.elapsed_ns / 1e9) /
+                                               stats.bytes_written : 0.0;
+        g_debug("Deduplicated %" G_GUINT64_FORMAT " files: %" G_GUINT64_FORMAT " bytes not written, "
+                "about %.1f s saved", stats.files_deduplicated, stats.bytes_deduplicated, seconds);
+        progress_ring_pushf(events, PROGRESS_EVENT_LOG, "%" G_GUINT64_FORMAT " copies deduplicated (%"
+                            G_GUINT64_FORMAT " MB not written)", stats.files_deduplicated,
+                            stats.bytes_deduplicated / 1000000);
+        TRACE_COUNTER("install_dedup_mb", (gint64)(stats.bytes_deduplicated / 1000000));
+    }
+    log_journal(job, stats.bytes_resumed, stats.journal_commits, stats.journal_ns, stats.elapsed_ns);
+    if (result == 0 && job->journal_path) {
+        journal_remove(job->journal_path);
+    }
+    if (job->payload) {
+        PayloadStats payload_stats;
+        payload_reader_get_stats(job->payload, &payload_stats);
+        g_debug("Decoded %" G_GUINT64_FORMAT " bytes from %" G_GUINT64_FORMAT " compressed in %u frames "
+                "with %u threads (%.1f MB/s per thread)",
+                payload_stats.bytes_decoded, payload_stats.compressed_bytes,
+                payload_reader_get_n_frames(job->payload), payload_stats.n_threads,
+                payload_stats.busy_ns ? payload_stats.bytes_decoded * 1e3 / payload_stats.busy_ns : 0.0);
+    }
+    
+    return_extract_result(task, job, result, extractor_get_error_path(job->extractor));
+}
+
+static void write_image(GTask* task, InstallJob* job) {
+    progress_ring_pushf(events, PROGRESS_EVENT_LOG, "Writing %s to %s", install_get_image_path(), job->target_path);
+    TRACE_BEGIN("image_write");
+    int result = stage_scheduler_run(job->scheduler);
+    TRACE_END("image_write");
+    log_stage_timings(job->scheduler);
+    
+    ImageWriterStats stats;
+    image_writer_get_stats(job->writer, &stats);
+    g_debug("Wrote %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " bytes to %s in %.2f s "
+            "(%.1f MB/s, %s%s); %" G_GUINT64_FORMAT " zero bytes skipped by %s",
+            stats.bytes_written, stats.bytes_done, job->target_path, stats.elapsed_ns / 1e9,
+            stats.bytes_per_second / 1e6, image_writer_engine_name(stats.engine),
+            stats.direct ? ", O_DIRECT" : "", stats.bytes_skipped, image_writer_skip_name(stats.skip));
+    if (stats.tuned) {
+        log_profile(&stats.profile);
+        g_debug("Writing in %u KiB blocks, %u in flight", stats.profile.block_size / 1024,
+                stats.profile.queue_depth);
+        TRACE_COUNTER("io_queue_depth", (gint64)stats.profile.queue_depth);
+    }
+    progress_ring_pushf(events, PROGRESS_EVENT_LOG, "%" G_GUINT64_FORMAT " bytes written in %.1f s (%.1f MB/s)",
+                        stats.bytes_written, stats.elapsed_ns / 1e9, stats.bytes_per_second / 1e6);
+    if (stats.bytes_resumed > 0) {
+        progress_ring_pushf(events, PROGRESS_EVENT_LOG, "%" G_GUINT64_FORMAT " bytes already on the disk",
+                            stats.bytes_resumed);
+    }
+    log_journal(job, stats.bytes_resumed, stats.journal_commits, stats.journal_ns, stats.elapsed_ns);
+    if (result == 0 && job->journal_path) {
+        journal_remove(job->journal_path);
+    }
+    
+    guint8 digest[SHA256_DIGEST_SIZE];
+    if (image_writer_get_image_digest(job->writer, digest) == 0) {
+        char hex[SHA256_DIGEST_SIZE * 2 + 1];
+        for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+            g_snprintf(hex + i * 2, 3, "%02x", digest[i]);
+        }
+        g_debug("Hashed %" G_GUINT64_FORMAT " bytes at %.1f MB/s, %u blocks read back; image digest %s",
+                stats.bytes_hashed, stats.hash_bytes_per_second / 1e6, stats.spot_checks_done, hex);
+        progress_ring_pushf(events, PROGRESS_EVENT_LOG, "Image digest %.16s...", hex);
+    }
+    
+    return_write_result(task, job, result, image_writer_get_error_offset(job->writer));
+}
+
+// Starts the helper with its standard input on one end of a socketpair,
+// through pkexec unless this process already runs as root or
+// WAVE_HELPER_ELEVATE=0, and waits for it to hand over its shared memory.
+// Runs on the install thread, since pkexec may wait for a password.
+static int start_helper(const char* path, HelperClient** client) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0) {
+        return -errno;
+    }
+    
+    gboolean elevate = getuid() != 0 && g_strcmp0(g_getenv("WAVE_HELPER_ELEVATE"), "0") != 0;
+    const char* argv[] = { "pkexec", path, "-s", NULL };
+    GSubprocessLauncher* launcher = g_subprocess_launcher_new(G_SUBPROCESS_FLAGS_NONE);
+    g_subprocess_launcher_take_stdin_fd(launcher, fds[1]);
+    
+    GError* error = NULL;
+    GSubprocess* process = g_subprocess_launcher_spawnv(launcher, elevate ? argv : argv + 1, &error);
+    g_object_unref(launcher);
+    if (!process) {
+        g_warning("Could not start %s: %s", path, error->message);
+        g_error_free(error);
+        close(fds[0]);
+        return -ENOENT;
+    }
+    g_object_unref(process);
+    
+    TRACE_BEGIN("helper_start");
+    gint64 start = g_get_monotonic_time();
+    int result = helper_client_new(fds[0], client);
+    TRACE_END("helper_start");
+    if (result == 0) {
+        g_debug("Started install helper %s%s in %.2f ms", path, elevate ? " through pkexec" : "",
+                (g_get_monotonic_time() - start) / 1000.0);
+    }
+    return result;
+}
+
+static void run_in_helper(GTask* task, InstallJob* job) {
+    HelperClient* client = g_atomic_pointer_get(&helper_client);
+    if (!client) {
+        int result = start_helper(job->helper_path, &client);
+        if (result < 0) {
+            g_task_return_new_error(task, G_IO_ERROR, g_io_error_from_errno(-result),
+                                    "Starting the install helper %s failed: %s", job->helper_path,
+                                    result == -ECONNRESET ? "it exited or was not authorized" : g_strerror(-result));
+            return;
+        }
+        g_atomic_pointer_set(&helper_client, client);
+    }
+    
+    // Replies to commands sent by the main thread arrive here too and only
+    // the one to START matters
+    TRACE_BEGIN("helper_run");
+    int result = helper_client_send(client, job->command);
+    
+    // A cancel from before START reached the helper while it had nothing to
+    // cancel; the helper keeps one that follows START
+    GCancellable* cancellable = g_task_get_cancellable(task);
+    if (result == 0 && cancellable && g_cancellable_is_cancelled(cancellable)) {
+        send_helper_command(HELPER_COMMAND_CANCEL);
+    }
+    HelperMessage message = { 0 };
+    while (result == 0) {
+        int received = helper_client_receive(client, &message);
+        if (received <= 0) {
+            result = received < 0 ? received : -ECONNRESET;
+            g_atomic_int_set(&helper_lost, TRUE);
+        } else if (message.type == HELPER_MESSAGE_FINISHED ||
+                   (message.type == HELPER_MESSAGE_REPLY && message.command == HELPER_COMMAND_START &&
+                    message.result < 0)) {
+            break;
+        }
+    }
+    TRACE_END("helper_run");
+    
+    if (result < 0) {
+        g_task_return_new_error(task, G_IO_ERROR, g_io_error_from_errno(-result),
+                                "Lost the connection to the install helper: %s", g_strerror(-result));
+    } else if (job->command->job == HELPER_JOB_IMAGE) {
+        if (message.has_digest) {
+            log_image_digest(message.digest);
+        }
+        return_write_result(task, job, message.result, message.error_offset);
+    } else {
+        return_extract_result(task, job, message.result, message.error_path[0] ? message.error_path : NULL);
+    }
+}
+
+static void install_thread(GTask* task, gpointer source_object, gpointer task_data,
+                           GCancellable* cancellable) {
+    InstallJob* job = task_data;
+    gulong handler_id = cancellable ? g_cancellable_connect(cancellable, G_CALLBACK(on_cancelled), job, NULL) : 0;
+    
+    if (job->command) {
+        run_in_helper(task, job);
+    } else if (job->extractor) {
+        extract_payload(task, job);
+    } else {
+        write_image(task, job);
+    }
+    
+    if (cancellable) {
+        g_cancellable_disconnect(cancellable, handler_id);
+    }
+}
+
+static void on_task_completed(GObject* task, GParamSpec* pspec, gpointer user_data) {
+    running = FALSE;
+}
+
+void install_run_async(const char* target_path, const SystemConfig* config, GCancellable* cancellable,
+                       GAsyncReadyCallback callback, gpointer user_data) {
+    GTask* task = g_task_new(NULL, cancellable, callback, user_data);
+    g_task_set_source_tag(task, install_run_async);
+    
+    if (running) {
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_BUSY, "An installation is already running");
+        g_object_unref(task);
+        return;
+    }
+    
+    g_clear_pointer(&current_writer, image_writer_free);
+    g_clear_pointer(&current_extractor, extractor_free);
+    if (g_atomic_int_get(&helper_lost)) {
+        g_clear_pointer(&helper_client, helper_client_free);
+        helper_lost = FALSE;
+    }
+    
+    // Nothing produces events between runs, so the ring can be reset here
+    if (!events) {
+        events = g_new(ProgressRing, 1);
+    }
+    progress_ring_init(events);
+    current_stage[0] = '\0';
+    
+    InstallJob* job = g_new0(InstallJob, 1);
+    gboolean dry_run = g_strcmp0(g_getenv("WAVE_INSTALL_DRY_RUN"), "1") == 0;
+    job->journal_path = get_journal_path(dry_run);
+    GError* error = NULL;
+    if (install_get_payload_path() && !dry_run && !check_root_space(job->journal_path, &error)) {
+        g_task_return_error(task, error);
+        install_job_free(job);
+        g_object_unref(task);
+        return;
+    }
+    use_helper = get_helper_path() != NULL;
+    if (use_helper) {
+        // The helper opens everything itself; this process only describes the job
+        HelperCommand* command = g_new(HelperCommand, 1);
+        helper_command_init(command, HELPER_COMMAND_START);
+        const char* source;
+        char* checksum_path = NULL;
+        command->dry_run = dry_run;
+        if (install_get_payload_path()) {
+            command->job = HELPER_JOB_PAYLOAD;
+            command->payload_threads = get_payload_threads();
+            load_extract_options(&command->extract_options);
+            char* manifest_path = get_dedup_manifest_path();
+            g_strlcpy(command->manifest_path, manifest_path ? manifest_path : "", sizeof(command->manifest_path));
+            g_free(manifest_path);
+            if (config) {
+                command->config = *config;
+            }
+            source = install_get_payload_path();
+            job->target_path = g_strdup(install_get_root_path());
+        } else {
+            command->job = HELPER_JOB_IMAGE;
+            load_writer_options(&command->writer_options);
+            checksum_path = get_checksum_path();
+            source = install_get_image_path();
+            job->target_path = g_strdup(target_path);
+        }
+        g_strlcpy(command->source, source, sizeof(command->source));
+        g_strlcpy(command->target, job->target_path, sizeof(command->target));
+        g_strlcpy(command->checksum_path, checksum_path ? checksum_path : "", sizeof(command->checksum_path));
+        g_strlcpy(command->journal_path, job->journal_path ? job->journal_path : "", sizeof(command->journal_path));
+        g_free(checksum_path);
+        job->command = command;
+        job->helper_path = g_canonicalize_filename(get_helper_path(), NULL);
+        HelperClient* client = helper_client;
+        helper_dropped_base = client ? progress_ring_get_dropped(helper_client_get_events(client)) : 0;
+    } else if (install_get_payload_path()) {
+        ExtractOptions options;
+        load_extract_options(&options);
+        options.journal_path = job->journal_path;
+        char* manifest_path = get_dedup_manifest_path();
+        options.manifest_path = manifest_path;
+        int result = open_payload(&job->payload);
+        if (result < 0) {
+            g_free(manifest_path);
+            g_task_return_new_error(task, G_IO_ERROR, g_io_error_from_errno(-result), "Opening %s failed: %s",
+                                    install_get_payload_path(),
+                                    result == -EBADMSG ? "the frame index is damaged" : g_strerror(-result));
+            install_job_free(job);
+            g_object_unref(task);
+            return;
+        }
+        if (job->payload) {
+            current_extractor = extractor_new_from_reader(payload_reader_read, job->payload,
+                                                          payload_reader_get_size(job->payload),
+                                                          install_get_root_path(), &options);
+        } else {
+            current_extractor = extractor_new(install_get_payload_path(), install_get_root_path(), &options);
+        }
+        g_free(manifest_path);
+        job->extractor = current_extractor;
+        job->target_path = g_strdup(install_get_root_path());
+    } else {
+        ImageWriterOptions options;
+        char* checksum_path = get_checksum_path();
+        load_writer_options(&options);
+        options.checksum_path = checksum_path;
+        options.journal_path = job->journal_path;
+        current_writer = image_writer_new(install_get_image_path(), target_path, &options);
+        g_free(checksum_path);
+        job->writer = current_writer;
+        job->target_path = g_strdup(target_path);
+    }
+    if (!job->command) {
+        int result = plan_stages(job, config, dry_run);
+        if (result < 0) {
+            g_task_return_new_error(task, G_IO_ERROR, g_io_error_from_errno(-result),
+                                    "Planning the installation failed: %s", g_strerror(-result));
+            install_job_free(job);
+            g_object_unref(task);
+            return;
+        }
+    }
+    running = TRUE;
+    
+    g_task_set_task_data(task, job, (GDestroyNotify)install_job_free);
+    g_signal_connect(task, "notify::completed", G_CALLBACK(on_task_completed), NULL);
+    g_task_run_in_thread(task, install_thread);
+    g_object_unref(task);
+}
+
+gboolean install_run_finish(GAsyncResult* result, GError** error) {
+    return g_task_propagate_boolean(G_TASK(result), error);
+}
+
+// The helper's ring once it is connected, or the one of this process
+static ProgressRing* get_events(void) {
+    if (use_helper) {
+        HelperClient* client = g_atomic_pointer_get(&helper_client);
+        return client ? helper_client_get_events(client) : NULL;
+    }
+    return events;
+}
+
+void install_set_paused(gboolean paused) {
+    if (use_helper) {
+        send_helper_command(paused ? HELPER_COMMAND_PAUSE : HELPER_COMMAND_RESUME);
+    } else if (current_extractor) {
+        extractor_set_paused(current_extractor, paused);
+    } else if (current_writer) {
+        image_writer_set_paused(current_writer, paused);
+    }
+}
+
+guint install_drain_events(InstallLogFunc func, gpointer user_data) {
+    ProgressRing* ring = get_events();
+    if (!ring) {
+        return 0;
+    }
+    
+    ProgressEvent event;
+    guint n_events = 0;
+    while (progress_ring_pop(ring, &event)) {
+        if (event.kind == PROGRESS_EVENT_STAGE) {
+            memcpy(current_stage, event.text, event.length + 1);
+        } else if (func) {
+            func(event.text, user_data);
+        }
+        n_events++;
+    }
+    return n_events;
+}
+
+gboolean install_get_progress(InstallProgress* progress) {
+    memset(progress, 0, sizeof(*progress));
+    progress->stage = current_stage[0] ? current_stage : NULL;
+    ProgressRing* ring = get_events();
+    progress->events_dropped = ring ? progress_ring_get_dropped(ring) - (use_helper ? helper_dropped_base : 0) : 0;
+    
+    if (use_helper) {
+        // Nothing to show until the helper is up, which can take a password
+        HelperClient* client = g_atomic_pointer_get(&helper_client);
+        HelperStatus status;
+        if (!client || helper_client_get_status(client, &status) < 0 || status.state == HELPER_STATE_IDLE) {
+            progress->eta_seconds = -1;
+            progress->status = running ? "Starting the install helper..." : NULL;
+            return running;
+        }
+        progress->bytes_done = status.bytes_done;
+        progress->bytes_total = status.bytes_total;
+        progress->bytes_per_second = status.bytes_per_second;
+        progress->eta_seconds = status.eta_seconds;
+        progress->hash_bytes_per_second = status.hash_bytes_per_second;
+        progress->paused = status.state == HELPER_STATE_PAUSED;
+        if (status.phase == HELPER_PHASE_SYNCING) {
+            progress->status = "Syncing...";
+        } else if (status.phase == HELPER_PHASE_VERIFYING) {
+            progress->status = "Verifying...";
+        }
+        return TRUE;
+    }
+    if (current_extractor) {
+        ExtractStats stats;
+        extractor_get_stats(current_extractor, &stats);
+        progress->bytes_done = stats.archive_done;
+        progress->bytes_total = stats.archive_bytes;
+        progress->bytes_per_second = stats.bytes_per_second;
+        progress->eta_seconds = stats.eta_seconds;
+        progress->paused = stats.paused;
+        progress->status = stats.syncing && !stats.finished ? "Syncing..." : NULL;
+        return TRUE;
+    }
+    if (current_writer) {
+        ImageWriterStats stats;
+        image_writer_get_stats(current_writer, &stats);
+        progress->bytes_done = stats.bytes_done;
+        progress->bytes_total = stats.bytes_total;
+        progress->bytes_per_second = stats.bytes_per_second;
+        progress->eta_seconds = stats.eta_seconds;
+        progress->hash_bytes_per_second = stats.hash_bytes_per_second;
+        progress->paused = stats.paused;
+        progress->status = stats.verifying ? "Verifying..." : NULL;
+        return TRUE;
+    }
+    return FALSE;
+}
@@ -0,0 +1,79 @@
+#ifndef INSTALL_H
+#define INSTALL_H
+
+#include <gio/gio.h>
+#include "backend/extract.h"
+#include "backend/imagewriter.h"
+#include "backend/sysconfig.h"
+
+// The OS image to install: WAVE_INSTALL_IMAGE, or the image on the live medium
+const char* install_get_image_path(void);
+
+// A tar or cpio payload to unpack instead of writing the image:
+// WAVE_INSTALL_PAYLOAD, or NULL for an image install
+const char* install_get_payload_path(void);
+
+// Where the target filesystem is mounted for a payload install:
+// WAVE_INSTALL_ROOT, or /mnt/wave
+const char* install_get_root_path(void);
+
+// Bytes the target disk needs: the size of the image, or for a payload an
+// estimate from its manifest (WAVE_INSTALL_MANIFEST, or <payload>.manifest).
+// 0 when it is not known. The manifest is mapped on the first call, so this
+// is cheap enough for building a page; main thread only.
+guint64 install_get_required_size(void);
+
+// Writes the OS image to target_path on a worker thread and flushes it, or
+// with a payload, unpacks it into the root path and ignores target_path. A
+// payload install fails with G_IO_ERROR_NO_SPACE before it starts when the
+// filesystem at the root has less room than the manifest says it needs.
+// Only one install runs at a time. Cancelling the cancellable stops the
+// writer between requests.
+//
+// The install runs as stages (backend/stages.h). After a payload, config,
+// which may be NULL, is written into the root; it is rendered while the
+// payload is unpacked. An image carries its own configuration.
+// WAVE_INSTALL_DRY_RUN=1 runs the stages as stubs that only wait, so the
+// whole flow can be tried without touching a disk.
+//
+// The work is done by wave-install-helper when it is installed, or when
+// WAVE_INSTALL_HELPER names it ("" forces an install in this process). The
+// helper is started through pkexec on the first run, unless this process is
+// root or WAVE_HELPER_ELEVATE=0, and serves the later runs.
+//
+// WAVE_WRITER_ENGINE (io_uring, threads), WAVE_WRITER_QUEUE_DEPTH,
+// WAVE_WRITER_BLOCK_SIZE and WAVE_WRITER_SPARSE=0 override the writer
+// defaults; WAVE_EXTRACT_WRITERS and WAVE_EXTRACT_SYNC=0 the extractor's.
+void install_run_async(const char* target_path, const SystemConfig* config, GCancellable* cancellable,
+                       GAsyncReadyCallback callback, gpointer user_data);
+gboolean install_run_finish(GAsyncResult* result, GError** error);
+
+typedef struct {
+    guint64 bytes_done;
+    guint64 bytes_total;            // 0 when not known
+    double bytes_per_second;
+    double eta_seconds;             // negative until there is a rate to go by
+    double hash_bytes_per_second;   // 0 when nothing is hashed
+    const char* status;             // what the final phase is doing, or NULL
+    const char* stage;              // the last stage drained, or NULL
+    gboolean paused;
+    guint64 events_dropped;         // log lines lost because the UI fell behind
+} InstallProgress;
+
+// Holds the running install after the requests in flight, or lets it go on
+void install_set_paused(gboolean paused);
+
+typedef void (*InstallLogFunc)(const char* line, gpointer user_data);
+
+// Takes the stage changes and log lines the install thread has queued since
+// the last call and passes each log line to func, oldest first. Never
+// blocks the install thread, which drops lines while the queue is full.
+// Returns the number of events taken. Main thread only; call it before
+// install_get_progress() so the stage is current.
+guint install_drain_events(InstallLogFunc func, gpointer user_data);
+
+// Progress of the running or last install; FALSE before the first one.
+// Cheap enough to call every frame. Main thread only.
+gboolean install_get_progress(InstallProgress* progress);
+
+#endif // INSTALL_H
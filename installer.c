@@ -1,9 +1,194 @@
 #include "installer.h"
+#include "install.h"
+#include "trace.h"
 
 // Global variables
 GtkWidget* main_window = NULL;
 GtkWidget* main_stack = NULL;
 GtkWidget* navigation_box = NULL;
+gint64 installer_start_time = 0;
+
+// Page descriptor table. Navigation follows the prev/next links; widgets
+// are created lazily the first time a page is needed.
+typedef struct {
+    const char* name;
+    GtkWidget* (*create)(void);
+    const char* prev;
+    const char* next;
+    gboolean (*validate)(void);
+    const char* next_label;
+    GtkWidget* widget;
+} InstallerPage;
+
+static InstallerPage pages[] = {
+    {"welcome",  create_welcome_page,  NULL,       "language", NULL,               "Next",    NULL},
+    {"language", create_language_page, "welcome",  "timezone", NULL,               "Next",    NULL},
+    {"timezone", create_timezone_page, "language", "keyboard", NULL,               "Next",    NULL},
+    {"keyboard", create_keyboard_page, "timezone", "disk",     NULL,               "Next",    NULL},
+    {"disk",     create_disk_page,     "keyboard", "network",  NULL,               "Next",    NULL},
+    {"network",  create_network_page,  "disk",     "user",     NULL,               "Next",    NULL},
+    {"user",     create_user_page,     "network",  NULL,       validate_user_page, "Install", NULL},
+    // Reached only through start_install(); Back returns after a failure
+    {"progress", create_progress_page, "user",     NULL,       NULL,               "Install", NULL}
+};
+
+#define N_PAGES G_N_ELEMENTS(pages)
+
+static InstallerPage* current_page = NULL;
+static GtkWidget* back_button = NULL;
+static GtkWidget* next_button = NULL;
+static guint prefetch_source_id = 0;
+static gint64 pages_built = 0;
+
+static InstallerPage* find_page(const char* page_name) {
+    for (guint i = 0; i < N_PAGES; i++) {
+        if (g_strcmp0(pages[i].name, page_name) == 0) {
+            return &pages[i];
+        }
+    }
+    return NULL;
+}
+
+GtkWidget* ensure_page(const char* page_name) {
+    InstallerPage* page = find_page(page_name);
+    g_return_val_if_fail(page != NULL, NULL);
+    
+    if (page->widget) {
+        return page->widget;
+    }
+    
+    TRACE_BEGIN_DETAIL("create_page", page->name);
+    gint64 start = g_get_monotonic_time();
+    apply_page_css(page->name);
+    page->widget = page->create();
+    g_debug("Built page '%s' in %.2f ms", page->name,
+            (g_get_monotonic_time() - start) / 1000.0);
+    TRACE_END("create_page");
+    TRACE_COUNTER("pages_built", ++pages_built);
+    gtk_stack_add_named(GTK_STACK(main_stack), page->widget, page->name);
+    return page->widget;
+}
+
+static gboolean prefetch_next_page(gpointer user_data) {
+    const char* page_name = user_data;
+    prefetch_source_id = 0;
+    ensure_page(page_name);
+    return G_SOURCE_REMOVE;
+}
+
+// Build the page the user is most likely to visit next while the main loop is idle
+static void schedule_page_prefetch(const char* page_name) {
+    InstallerPage* page = find_page(page_name);
+    InstallerPage* next = page ? find_page(page->next) : NULL;
+    if (!next || next->widget) {
+        return;
+    }
+    
+    if (prefetch_source_id) {
+        g_source_remove(prefetch_source_id);
+    }
+    prefetch_source_id = g_idle_add_full(G_PRIORITY_LOW, prefetch_next_page,
+                                         (gpointer)next->name, NULL);
+}
+
+static void on_back_clicked(GtkButton* button, gpointer user_data) {
+    if (current_page && current_page->prev) {
+        navigate_to_page(current_page->prev);
+    }
+}
+
+static void on_install_finished(GObject* source, GAsyncResult* result, gpointer user_data) {
+    GError* error = NULL;
+    
+    if (install_run_finish(result, &error)) {
+        progress_page_finish(TRUE, NULL);
+        gtk_button_set_label(GTK_BUTTON(next_button), "Installed");
+        return;
+    }
+    
+    g_warning("Installation failed: %s", error->message);
+    progress_page_finish(FALSE, error->message);
+    g_error_free(error);
+    gtk_button_set_label(GTK_BUTTON(next_button), "Retry Install");
+    gtk_widget_set_sensitive(next_button, TRUE);
+    gtk_widget_set_sensitive(back_button, TRUE);
+}
+
+// The settings from the language, time zone and keyboard pages. The
+// language page only offers UTF-8 locales and names them without the
+// charset, which LANG needs before any modifier.
+static void get_system_config(SystemConfig* config) {
+    char* locale = get_selected_locale();
+    char* timezone = get_selected_timezone();
+    char* layout = get_selected_keyboard_layout();
+    char* variant = get_selected_keyboard_variant();
+    char* lang = NULL;
+    if (locale) {
+        const char* modifier = strchr(locale, '@');
+        lang = g_strdup_printf("%.*s.UTF-8%s", modifier ? (int)(modifier - locale) : (int)strlen(locale), locale,
+                               modifier ? modifier : "");
+    }
+    
+    if (system_config_set(config, lang, timezone, layout, variant) < 0) {
+        g_warning("The selected settings cannot be written into the installed system: %s, %s, %s %s",
+                  lang ? lang : "no locale", timezone ? timezone : "no time zone", layout ? layout : "no layout",
+                  variant ? variant : "");
+    }
+    g_free(lang);
+    g_free(locale);
+    g_free(timezone);
+    g_free(layout);
+    g_free(variant);
+}
+
+static void start_install(void) {
+    // A payload goes into the filesystem mounted at the install root
+    char* target = install_get_payload_path() ? g_strdup(install_get_root_path()) : get_selected_disk_node();
+    if (!target) {
+        navigate_to_page("disk");
+        return;
+    }
+    
+    // Navigation stays locked while the disk is being written
+    navigate_to_page("progress");
+    gtk_widget_set_sensitive(next_button, FALSE);
+    gtk_widget_set_sensitive(back_button, FALSE);
+    gtk_button_set_label(GTK_BUTTON(next_button), "Installing...");
+    progress_page_start();
+    SystemConfig config;
+    get_system_config(&config);
+    install_run_async(target, &config, NULL, on_install_finished, NULL);
+    g_free(target);
+}
+
+static void on_next_clicked(GtkButton* button, gpointer user_data) {
+    if (!current_page) {
+        return;
+    }
+    if (current_page->validate && !current_page->validate()) {
+        return;
+    }
+    if (current_page->next) {
+        navigate_to_page(current_page->next);
+    } else {
+        start_install();
+    }
+}
+
+static void on_first_paint(GdkFrameClock* clock, gpointer user_data) {
+    g_signal_handlers_disconnect_by_func(clock, on_first_paint, user_data);
+    TRACE_INSTANT("first_frame");
+    g_debug("Startup to first frame: %.2f ms",
+            (g_get_monotonic_time() - installer_start_time) / 1000.0);
+    
+    // Start prefetching only once the first frame is on screen
+    schedule_page_prefetch("welcome");
+}
+
+static void on_window_realize(GtkWidget* window, gpointer user_data) {
+    GdkFrameClock* clock = gtk_widget_get_frame_clock(window);
+    g_signal_connect(clock, "after-paint", G_CALLBACK(on_first_paint), NULL);
+}
 
 void create_installer_window(GtkApplication *app) {
     // Apply custom CSS first
@@ -44,79 +229,60 @@ void create_installer_window(GtkApplication *app) {
     gtk_widget_set_halign(navigation_box, GTK_ALIGN_END);
     gtk_box_append(GTK_BOX(content_box), navigation_box);
     
-    // Add all pages to stack
-    gtk_stack_add_named(GTK_STACK(main_stack), create_welcome_page(), "welcome");
-    gtk_stack_add_named(GTK_STACK(main_stack), create_language_page(), "language");
-    gtk_stack_add_named(GTK_STACK(main_stack), create_timezone_page(), "timezone");
-    gtk_stack_add_named(GTK_STACK(main_stack), create_keyboard_page(), "keyboard");
-    gtk_stack_add_named(GTK_STACK(main_stack), create_disk_page(), "disk");
-    gtk_stack_add_named(GTK_STACK(main_stack), create_network_page(), "network");
-    gtk_stack_add_named(GTK_STACK(main_stack), create_user_page(), "user");    // Set initial page and present window
+    // Only the welcome page is built before the first frame; the rest are
+    // built on demand or prefetched from an idle callback
+    ensure_page("welcome");
     gtk_stack_set_visible_child_name(GTK_STACK(main_stack), "welcome");
     setup_navigation_buttons(NULL, "welcome");
     
+    g_signal_connect(main_window, "realize", G_CALLBACK(on_window_realize), NULL);
     gtk_window_present(GTK_WINDOW(main_window));
 }
 
 void navigate_to_page(const char* page_name) {
+    TRACE_BEGIN_DETAIL("navigate_to_page", page_name);
+    ensure_page(page_name);
     gtk_stack_set_visible_child_name(GTK_STACK(main_stack), page_name);
     setup_navigation_buttons(NULL, page_name);
+    schedule_page_prefetch(page_name);
+    TRACE_END("navigate_to_page");
 }
 
-void setup_navigation_buttons(GtkWidget* page, const char* current_page) {
-    // Clear existing buttons
-    GtkWidget* child = gtk_widget_get_first_child(navigation_box);
-    while (child) {
-        GtkWidget* next = gtk_widget_get_next_sibling(child);
-        gtk_box_remove(GTK_BOX(navigation_box), child);
-        child = next;
-    }
-    
-    // Back button (if not on welcome page)
-    if (g_strcmp0(current_page, "welcome") != 0) {
-        GtkWidget* back_button = gtk_button_new_with_label("Back");
+void setup_navigation_buttons(GtkWidget* page, const char* page_name) {
+    // The buttons are created once and only relabelled afterwards
+    if (!back_button) {
+        back_button = gtk_button_new_with_label("Back");
         gtk_widget_add_css_class(back_button, "secondary-button");
+        g_signal_connect(back_button, "clicked", G_CALLBACK(on_back_clicked), NULL);
         gtk_box_append(GTK_BOX(navigation_box), back_button);
         
-        // Connect back button signal based on current page
-        if (g_strcmp0(current_page, "language") == 0) {
-            g_signal_connect_swapped(back_button, "clicked", G_CALLBACK(navigate_to_page), "welcome");
-        } else if (g_strcmp0(current_page, "timezone") == 0) {
-            g_signal_connect_swapped(back_button, "clicked", G_CALLBACK(navigate_to_page), "language");
-        } else if (g_strcmp0(current_page, "keyboard") == 0) {
-            g_signal_connect_swapped(back_button, "clicked", G_CALLBACK(navigate_to_page), "timezone");
-        } else if (g_strcmp0(current_page, "disk") == 0) {
-            g_signal_connect_swapped(back_button, "clicked", G_CALLBACK(navigate_to_page), "keyboard");
-        } else if (g_strcmp0(current_page, "network") == 0) {
-            g_signal_connect_swapped(back_button, "clicked", G_CALLBACK(navigate_to_page), "disk");
-        } else if (g_strcmp0(current_page, "user") == 0) {
-            g_signal_connect_swapped(back_button, "clicked", G_CALLBACK(navigate_to_page), "network");
-        }
-    }
-    
-    // Next button
-    GtkWidget* next_button;
-    if (g_strcmp0(current_page, "user") == 0) {
-        next_button = gtk_button_new_with_label("Install");
-    } else {
         next_button = gtk_button_new_with_label("Next");
+        gtk_widget_add_css_class(next_button, "primary-button");
+        g_signal_connect(next_button, "clicked", G_CALLBACK(on_next_clicked), NULL);
+        gtk_box_append(GTK_BOX(navigation_box), next_button);
     }
-    gtk_widget_add_css_class(next_button, "primary-button");
-    gtk_box_append(GTK_BOX(navigation_box), next_button);
-    
-    // Connect next button signal based on current page
-    if (g_strcmp0(current_page, "welcome") == 0) {
-        g_signal_connect_swapped(next_button, "clicked", G_CALLBACK(navigate_to_page), "language");
-    } else if (g_strcmp0(current_page, "language") == 0) {
-        g_signal_connect_swapped(next_button, "clicked", G_CALLBACK(navigate_to_page), "timezone");
-    } else if (g_strcmp0(current_page, "timezone") == 0) {
-        g_signal_connect_swapped(next_button, "clicked", G_CALLBACK(navigate_to_page), "keyboard");
-    } else if (g_strcmp0(current_page, "keyboard") == 0) {
-        g_signal_connect_swapped(next_button, "clicked", G_CALLBACK(navigate_to_page), "disk");
-    } else if (g_strcmp0(current_page, "disk") == 0) {
-        g_signal_connect_swapped(next_button, "clicked", G_CALLBACK(navigate_to_page), "network");
-    } else if (g_strcmp0(current_page, "network") == 0) {
-        g_signal_connect_swapped(next_button, "clicked", G_CALLBACK(navigate_to_page), "user");
+    
+    current_page = find_page(page_name);
+    g_return_if_fail(current_page != NULL);
+    
+    gtk_widget_set_visible(back_button, current_page->prev != NULL);
+    gtk_button_set_label(GTK_BUTTON(next_button), current_page->next_label);
+}
+
+// Forwards how a search narrowed or widened its results to a list filter
+void filter_changed_for_search(GtkFilter* filter, SearchChange change) {
+    switch (change) {
+    case SEARCH_CHANGE_MORE_STRICT:
+        gtk_filter_changed(filter, GTK_FILTER_CHANGE_MORE_STRICT);
+        break;
+    case SEARCH_CHANGE_LESS_STRICT:
+        gtk_filter_changed(filter, GTK_FILTER_CHANGE_LESS_STRICT);
+        break;
+    case SEARCH_CHANGE_DIFFERENT:
+        gtk_filter_changed(filter, GTK_FILTER_CHANGE_DIFFERENT);
+        break;
+    case SEARCH_CHANGE_NONE:
+        break;
     }
 }
 
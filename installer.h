@@ -3,6 +3,7 @@
 
 #include <gtk/gtk.h>
 #include <glib.h>
+#include "search-index.h"
 
 // Main installer window
 void create_installer_window(GtkApplication *app);
@@ -15,21 +16,42 @@ GtkWidget* create_keyboard_page(void);
 GtkWidget* create_disk_page(void);
 GtkWidget* create_network_page(void);
 GtkWidget* create_user_page(void);
+GtkWidget* create_progress_page(void);
+
+// The progress page follows the running install once per frame until it
+// is told how the install ended; message goes to the end of its log
+void progress_page_start(void);
+void progress_page_finish(gboolean success, const char* message);
+
+// Page validation hooks, run before leaving a page with the Next button
+gboolean validate_user_page(void);
+
+// Selections made on the pages; NULL when nothing has been chosen
+char* get_selected_disk_node(void);
+char* get_selected_locale(void);            // "de_DE", "sr_RS@latin"
+char* get_selected_timezone(void);
+char* get_selected_keyboard_layout(void);
+char* get_selected_keyboard_variant(void);  // "" for the plain layout
 
 // Navigation functions
+GtkWidget* ensure_page(const char* page_name);
 void navigate_to_page(const char* page_name);
-void setup_navigation_buttons(GtkWidget* page, const char* current_page);
+void setup_navigation_buttons(GtkWidget* page, const char* page_name);
 
 // Utility functions
 GtkWidget* create_rounded_frame(GtkWidget* child);
-GtkWidget* create_disk_card(const char* name, const char* size, const char* type, const char* icon_name);
+GtkWidget* create_disk_card(const char* name, const char* size, const char* type, const char* details,
+                            const char* icon_name);
 GtkWidget* create_network_card(const char* name, const char* signal_strength, gboolean is_secure);
 void show_wifi_password_dialog(GtkWidget* parent, const char* network_name);
 void apply_custom_css(void);
+void apply_page_css(const char* page_name);
+void filter_changed_for_search(GtkFilter* filter, SearchChange change);
 
 // Global variables
 extern GtkWidget* main_window;
 extern GtkWidget* main_stack;
 extern GtkWidget* navigation_box;
+extern gint64 installer_start_time;
 
 #endif // INSTALLER_H
@@ -0,0 +1,505 @@
+#include "keyboard-view.h"
+#include "trace.h"
+#include <math.h>
+#include <string.h>
+#include <xkbcommon/xkbcommon.h>
+
+#define KEYBOARD_COLUMNS 15.0f
+#define KEYBOARD_ROWS 5
+#define MIN_KEY_SIZE 24
+#define NATURAL_KEY_SIZE 40
+#define KEY_GAP 2.0f
+#define KEY_RADIUS 4.0f
+#define MAX_CACHED_LAYOUTS 16
+
+// XKB keycodes are evdev keycodes offset by 8
+#define EVDEV(code) ((code) + 8)
+
+typedef struct {
+    guint8 row;
+    float width;        // in key units
+    guint16 keycode;    // XKB keycode
+    const char* label;  // fixed label for non-character keys; NULL when the keymap provides the legends
+} KeyboardKey;
+
+// pc105 main block, every row is 15 units wide
+static const KeyboardKey keyboard_keys[] = {
+    {0, 1.0f, EVDEV(41), NULL},
+    {0, 1.0f, EVDEV(2), NULL}, {0, 1.0f, EVDEV(3), NULL}, {0, 1.0f, EVDEV(4), NULL},
+    {0, 1.0f, EVDEV(5), NULL}, {0, 1.0f, EVDEV(6), NULL}, {0, 1.0f, EVDEV(7), NULL},
+    {0, 1.0f, EVDEV(8), NULL}, {0, 1.0f, EVDEV(9), NULL}, {0, 1.0f, EVDEV(10), NULL},
+    {0, 1.0f, EVDEV(11), NULL}, {0, 1.0f, EVDEV(12), NULL}, {0, 1.0f, EVDEV(13), NULL},
+    {0, 2.0f, EVDEV(14), "⌫"},
+    
+    {1, 1.5f, EVDEV(15), "Tab"},
+    {1, 1.0f, EVDEV(16), NULL}, {1, 1.0f, EVDEV(17), NULL}, {1, 1.0f, EVDEV(18), NULL},
+    {1, 1.0f, EVDEV(19), NULL}, {1, 1.0f, EVDEV(20), NULL}, {1, 1.0f, EVDEV(21), NULL},
+    {1, 1.0f, EVDEV(22), NULL}, {1, 1.0f, EVDEV(23), NULL}, {1, 1.0f, EVDEV(24), NULL},
+    {1, 1.0f, EVDEV(25), NULL}, {1, 1.0f, EVDEV(26), NULL}, {1, 1.0f, EVDEV(27), NULL},
+    {1, 1.5f, EVDEV(43), NULL},
+    
+    {2, 1.75f, EVDEV(58), "Caps"},
+    {2, 1.0f, EVDEV(30), NULL}, {2, 1.0f, EVDEV(31), NULL}, {2, 1.0f, EVDEV(32), NULL},
+    {2, 1.0f, EVDEV(33), NULL}, {2, 1.0f, EVDEV(34), NULL}, {2, 1.0f, EVDEV(35), NULL},
+    {2, 1.0f, EVDEV(36), NULL}, {2, 1.0f, EVDEV(37), NULL}, {2, 1.0f, EVDEV(38), NULL},
+    {2, 1.0f, EVDEV(39), NULL}, {2, 1.0f, EVDEV(40), NULL},
+    {2, 2.25f, EVDEV(28), "Enter"},
+    
+    {3, 1.25f, EVDEV(42), "Shift"},
+    {3, 1.0f, EVDEV(86), NULL},
+    {3, 1.0f, EVDEV(44), NULL}, {3, 1.0f, EVDEV(45), NULL}, {3, 1.0f, EVDEV(46), NULL},
+    {3, 1.0f, EVDEV(47), NULL}, {3, 1.0f, EVDEV(48), NULL}, {3, 1.0f, EVDEV(49), NULL},
+    {3, 1.0f, EVDEV(50), NULL}, {3, 1.0f, EVDEV(51), NULL}, {3, 1.0f, EVDEV(52), NULL},
+    {3, 1.0f, EVDEV(53), NULL},
+    {3, 2.75f, EVDEV(54), "Shift"},
+    
+    {4, 1.25f, EVDEV(29), "Ctrl"},
+    {4, 1.25f, EVDEV(125), "Super"},
+    {4, 1.25f, EVDEV(56), "Alt"},
+    {4, 6.25f, EVDEV(57), ""},
+    {4, 1.25f, EVDEV(100), "AltGr"},
+    {4, 1.25f, EVDEV(126), "Super"},
+    {4, 1.25f, EVDEV(127), "Menu"},
+    {4, 1.25f, EVDEV(97), "Ctrl"}
+};
+
+#define N_KEYS G_N_ELEMENTS(keyboard_keys)
+
+// Left edge of every key in key units, filled in once by class_init
+static float key_offsets[N_KEYS];
+
+// Dead keys have no UTF-8 form of their own, so show the accent they add
+static const struct {
+    xkb_keysym_t keysym;
+    const char* legend;
+} dead_key_legends[] = {
+    {XKB_KEY_dead_grave, "`"},
+    {XKB_KEY_dead_acute, "´"},
+    {XKB_KEY_dead_circumflex, "^"},
+    {XKB_KEY_dead_tilde, "~"},
+    {XKB_KEY_dead_macron, "¯"},
+    {XKB_KEY_dead_breve, "˘"},
+    {XKB_KEY_dead_abovedot, "˙"},
+    {XKB_KEY_dead_diaeresis, "¨"},
+    {XKB_KEY_dead_abovering, "˚"},
+    {XKB_KEY_dead_doubleacute, "˝"},
+    {XKB_KEY_dead_caron, "ˇ"},
+    {XKB_KEY_dead_cedilla, "¸"},
+    {XKB_KEY_dead_ogonek, "˛"}
+};
+
+enum {
+    LEVEL_BASE,
+    LEVEL_SHIFT,
+    LEVEL_ALTGR,
+    N_LEVELS
+};
+
+typedef struct {
+    char legends[N_KEYS][N_LEVELS][8];
+} KeyboardLegends;
+
+typedef struct {
+    KeyboardLegends* legends;
+    GskRenderNode* node;  // NULL until drawn at the current size and style
+    float unit;
+} CachedLayout;
+
+typedef struct {
+    char* key;
+    char* layout;
+    char* variant;
+} LayoutRequest;
+
+struct _WaveKeyboardView {
+    GtkWidget parent_instance;
+    char* layout_key;       // "layout(variant)" that was asked for
+    GHashTable* layouts;    // layout_key -> CachedLayout
+    CachedLayout* blank;    // shown before the first keymap is ready
+    CachedLayout* current;  // either blank or owned by layouts
+    GCancellable* pending;
+    guint pressed_keycode;
+};
+
+G_DEFINE_TYPE(WaveKeyboardView, wave_keyboard_view, GTK_TYPE_WIDGET)
+
+static void cached_layout_free(CachedLayout* cached) {
+    g_clear_pointer(&cached->node, gsk_render_node_unref);
+    g_free(cached->legends);
+    g_free(cached);
+}
+
+static void layout_request_free(LayoutRequest* request) {
+    g_free(request->key);
+    g_free(request->layout);
+    g_free(request->variant);
+    g_free(request);
+}
+
+static void keysym_to_legend(xkb_keysym_t keysym, char* buffer, gsize size) {
+    buffer[0] = '\0';
+    if (keysym == XKB_KEY_NoSymbol) {
+        return;
+    }
+    
+    for (guint i = 0; i < G_N_ELEMENTS(dead_key_legends); i++) {
+        if (dead_key_legends[i].keysym == keysym) {
+            g_strlcpy(buffer, dead_key_legends[i].legend, size);
+            return;
+        }
+    }
+    
+    // Control characters and keysyms without a character get no legend
+    int length = xkb_keysym_to_utf8(keysym, buffer, size);
+    if (length <= 0 || (guchar)buffer[0] < 0x20 || buffer[0] == 0x7f) {
+        buffer[0] = '\0';
+    }
+}
+
+static void compile_keymap_thread(GTask* task, gpointer source_object, gpointer task_data,
+                                  GCancellable* cancellable) {
+    const LayoutRequest* request = task_data;
+    TRACE_BEGIN("keymap_compile");
+    
+    struct xkb_context* context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+    struct xkb_rule_names names = {"evdev", "pc105", request->layout, request->variant, NULL};
+    struct xkb_keymap* keymap = context
+        ? xkb_keymap_new_from_names(context, &names, XKB_KEYMAP_COMPILE_NO_FLAGS)
+        : NULL;
+    
+    if (!keymap) {
+        if (context) {
+            xkb_context_unref(context);
+        }
+        TRACE_END("keymap_compile");
+        g_task_return_new_error(task, G_IO_ERROR, G_IO_ERROR_FAILED,
+                                "Could not compile keymap %s", request->key);
+        return;
+    }
+    
+    // Levels 1-3 are base, Shift and AltGr for all common key types
+    KeyboardLegends* legends = g_new0(KeyboardLegends, 1);
+    for (guint i = 0; i < N_KEYS; i++) {
+        if (keyboard_keys[i].label) {
+            continue;
+        }
+        
+        for (int level = 0; level < N_LEVELS; level++) {
+            const xkb_keysym_t* keysyms;
+            int n = xkb_keymap_key_get_syms_by_level(keymap, keyboard_keys[i].keycode, 0, level, &keysyms);
+            if (n > 0) {
+                keysym_to_legend(keysyms[0], legends->legends[i][level], sizeof(legends->legends[i][level]));
+            }
+        }
+    }
+    
+    xkb_keymap_unref(keymap);
+    xkb_context_unref(context);
+    TRACE_END("keymap_compile");
+    g_task_return_pointer(task, legends, g_free);
+}
+
+static void get_key_rect(guint index, float unit, graphene_rect_t* rect) {
+    graphene_rect_init(rect, key_offsets[index] * unit + KEY_GAP, keyboard_keys[index].row * unit + KEY_GAP,
+                       keyboard_keys[index].width * unit - 2 * KEY_GAP, unit - 2 * KEY_GAP);
+}
+
+static void get_foreground_color(GtkWidget* widget, GdkRGBA* color) {
+#if GTK_CHECK_VERSION(4, 10, 0)
+    gtk_widget_get_color(widget, color);
+#else
+    gtk_style_context_get_color(gtk_widget_get_style_context(widget), color);
+#endif
+}
+
+// Draws text so that the point (x, y) sits at the given fraction of its extents
+static void append_text(GtkSnapshot* snapshot, PangoLayout* layout, const char* text,
+                        float x, float y, float align_x, float align_y, const GdkRGBA* color) {
+    PangoRectangle extents;
+    pango_layout_set_text(layout, text, -1);
+    pango_layout_get_pixel_extents(layout, NULL, &extents);
+    
+    gtk_snapshot_save(snapshot);
+    gtk_snapshot_translate(snapshot, &GRAPHENE_POINT_INIT(x - extents.width * align_x - extents.x,
+                                                          y - extents.height * align_y - extents.y));
+    gtk_snapshot_append_layout(snapshot, layout, color);
+    gtk_snapshot_restore(snapshot);
+}
+
+static gboolean is_case_pair(const char* base, const char* shifted) {
+    gunichar lower = g_utf8_get_char(base);
+    return base[0] && shifted[0] && g_unichar_toupper(lower) == g_utf8_get_char(shifted) &&
+           lower != g_utf8_get_char(shifted);
+}
+
+static GskRenderNode* build_keyboard_node(GtkWidget* widget, const KeyboardLegends* legends, float unit) {
+    TRACE_BEGIN("keyboard_node_build");
+    GdkRGBA foreground;
+    get_foreground_color(widget, &foreground);
+    
+    GdkRGBA key_color = foreground;
+    key_color.alpha *= 0.06f;
+    GdkRGBA border_color = foreground;
+    border_color.alpha *= 0.25f;
+    GdkRGBA secondary_color = foreground;
+    secondary_color.alpha *= 0.6f;
+    const float border_widths[4] = {1, 1, 1, 1};
+    const GdkRGBA border_colors[4] = {border_color, border_color, border_color, border_color};
+    
+    PangoLayout* layout = gtk_widget_create_pango_layout(widget, NULL);
+    PangoContext* context = pango_layout_get_context(layout);
+    PangoFontDescription* font = pango_font_description_copy(pango_context_get_font_description(context));
+    float padding = unit * 0.12f;
+    
+    GtkSnapshot* snapshot = gtk_snapshot_new();
+    for (guint i = 0; i < N_KEYS; i++) {
+        const KeyboardKey* key = &keyboard_keys[i];
+        graphene_rect_t rect;
+        GskRoundedRect outline;
+        
+        get_key_rect(i, unit, &rect);
+        gsk_rounded_rect_init_from_rect(&outline, &rect, KEY_RADIUS);
+        gtk_snapshot_push_rounded_clip(snapshot, &outline);
+        gtk_snapshot_append_color(snapshot, &key_color, &rect);
+        gtk_snapshot_pop(snapshot);
+        gtk_snapshot_append_border(snapshot, &outline, border_widths, border_colors);
+        
+        float left = rect.origin.x + padding;
+        float right = rect.origin.x + rect.size.width - padding;
+        float top = rect.origin.y + padding * 0.5f;
+        float bottom = rect.origin.y + rect.size.height - padding * 0.5f;
+        
+        if (key->label) {
+            pango_font_description_set_absolute_size(font, unit * 0.24f * PANGO_SCALE);
+            pango_layout_set_font_description(layout, font);
+            append_text(snapshot, layout, key->label, rect.origin.x + rect.size.width / 2,
+                        rect.origin.y + rect.size.height / 2, 0.5f, 0.5f, &secondary_color);
+            continue;
+        }
+        
+        const char* base = legends->legends[i][LEVEL_BASE];
+        const char* shifted = legends->legends[i][LEVEL_SHIFT];
+        const char* altgr = legends->legends[i][LEVEL_ALTGR];
+        
+        pango_font_description_set_absolute_size(font, unit * 0.34f * PANGO_SCALE);
+        pango_layout_set_font_description(layout, font);
+        
+        // Letters only show their capital, like printed key caps
+        if (is_case_pair(base, shifted)) {
+            append_text(snapshot, layout, shifted, left, top, 0.0f, 0.0f, &foreground);
+        } else {
+            if (shifted[0] && strcmp(shifted, base) != 0) {
+                append_text(snapshot, layout, shifted, left, top, 0.0f, 0.0f, &foreground);
+            }
+            if (base[0]) {
+                append_text(snapshot, layout, base, left, bottom, 0.0f, 1.0f, &foreground);
+            }
+        }
+        
+        if (altgr[0] && strcmp(altgr, base) != 0 && strcmp(altgr, shifted) != 0) {
+            pango_font_description_set_absolute_size(font, unit * 0.26f * PANGO_SCALE);
+            pango_layout_set_font_description(layout, font);
+            append_text(snapshot, layout, altgr, right, bottom, 1.0f, 1.0f, &secondary_color);
+        }
+    }
+    
+    pango_font_description_free(font);
+    g_object_unref(layout);
+    TRACE_END("keyboard_node_build");
+    return gtk_snapshot_free_to_node(snapshot);
+}
+
+static void wave_keyboard_view_snapshot(GtkWidget* widget, GtkSnapshot* snapshot) {
+    WaveKeyboardView* view = WAVE_KEYBOARD_VIEW(widget);
+    int width = gtk_widget_get_width(widget);
+    int height = gtk_widget_get_height(widget);
+    float unit = floorf(MIN(width / KEYBOARD_COLUMNS, height / (float)KEYBOARD_ROWS));
+    
+    if (unit <= 4 * KEY_GAP) {
+        return;
+    }
+    
+    CachedLayout* cached = view->current;
+    if (!cached->node || cached->unit != unit) {
+        g_clear_pointer(&cached->node, gsk_render_node_unref);
+        cached->node = build_keyboard_node(widget, cached->legends, unit);
+        cached->unit = unit;
+    }
+    
+    gtk_snapshot_save(snapshot);
+    gtk_snapshot_translate(snapshot, &GRAPHENE_POINT_INIT(floorf((width - unit * KEYBOARD_COLUMNS) / 2), 0));
+    if (cached->node) {
+        gtk_snapshot_append_node(snapshot, cached->node);
+    }
+    
+    // The highlight is drawn over the cached node, so key presses only cost one extra node
+    if (view->pressed_keycode) {
+        for (guint i = 0; i < N_KEYS; i++) {
+            if (keyboard_keys[i].keycode == view->pressed_keycode) {
+                GdkRGBA highlight = {0.0f, 0.4f, 0.8f, 0.45f};
+                graphene_rect_t rect;
+                GskRoundedRect outline;
+                
+                get_key_rect(i, unit, &rect);
+                gsk_rounded_rect_init_from_rect(&outline, &rect, KEY_RADIUS);
+                gtk_snapshot_push_rounded_clip(snapshot, &outline);
+                gtk_snapshot_append_color(snapshot, &highlight, &rect);
+                gtk_snapshot_pop(snapshot);
+                break;
+            }
+        }
+    }
+    gtk_snapshot_restore(snapshot);
+}
+
+static void wave_keyboard_view_measure(GtkWidget* widget, GtkOrientation orientation, int for_size,
+                                       int* minimum, int* natural, int* minimum_baseline, int* natural_baseline) {
+    if (orientation == GTK_ORIENTATION_HORIZONTAL) {
+        *minimum = (int)(KEYBOARD_COLUMNS * MIN_KEY_SIZE);
+        *natural = (int)(KEYBOARD_COLUMNS * NATURAL_KEY_SIZE);
+    } else {
+        *minimum = KEYBOARD_ROWS * MIN_KEY_SIZE;
+        *natural = KEYBOARD_ROWS * NATURAL_KEY_SIZE;
+    }
+}
+
+// Colors and fonts come from the style, so every cached node is stale now
+static void invalidate_nodes(WaveKeyboardView* view) {
+    GHashTableIter iter;
+    gpointer value;
+    
+    g_hash_table_iter_init(&iter, view->layouts);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        g_clear_pointer(&((CachedLayout*)value)->node, gsk_render_node_unref);
+    }
+    g_clear_pointer(&view->blank->node, gsk_render_node_unref);
+    gtk_widget_queue_draw(GTK_WIDGET(view));
+}
+
+static void wave_keyboard_view_css_changed(GtkWidget* widget, GtkCssStyleChange* change) {
+    GTK_WIDGET_CLASS(wave_keyboard_view_parent_class)->css_changed(widget, change);
+    invalidate_nodes(WAVE_KEYBOARD_VIEW(widget));
+}
+
+static void wave_keyboard_view_system_setting_changed(GtkWidget* widget, GtkSystemSetting setting) {
+    GTK_WIDGET_CLASS(wave_keyboard_view_parent_class)->system_setting_changed(widget, setting);
+    invalidate_nodes(WAVE_KEYBOARD_VIEW(widget));
+}
+
+static void wave_keyboard_view_dispose(GObject* object) {
+    WaveKeyboardView* view = WAVE_KEYBOARD_VIEW(object);
+    
+    if (view->pending) {
+        g_cancellable_cancel(view->pending);
+        g_clear_object(&view->pending);
+    }
+    g_clear_pointer(&view->layouts, g_hash_table_destroy);
+    g_clear_pointer(&view->blank, cached_layout_free);
+    g_clear_pointer(&view->layout_key, g_free);
+    view->current = NULL;
+    
+    G_OBJECT_CLASS(wave_keyboard_view_parent_class)->dispose(object);
+}
+
+static void wave_keyboard_view_class_init(WaveKeyboardViewClass* klass) {
+    GObjectClass* object_class = G_OBJECT_CLASS(klass);
+    GtkWidgetClass* widget_class = GTK_WIDGET_CLASS(klass);
+    
+    object_class->dispose = wave_keyboard_view_dispose;
+    widget_class->snapshot = wave_keyboard_view_snapshot;
+    widget_class->measure = wave_keyboard_view_measure;
+    widget_class->css_changed = wave_keyboard_view_css_changed;
+    widget_class->system_setting_changed = wave_keyboard_view_system_setting_changed;
+    gtk_widget_class_set_css_name(widget_class, "keyboard-view");
+    
+    float x = 0;
+    for (guint i = 0; i < N_KEYS; i++) {
+        if (i > 0 && keyboard_keys[i].row != keyboard_keys[i - 1].row) {
+            x = 0;
+        }
+        key_offsets[i] = x;
+        x += keyboard_keys[i].width;
+    }
+}
+
+static void wave_keyboard_view_init(WaveKeyboardView* view) {
+    view->layouts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)cached_layout_free);
+    view->blank = g_new0(CachedLayout, 1);
+    view->blank->legends = g_new0(KeyboardLegends, 1);
+    view->current = view->blank;
+}
+
+GtkWidget* wave_keyboard_view_new(void) {
+    return g_object_new(WAVE_TYPE_KEYBOARD_VIEW, NULL);
+}
+
+static void on_keymap_compiled(GObject* source, GAsyncResult* result, gpointer user_data) {
+    GError* error = NULL;
+    KeyboardLegends* legends = g_task_propagate_pointer(G_TASK(result), &error);
+    
+    // A cancelled task means the layout changed again or the view is gone
+    if (!legends) {
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_debug("%s", error->message);
+        }
+        g_error_free(error);
+        return;
+    }
+    
+    WaveKeyboardView* view = WAVE_KEYBOARD_VIEW(source);
+    const LayoutRequest* request = g_task_get_task_data(G_TASK(result));
+    g_clear_object(&view->pending);
+    
+    if (g_hash_table_size(view->layouts) >= MAX_CACHED_LAYOUTS) {
+        view->current = view->blank;
+        g_hash_table_remove_all(view->layouts);
+    }
+    
+    CachedLayout* cached = g_new0(CachedLayout, 1);
+    cached->legends = legends;
+    g_hash_table_insert(view->layouts, g_strdup(request->key), cached);
+    
+    view->current = cached;
+    gtk_widget_queue_draw(GTK_WIDGET(view));
+}
+
+void wave_keyboard_view_set_layout(WaveKeyboardView* view, const char* layout, const char* variant) {
+    char* key = g_strdup_printf("%s(%s)", layout, variant ? variant : "");
+    if (g_strcmp0(key, view->layout_key) == 0) {
+        g_free(key);
+        return;
+    }
+    
+    g_free(view->layout_key);
+    view->layout_key = key;
+    
+    if (view->pending) {
+        g_cancellable_cancel(view->pending);
+        g_clear_object(&view->pending);
+    }
+    
+    CachedLayout* cached = g_hash_table_lookup(view->layouts, key);
+    if (cached) {
+        view->current = cached;
+        gtk_widget_queue_draw(GTK_WIDGET(view));
+        return;
+    }
+    
+    LayoutRequest* request = g_new0(LayoutRequest, 1);
+    request->key = g_strdup(key);
+    request->layout = g_strdup(layout);
+    request->variant = g_strdup(variant ? variant : "");
+    
+    view->pending = g_cancellable_new();
+    GTask* task = g_task_new(view, view->pending, on_keymap_compiled, NULL);
+    g_task_set_task_data(task, request, (GDestroyNotify)layout_request_free);
+    g_task_run_in_thread(task, compile_keymap_thread);
+    g_object_unref(task);
+}
+
+void wave_keyboard_view_set_pressed_key(WaveKeyboardView* view, guint keycode) {
+    if (view->pressed_keycode != keycode) {
+        view->pressed_keycode = keycode;
+        gtk_widget_queue_draw(GTK_WIDGET(view));
+    }
+}
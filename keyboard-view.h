@@ -0,0 +1,21 @@
+#ifndef KEYBOARD_VIEW_H
+#define KEYBOARD_VIEW_H
+
+#include <gtk/gtk.h>
+
+// Draws a full pc105 keyboard for an XKB layout in a single snapshot. The
+// legends are read from the compiled keymap on a worker thread, and the
+// render node for each layout is kept, so switching back to a layout or
+// highlighting a key does not rebuild any text.
+#define WAVE_TYPE_KEYBOARD_VIEW (wave_keyboard_view_get_type())
+G_DECLARE_FINAL_TYPE(WaveKeyboardView, wave_keyboard_view, WAVE, KEYBOARD_VIEW, GtkWidget)
+
+GtkWidget* wave_keyboard_view_new(void);
+
+// Keeps showing the previous layout until the new keymap has been compiled
+void wave_keyboard_view_set_layout(WaveKeyboardView* view, const char* layout, const char* variant);
+
+// Highlights the key with the given XKB (hardware) keycode; 0 clears it
+void wave_keyboard_view_set_pressed_key(WaveKeyboardView* view, guint keycode);
+
+#endif // KEYBOARD_VIEW_H
@@ -0,0 +1,483 @@
+#include "keyboards.h"
+#include "trace.h"
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#define DEFAULT_XKB_ROOT "/usr/share/X11/xkb"
+#define RULES_FILE_NAME "evdev.xml"
+#define CACHE_FILE_NAME "xkb-layouts.cache"
+
+// Bump the trailing digit whenever the cache layout changes
+#define CACHE_MAGIC "WAVEXKB1"
+#define CACHE_FIELDS 4
+
+#define PARSE_CHUNK_SIZE (64 * 1024)
+
+// The cache is a header, then CACHE_FIELDS string offsets per entry, then a
+// pool of NUL-terminated strings. It is written and read on the same machine,
+// so everything is in native byte order.
+typedef struct {
+    char magic[8];
+    gint64 source_mtime;
+    gint64 source_size;
+    guint32 n_entries;
+    guint32 strings_size;
+} CacheHeader;
+
+static const KeyboardLayoutInfo builtin_layouts[] = {
+    {"us", "", "English (US)", "eng"},
+    {"gb", "", "English (UK)", "eng"},
+    {"de", "", "German", "ger"},
+    {"fr", "", "French", "fre"},
+    {"es", "", "Spanish", "spa"},
+    {"it", "", "Italian", "ita"},
+    {"pt", "", "Portuguese", "por"},
+    {"ru", "", "Russian", "rus"},
+    {"cn", "", "Chinese", "chi"},
+    {"jp", "", "Japanese", "jpn"},
+    {"kr", "", "Korean", "kor"},
+    {"ara", "", "Arabic", "ara"},
+    {"in", "", "Indian", "hin"},
+    {"nl", "", "Dutch", "dut"},
+    {"pl", "", "Polish", "pol"},
+    {"se", "", "Swedish", "swe"},
+    {"no", "", "Norwegian", "nor"},
+    {"dk", "", "Danish", "dan"},
+    {"fi", "", "Finnish", "fin"},
+    {"gr", "", "Greek", "gre"}
+};
+
+static void build_search_index(KeyboardTable* table) {
+    table->search_index = search_index_new();
+    for (guint i = 0; i < table->n_entries; i++) {
+        const KeyboardLayoutInfo* info = &table->entries[i];
+        search_index_add(table->search_index, info->description, info->layout, info->variant,
+                         info->languages, NULL);
+    }
+}
+
+KeyboardTable* keyboard_table_new_builtin(void) {
+    guint n = G_N_ELEMENTS(builtin_layouts);
+    KeyboardTable* table = g_new0(KeyboardTable, 1);
+    table->entries = g_new0(KeyboardLayoutInfo, n);
+    table->n_entries = n;
+    table->strings = g_string_chunk_new(1024);
+    
+    for (guint i = 0; i < n; i++) {
+        table->entries[i].layout = g_string_chunk_insert_const(table->strings, builtin_layouts[i].layout);
+        table->entries[i].variant = g_string_chunk_insert_const(table->strings, builtin_layouts[i].variant);
+        table->entries[i].description = g_string_chunk_insert_const(table->strings, builtin_layouts[i].description);
+        table->entries[i].languages = g_string_chunk_insert_const(table->strings, builtin_layouts[i].languages);
+    }
+    
+    build_search_index(table);
+    return table;
+}
+
+void keyboard_table_free(KeyboardTable* table) {
+    if (!table) {
+        return;
+    }
+    
+    g_free(table->entries);
+    search_index_free(table->search_index);
+    if (table->strings) {
+        g_string_chunk_free(table->strings);
+    }
+    if (table->cache_file) {
+        g_mapped_file_unref(table->cache_file);
+    }
+    g_free(table);
+}
+
+int keyboard_table_find(const KeyboardTable* table, const char* layout, const char* variant) {
+    for (guint i = 0; i < table->n_entries; i++) {
+        const KeyboardLayoutInfo* info = &table->entries[i];
+        if (strcmp(info->layout, layout) == 0 && strcmp(info->variant, variant ? variant : "") == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Honours XKB_CONFIG_ROOT the same way libxkbcommon does
+static char* rules_file_path(void) {
+    const char* root = g_getenv("XKB_CONFIG_ROOT");
+    return g_build_filename(root && *root ? root : DEFAULT_XKB_ROOT, "rules", RULES_FILE_NAME, NULL);
+}
+
+static char* cache_file_path(void) {
+    return g_build_filename(g_get_user_cache_dir(), "wave-installer", CACHE_FILE_NAME, NULL);
+}
+
+// Parsed entry plus the description of its base layout, which keeps variants
+// grouped under their layout when sorting
+typedef struct {
+    KeyboardLayoutInfo info;
+    const char* layout_description;
+} ParsedLayout;
+
+// State for the streaming evdev.xml parser. Only the layoutList section is
+// read; models and options have configItems of their own.
+typedef struct {
+    GArray* layouts;   // ParsedLayout
+    GStringChunk* strings;
+    GString* text;
+    GString* languages;
+    char* name;
+    char* description;
+    const char* layout;
+    const char* layout_description;
+    const char* layout_languages;
+    gboolean in_layout_list;
+    gboolean in_variant;
+    gboolean collecting;
+} XkbParser;
+
+static void xkb_start_element(GMarkupParseContext* context, const char* element_name,
+                              const char** attribute_names, const char** attribute_values,
+                              gpointer user_data, GError** error) {
+    XkbParser* parser = user_data;
+    
+    if (strcmp(element_name, "layoutList") == 0) {
+        parser->in_layout_list = TRUE;
+    } else if (!parser->in_layout_list) {
+        return;
+    } else if (strcmp(element_name, "layout") == 0) {
+        parser->layout = NULL;
+        parser->in_variant = FALSE;
+    } else if (strcmp(element_name, "variant") == 0) {
+        parser->in_variant = TRUE;
+    } else if (strcmp(element_name, "configItem") == 0) {
+        g_clear_pointer(&parser->name, g_free);
+        g_clear_pointer(&parser->description, g_free);
+        g_string_truncate(parser->languages, 0);
+    } else if (strcmp(element_name, "name") == 0 || strcmp(element_name, "description") == 0 ||
+               strcmp(element_name, "iso639Id") == 0) {
+        parser->collecting = TRUE;
+        g_string_truncate(parser->text, 0);
+    }
+}
+
+// Adds the layout or variant described by the configItem that just ended
+static void xkb_add_config_item(XkbParser* parser) {
+    if (!parser->name || !*parser->name || (parser->in_variant && !parser->layout)) {
+        return;
+    }
+    
+    const char* description = parser->description && *parser->description ? parser->description : parser->name;
+    ParsedLayout entry = {0};
+    
+    if (!parser->in_variant) {
+        parser->layout = g_string_chunk_insert_const(parser->strings, parser->name);
+        parser->layout_description = g_string_chunk_insert(parser->strings, description);
+        parser->layout_languages = g_string_chunk_insert_const(parser->strings, parser->languages->str);
+        entry.info.variant = g_string_chunk_insert_const(parser->strings, "");
+        entry.info.description = parser->layout_description;
+        entry.info.languages = parser->layout_languages;
+    } else {
+        // Variants without a languageList inherit the languages of their layout
+        entry.info.variant = g_string_chunk_insert(parser->strings, parser->name);
+        entry.info.description = g_string_chunk_insert(parser->strings, description);
+        entry.info.languages = parser->languages->len
+            ? g_string_chunk_insert_const(parser->strings, parser->languages->str)
+            : parser->layout_languages;
+    }
+    
+    entry.info.layout = parser->layout;
+    entry.layout_description = parser->layout_description;
+    g_array_append_val(parser->layouts, entry);
+}
+
+static void xkb_end_element(GMarkupParseContext* context, const char* element_name,
+                            gpointer user_data, GError** error) {
+    XkbParser* parser = user_data;
+    
+    if (!parser->in_layout_list) {
+        return;
+    }
+    
+    if (strcmp(element_name, "layoutList") == 0) {
+        parser->in_layout_list = FALSE;
+    } else if (strcmp(element_name, "variant") == 0) {
+        parser->in_variant = FALSE;
+    } else if (strcmp(element_name, "configItem") == 0) {
+        xkb_add_config_item(parser);
+    } else if (strcmp(element_name, "name") == 0) {
+        g_free(parser->name);
+        parser->name = g_strdup(g_strstrip(parser->text->str));
+    } else if (strcmp(element_name, "description") == 0) {
+        g_free(parser->description);
+        parser->description = g_strdup(g_strstrip(parser->text->str));
+    } else if (strcmp(element_name, "iso639Id") == 0) {
+        if (parser->languages->len) {
+            g_string_append_c(parser->languages, ' ');
+        }
+        g_string_append(parser->languages, g_strstrip(parser->text->str));
+    }
+    parser->collecting = FALSE;
+}
+
+static void xkb_text(GMarkupParseContext* context, const char* text, gsize text_len,
+                     gpointer user_data, GError** error) {
+    XkbParser* parser = user_data;
+    if (parser->collecting) {
+        g_string_append_len(parser->text, text, text_len);
+    }
+}
+
+static const GMarkupParser xkb_parser_funcs = {
+    xkb_start_element,
+    xkb_end_element,
+    xkb_text,
+    NULL,
+    NULL
+};
+
+static int compare_parsed_layouts(gconstpointer a, gconstpointer b) {
+    const ParsedLayout* la = a;
+    const ParsedLayout* lb = b;
+    int result = g_ascii_strcasecmp(la->layout_description, lb->layout_description);
+    if (result == 0) {
+        result = strcmp(la->info.layout, lb->info.layout);
+    }
+    if (result == 0) {
+        // The base layout comes before its variants
+        result = (la->info.variant[0] != '\0') - (lb->info.variant[0] != '\0');
+    }
+    if (result == 0) {
+        result = g_ascii_strcasecmp(la->info.description, lb->info.description);
+    }
+    return result;
+}
+
+// Feeds the rules file to GMarkup in fixed-size chunks, so the document is
+// never held in memory as a whole
+static KeyboardTable* parse_rules_file(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+    
+    XkbParser parser = {0};
+    parser.layouts = g_array_new(FALSE, TRUE, sizeof(ParsedLayout));
+    parser.strings = g_string_chunk_new(32 * 1024);
+    parser.text = g_string_new(NULL);
+    parser.languages = g_string_new(NULL);
+    
+    GMarkupParseContext* context = g_markup_parse_context_new(&xkb_parser_funcs, 0, &parser, NULL);
+    char* buffer = g_malloc(PARSE_CHUNK_SIZE);
+    GError* error = NULL;
+    gboolean ok = TRUE;
+    size_t length;
+    
+    while (ok && (length = fread(buffer, 1, PARSE_CHUNK_SIZE, file)) > 0) {
+        ok = g_markup_parse_context_parse(context, buffer, length, &error);
+    }
+    if (ok) {
+        ok = g_markup_parse_context_end_parse(context, &error);
+    }
+    if (!ok) {
+        g_warning("Could not parse %s: %s", path, error->message);
+        g_error_free(error);
+    }
+    
+    g_free(buffer);
+    g_markup_parse_context_free(context);
+    fclose(file);
+    g_string_free(parser.text, TRUE);
+    g_string_free(parser.languages, TRUE);
+    g_free(parser.name);
+    g_free(parser.description);
+    
+    if (!ok || parser.layouts->len == 0) {
+        g_array_free(parser.layouts, TRUE);
+        g_string_chunk_free(parser.strings);
+        return NULL;
+    }
+    
+    g_array_sort(parser.layouts, compare_parsed_layouts);
+    
+    KeyboardTable* table = g_new0(KeyboardTable, 1);
+    table->n_entries = parser.layouts->len;
+    table->entries = g_new(KeyboardLayoutInfo, table->n_entries);
+    table->strings = parser.strings;
+    for (guint i = 0; i < table->n_entries; i++) {
+        table->entries[i] = g_array_index(parser.layouts, ParsedLayout, i).info;
+    }
+    
+    g_array_free(parser.layouts, TRUE);
+    return table;
+}
+
+// Maps the cache and points the entries straight into it. Returns NULL when
+// the cache is missing, damaged or was written for a different rules file.
+static KeyboardTable* load_cache(const char* path, const GStatBuf* source) {
+    GMappedFile* file = g_mapped_file_new(path, FALSE, NULL);
+    if (!file) {
+        return NULL;
+    }
+    
+    const char* data = g_mapped_file_get_contents(file);
+    gsize length = g_mapped_file_get_length(file);
+    CacheHeader header;
+    
+    if (length < sizeof(header)) {
+        g_mapped_file_unref(file);
+        return NULL;
+    }
+    memcpy(&header, data, sizeof(header));
+    
+    gsize records_size = (gsize)header.n_entries * CACHE_FIELDS * sizeof(guint32);
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.source_mtime != (gint64)source->st_mtime || header.source_size != (gint64)source->st_size ||
+        header.n_entries == 0 || header.strings_size == 0 ||
+        length != sizeof(header) + records_size + header.strings_size || data[length - 1] != '\0') {
+        g_mapped_file_unref(file);
+        return NULL;
+    }
+    
+    // The header is 32 bytes and the mapping is page aligned, so the offsets are aligned too
+    const guint32* records = (const guint32*)(data + sizeof(header));
+    const char* strings = data + sizeof(header) + records_size;
+    
+    for (gsize i = 0; i < (gsize)header.n_entries * CACHE_FIELDS; i++) {
+        if (records[i] >= header.strings_size) {
+            g_mapped_file_unref(file);
+            return NULL;
+        }
+    }
+    
+    KeyboardTable* table = g_new0(KeyboardTable, 1);
+    table->cache_file = file;
+    table->n_entries = header.n_entries;
+    table->entries = g_new(KeyboardLayoutInfo, table->n_entries);
+    
+    for (guint i = 0; i < table->n_entries; i++) {
+        const guint32* record = records + i * CACHE_FIELDS;
+        table->entries[i].layout = strings + record[0];
+        table->entries[i].variant = strings + record[1];
+        table->entries[i].description = strings + record[2];
+        table->entries[i].languages = strings + record[3];
+    }
+    
+    return table;
+}
+
+// Appends a string to the pool once and returns its offset
+static guint32 pool_string(GString* pool, GHashTable* offsets, const char* string) {
+    gpointer offset;
+    if (g_hash_table_lookup_extended(offsets, string, NULL, &offset)) {
+        return GPOINTER_TO_UINT(offset);
+    }
+    
+    guint32 new_offset = (guint32)pool->len;
+    g_string_append_len(pool, string, strlen(string) + 1);
+    g_hash_table_insert(offsets, (gpointer)string, GUINT_TO_POINTER(new_offset));
+    return new_offset;
+}
+
+static void write_cache(const char* path, const KeyboardTable* table, const GStatBuf* source) {
+    GString* pool = g_string_new(NULL);
+    GHashTable* offsets = g_hash_table_new(g_str_hash, g_str_equal);
+    guint32* records = g_new(guint32, (gsize)table->n_entries * CACHE_FIELDS);
+    
+    for (guint i = 0; i < table->n_entries; i++) {
+        const KeyboardLayoutInfo* info = &table->entries[i];
+        guint32* record = records + (gsize)i * CACHE_FIELDS;
+        record[0] = pool_string(pool, offsets, info->layout);
+        record[1] = pool_string(pool, offsets, info->variant);
+        record[2] = pool_string(pool, offsets, info->description);
+        record[3] = pool_string(pool, offsets, info->languages);
+    }
+    
+    CacheHeader header = {0};
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.source_mtime = (gint64)source->st_mtime;
+    header.source_size = (gint64)source->st_size;
+    header.n_entries = table->n_entries;
+    header.strings_size = (guint32)pool->len;
+    
+    GByteArray* contents = g_byte_array_new();
+    g_byte_array_append(contents, (const guint8*)&header, sizeof(header));
+    g_byte_array_append(contents, (const guint8*)records, (guint)((gsize)table->n_entries * CACHE_FIELDS * sizeof(guint32)));
+    g_byte_array_append(contents, (const guint8*)pool->str, (guint)pool->len);
+    
+    // g_file_set_contents() writes to a temporary file and renames it, so a
+    // concurrent reader never sees a half-written cache
+    char* directory = g_path_get_dirname(path);
+    GError* error = NULL;
+    if (g_mkdir_with_parents(directory, 0700) != 0 ||
+        !g_file_set_contents(path, (const char*)contents->data, contents->len, &error)) {
+        g_debug("Could not write keyboard layout cache %s: %s", path,
+                error ? error->message : g_strerror(errno));
+        g_clear_error(&error);
+    }
+    
+    g_free(directory);
+    g_byte_array_free(contents, TRUE);
+    g_free(records);
+    g_hash_table_destroy(offsets);
+    g_string_free(pool, TRUE);
+}
+
+KeyboardTable* keyboard_table_load(void) {
+    TRACE_BEGIN("keyboard_table_load");
+    char* rules_path = rules_file_path();
+    char* cache_path = cache_file_path();
+    KeyboardTable* table = NULL;
+    GStatBuf source;
+    
+    if (g_stat(rules_path, &source) == 0) {
+        gint64 start = g_get_monotonic_time();
+        TRACE_BEGIN("xkb_cache_load");
+        table = load_cache(cache_path, &source);
+        TRACE_END("xkb_cache_load");
+        
+        if (table) {
+            g_debug("Loaded %u keyboard layouts from cache in %.2f ms", table->n_entries,
+                    (g_get_monotonic_time() - start) / 1000.0);
+        } else {
+            start = g_get_monotonic_time();
+            TRACE_BEGIN("xkb_parse");
+            table = parse_rules_file(rules_path);
+            TRACE_END("xkb_parse");
+            
+            if (table) {
+                g_debug("Parsed %u keyboard layouts from %s in %.2f ms", table->n_entries, rules_path,
+                        (g_get_monotonic_time() - start) / 1000.0);
+                write_cache(cache_path, table, &source);
+            }
+        }
+    }
+    
+    g_free(rules_path);
+    g_free(cache_path);
+    
+    if (!table) {
+        TRACE_END("keyboard_table_load");
+        return keyboard_table_new_builtin();
+    }
+    
+    build_search_index(table);
+    TRACE_COUNTER("keyboard_layouts", table->n_entries);
+    TRACE_END("keyboard_table_load");
+    return table;
+}
+
+static void load_keyboards_thread(GTask* task, gpointer source_object, gpointer task_data,
+                                  GCancellable* cancellable) {
+    g_task_return_pointer(task, keyboard_table_load(), (GDestroyNotify)keyboard_table_free);
+}
+
+void keyboard_table_load_async(GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data) {
+    GTask* task = g_task_new(NULL, cancellable, callback, user_data);
+    g_task_run_in_thread(task, load_keyboards_thread);
+    g_object_unref(task);
+}
+
+KeyboardTable* keyboard_table_load_finish(GAsyncResult* result, GError** error) {
+    return g_task_propagate_pointer(G_TASK(result), error);
+}
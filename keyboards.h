@@ -0,0 +1,38 @@
+#ifndef KEYBOARDS_H
+#define KEYBOARDS_H
+
+#include <gio/gio.h>
+#include "search-index.h"
+
+// One selectable keyboard layout or layout variant. Variants directly follow
+// their base layout in the table. The strings live in the owning table's
+// string chunk or cache mapping.
+typedef struct {
+    const char* layout;       // XKB layout, e.g. "de"
+    const char* variant;      // XKB variant, e.g. "nodeadkeys"; "" for the base layout
+    const char* description;  // e.g. "German (no dead keys)"
+    const char* languages;    // space-separated ISO 639 codes, e.g. "ger"
+} KeyboardLayoutInfo;
+
+typedef struct {
+    KeyboardLayoutInfo* entries;
+    guint n_entries;
+    GStringChunk* strings;     // used by the built-in table and the XML parser
+    GMappedFile* cache_file;   // used when the table came from the binary cache
+    SearchIndex* search_index; // one entry per layout or variant, in table order
+} KeyboardTable;
+
+// Small built-in table used until the XKB rules have been loaded
+KeyboardTable* keyboard_table_new_builtin(void);
+
+// Reads the layouts from the binary cache, or parses evdev.xml and rewrites
+// the cache when it is missing or stale. Blocks, so call it from a worker
+// thread or through keyboard_table_load_async().
+KeyboardTable* keyboard_table_load(void);
+void keyboard_table_load_async(GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data);
+KeyboardTable* keyboard_table_load_finish(GAsyncResult* result, GError** error);
+
+int keyboard_table_find(const KeyboardTable* table, const char* layout, const char* variant);
+void keyboard_table_free(KeyboardTable* table);
+
+#endif // KEYBOARDS_H
@@ -0,0 +1,326 @@
+#include "locales.h"
+#include "trace.h"
+#include <string.h>
+
+#define SUPPORTED_LOCALES_FILE "/usr/share/i18n/SUPPORTED"
+#define LOCALE_SOURCE_DIR "/usr/share/i18n/locales"
+
+// Guards against `copy` cycles between locale source files
+#define MAX_COPY_DEPTH 4
+
+static const LocaleInfo builtin_locales[] = {
+    {"en_US", "English (United States)", "English (United States)"},
+    {"en_GB", "English (United Kingdom)", "English (United Kingdom)"},
+    {"de_DE", "Deutsch (Deutschland)", "German (Germany)"},
+    {"fr_FR", "Français (France)", "French (France)"},
+    {"es_ES", "Español (España)", "Spanish (Spain)"},
+    {"it_IT", "Italiano (Italia)", "Italian (Italy)"},
+    {"pt_BR", "Português (Brasil)", "Portuguese (Brazil)"},
+    {"ru_RU", "Русский (Россия)", "Russian (Russia)"},
+    {"zh_CN", "中文 (简体)", "Chinese (China)"},
+    {"ja_JP", "日本語 (日本)", "Japanese (Japan)"},
+    {"ko_KR", "한국어 (대한민국)", "Korean (South Korea)"},
+    {"ar_EG", "العربية", "Arabic (Egypt)"},
+    {"hi_IN", "हिन्दी (भारत)", "Hindi (India)"},
+    {"nl_NL", "Nederlands (Nederland)", "Dutch (Netherlands)"},
+    {"pl_PL", "Polski (Polska)", "Polish (Poland)"},
+    {"sv_SE", "Svenska (Sverige)", "Swedish (Sweden)"},
+    {"nb_NO", "Norsk (Norge)", "Norwegian Bokmål (Norway)"},
+    {"da_DK", "Dansk (Danmark)", "Danish (Denmark)"},
+    {"fi_FI", "Suomi (Suomi)", "Finnish (Finland)"},
+    {"el_GR", "Ελληνικά (Ελλάδα)", "Greek (Greece)"}
+};
+
+// Names read from the LC_IDENTIFICATION and LC_ADDRESS sections of a
+// locale source file
+typedef struct {
+    char* language;
+    char* territory;
+    char* native_language;
+    char* native_territory;
+} LocaleNames;
+
+static void locale_names_clear(LocaleNames* names) {
+    g_free(names->language);
+    g_free(names->territory);
+    g_free(names->native_language);
+    g_free(names->native_territory);
+}
+
+static LocaleTable* locale_table_new(guint reserve) {
+    LocaleTable* table = g_new0(LocaleTable, 1);
+    table->entries = g_new0(LocaleInfo, MAX(reserve, 1));
+    table->strings = g_string_chunk_new(16 * 1024);
+    return table;
+}
+
+static int compare_locales(gconstpointer a, gconstpointer b) {
+    const LocaleInfo* la = a;
+    const LocaleInfo* lb = b;
+    int result = g_ascii_strcasecmp(la->english_name, lb->english_name);
+    return result != 0 ? result : strcmp(la->code, lb->code);
+}
+
+static void build_search_index(LocaleTable* table) {
+    table->search_index = search_index_new();
+    for (guint i = 0; i < table->n_entries; i++) {
+        const LocaleInfo* info = &table->entries[i];
+        search_index_add(table->search_index, info->native_name, info->english_name, info->code, NULL);
+    }
+}
+
+LocaleTable* locale_table_new_from(const LocaleInfo* entries, guint n_entries) {
+    LocaleTable* table = locale_table_new(n_entries);
+    
+    for (guint i = 0; i < n_entries; i++) {
+        table->entries[i].code = g_string_chunk_insert_const(table->strings, entries[i].code);
+        table->entries[i].native_name = g_string_chunk_insert_const(table->strings, entries[i].native_name);
+        table->entries[i].english_name = g_string_chunk_insert_const(table->strings, entries[i].english_name);
+    }
+    table->n_entries = n_entries;
+    build_search_index(table);
+    return table;
+}
+
+LocaleTable* locale_table_new_builtin(void) {
+    return locale_table_new_from(builtin_locales, G_N_ELEMENTS(builtin_locales));
+}
+
+void locale_table_free(LocaleTable* table) {
+    if (!table) {
+        return;
+    }
+    g_free(table->entries);
+    g_string_chunk_free(table->strings);
+    search_index_free(table->search_index);
+    g_free(table);
+}
+
+int locale_table_find(const LocaleTable* table, const char* code) {
+    for (guint i = 0; i < table->n_entries; i++) {
+        if (g_strcmp0(table->entries[i].code, code) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// Decodes a quoted locale source value such as "<U0044><U0065>utsch" into UTF-8
+static char* decode_locale_value(const char* value, char escape_char) {
+    const char* p = strchr(value, '"');
+    if (!p) {
+        return NULL;
+    }
+    p++;
+    
+    GString* out = g_string_new(NULL);
+    while (*p && *p != '"') {
+        if (p[0] == '<' && p[1] == 'U') {
+            char* end = NULL;
+            gunichar c = (gunichar)g_ascii_strtoull(p + 2, &end, 16);
+            if (end && *end == '>') {
+                g_string_append_unichar(out, c);
+                p = end + 1;
+                continue;
+            }
+        }
+        if (*p == escape_char && p[1]) {
+            p++;
+        }
+        g_string_append_c(out, *p);
+        p++;
+    }
+    
+    if (out->len == 0) {
+        g_string_free(out, TRUE);
+        return NULL;
+    }
+    return g_string_free(out, FALSE);
+}
+
+static void read_locale_names(const char* locale_name, LocaleNames* names, int depth) {
+    char* path = g_build_filename(LOCALE_SOURCE_DIR, locale_name, NULL);
+    char* contents = NULL;
+    
+    if (depth > MAX_COPY_DEPTH || !g_file_get_contents(path, &contents, NULL, NULL)) {
+        g_free(path);
+        return;
+    }
+    g_free(path);
+    
+    char escape_char = '\\';
+    enum { SECTION_OTHER, SECTION_IDENTIFICATION, SECTION_ADDRESS } section = SECTION_OTHER;
+    char** lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+    
+    for (char** line = lines; *line; line++) {
+        char* text = g_strstrip(*line);
+        
+        if (g_str_has_prefix(text, "escape_char")) {
+            char* value = g_strstrip(text + strlen("escape_char"));
+            if (*value) {
+                escape_char = *value;
+            }
+        } else if (g_str_has_prefix(text, "END ")) {
+            section = SECTION_OTHER;
+        } else if (strcmp(text, "LC_IDENTIFICATION") == 0) {
+            section = SECTION_IDENTIFICATION;
+        } else if (strcmp(text, "LC_ADDRESS") == 0) {
+            section = SECTION_ADDRESS;
+        } else if (section == SECTION_OTHER) {
+            continue;
+        } else if (g_str_has_prefix(text, "copy")) {
+            char* source = decode_locale_value(text, escape_char);
+            if (source) {
+                // Only fill in what this file does not define itself
+                LocaleNames copied = {0};
+                read_locale_names(source, &copied, depth + 1);
+                if (section == SECTION_IDENTIFICATION) {
+                    if (!names->language) names->language = g_steal_pointer(&copied.language);
+                    if (!names->territory) names->territory = g_steal_pointer(&copied.territory);
+                } else {
+                    if (!names->native_language) names->native_language = g_steal_pointer(&copied.native_language);
+                    if (!names->native_territory) names->native_territory = g_steal_pointer(&copied.native_territory);
+                }
+                locale_names_clear(&copied);
+                g_free(source);
+            }
+        } else if (section == SECTION_IDENTIFICATION && !names->language && g_str_has_prefix(text, "language")) {
+            names->language = decode_locale_value(text, escape_char);
+        } else if (section == SECTION_IDENTIFICATION && !names->territory && g_str_has_prefix(text, "territory")) {
+            names->territory = decode_locale_value(text, escape_char);
+        } else if (section == SECTION_ADDRESS && !names->native_language && g_str_has_prefix(text, "lang_name")) {
+            names->native_language = decode_locale_value(text, escape_char);
+        } else if (section == SECTION_ADDRESS && !names->native_territory && g_str_has_prefix(text, "country_name")) {
+            names->native_territory = decode_locale_value(text, escape_char);
+        }
+    }
+    
+    g_strfreev(lines);
+}
+
+// Strips the charset from "de_DE.UTF-8" or "sr_RS.utf8@latin", keeping the modifier
+static char* locale_code_from_name(const char* name) {
+    const char* dot = strchr(name, '.');
+    if (!dot) {
+        return g_strdup(name);
+    }
+    const char* at = strchr(dot, '@');
+    char* base = g_strndup(name, dot - name);
+    char* code = g_strconcat(base, at ? at : "", NULL);
+    g_free(base);
+    return code;
+}
+
+static gboolean is_utf8_charset(const char* charset) {
+    return g_ascii_strcasecmp(charset, "UTF-8") == 0 || g_ascii_strcasecmp(charset, "utf8") == 0;
+}
+
+// Returns the UTF-8 locale codes offered by the system
+static GPtrArray* read_supported_codes(void) {
+    GPtrArray* codes = g_ptr_array_new_with_free_func(g_free);
+    char* contents = NULL;
+    
+    if (g_file_get_contents(SUPPORTED_LOCALES_FILE, &contents, NULL, NULL)) {
+        // Lines look like "de_DE.UTF-8 UTF-8" or "sr_RS@latin UTF-8"
+        char** lines = g_strsplit(contents, "\n", -1);
+        for (char** line = lines; *line; line++) {
+            char** fields = g_strsplit_set(g_strstrip(*line), " \t", 2);
+            if (fields[0] && fields[1] && *fields[0] != '#' && is_utf8_charset(g_strstrip(fields[1]))) {
+                g_ptr_array_add(codes, locale_code_from_name(fields[0]));
+            }
+            g_strfreev(fields);
+        }
+        g_strfreev(lines);
+        g_free(contents);
+    } else if (g_spawn_command_line_sync("locale -a", &contents, NULL, NULL, NULL)) {
+        // Lines look like "de_DE.utf8"; skip C, POSIX and non-UTF-8 locales
+        char** lines = g_strsplit(contents, "\n", -1);
+        for (char** line = lines; *line; line++) {
+            const char* dot = strchr(*line, '.');
+            if (strchr(*line, '_') && dot) {
+                char* charset = g_strndup(dot + 1, strcspn(dot + 1, "@"));
+                if (is_utf8_charset(charset)) {
+                    g_ptr_array_add(codes, locale_code_from_name(*line));
+                }
+                g_free(charset);
+            }
+        }
+        g_strfreev(lines);
+        g_free(contents);
+    }
+    
+    return codes;
+}
+
+static char* format_locale_name(const char* language, const char* territory) {
+    return territory ? g_strdup_printf("%s (%s)", language, territory) : g_strdup(language);
+}
+
+LocaleTable* locale_table_load(void) {
+    TRACE_BEGIN("locale_table_load");
+    GPtrArray* codes = read_supported_codes();
+    
+    if (codes->len == 0) {
+        g_ptr_array_free(codes, TRUE);
+        TRACE_END("locale_table_load");
+        return locale_table_new_builtin();
+    }
+    
+    LocaleTable* table = locale_table_new(codes->len);
+    GHashTable* seen = g_hash_table_new(g_str_hash, g_str_equal);
+    
+    for (guint i = 0; i < codes->len; i++) {
+        const char* code = g_ptr_array_index(codes, i);
+        if (g_hash_table_contains(seen, code)) {
+            continue;
+        }
+        
+        LocaleNames names = {0};
+        read_locale_names(code, &names, 0);
+        
+        // Fall back to the code itself when the locale sources are not installed
+        const char* language = names.language ? names.language : code;
+        char* english_name = format_locale_name(language, names.territory);
+        char* native_name = names.native_language
+            ? format_locale_name(names.native_language, names.native_territory)
+            : g_strdup(english_name);
+        
+        LocaleInfo* info = &table->entries[table->n_entries++];
+        info->code = g_string_chunk_insert_const(table->strings, code);
+        info->english_name = g_string_chunk_insert(table->strings, english_name);
+        info->native_name = g_string_chunk_insert(table->strings, native_name);
+        g_hash_table_add(seen, (gpointer)info->code);
+        
+        g_free(english_name);
+        g_free(native_name);
+        locale_names_clear(&names);
+    }
+    
+    qsort(table->entries, table->n_entries, sizeof(LocaleInfo), compare_locales);
+    
+    // Normalizing the search keys is the expensive part, so it happens here
+    // on the worker thread as well
+    build_search_index(table);
+    
+    g_hash_table_destroy(seen);
+    g_ptr_array_free(codes, TRUE);
+    TRACE_COUNTER("locales", table->n_entries);
+    TRACE_END("locale_table_load");
+    return table;
+}
+
+static void load_locales_thread(GTask* task, gpointer source_object, gpointer task_data,
+                                GCancellable* cancellable) {
+    g_task_return_pointer(task, locale_table_load(), (GDestroyNotify)locale_table_free);
+}
+
+void locale_table_load_async(GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data) {
+    GTask* task = g_task_new(NULL, cancellable, callback, user_data);
+    g_task_run_in_thread(task, load_locales_thread);
+    g_object_unref(task);
+}
+
+LocaleTable* locale_table_load_finish(GAsyncResult* result, GError** error) {
+    return g_task_propagate_pointer(G_TASK(result), error);
+}
@@ -0,0 +1,37 @@
+#ifndef LOCALES_H
+#define LOCALES_H
+
+#include <gio/gio.h>
+#include "search-index.h"
+
+// One selectable system locale. All strings live in the owning table's
+// string chunk.
+typedef struct {
+    const char* code;          // e.g. "de_DE", "sr_RS@latin"
+    const char* native_name;   // e.g. "Deutsch (Deutschland)"
+    const char* english_name;  // e.g. "German (Germany)"
+} LocaleInfo;
+
+typedef struct {
+    LocaleInfo* entries;
+    guint n_entries;
+    GStringChunk* strings;
+    SearchIndex* search_index;   // one entry per locale, in table order
+} LocaleTable;
+
+// Small built-in table used until the system locale set has been loaded
+LocaleTable* locale_table_new_builtin(void);
+
+// Copies the given entries, in order, into a new table and indexes them
+LocaleTable* locale_table_new_from(const LocaleInfo* entries, guint n_entries);
+
+// Reads the supported locales from /usr/share/i18n (or `locale -a`). Blocks,
+// so call it from a worker thread or through locale_table_load_async().
+LocaleTable* locale_table_load(void);
+void locale_table_load_async(GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data);
+LocaleTable* locale_table_load_finish(GAsyncResult* result, GError** error);
+
+int locale_table_find(const LocaleTable* table, const char* code);
+void locale_table_free(LocaleTable* table);
+
+#endif // LOCALES_H
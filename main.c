@@ -1,19 +1,47 @@
 #include <gtk/gtk.h>
 #include <glib.h>
 #include "installer.h"
+#include "trace.h"
 
 static void activate(GtkApplication* app, gpointer user_data) {
     create_installer_window(app);
 }
 
+static gint handle_local_options(GApplication* app, GVariantDict* options, gpointer user_data) {
+    const char* trace_path = NULL;
+    
+    if (!g_variant_dict_lookup(options, "trace", "^&ay", &trace_path)) {
+        trace_path = g_getenv("WAVE_TRACE");
+    }
+    
+    if (trace_path) {
+        trace_init(trace_path);
+        // The main span starts with the process, before options were parsed
+        if (trace_enabled) {
+            trace_begin_at("main", NULL, installer_start_time);
+        }
+    }
+    
+    // Continue with the default handling
+    return -1;
+}
+
 int main(int argc, char **argv) {
     GtkApplication *app;
     int status;
 
+    installer_start_time = g_get_monotonic_time();
     app = gtk_application_new("org.waveinstaller.installer", G_APPLICATION_DEFAULT_FLAGS);
+    g_application_add_main_option(G_APPLICATION(app), "trace", 0, G_OPTION_FLAG_NONE,
+                                  G_OPTION_ARG_FILENAME,
+                                  "Write a Chrome trace-event JSON file", "FILE");
+    g_signal_connect(app, "handle-local-options", G_CALLBACK(handle_local_options), NULL);
     g_signal_connect(app, "activate", G_CALLBACK(activate), NULL);
     status = g_application_run(G_APPLICATION(app), argc, argv);
     g_object_unref(app);
 
+    TRACE_END("main");
+    trace_shutdown();
+
     return status;
 }
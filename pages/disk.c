@@ -1,6 +1,18 @@
 #include "../installer.h"
+#include "../install.h"
+#include "../storage.h"
+#include <string.h>
+
+#define MAX_LISTED_PARTITIONS 8
 
 static GtkWidget* selected_disk_card = NULL;
+static GtkWidget* disk_list_box = NULL;
+static GtkWidget* disk_status_label = NULL;
+static GHashTable* disk_cards = NULL;  // kernel name -> card
+static guint pending_probes = 0;
+static guint64 required_size = 0;      // 0 when not known; every disk is offered then
+static GHashTable* disk_speeds = NULL; // kernel name -> StorageSpeed, kept when a card is replaced
+static GtkWidget* recommended_card = NULL;
 
 static void on_disk_card_clicked(GtkButton* button, gpointer user_data) {
     GtkWidget* card = GTK_WIDGET(button);
@@ -15,7 +27,15 @@ static void on_disk_card_clicked(GtkButton* button, gpointer user_data) {
     gtk_widget_add_css_class(card, "selected-card");
 }
 
-GtkWidget* create_disk_card(const char* name, const char* size, const char* type, const char* icon_name) {
+char* get_selected_disk_node(void) {
+    if (!selected_disk_card) {
+        return NULL;
+    }
+    return storage_get_device_node(g_object_get_data(G_OBJECT(selected_disk_card), "device-name"));
+}
+
+GtkWidget* create_disk_card(const char* name, const char* size, const char* type, const char* details,
+                            const char* icon_name) {
     GtkWidget* card_button = gtk_button_new();
     gtk_widget_add_css_class(card_button, "disk-card");
     g_signal_connect(card_button, "clicked", G_CALLBACK(on_disk_card_clicked), NULL);
@@ -37,10 +57,19 @@ GtkWidget* create_disk_card(const char* name, const char* size, const char* type
     gtk_widget_set_hexpand(info_box, TRUE);
     gtk_widget_set_halign(info_box, GTK_ALIGN_START);
     
+    GtkWidget* name_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
     GtkWidget* name_label = gtk_label_new(name);
     gtk_widget_add_css_class(name_label, "disk-name");
     gtk_widget_set_halign(name_label, GTK_ALIGN_START);
-    gtk_box_append(GTK_BOX(info_box), name_label);
+    gtk_box_append(GTK_BOX(name_box), name_label);
+    
+    // Shown on the fastest disk once speeds are known
+    GtkWidget* recommended_label = gtk_label_new("Recommended");
+    gtk_widget_add_css_class(recommended_label, "recommended-badge");
+    gtk_widget_set_valign(recommended_label, GTK_ALIGN_CENTER);
+    gtk_widget_set_visible(recommended_label, FALSE);
+    gtk_box_append(GTK_BOX(name_box), recommended_label);
+    gtk_box_append(GTK_BOX(info_box), name_box);
     
     GtkWidget* size_label = gtk_label_new(size);
     gtk_widget_add_css_class(size_label, "disk-size");
@@ -52,6 +81,22 @@ GtkWidget* create_disk_card(const char* name, const char* size, const char* type
     gtk_widget_set_halign(type_label, GTK_ALIGN_START);
     gtk_box_append(GTK_BOX(info_box), type_label);
     
+    // Filled in when the speed probe has run
+    GtkWidget* speed_label = gtk_label_new(NULL);
+    gtk_widget_add_css_class(speed_label, "disk-speed");
+    gtk_widget_set_halign(speed_label, GTK_ALIGN_START);
+    gtk_widget_set_visible(speed_label, FALSE);
+    gtk_box_append(GTK_BOX(info_box), speed_label);
+    
+    // Existing contents, so nobody erases the wrong disk
+    if (details) {
+        GtkWidget* details_label = gtk_label_new(details);
+        gtk_widget_add_css_class(details_label, "disk-partitions");
+        gtk_widget_set_halign(details_label, GTK_ALIGN_START);
+        gtk_label_set_xalign(GTK_LABEL(details_label), 0);
+        gtk_box_append(GTK_BOX(info_box), details_label);
+    }
+    
     gtk_box_append(GTK_BOX(card_box), info_box);
     
     // Selection indicator
@@ -61,10 +106,258 @@ GtkWidget* create_disk_card(const char* name, const char* size, const char* type
     gtk_box_append(GTK_BOX(card_box), check_icon);
     
     gtk_button_set_child(GTK_BUTTON(card_button), card_box);
+    g_object_set_data(G_OBJECT(card_button), "speed-label", speed_label);
+    g_object_set_data(G_OBJECT(card_button), "recommended-label", recommended_label);
     
     return card_button;
 }
 
+static void update_disk_status(void) {
+    if (g_hash_table_size(disk_cards) > 0) {
+        gtk_widget_set_visible(disk_status_label, FALSE);
+        return;
+    }
+    
+    gtk_label_set_text(GTK_LABEL(disk_status_label),
+                       pending_probes > 0 ? "Looking for disks..." : "No suitable disks were found.");
+    gtk_widget_set_visible(disk_status_label, TRUE);
+}
+
+// Payloads are many small files, so they go by random reads; images are
+// written in order
+static double get_speed_score(const StorageSpeed* speed) {
+    return install_get_payload_path() ? speed->random_iops : speed->read_bytes_per_second;
+}
+
+// Marks the fastest disk that can be picked, once there are at least two to
+// compare
+static void update_recommended_card(void) {
+    GtkWidget* best = NULL;
+    double best_score = 0;
+    guint n_measured = 0;
+    
+    GHashTableIter iter;
+    gpointer name, card;
+    g_hash_table_iter_init(&iter, disk_cards);
+    while (g_hash_table_iter_next(&iter, &name, &card)) {
+        const StorageSpeed* speed = g_hash_table_lookup(disk_speeds, name);
+        if (!speed || !gtk_widget_get_sensitive(card)) {
+            continue;
+        }
+        n_measured++;
+        if (get_speed_score(speed) > best_score) {
+            best = card;
+            best_score = get_speed_score(speed);
+        }
+    }
+    if (n_measured < 2) {
+        best = NULL;
+    }
+    
+    if (recommended_card && recommended_card != best) {
+        gtk_widget_set_visible(g_object_get_data(G_OBJECT(recommended_card), "recommended-label"), FALSE);
+        gtk_widget_remove_css_class(recommended_card, "recommended-card");
+    }
+    recommended_card = best;
+    if (best) {
+        gtk_widget_set_visible(g_object_get_data(G_OBJECT(best), "recommended-label"), TRUE);
+        gtk_widget_add_css_class(best, "recommended-card");
+    }
+}
+
+static void show_disk_speed(GtkWidget* card, const StorageSpeed* speed) {
+    char* rate = g_format_size((guint64)speed->read_bytes_per_second);
+    char* text = g_strdup_printf("Reads %s/s · %.0f IOPS", rate, speed->random_iops);
+    GtkWidget* speed_label = g_object_get_data(G_OBJECT(card), "speed-label");
+    gtk_label_set_text(GTK_LABEL(speed_label), text);
+    gtk_widget_set_visible(speed_label, TRUE);
+    g_free(text);
+    g_free(rate);
+}
+
+static void on_disk_speed_measured(GObject* source, GAsyncResult* result, gpointer user_data) {
+    char* name = user_data;
+    StorageSpeed* speed = storage_measure_speed_finish(result, NULL);
+    
+    // The disk may have gone away while it was waiting for its turn
+    GtkWidget* card = g_hash_table_lookup(disk_cards, name);
+    if (speed && card) {
+        g_hash_table_insert(disk_speeds, g_strdup(name), speed);
+        show_disk_speed(card, speed);
+        update_recommended_card();
+    } else {
+        g_free(speed);
+    }
+    g_free(name);
+}
+
+static void remove_disk_card(const char* name) {
+    GtkWidget* card = g_hash_table_lookup(disk_cards, name);
+    if (!card) {
+        return;
+    }
+    
+    if (card == selected_disk_card) {
+        selected_disk_card = NULL;
+    }
+    if (card == recommended_card) {
+        recommended_card = NULL;
+    }
+    gtk_box_remove(GTK_BOX(disk_list_box), card);
+    g_hash_table_remove(disk_cards, name);
+}
+
+static void append_contents(GString* details, const char* filesystem, const char* label) {
+    g_string_append(details, filesystem ? filesystem : "unknown");
+    if (label && *label) {
+        g_string_append_printf(details, " \"%s\"", label);
+    }
+}
+
+// One line per partition: number, size, filesystem and label, then the GPT name
+static char* describe_partitions(const PartitionTable* table) {
+    GString* details = g_string_new(NULL);
+    
+    if (table->scheme == PARTITION_SCHEME_NONE) {
+        if (!table->filesystem) {
+            return g_string_free(details, TRUE);
+        }
+        g_string_append(details, "Whole disk: ");
+        append_contents(details, table->filesystem, table->label);
+        return g_string_free(details, FALSE);
+    }
+    
+    g_string_append(details, table->scheme == PARTITION_SCHEME_GPT ? "GPT" : "MBR");
+    if (table->gpt_from_backup) {
+        g_string_append(details, " (primary table damaged, using backup)");
+    }
+    
+    for (guint32 i = 0; i < table->n_partitions && i < MAX_LISTED_PARTITIONS; i++) {
+        const PartitionInfo* partition = &table->partitions[i];
+        char* size = g_format_size(partition->size);
+        
+        g_string_append_printf(details, "\n%3u  %9s  ", partition->number, size);
+        if (partition_is_extended(partition)) {
+            g_string_append(details, "extended");
+        } else {
+            append_contents(details, partition->filesystem, partition->label);
+        }
+        if (partition->name[0]) {
+            g_string_append_printf(details, "  (%s)", partition->name);
+        }
+        g_free(size);
+    }
+    if (table->n_partitions > MAX_LISTED_PARTITIONS) {
+        g_string_append_printf(details, "\n     and %u more", table->n_partitions - MAX_LISTED_PARTITIONS);
+    }
+    
+    return g_string_free(details, FALSE);
+}
+
+static void add_disk_card(const StorageDevice* device) {
+    char* path = storage_device_get_path(device);
+    char* size = g_format_size(device->size_bytes);
+    GString* type = g_string_new(storage_device_get_type_label(device));
+    char* details = device->table ? describe_partitions(device->table) : NULL;
+    
+    // The table read from the disk is more current than /proc/partitions,
+    // which lags behind until the kernel re-reads it
+    guint n_partitions = device->table ? device->table->n_partitions : device->n_partitions;
+    g_string_append_printf(type, " · %s", path);
+    if (n_partitions > 0) {
+        g_string_append_printf(type, " · %u partition%s", n_partitions, n_partitions == 1 ? "" : "s");
+    }
+    gboolean too_small = required_size > 0 && device->size_bytes < required_size;
+    if (too_small) {
+        char* required = g_format_size(required_size);
+        g_string_append_printf(type, " · too small, Wave OS needs %s", required);
+        g_free(required);
+    }
+    
+    GtkWidget* card = create_disk_card(device->model ? device->model : path, size, type->str, details,
+                                       storage_device_get_icon_name(device));
+    g_object_set_data_full(G_OBJECT(card), "device-name", g_strdup(device->name), g_free);
+    if (too_small) {
+        gtk_widget_set_sensitive(card, FALSE);
+        gtk_widget_add_css_class(card, "too-small");
+    }
+    
+    // A re-probed device replaces its old card. Keep the cards ordered by
+    // kernel name, whatever order the probes finish in.
+    gboolean was_selected = selected_disk_card && g_hash_table_lookup(disk_cards, device->name) == selected_disk_card;
+    remove_disk_card(device->name);
+    GtkWidget* previous = NULL;
+    for (GtkWidget* child = gtk_widget_get_first_child(disk_list_box); child;
+         child = gtk_widget_get_next_sibling(child)) {
+        if (strcmp(g_object_get_data(G_OBJECT(child), "device-name"), device->name) > 0) {
+            break;
+        }
+        previous = child;
+    }
+    
+    gtk_box_insert_child_after(GTK_BOX(disk_list_box), card, previous);
+    g_hash_table_insert(disk_cards, g_strdup(device->name), card);
+    
+    // The selection moves to the new card like the speed does, unless the
+    // disk no longer fits the payload
+    if (was_selected && !too_small) {
+        selected_disk_card = card;
+        gtk_widget_add_css_class(card, "selected-card");
+    }
+    
+    // A card replaced after a partition table change keeps the speed it had;
+    // only new disks and new media are measured
+    const StorageSpeed* speed = g_hash_table_lookup(disk_speeds, device->name);
+    if (speed) {
+        show_disk_speed(card, speed);
+        update_recommended_card();
+    } else if (!too_small && g_strcmp0(g_getenv("WAVE_DISK_SPEED"), "0") != 0) {
+        storage_measure_speed_async(device->name, NULL, on_disk_speed_measured, g_strdup(device->name));
+    }
+    
+    g_string_free(type, TRUE);
+    g_free(details);
+    g_free(size);
+    g_free(path);
+}
+
+static void on_disk_probed(GObject* source, GAsyncResult* result, gpointer user_data) {
+    StorageDevice* device = storage_probe_device_finish(result, NULL);
+    pending_probes--;
+    
+    if (device) {
+        add_disk_card(device);
+        storage_device_free(device);
+    }
+    update_disk_status();
+}
+
+static void probe_disk(const char* name) {
+    pending_probes++;
+    storage_probe_device_async(name, NULL, on_disk_probed, NULL);
+}
+
+static void on_disks_listed(GObject* source, GAsyncResult* result, gpointer user_data) {
+    char** names = storage_list_devices_finish(result, NULL);
+    
+    for (char** name = names; name && *name; name++) {
+        probe_disk(*name);
+    }
+    g_strfreev(names);
+    update_disk_status();
+}
+
+static void on_storage_event(const char* name, gboolean added, gpointer user_data) {
+    if (added) {
+        probe_disk(name);
+    } else {
+        remove_disk_card(name);
+        g_hash_table_remove(disk_speeds, name);
+        update_recommended_card();
+    }
+    update_disk_status();
+}
+
 GtkWidget* create_disk_page(void) {
     GtkWidget* page = gtk_box_new(GTK_ORIENTATION_VERTICAL, 32);
     gtk_widget_set_valign(page, GTK_ALIGN_CENTER);
@@ -90,39 +383,35 @@ GtkWidget* create_disk_page(void) {
     gtk_widget_set_halign(content_box, GTK_ALIGN_FILL);
     gtk_widget_set_vexpand(content_box, TRUE);
     
+    disk_status_label = gtk_label_new("Looking for disks...");
+    gtk_widget_add_css_class(disk_status_label, "disk-status");
+    gtk_box_append(GTK_BOX(content_box), disk_status_label);
+    
     // Scrollable disk list
     GtkWidget* scrolled = gtk_scrolled_window_new();
     gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled), GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
     gtk_widget_set_vexpand(scrolled, TRUE);
     gtk_widget_add_css_class(scrolled, "disk-list");
     
-    GtkWidget* disk_list_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 12);
+    disk_list_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 12);
     gtk_widget_set_margin_top(disk_list_box, 12);
     gtk_widget_set_margin_bottom(disk_list_box, 12);
     gtk_widget_set_margin_start(disk_list_box, 12);
     gtk_widget_set_margin_end(disk_list_box, 12);
     
-    // Sample disks
-    struct {
-        const char* name;
-        const char* size;
-        const char* type;
-        const char* icon;
-    } disks[] = {
-        {"Samsung SSD 980 PRO 1TB", "931.5 GB", "NVMe SSD", "drive-harddisk-solidstate"},
-        {"Western Digital Blue 2TB", "1.82 TB", "SATA HDD", "drive-harddisk"},
-        {"Kingston USB Drive", "32.0 GB", "USB Storage", "drive-removable-media"},
-        {"Seagate Backup Plus", "4.0 TB", "External HDD", "drive-harddisk-usb"}
-    };
-    
-    for (int i = 0; i < 4; i++) {
-        GtkWidget* disk_card = create_disk_card(
-            disks[i].name,
-            disks[i].size,
-            disks[i].type,
-            disks[i].icon
-        );
-        gtk_box_append(GTK_BOX(disk_list_box), disk_card);
+    // Disks smaller than the image or the unpacked payload are shown but
+    // cannot be picked; the payload size comes from its manifest. A payload
+    // goes into the filesystem at the install root, whose own free space is
+    // checked when the install starts.
+    required_size = install_get_required_size();
+    
+    // Cards are added as each device has been probed, and kept up to date
+    // with hotplug events
+    disk_cards = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    disk_speeds = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    storage_list_devices_async(NULL, on_disks_listed, NULL);
+    if (storage_get_root()[0] == '\0') {
+        storage_monitor_start(on_storage_event, NULL);
     }
     
     gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scrolled), disk_list_box);
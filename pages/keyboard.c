@@ -1,11 +1,168 @@
 #include "../installer.h"
+#include "../index-model.h"
+#include "../keyboard-view.h"
+#include "../keyboards.h"
+#include "../trace.h"
 
-static GtkWidget* keyboard_combo = NULL;
+static GtkWidget* layout_list_view = NULL;
+static GtkWidget* layout_search = NULL;
 static GtkWidget* test_entry = NULL;
+static GtkWidget* keyboard_view = NULL;
+static KeyboardTable* keyboard_table = NULL;
+static WaveIndexModel* layout_model = NULL;
+static GtkCustomFilter* layout_filter = NULL;
+static GtkSingleSelection* layout_selection = NULL;
+static char* selected_layout = NULL;
+static char* selected_variant = NULL;
 
-static void on_keyboard_layout_changed(GtkComboBox* combo, gpointer user_data) {
-    int active = gtk_combo_box_get_active(combo);
-    g_print("Selected keyboard layout index: %d\n", active);
+static gboolean filter_layout(gpointer item, gpointer user_data) {
+    return search_index_matches(keyboard_table->search_index, wave_index_item_get_index(item));
+}
+
+static void apply_layout_search(SearchChange forced_change) {
+    TRACE_BEGIN("keyboard_search");
+    const char* search_text = gtk_editable_get_text(GTK_EDITABLE(layout_search));
+    SearchChange change = search_index_update(keyboard_table->search_index, search_text);
+    
+    filter_changed_for_search(GTK_FILTER(layout_filter),
+                              forced_change != SEARCH_CHANGE_NONE ? forced_change : change);
+    TRACE_COUNTER("keyboard_matches", search_index_get_n_matches(keyboard_table->search_index));
+    TRACE_END("keyboard_search");
+}
+
+static void on_layout_search_changed(GtkEditable* editable, gpointer user_data) {
+    apply_layout_search(SEARCH_CHANGE_NONE);
+}
+
+static void on_layout_row_setup(GtkSignalListItemFactory* factory, GtkListItem* list_item, gpointer user_data) {
+    GtkWidget* row_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
+    gtk_widget_set_margin_top(row_box, 8);
+    gtk_widget_set_margin_bottom(row_box, 8);
+    gtk_widget_set_margin_start(row_box, 12);
+    gtk_widget_set_margin_end(row_box, 12);
+    
+    GtkWidget* label_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 2);
+    gtk_widget_set_hexpand(label_box, TRUE);
+    
+    GtkWidget* name_label = gtk_label_new(NULL);
+    gtk_widget_set_halign(name_label, GTK_ALIGN_START);
+    gtk_label_set_ellipsize(GTK_LABEL(name_label), PANGO_ELLIPSIZE_END);
+    gtk_box_append(GTK_BOX(label_box), name_label);
+    
+    GtkWidget* detail_label = gtk_label_new(NULL);
+    gtk_widget_add_css_class(detail_label, "keyboard-detail");
+    gtk_widget_set_halign(detail_label, GTK_ALIGN_START);
+    gtk_box_append(GTK_BOX(label_box), detail_label);
+    
+    gtk_box_append(GTK_BOX(row_box), label_box);
+    
+    // Add selection indicator
+    GtkWidget* check = gtk_image_new_from_icon_name("emblem-ok-symbolic");
+    gtk_widget_add_css_class(check, "selection-check");
+    gtk_box_append(GTK_BOX(row_box), check);
+    
+    gtk_list_item_set_child(list_item, row_box);
+}
+
+static void on_layout_row_bind(GtkSignalListItemFactory* factory, GtkListItem* list_item, gpointer user_data) {
+    guint index = wave_index_item_get_index(gtk_list_item_get_item(list_item));
+    if (index >= keyboard_table->n_entries) {
+        return;
+    }
+    
+    const KeyboardLayoutInfo* info = &keyboard_table->entries[index];
+    GtkWidget* row_box = gtk_list_item_get_child(list_item);
+    GtkWidget* label_box = gtk_widget_get_first_child(row_box);
+    GtkWidget* name_label = gtk_widget_get_first_child(label_box);
+    GtkWidget* detail_label = gtk_widget_get_next_sibling(name_label);
+    
+    // Variants are indented under their base layout
+    if (info->variant[0]) {
+        gtk_widget_add_css_class(row_box, "keyboard-variant");
+    } else {
+        gtk_widget_remove_css_class(row_box, "keyboard-variant");
+    }
+    
+    GString* detail = g_string_new(info->layout);
+    if (info->variant[0]) {
+        g_string_append_printf(detail, "(%s)", info->variant);
+    }
+    if (info->languages[0]) {
+        g_string_append_printf(detail, " · %s", info->languages);
+    }
+    gtk_label_set_text(GTK_LABEL(name_label), info->description);
+    gtk_label_set_text(GTK_LABEL(detail_label), detail->str);
+    g_string_free(detail, TRUE);
+}
+
+static void on_layout_selected(GtkSingleSelection* selection, GParamSpec* pspec, gpointer user_data) {
+    WaveIndexItem* item = gtk_single_selection_get_selected_item(selection);
+    
+    if (item && wave_index_item_get_index(item) < keyboard_table->n_entries) {
+        const KeyboardLayoutInfo* info = &keyboard_table->entries[wave_index_item_get_index(item)];
+        g_free(selected_layout);
+        g_free(selected_variant);
+        selected_layout = g_strdup(info->layout);
+        selected_variant = g_strdup(info->variant);
+        
+        if (keyboard_view) {
+            wave_keyboard_view_set_layout(WAVE_KEYBOARD_VIEW(keyboard_view), info->layout, info->variant);
+        }
+    }
+}
+
+char* get_selected_keyboard_layout(void) {
+    return g_strdup(selected_layout);
+}
+
+char* get_selected_keyboard_variant(void) {
+    return g_strdup(selected_variant);
+}
+
+// Selects the previously chosen layout, or US English
+static void select_default_layout(void) {
+    // List positions only match table indices while nothing is filtered out
+    if (search_index_get_n_matches(keyboard_table->search_index) != keyboard_table->n_entries) {
+        return;
+    }
+    
+    int index = selected_layout ? keyboard_table_find(keyboard_table, selected_layout, selected_variant) : -1;
+    if (index < 0) {
+        index = keyboard_table_find(keyboard_table, "us", NULL);
+    }
+    
+    if (index >= 0) {
+        gtk_single_selection_set_selected(layout_selection, (guint)index);
+        gtk_widget_activate_action(layout_list_view, "list.scroll-to-item", "u", (guint)index);
+    }
+}
+
+// Highlights the key under the user's finger. Runs in the capture phase so
+// the entry still receives the event.
+static gboolean on_test_key_pressed(GtkEventControllerKey* controller, guint keyval, guint keycode,
+                                    GdkModifierType state, gpointer user_data) {
+    wave_keyboard_view_set_pressed_key(WAVE_KEYBOARD_VIEW(keyboard_view), keycode);
+    return FALSE;
+}
+
+static void on_test_key_released(GtkEventControllerKey* controller, guint keyval, guint keycode,
+                                 GdkModifierType state, gpointer user_data) {
+    wave_keyboard_view_set_pressed_key(WAVE_KEYBOARD_VIEW(keyboard_view), 0);
+}
+
+static void on_keyboards_loaded(GObject* source, GAsyncResult* result, gpointer user_data) {
+    KeyboardTable* table = keyboard_table_load_finish(result, NULL);
+    if (!table) {
+        return;
+    }
+    
+    KeyboardTable* old_table = keyboard_table;
+    keyboard_table = table;
+    wave_index_model_set_n_items(layout_model, table->n_entries);
+    keyboard_table_free(old_table);
+    
+    apply_layout_search(SEARCH_CHANGE_DIFFERENT);
+    select_default_layout();
 }
 
 GtkWidget* create_keyboard_page(void) {
@@ -29,8 +186,9 @@ GtkWidget* create_keyboard_page(void) {
     
     // Content area
     GtkWidget* content_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 24);
-    gtk_widget_set_halign(content_box, GTK_ALIGN_CENTER);
+    gtk_widget_set_halign(content_box, GTK_ALIGN_FILL);
     gtk_widget_set_hexpand(content_box, TRUE);
+    gtk_widget_set_vexpand(content_box, TRUE);
     
     // Keyboard layout selection
     GtkWidget* layout_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 12);
@@ -40,40 +198,41 @@ GtkWidget* create_keyboard_page(void) {
     gtk_widget_add_css_class(layout_label, "field-label");
     gtk_box_append(GTK_BOX(layout_box), layout_label);
     
-    keyboard_combo = gtk_combo_box_text_new();
-    gtk_widget_add_css_class(keyboard_combo, "keyboard-combo");
-    g_signal_connect(keyboard_combo, "changed", G_CALLBACK(on_keyboard_layout_changed), NULL);
-    
-    // Add keyboard layouts
-    const char* layouts[] = {
-        "English (US)",
-        "English (UK)",
-        "German",
-        "French",
-        "Spanish",
-        "Italian",
-        "Portuguese",
-        "Russian",
-        "Chinese (Simplified)",
-        "Japanese",
-        "Korean",
-        "Arabic",
-        "Hindi",
-        "Dutch",
-        "Polish",
-        "Swedish",
-        "Norwegian",
-        "Danish",
-        "Finnish",
-        "Greek"
-    };
-    
-    for (int i = 0; i < 20; i++) {
-        gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(keyboard_combo), layouts[i]);
-    }
+    layout_search = gtk_search_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(layout_search), "Search layouts and variants...");
+    gtk_widget_add_css_class(layout_search, "search-entry");
+    g_signal_connect(layout_search, "search-changed", G_CALLBACK(on_layout_search_changed), NULL);
+    gtk_box_append(GTK_BOX(layout_box), layout_search);
+    
+    // Layouts with their variants, read from the XKB rules on a worker thread.
+    // Until they arrive the list shows a small built-in set.
+    GtkWidget* scrolled = gtk_scrolled_window_new();
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled), GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+    gtk_widget_set_vexpand(scrolled, TRUE);
+    gtk_widget_set_hexpand(scrolled, TRUE);
+    gtk_widget_add_css_class(scrolled, "keyboard-list");
+    
+    keyboard_table = keyboard_table_new_builtin();
+    layout_model = wave_index_model_new(keyboard_table->n_entries);
+    layout_filter = gtk_custom_filter_new(filter_layout, NULL, NULL);
+    GtkFilterListModel* filtered = gtk_filter_list_model_new(G_LIST_MODEL(g_object_ref(layout_model)),
+                                                             GTK_FILTER(g_object_ref(layout_filter)));
+    layout_selection = gtk_single_selection_new(G_LIST_MODEL(filtered));
+    gtk_single_selection_set_autoselect(layout_selection, FALSE);
+    g_signal_connect(layout_selection, "notify::selected", G_CALLBACK(on_layout_selected), NULL);
     
-    gtk_combo_box_set_active(GTK_COMBO_BOX(keyboard_combo), 0);
-    gtk_box_append(GTK_BOX(layout_box), keyboard_combo);
+    GtkListItemFactory* factory = gtk_signal_list_item_factory_new();
+    g_signal_connect(factory, "setup", G_CALLBACK(on_layout_row_setup), NULL);
+    g_signal_connect(factory, "bind", G_CALLBACK(on_layout_row_bind), NULL);
+    
+    layout_list_view = gtk_list_view_new(GTK_SELECTION_MODEL(layout_selection), factory);
+    gtk_widget_add_css_class(layout_list_view, "keyboard-listview");
+    
+    select_default_layout();
+    keyboard_table_load_async(NULL, on_keyboards_loaded, NULL);
+    
+    gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scrolled), layout_list_view);
+    gtk_box_append(GTK_BOX(layout_box), scrolled);
     
     gtk_box_append(GTK_BOX(content_box), layout_box);
     
@@ -100,6 +259,12 @@ GtkWidget* create_keyboard_page(void) {
     test_entry = gtk_entry_new();
     gtk_entry_set_placeholder_text(GTK_ENTRY(test_entry), "Type here to test your keyboard...");
     gtk_widget_add_css_class(test_entry, "test-entry");
+    
+    GtkEventController* key_controller = gtk_event_controller_key_new();
+    gtk_event_controller_set_propagation_phase(key_controller, GTK_PHASE_CAPTURE);
+    g_signal_connect(key_controller, "key-pressed", G_CALLBACK(on_test_key_pressed), NULL);
+    g_signal_connect(key_controller, "key-released", G_CALLBACK(on_test_key_released), NULL);
+    gtk_widget_add_controller(test_entry, key_controller);
     gtk_box_append(GTK_BOX(test_box), test_entry);
     
     // Sample text to test special characters
@@ -111,7 +276,7 @@ GtkWidget* create_keyboard_page(void) {
     gtk_frame_set_child(GTK_FRAME(test_frame), test_box);
     gtk_box_append(GTK_BOX(content_box), test_frame);
     
-    // Layout preview (placeholder)
+    // Layout preview
     GtkWidget* preview_frame = create_rounded_frame(NULL);
     gtk_widget_add_css_class(preview_frame, "preview-frame");
     
@@ -126,31 +291,13 @@ GtkWidget* create_keyboard_page(void) {
     gtk_widget_add_css_class(preview_title, "preview-title");
     gtk_box_append(GTK_BOX(preview_box), preview_title);
     
-    // Simplified keyboard representation
-    GtkWidget* keyboard_grid = gtk_grid_new();
-    gtk_grid_set_row_spacing(GTK_GRID(keyboard_grid), 4);
-    gtk_grid_set_column_spacing(GTK_GRID(keyboard_grid), 4);
-    gtk_widget_set_halign(keyboard_grid, GTK_ALIGN_CENTER);
-    
-    // First row keys
-    const char* first_row[] = {"Q", "W", "E", "R", "T", "Y", "U", "I", "O", "P"};
-    for (int i = 0; i < 10; i++) {
-        GtkWidget* key = gtk_label_new(first_row[i]);
-        gtk_widget_add_css_class(key, "keyboard-key");
-        gtk_widget_set_size_request(key, 30, 30);
-        gtk_grid_attach(GTK_GRID(keyboard_grid), key, i, 0, 1, 1);
+    // Drawn from the selected layout's keymap
+    keyboard_view = wave_keyboard_view_new();
+    gtk_widget_add_css_class(keyboard_view, "keyboard-view");
+    if (selected_layout) {
+        wave_keyboard_view_set_layout(WAVE_KEYBOARD_VIEW(keyboard_view), selected_layout, selected_variant);
     }
-    
-    // Second row keys
-    const char* second_row[] = {"A", "S", "D", "F", "G", "H", "J", "K", "L"};
-    for (int i = 0; i < 9; i++) {
-        GtkWidget* key = gtk_label_new(second_row[i]);
-        gtk_widget_add_css_class(key, "keyboard-key");
-        gtk_widget_set_size_request(key, 30, 30);
-        gtk_grid_attach(GTK_GRID(keyboard_grid), key, i, 1, 1, 1);
-    }
-    
-    gtk_box_append(GTK_BOX(preview_box), keyboard_grid);
+    gtk_box_append(GTK_BOX(preview_box), keyboard_view);
     
     gtk_frame_set_child(GTK_FRAME(preview_frame), preview_box);
     gtk_box_append(GTK_BOX(content_box), preview_frame);
@@ -1,13 +1,141 @@
 #include "../installer.h"
+#include "../index-model.h"
+#include "../locales.h"
+#include "../trace.h"
 
-static GtkWidget* language_combo = NULL;
+static GtkWidget* language_list_view = NULL;
 static GtkWidget* search_entry = NULL;
+static LocaleTable* locale_table = NULL;
+static WaveIndexModel* locale_model = NULL;
+static GtkCustomFilter* locale_filter = NULL;
+static GtkSingleSelection* locale_selection = NULL;
+static char* selected_locale = NULL;
+
+static gboolean filter_locale(gpointer item, gpointer user_data) {
+    return search_index_matches(locale_table->search_index, wave_index_item_get_index(item));
+}
+
+// Narrows or widens the list for the current search text. GtkSearchEntry
+// already debounces "search-changed", so this runs once per typing pause.
+static void apply_search(SearchChange forced_change) {
+    TRACE_BEGIN("language_search");
+    const char* search_text = gtk_editable_get_text(GTK_EDITABLE(search_entry));
+    SearchChange change = search_index_update(locale_table->search_index, search_text);
+    
+    filter_changed_for_search(GTK_FILTER(locale_filter),
+                              forced_change != SEARCH_CHANGE_NONE ? forced_change : change);
+    TRACE_COUNTER("language_matches", search_index_get_n_matches(locale_table->search_index));
+    TRACE_END("language_search");
+}
 
 static void on_search_changed(GtkEditable* editable, gpointer user_data) {
-    const char* search_text = gtk_editable_get_text(editable);
-    // In a real implementation, this would filter the combo box
-    // For now, we'll just print the search text
-    g_print("Searching for: %s\n", search_text);
+    apply_search(SEARCH_CHANGE_NONE);
+}
+
+static void on_language_row_setup(GtkSignalListItemFactory* factory, GtkListItem* list_item, gpointer user_data) {
+    GtkWidget* row_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
+    gtk_widget_set_margin_top(row_box, 10);
+    gtk_widget_set_margin_bottom(row_box, 10);
+    gtk_widget_set_margin_start(row_box, 12);
+    gtk_widget_set_margin_end(row_box, 12);
+    
+    // Add globe icon for languages
+    GtkWidget* icon = gtk_image_new_from_icon_name("preferences-desktop-locale-symbolic");
+    gtk_widget_set_margin_start(icon, 4);
+    gtk_box_append(GTK_BOX(row_box), icon);
+    
+    GtkWidget* label_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 2);
+    gtk_widget_set_hexpand(label_box, TRUE);
+    
+    GtkWidget* label = gtk_label_new(NULL);
+    gtk_widget_set_halign(label, GTK_ALIGN_START);
+    gtk_box_append(GTK_BOX(label_box), label);
+    
+    GtkWidget* detail_label = gtk_label_new(NULL);
+    gtk_widget_add_css_class(detail_label, "language-detail");
+    gtk_widget_set_halign(detail_label, GTK_ALIGN_START);
+    gtk_box_append(GTK_BOX(label_box), detail_label);
+    
+    gtk_box_append(GTK_BOX(row_box), label_box);
+    
+    // Add selection indicator
+    GtkWidget* check = gtk_image_new_from_icon_name("emblem-ok-symbolic");
+    gtk_widget_add_css_class(check, "selection-check");
+    gtk_box_append(GTK_BOX(row_box), check);
+    
+    gtk_list_item_set_child(list_item, row_box);
+}
+
+static void on_language_row_bind(GtkSignalListItemFactory* factory, GtkListItem* list_item, gpointer user_data) {
+    guint index = wave_index_item_get_index(gtk_list_item_get_item(list_item));
+    if (index >= locale_table->n_entries) {
+        return;
+    }
+    
+    const LocaleInfo* info = &locale_table->entries[index];
+    
+    GtkWidget* row_box = gtk_list_item_get_child(list_item);
+    GtkWidget* label_box = gtk_widget_get_next_sibling(gtk_widget_get_first_child(row_box));
+    GtkWidget* label = gtk_widget_get_first_child(label_box);
+    GtkWidget* detail_label = gtk_widget_get_next_sibling(label);
+    
+    char* detail = g_strdup_printf("%s · %s", info->english_name, info->code);
+    gtk_label_set_text(GTK_LABEL(label), info->native_name);
+    gtk_label_set_text(GTK_LABEL(detail_label), detail);
+    g_free(detail);
+}
+
+static void on_language_selected(GtkSingleSelection* selection, GParamSpec* pspec, gpointer user_data) {
+    WaveIndexItem* item = gtk_single_selection_get_selected_item(selection);
+    
+    if (item && wave_index_item_get_index(item) < locale_table->n_entries) {
+        g_free(selected_locale);
+        selected_locale = g_strdup(locale_table->entries[wave_index_item_get_index(item)].code);
+    }
+}
+
+char* get_selected_locale(void) {
+    return g_strdup(selected_locale);
+}
+
+// Selects the previously chosen locale, or the one the live session runs in
+static void select_default_locale(void) {
+    const LocaleTable* table = locale_table;
+    
+    // List positions only match table indices while nothing is filtered out
+    if (search_index_get_n_matches(table->search_index) != table->n_entries) {
+        return;
+    }
+    
+    int index = selected_locale ? locale_table_find(table, selected_locale) : -1;
+    
+    for (const char* const* name = g_get_language_names(); index < 0 && *name; name++) {
+        index = locale_table_find(table, *name);
+    }
+    if (index < 0) {
+        index = locale_table_find(table, "en_US");
+    }
+    
+    if (index >= 0) {
+        gtk_single_selection_set_selected(locale_selection, (guint)index);
+        gtk_widget_activate_action(language_list_view, "list.scroll-to-item", "u", (guint)index);
+    }
+}
+
+static void on_locales_loaded(GObject* source, GAsyncResult* result, gpointer user_data) {
+    LocaleTable* table = locale_table_load_finish(result, NULL);
+    if (!table) {
+        return;
+    }
+    
+    LocaleTable* old_table = locale_table;
+    locale_table = table;
+    wave_index_model_set_n_items(locale_model, table->n_entries);
+    locale_table_free(old_table);
+    
+    // The new table has its own index, so re-run whatever was typed meanwhile
+    apply_search(SEARCH_CHANGE_DIFFERENT);
+    select_default_locale();
 }
 
 GtkWidget* create_language_page(void) {
@@ -47,70 +175,28 @@ GtkWidget* create_language_page(void) {
     gtk_widget_set_size_request(scrolled, -1, 300); // Set minimum height
     gtk_widget_add_css_class(scrolled, "language-list");
     
-    GtkWidget* language_list_box = gtk_list_box_new();
-    gtk_widget_add_css_class(language_list_box, "language-listbox");
-    gtk_list_box_set_selection_mode(GTK_LIST_BOX(language_list_box), GTK_SELECTION_SINGLE);
-    
-    // Add sample languages
-    const char* languages[] = {
-        "English (United States)",
-        "English (United Kingdom)",
-        "Deutsch (Deutschland)",
-        "Français (France)",
-        "Español (España)",
-        "Italiano (Italia)",
-        "Português (Brasil)",
-        "Русский (Россия)",
-        "中文 (简体)",
-        "日本語 (日本)",
-        "한국어 (대한민국)",
-        "العربية",
-        "हिन्दी (भारत)",
-        "Nederlands (Nederland)",
-        "Polski (Polska)",
-        "Svenska (Sverige)",
-        "Norsk (Norge)",
-        "Dansk (Danmark)",
-        "Suomi (Suomi)",
-        "Ελληνικά (Ελλάδα)"
-    };
-    
-    for (int i = 0; i < 20; i++) {        GtkWidget* row = gtk_list_box_row_new();
-        gtk_widget_add_css_class(row, "language-row");
-        
-        // Create a more visually distinct row with icon
-        GtkWidget* row_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
-        gtk_widget_set_margin_top(row_box, 10);
-        gtk_widget_set_margin_bottom(row_box, 10);
-        gtk_widget_set_margin_start(row_box, 12);
-        gtk_widget_set_margin_end(row_box, 12);
-        
-        // Add globe icon for languages
-        GtkWidget* icon = gtk_image_new_from_icon_name("preferences-desktop-locale-symbolic");
-        gtk_widget_set_margin_start(icon, 4);
-        gtk_box_append(GTK_BOX(row_box), icon);
-        
-        GtkWidget* label = gtk_label_new(languages[i]);
-        gtk_widget_set_halign(label, GTK_ALIGN_START);
-        gtk_widget_set_hexpand(label, TRUE);
-        gtk_box_append(GTK_BOX(row_box), label);
-
-        // Add selection indicator
-        GtkWidget* check = gtk_image_new_from_icon_name("emblem-ok-symbolic");
-        gtk_widget_set_opacity(check, 0);
-        gtk_widget_add_css_class(check, "selection-check");
-        gtk_box_append(GTK_BOX(row_box), check);
-        
-        gtk_list_box_row_set_child(GTK_LIST_BOX_ROW(row), row_box);
-        
-        gtk_list_box_append(GTK_LIST_BOX(language_list_box), row);
-    }
+    // Rows are only created for the visible part of the list. Start with the
+    // built-in locales and swap in the full system set once it has loaded.
+    locale_table = locale_table_new_builtin();
+    locale_model = wave_index_model_new(locale_table->n_entries);
+    locale_filter = gtk_custom_filter_new(filter_locale, NULL, NULL);
+    GtkFilterListModel* filtered = gtk_filter_list_model_new(G_LIST_MODEL(g_object_ref(locale_model)),
+                                                             GTK_FILTER(g_object_ref(locale_filter)));
+    locale_selection = gtk_single_selection_new(G_LIST_MODEL(filtered));
+    gtk_single_selection_set_autoselect(locale_selection, FALSE);
+    g_signal_connect(locale_selection, "notify::selected", G_CALLBACK(on_language_selected), NULL);
+    
+    GtkListItemFactory* factory = gtk_signal_list_item_factory_new();
+    g_signal_connect(factory, "setup", G_CALLBACK(on_language_row_setup), NULL);
+    g_signal_connect(factory, "bind", G_CALLBACK(on_language_row_bind), NULL);
+    
+    language_list_view = gtk_list_view_new(GTK_SELECTION_MODEL(locale_selection), factory);
+    gtk_widget_add_css_class(language_list_view, "language-listbox");
     
-    // Select first item by default
-    gtk_list_box_select_row(GTK_LIST_BOX(language_list_box), 
-                           gtk_list_box_get_row_at_index(GTK_LIST_BOX(language_list_box), 0));
+    select_default_locale();
+    locale_table_load_async(NULL, on_locales_loaded, NULL);
     
-    gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scrolled), language_list_box);
+    gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scrolled), language_list_view);
     gtk_box_append(GTK_BOX(content_box), scrolled);
     
     // Language info
@@ -0,0 +1,266 @@
+#include "../installer.h"
+#include "../install.h"
+#include "../trace.h"
+
+#define LOG_TAIL_LINES 8
+
+// The text below the bar changes more slowly than the bar itself, so it is
+// not relaid out every frame
+#define DETAIL_INTERVAL_US (G_USEC_PER_SEC / 4)
+
+static GtkWidget* progress_page = NULL;
+static GtkWidget* stage_label = NULL;
+static GtkWidget* progress_bar = NULL;
+static GtkWidget* detail_label = NULL;
+static GtkWidget* log_label = NULL;
+static GtkWidget* pause_button = NULL;
+static gboolean paused = FALSE;
+static guint tick_id = 0;
+
+// The last lines of the install log, oldest first from log_first
+static char* log_tail[LOG_TAIL_LINES];
+static guint log_first = 0;
+static guint log_count = 0;
+static gboolean log_changed = FALSE;
+
+// Frame statistics of the current run
+static gint64 detail_time = 0;
+static gint64 last_frame_time = 0;
+static gint64 longest_frame_gap = 0;
+static gint64 tick_time_total = 0;
+static gint64 tick_time_max = 0;
+static guint64 n_ticks = 0;
+static guint64 n_events = 0;
+
+static void add_log_line(const char* line, gpointer user_data) {
+    guint index = (log_first + log_count) % LOG_TAIL_LINES;
+    if (log_count == LOG_TAIL_LINES) {
+        log_first = (log_first + 1) % LOG_TAIL_LINES;
+    } else {
+        log_count++;
+    }
+    g_free(log_tail[index]);
+    log_tail[index] = g_strdup(line);
+    log_changed = TRUE;
+}
+
+static void clear_log_tail(void) {
+    for (guint i = 0; i < LOG_TAIL_LINES; i++) {
+        g_clear_pointer(&log_tail[i], g_free);
+    }
+    log_first = 0;
+    log_count = 0;
+    log_changed = TRUE;
+}
+
+static void update_log_label(void) {
+    GString* text = g_string_new(NULL);
+    for (guint i = 0; i < log_count; i++) {
+        if (i > 0) {
+            g_string_append_c(text, '\n');
+        }
+        g_string_append(text, log_tail[(log_first + i) % LOG_TAIL_LINES]);
+    }
+    gtk_label_set_text(GTK_LABEL(log_label), text->str);
+    g_string_free(text, TRUE);
+    log_changed = FALSE;
+}
+
+static void set_label_if_changed(GtkWidget* label, const char* text) {
+    if (g_strcmp0(gtk_label_get_text(GTK_LABEL(label)), text) != 0) {
+        gtk_label_set_text(GTK_LABEL(label), text);
+    }
+}
+
+static void on_pause_clicked(GtkButton* button, gpointer user_data) {
+    // The label follows once the install reports the new state
+    install_set_paused(!paused);
+}
+
+static void update_detail_label(const InstallProgress* progress) {
+    if (progress->paused) {
+        set_label_if_changed(detail_label, "Paused");
+        return;
+    }
+    if (progress->status) {
+        set_label_if_changed(detail_label, progress->status);
+        return;
+    }
+    
+    GString* detail = g_string_new(NULL);
+    if (progress->bytes_total > 0) {
+        g_string_append_printf(detail, "%d%%", (int)(progress->bytes_done * 100 / progress->bytes_total));
+    }
+    if (progress->bytes_per_second > 0) {
+        char* rate = g_format_size((guint64)progress->bytes_per_second);
+        g_string_append_printf(detail, "%s%s/s", detail->len ? " · " : "", rate);
+        g_free(rate);
+    }
+    if (progress->eta_seconds >= 0) {
+        int seconds = (int)(progress->eta_seconds + 0.5);
+        g_string_append_printf(detail, "%s%d:%02d left", detail->len ? " · " : "", seconds / 60, seconds % 60);
+    }
+    if (progress->hash_bytes_per_second > 0) {
+        char* rate = g_format_size((guint64)progress->hash_bytes_per_second);
+        g_string_append_printf(detail, "%shashing %s/s", detail->len ? " · " : "", rate);
+        g_free(rate);
+    }
+    if (progress->events_dropped > 0) {
+        g_string_append_printf(detail, "%s%" G_GUINT64_FORMAT " log lines skipped", detail->len ? " · " : "",
+                               progress->events_dropped);
+    }
+    set_label_if_changed(detail_label, detail->str);
+    g_string_free(detail, TRUE);
+}
+
+// Runs once per frame while the install runs: everything the install thread
+// queued since the last frame becomes a single update of each widget
+static gboolean on_progress_tick(GtkWidget* widget, GdkFrameClock* clock, gpointer user_data) {
+    gint64 start = g_get_monotonic_time();
+    gint64 frame_time = gdk_frame_clock_get_frame_time(clock);
+    if (last_frame_time) {
+        longest_frame_gap = MAX(longest_frame_gap, frame_time - last_frame_time);
+    }
+    last_frame_time = frame_time;
+    
+    n_events += install_drain_events(add_log_line, NULL);
+    if (log_changed) {
+        update_log_label();
+    }
+    
+    InstallProgress progress;
+    if (install_get_progress(&progress)) {
+        if (progress.stage) {
+            set_label_if_changed(stage_label, progress.stage);
+        }
+        if (progress.paused != paused) {
+            paused = progress.paused;
+            gtk_button_set_label(GTK_BUTTON(pause_button), paused ? "Resume" : "Pause");
+            detail_time = 0;
+        }
+        if (progress.bytes_total > 0) {
+            gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(progress_bar),
+                                          (double)progress.bytes_done / progress.bytes_total);
+        } else {
+            gtk_progress_bar_pulse(GTK_PROGRESS_BAR(progress_bar));
+        }
+        if (frame_time - detail_time >= DETAIL_INTERVAL_US) {
+            update_detail_label(&progress);
+            detail_time = frame_time;
+        }
+    }
+    
+    gint64 elapsed = g_get_monotonic_time() - start;
+    tick_time_total += elapsed;
+    tick_time_max = MAX(tick_time_max, elapsed);
+    n_ticks++;
+    return G_SOURCE_CONTINUE;
+}
+
+void progress_page_start(void) {
+    g_return_if_fail(progress_page != NULL);
+    
+    clear_log_tail();
+    update_log_label();
+    gtk_label_set_text(GTK_LABEL(stage_label), "Preparing");
+    gtk_label_set_text(GTK_LABEL(detail_label), "");
+    gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(progress_bar), 0);
+    gtk_widget_remove_css_class(progress_page, "failed");
+    gtk_button_set_label(GTK_BUTTON(pause_button), "Pause");
+    gtk_widget_set_visible(pause_button, TRUE);
+    paused = FALSE;
+    
+    detail_time = 0;
+    last_frame_time = 0;
+    longest_frame_gap = 0;
+    tick_time_total = 0;
+    tick_time_max = 0;
+    n_ticks = 0;
+    n_events = 0;
+    if (!tick_id) {
+        tick_id = gtk_widget_add_tick_callback(progress_page, on_progress_tick, NULL, NULL);
+    }
+}
+
+void progress_page_finish(gboolean success, const char* message) {
+    g_return_if_fail(progress_page != NULL);
+    
+    if (tick_id) {
+        gtk_widget_remove_tick_callback(progress_page, tick_id);
+        tick_id = 0;
+    }
+    
+    // Whatever arrived after the last frame still belongs in the log
+    n_events += install_drain_events(add_log_line, NULL);
+    InstallProgress progress;
+    gboolean have_progress = install_get_progress(&progress);
+    if (message) {
+        add_log_line(message, NULL);
+    }
+    update_log_label();
+    
+    if (success) {
+        gtk_label_set_text(GTK_LABEL(stage_label), "Wave OS is installed");
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(progress_bar), 1);
+    } else {
+        gtk_label_set_text(GTK_LABEL(stage_label), "The installation failed");
+        gtk_widget_add_css_class(progress_page, "failed");
+    }
+    gtk_label_set_text(GTK_LABEL(detail_label), "");
+    gtk_widget_set_visible(pause_button, FALSE);
+    
+    TRACE_COUNTER("progress_longest_frame_gap_us", longest_frame_gap);
+    g_debug("Progress page: %" G_GUINT64_FORMAT " frames, %" G_GUINT64_FORMAT " events drained, %"
+            G_GUINT64_FORMAT " dropped; tick %.1f us on average, %" G_GINT64_FORMAT " us at most; "
+            "longest gap between frames %.1f ms",
+            n_ticks, n_events, have_progress ? progress.events_dropped : 0,
+            n_ticks ? (double)tick_time_total / n_ticks : 0.0, tick_time_max, longest_frame_gap / 1000.0);
+}
+
+GtkWidget* create_progress_page(void) {
+    progress_page = gtk_box_new(GTK_ORIENTATION_VERTICAL, 16);
+    gtk_widget_set_valign(progress_page, GTK_ALIGN_CENTER);
+    gtk_widget_set_margin_start(progress_page, 40);
+    gtk_widget_set_margin_end(progress_page, 40);
+    gtk_widget_add_css_class(progress_page, "progress-page");
+    
+    GtkWidget* title = gtk_label_new("Installing Wave OS");
+    gtk_widget_add_css_class(title, "page-title");
+    gtk_box_append(GTK_BOX(progress_page), title);
+    
+    stage_label = gtk_label_new("Preparing");
+    gtk_widget_add_css_class(stage_label, "progress-stage");
+    gtk_widget_set_halign(stage_label, GTK_ALIGN_START);
+    gtk_box_append(GTK_BOX(progress_page), stage_label);
+    
+    progress_bar = gtk_progress_bar_new();
+    gtk_progress_bar_set_pulse_step(GTK_PROGRESS_BAR(progress_bar), 0.02);
+    gtk_widget_add_css_class(progress_bar, "install-progress");
+    gtk_box_append(GTK_BOX(progress_page), progress_bar);
+    
+    GtkWidget* detail_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 12);
+    detail_label = gtk_label_new("");
+    gtk_widget_add_css_class(detail_label, "progress-detail");
+    gtk_widget_set_halign(detail_label, GTK_ALIGN_START);
+    gtk_widget_set_hexpand(detail_label, TRUE);
+    gtk_box_append(GTK_BOX(detail_box), detail_label);
+    
+    pause_button = gtk_button_new_with_label("Pause");
+    gtk_widget_add_css_class(pause_button, "secondary-button");
+    gtk_widget_set_visible(pause_button, FALSE);
+    g_signal_connect(pause_button, "clicked", G_CALLBACK(on_pause_clicked), NULL);
+    gtk_box_append(GTK_BOX(detail_box), pause_button);
+    gtk_box_append(GTK_BOX(progress_page), detail_box);
+    
+    // Fixed height, so new lines never move the widgets above
+    log_label = gtk_label_new("");
+    gtk_widget_add_css_class(log_label, "progress-log");
+    gtk_label_set_xalign(GTK_LABEL(log_label), 0);
+    gtk_label_set_yalign(GTK_LABEL(log_label), 1);
+    gtk_label_set_lines(GTK_LABEL(log_label), LOG_TAIL_LINES);
+    gtk_label_set_ellipsize(GTK_LABEL(log_label), PANGO_ELLIPSIZE_END);
+    gtk_label_set_selectable(GTK_LABEL(log_label), TRUE);
+    gtk_box_append(GTK_BOX(progress_page), create_rounded_frame(log_label));
+    
+    return progress_page;
+}
@@ -1,11 +1,220 @@
 #include "../installer.h"
+#include "../index-model.h"
+#include "../trace.h"
+#include "../tzdata.h"
 
-static GtkWidget* timezone_combo = NULL;
+static GtkWidget* timezone_list_view = NULL;
 static GtkWidget* timezone_search = NULL;
+static TimezoneTable* timezone_table = NULL;
+static WaveIndexModel* timezone_model = NULL;
+static GtkCustomFilter* timezone_filter = NULL;
+static GtkSingleSelection* timezone_selection = NULL;
+static char* selected_timezone = NULL;
+
+// Live clock state. One timer drives both the selected zone's clock and the
+// per-row local times, and it only runs while the page is mapped.
+static GtkWidget* current_time_label = NULL;
+static GTimeZone* selected_tz = NULL;
+static GPtrArray* bound_time_labels = NULL;
+static guint clock_source_id = 0;
+static gint64 last_row_minute = -1;
+
+static gboolean filter_timezone(gpointer item, gpointer user_data) {
+    return search_index_matches(timezone_table->search_index, wave_index_item_get_index(item));
+}
+
+static void apply_timezone_search(SearchChange forced_change) {
+    TRACE_BEGIN("timezone_search");
+    const char* search_text = gtk_editable_get_text(GTK_EDITABLE(timezone_search));
+    SearchChange change = search_index_update(timezone_table->search_index, search_text);
+    
+    filter_changed_for_search(GTK_FILTER(timezone_filter),
+                              forced_change != SEARCH_CHANGE_NONE ? forced_change : change);
+    TRACE_COUNTER("timezone_matches", search_index_get_n_matches(timezone_table->search_index));
+    TRACE_END("timezone_search");
+}
 
 static void on_timezone_search_changed(GtkEditable* editable, gpointer user_data) {
-    const char* search_text = gtk_editable_get_text(editable);
-    g_print("Searching timezones: %s\n", search_text);
+    apply_timezone_search(SEARCH_CHANGE_NONE);
+}
+
+// Formats a zone's wall clock from its precomputed offset, without creating
+// a GTimeZone per row
+static void update_row_time(GtkWidget* label, gint64 now) {
+    guint index = GPOINTER_TO_UINT(g_object_get_data(G_OBJECT(label), "zone-index"));
+    if (!timezone_table->offsets_ready || index >= timezone_table->n_zones) {
+        gtk_label_set_text(GTK_LABEL(label), "");
+        return;
+    }
+    
+    gint64 local = now + timezone_table->zones[index].utc_offset;
+    gint64 minutes_of_day = ((local / 60) % (24 * 60) + 24 * 60) % (24 * 60);
+    char text[8];
+    g_snprintf(text, sizeof(text), "%02d:%02d", (int)(minutes_of_day / 60), (int)(minutes_of_day % 60));
+    gtk_label_set_text(GTK_LABEL(label), text);
+}
+
+static void update_clock(void) {
+    // GDateTime is immutable, so one is created per tick, directly in the
+    // selected zone; the GTimeZone is only looked up again when the
+    // selection changes
+    GDateTime* local = g_date_time_new_now(selected_tz);
+    gint64 now = g_date_time_to_unix(local);
+    char* text = g_date_time_format(local, "%Y-%m-%d %H:%M:%S");
+    gtk_label_set_text(GTK_LABEL(current_time_label), text);
+    g_free(text);
+    g_date_time_unref(local);
+    
+    // Visible rows only show hours and minutes, so refresh them in one batch per minute
+    if (now / 60 != last_row_minute) {
+        last_row_minute = now / 60;
+        for (guint i = 0; i < bound_time_labels->len; i++) {
+            update_row_time(g_ptr_array_index(bound_time_labels, i), now);
+        }
+    }
+}
+
+static gboolean on_clock_tick(gpointer user_data);
+
+// Schedules the next tick just after the coming second boundary, so the
+// clock never lags a second behind and the timer wakes up once per second
+static void schedule_clock_tick(void) {
+    gint64 now_ms = g_get_real_time() / 1000;
+    guint delay = (guint)(1000 - now_ms % 1000);
+    clock_source_id = g_timeout_add(delay, on_clock_tick, NULL);
+}
+
+static gboolean on_clock_tick(gpointer user_data) {
+    update_clock();
+    schedule_clock_tick();
+    return G_SOURCE_REMOVE;
+}
+
+static void on_timezone_page_map(GtkWidget* page, gpointer user_data) {
+    last_row_minute = -1;
+    update_clock();
+    if (!clock_source_id) {
+        schedule_clock_tick();
+    }
+}
+
+static void on_timezone_page_unmap(GtkWidget* page, gpointer user_data) {
+    if (clock_source_id) {
+        g_source_remove(clock_source_id);
+        clock_source_id = 0;
+    }
+}
+
+static void on_timezone_row_setup(GtkSignalListItemFactory* factory, GtkListItem* list_item, gpointer user_data) {
+    GtkWidget* row_box = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 10);
+    gtk_widget_set_margin_top(row_box, 8);
+    gtk_widget_set_margin_bottom(row_box, 8);
+    gtk_widget_set_margin_start(row_box, 12);
+    gtk_widget_set_margin_end(row_box, 12);
+    
+    GtkWidget* label_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 2);
+    gtk_widget_set_hexpand(label_box, TRUE);
+    
+    GtkWidget* name_label = gtk_label_new(NULL);
+    gtk_widget_set_halign(name_label, GTK_ALIGN_START);
+    gtk_box_append(GTK_BOX(label_box), name_label);
+    
+    GtkWidget* detail_label = gtk_label_new(NULL);
+    gtk_widget_add_css_class(detail_label, "timezone-detail");
+    gtk_widget_set_halign(detail_label, GTK_ALIGN_START);
+    gtk_box_append(GTK_BOX(label_box), detail_label);
+    
+    gtk_box_append(GTK_BOX(row_box), label_box);
+    
+    GtkWidget* time_label = gtk_label_new(NULL);
+    gtk_widget_add_css_class(time_label, "timezone-time");
+    gtk_box_append(GTK_BOX(row_box), time_label);
+    
+    // Add selection indicator
+    GtkWidget* check = gtk_image_new_from_icon_name("emblem-ok-symbolic");
+    gtk_widget_add_css_class(check, "selection-check");
+    gtk_box_append(GTK_BOX(row_box), check);
+    
+    gtk_list_item_set_child(list_item, row_box);
+}
+
+static void on_timezone_row_bind(GtkSignalListItemFactory* factory, GtkListItem* list_item, gpointer user_data) {
+    guint index = wave_index_item_get_index(gtk_list_item_get_item(list_item));
+    if (index >= timezone_table->n_zones) {
+        return;
+    }
+    
+    const TimezoneInfo* info = &timezone_table->zones[index];
+    GtkWidget* label_box = gtk_widget_get_first_child(gtk_list_item_get_child(list_item));
+    GtkWidget* name_label = gtk_widget_get_first_child(label_box);
+    GtkWidget* detail_label = gtk_widget_get_next_sibling(name_label);
+    
+    char* name = g_strdelimit(timezone_info_dup_name(info), "_", ' ');
+    gtk_label_set_text(GTK_LABEL(name_label), name);
+    g_free(name);
+    
+    GString* detail = g_string_new(NULL);
+    if (timezone_table->offsets_ready) {
+        char offset[16];
+        timezone_format_offset(info->utc_offset, offset, sizeof(offset));
+        g_string_append_printf(detail, "%s · %s", offset, info->abbreviation);
+    }
+    if (info->countries) {
+        g_string_append_printf(detail, "%s%.*s", detail->len ? " · " : "",
+                               (int)info->countries_len, info->countries);
+    }
+    gtk_label_set_text(GTK_LABEL(detail_label), detail->str);
+    g_string_free(detail, TRUE);
+    
+    GtkWidget* time_label = gtk_widget_get_next_sibling(label_box);
+    g_object_set_data(G_OBJECT(time_label), "zone-index", GUINT_TO_POINTER(index));
+    g_ptr_array_add(bound_time_labels, time_label);
+    update_row_time(time_label, g_get_real_time() / G_USEC_PER_SEC);
+}
+
+static void on_timezone_row_unbind(GtkSignalListItemFactory* factory, GtkListItem* list_item, gpointer user_data) {
+    GtkWidget* label_box = gtk_widget_get_first_child(gtk_list_item_get_child(list_item));
+    g_ptr_array_remove_fast(bound_time_labels, gtk_widget_get_next_sibling(label_box));
+}
+
+static void on_timezone_selected(GtkSingleSelection* selection, GParamSpec* pspec, gpointer user_data) {
+    WaveIndexItem* item = gtk_single_selection_get_selected_item(selection);
+    
+    if (item && wave_index_item_get_index(item) < timezone_table->n_zones) {
+        g_free(selected_timezone);
+        selected_timezone = timezone_info_dup_name(&timezone_table->zones[wave_index_item_get_index(item)]);
+        
+        GTimeZone* tz = g_time_zone_new_identifier(selected_timezone);
+        if (tz) {
+            g_time_zone_unref(selected_tz);
+            selected_tz = tz;
+        }
+        if (clock_source_id) {
+            update_clock();
+        }
+    }
+}
+
+char* get_selected_timezone(void) {
+    return g_strdup(selected_timezone);
+}
+
+static void on_timezone_offsets_ready(GObject* source, GAsyncResult* result, gpointer user_data) {
+    if (!timezone_table_compute_offsets_finish(timezone_table, result, NULL)) {
+        return;
+    }
+    
+    // Rebind the visible rows so they show offsets, and re-run the search
+    // against the new index, which now also covers offsets
+    wave_index_model_set_n_items(timezone_model, timezone_table->n_zones);
+    apply_timezone_search(SEARCH_CHANGE_DIFFERENT);
+    
+    if (selected_timezone && search_index_get_n_matches(timezone_table->search_index) == timezone_table->n_zones) {
+        int index = timezone_table_find(timezone_table, selected_timezone);
+        if (index >= 0) {
+            gtk_single_selection_set_selected(timezone_selection, (guint)index);
+        }
+    }
 }
 
 GtkWidget* create_timezone_page(void) {
@@ -28,8 +237,9 @@ GtkWidget* create_timezone_page(void) {
     gtk_box_append(GTK_BOX(page), header_box);
       // Content area
     GtkWidget* content_box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 20);
-    gtk_widget_set_halign(content_box, GTK_ALIGN_CENTER);
+    gtk_widget_set_halign(content_box, GTK_ALIGN_FILL);
     gtk_widget_set_hexpand(content_box, TRUE);
+    gtk_widget_set_vexpand(content_box, TRUE);
       // Search entry for timezones
     timezone_search = gtk_search_entry_new();
     gtk_entry_set_placeholder_text(GTK_ENTRY(timezone_search), "Search timezones...");
@@ -37,47 +247,39 @@ GtkWidget* create_timezone_page(void) {
     g_signal_connect(timezone_search, "search-changed", G_CALLBACK(on_timezone_search_changed), NULL);
     gtk_box_append(GTK_BOX(content_box), timezone_search);
     
-    // Timezone selection combo box
-    timezone_combo = gtk_combo_box_text_new();
-    gtk_widget_add_css_class(timezone_combo, "timezone-combo");
-    
-    // Add sample timezones in Continent/City format
-    const char* timezones[] = {
-        "Africa/Cairo",
-        "America/New_York",
-        "America/Los_Angeles",
-        "America/Chicago",
-        "America/Denver",
-        "America/Sao_Paulo",
-        "America/Mexico_City",
-        "Asia/Tokyo",
-        "Asia/Shanghai",
-        "Asia/Seoul",
-        "Asia/Mumbai",
-        "Asia/Dubai",
-        "Asia/Singapore",
-        "Europe/London",
-        "Europe/Paris",
-        "Europe/Berlin",
-        "Europe/Rome",
-        "Europe/Moscow",
-        "Europe/Stockholm",
-        "Europe/Amsterdam",
-        "Australia/Sydney",
-        "Australia/Melbourne",
-        "Pacific/Auckland",
-        "Pacific/Honolulu"
-    };
-    
-    for (int i = 0; i < 24; i++) {
-        gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(timezone_combo), timezones[i]);
-    }
+    // Scrollable, filterable timezone list. Zone names come straight from the
+    // mapped tz database; offsets are filled in by a worker thread.
+    GtkWidget* scrolled = gtk_scrolled_window_new();
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrolled), GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+    gtk_widget_set_vexpand(scrolled, TRUE);
+    gtk_widget_set_hexpand(scrolled, TRUE);
+    gtk_widget_add_css_class(scrolled, "timezone-list");
+    
+    timezone_table = timezone_table_load();
+    selected_tz = g_time_zone_new_utc();
+    bound_time_labels = g_ptr_array_new();
+    timezone_model = wave_index_model_new(timezone_table->n_zones);
+    timezone_filter = gtk_custom_filter_new(filter_timezone, NULL, NULL);
+    GtkFilterListModel* filtered = gtk_filter_list_model_new(G_LIST_MODEL(g_object_ref(timezone_model)),
+                                                             GTK_FILTER(g_object_ref(timezone_filter)));
+    timezone_selection = gtk_single_selection_new(G_LIST_MODEL(filtered));
+    gtk_single_selection_set_autoselect(timezone_selection, FALSE);
+    g_signal_connect(timezone_selection, "notify::selected", G_CALLBACK(on_timezone_selected), NULL);
+    
+    GtkListItemFactory* factory = gtk_signal_list_item_factory_new();
+    g_signal_connect(factory, "setup", G_CALLBACK(on_timezone_row_setup), NULL);
+    g_signal_connect(factory, "bind", G_CALLBACK(on_timezone_row_bind), NULL);
+    g_signal_connect(factory, "unbind", G_CALLBACK(on_timezone_row_unbind), NULL);
+    
+    timezone_list_view = gtk_list_view_new(GTK_SELECTION_MODEL(timezone_selection), factory);
+    gtk_widget_add_css_class(timezone_list_view, "timezone-listview");
     
     // Set default selection (UTC)
-    gtk_combo_box_text_prepend_text(GTK_COMBO_BOX_TEXT(timezone_combo), "UTC");
-    gtk_combo_box_set_active(GTK_COMBO_BOX(timezone_combo), 0);
+    gtk_single_selection_set_selected(timezone_selection, 0);
+    timezone_table_compute_offsets_async(timezone_table, NULL, on_timezone_offsets_ready, NULL);
     
-    gtk_box_append(GTK_BOX(content_box), timezone_combo);
+    gtk_scrolled_window_set_child(GTK_SCROLLED_WINDOW(scrolled), timezone_list_view);
+    gtk_box_append(GTK_BOX(content_box), scrolled);
     
     // Current time display
     GtkWidget* time_frame = create_rounded_frame(NULL);
@@ -94,10 +296,10 @@ GtkWidget* create_timezone_page(void) {
     gtk_widget_add_css_class(time_label, "time-label");
     gtk_box_append(GTK_BOX(time_box), time_label);
     
-    // Get current time (placeholder)
-    GtkWidget* current_time = gtk_label_new("2025-06-09 14:30:00");
-    gtk_widget_add_css_class(current_time, "current-time");
-    gtk_box_append(GTK_BOX(time_box), current_time);
+    // Updated every second while the page is visible
+    current_time_label = gtk_label_new(NULL);
+    gtk_widget_add_css_class(current_time_label, "current-time");
+    gtk_box_append(GTK_BOX(time_box), current_time_label);
     
     gtk_frame_set_child(GTK_FRAME(time_frame), time_box);
     gtk_box_append(GTK_BOX(content_box), time_frame);
@@ -127,5 +329,8 @@ GtkWidget* create_timezone_page(void) {
     
     gtk_box_append(GTK_BOX(page), content_box);
     
+    g_signal_connect(page, "map", G_CALLBACK(on_timezone_page_map), NULL);
+    g_signal_connect(page, "unmap", G_CALLBACK(on_timezone_page_unmap), NULL);
+    
     return page;
 }
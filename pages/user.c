@@ -80,6 +80,29 @@ static void on_username_changed(GtkEntry* entry, gpointer user_data) {
     }
 }
 
+gboolean validate_user_page(void) {
+    const char* username = gtk_editable_get_text(GTK_EDITABLE(username_entry));
+    const char* password = gtk_editable_get_text(GTK_EDITABLE(password_entry));
+    const char* confirm = gtk_editable_get_text(GTK_EDITABLE(confirm_password_entry));
+    
+    gtk_widget_remove_css_class(username_entry, "error");
+    gtk_widget_remove_css_class(confirm_password_entry, "error");
+    
+    if (strlen(username) == 0) {
+        gtk_widget_add_css_class(username_entry, "error");
+        gtk_widget_grab_focus(username_entry);
+        return FALSE;
+    }
+    
+    if (strlen(password) == 0 || g_strcmp0(password, confirm) != 0) {
+        gtk_widget_add_css_class(confirm_password_entry, "error");
+        gtk_widget_grab_focus(confirm_password_entry);
+        return FALSE;
+    }
+    
+    return TRUE;
+}
+
 GtkWidget* create_user_page(void) {
     GtkWidget* page = gtk_box_new(GTK_ORIENTATION_VERTICAL, 32);
     gtk_widget_set_valign(page, GTK_ALIGN_CENTER);
@@ -0,0 +1,241 @@
+#include "search-index.h"
+#include <stdarg.h>
+#include <string.h>
+
+// Separates the keys of one entry so a query cannot match across them
+#define KEY_SEPARATOR '\x1f'
+
+// One cached query result. Level 0 is the empty query, which matches everything.
+typedef struct {
+    char* query;
+    char** tokens;
+    GArray* matches;   // sorted entry numbers
+} SearchLevel;
+
+struct SearchIndex {
+    GString* text;         // normalized keys of all entries, NUL-terminated per entry
+    GArray* offsets;       // start of each entry in text
+    GPtrArray* levels;     // stack of SearchLevel, each refining the one below
+    guint32* match_bits;   // membership bitmap for the top level
+    guint match_bits_len;
+};
+
+typedef struct {
+    gunichar from;
+    const char* to;
+} Transliteration;
+
+static const Transliteration transliterations[] = {
+    {0x00DF, "ss"},  // ß
+    {0x00E6, "ae"},  // æ
+    {0x0153, "oe"},  // œ
+    {0x00F8, "o"},   // ø
+    {0x0111, "d"},   // đ
+    {0x00F0, "d"},   // ð
+    {0x0142, "l"},   // ł
+    {0x00FE, "th"},  // þ
+    {0x0131, "i"},   // ı
+    {0x0127, "h"},   // ħ
+    {0x0167, "t"}    // ŧ
+};
+
+char* search_index_normalize(const char* text) {
+    char* decomposed = g_utf8_normalize(text, -1, G_NORMALIZE_NFKD);
+    if (!decomposed) {
+        return g_strdup("");
+    }
+    
+    GString* out = g_string_sized_new(strlen(decomposed));
+    for (const char* p = decomposed; *p; p = g_utf8_next_char(p)) {
+        gunichar c = g_utf8_get_char(p);
+        
+        // Combining marks are what is left of the accents after decomposition
+        if (g_unichar_ismark(c)) {
+            continue;
+        }
+        
+        c = g_unichar_tolower(c);
+        
+        gboolean transliterated = FALSE;
+        for (guint i = 0; i < G_N_ELEMENTS(transliterations); i++) {
+            if (transliterations[i].from == c) {
+                g_string_append(out, transliterations[i].to);
+                transliterated = TRUE;
+                break;
+            }
+        }
+        if (!transliterated) {
+            g_string_append_unichar(out, c);
+        }
+    }
+    
+    g_free(decomposed);
+    return g_string_free(out, FALSE);
+}
+
+static void search_level_free(gpointer data) {
+    SearchLevel* level = data;
+    g_free(level->query);
+    g_strfreev(level->tokens);
+    g_array_free(level->matches, TRUE);
+    g_free(level);
+}
+
+static SearchLevel* search_level_new(const char* query) {
+    SearchLevel* level = g_new0(SearchLevel, 1);
+    level->query = g_strdup(query);
+    level->tokens = g_strsplit_set(query, " \t", -1);
+    level->matches = g_array_new(FALSE, FALSE, sizeof(guint));
+    return level;
+}
+
+SearchIndex* search_index_new(void) {
+    SearchIndex* index = g_new0(SearchIndex, 1);
+    index->text = g_string_new(NULL);
+    index->offsets = g_array_new(FALSE, FALSE, sizeof(guint));
+    index->levels = g_ptr_array_new_with_free_func(search_level_free);
+    return index;
+}
+
+void search_index_free(SearchIndex* index) {
+    if (!index) {
+        return;
+    }
+    g_string_free(index->text, TRUE);
+    g_array_free(index->offsets, TRUE);
+    g_ptr_array_free(index->levels, TRUE);
+    g_free(index->match_bits);
+    g_free(index);
+}
+
+guint search_index_add(SearchIndex* index, const char* first_key, ...) {
+    guint entry = index->offsets->len;
+    guint offset = index->text->len;
+    g_array_append_val(index->offsets, offset);
+    
+    va_list args;
+    va_start(args, first_key);
+    for (const char* key = first_key; key; key = va_arg(args, const char*)) {
+        char* normalized = search_index_normalize(key);
+        if (index->text->len > offset) {
+            g_string_append_c(index->text, KEY_SEPARATOR);
+        }
+        g_string_append(index->text, normalized);
+        g_free(normalized);
+    }
+    va_end(args);
+    
+    // Entries are stored NUL-terminated so strstr() stops at the entry boundary
+    g_string_append_c(index->text, '\0');
+    
+    // Adding entries invalidates any cached results
+    g_ptr_array_set_size(index->levels, 0);
+    return entry;
+}
+
+static gboolean entry_matches(const SearchIndex* index, guint entry, char** tokens) {
+    const char* haystack = index->text->str + g_array_index(index->offsets, guint, entry);
+    for (char** token = tokens; *token; token++) {
+        if (**token && !strstr(haystack, *token)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static void update_match_bits(SearchIndex* index) {
+    guint n_words = (index->offsets->len + 31) / 32;
+    if (index->match_bits_len != n_words) {
+        g_free(index->match_bits);
+        index->match_bits = g_new(guint32, MAX(n_words, 1));
+        index->match_bits_len = n_words;
+    }
+    memset(index->match_bits, 0, MAX(n_words, 1) * sizeof(guint32));
+    
+    SearchLevel* top = g_ptr_array_index(index->levels, index->levels->len - 1);
+    for (guint i = 0; i < top->matches->len; i++) {
+        guint entry = g_array_index(top->matches, guint, i);
+        index->match_bits[entry / 32] |= 1u << (entry % 32);
+    }
+}
+
+static void ensure_base_level(SearchIndex* index) {
+    if (index->levels->len > 0) {
+        return;
+    }
+    
+    SearchLevel* base = search_level_new("");
+    for (guint entry = 0; entry < index->offsets->len; entry++) {
+        g_array_append_val(base->matches, entry);
+    }
+    g_ptr_array_add(index->levels, base);
+}
+
+SearchChange search_index_update(SearchIndex* index, const char* query) {
+    char* normalized = search_index_normalize(query ? query : "");
+    gboolean was_initialized = index->levels->len > 0;
+    ensure_base_level(index);
+    
+    SearchLevel* top = g_ptr_array_index(index->levels, index->levels->len - 1);
+    if (was_initialized && strcmp(top->query, normalized) == 0) {
+        g_free(normalized);
+        return SEARCH_CHANGE_NONE;
+    }
+    
+    // Drop cached levels that are not a prefix of the new query. Everything
+    // left below is a superset of the new result.
+    guint old_depth = index->levels->len;
+    while (index->levels->len > 1) {
+        top = g_ptr_array_index(index->levels, index->levels->len - 1);
+        if (g_str_has_prefix(normalized, top->query)) {
+            break;
+        }
+        g_ptr_array_set_size(index->levels, index->levels->len - 1);
+    }
+    top = g_ptr_array_index(index->levels, index->levels->len - 1);
+    gboolean popped = index->levels->len < old_depth;
+    
+    gboolean narrowed = FALSE;
+    if (strcmp(top->query, normalized) != 0) {
+        // Rescan only the entries that matched the shorter query
+        SearchLevel* level = search_level_new(normalized);
+        for (guint i = 0; i < top->matches->len; i++) {
+            guint entry = g_array_index(top->matches, guint, i);
+            if (entry_matches(index, entry, level->tokens)) {
+                g_array_append_val(level->matches, entry);
+            }
+        }
+        g_ptr_array_add(index->levels, level);
+        narrowed = TRUE;
+    }
+    
+    update_match_bits(index);
+    g_free(normalized);
+    
+    if (!was_initialized || (popped && narrowed)) {
+        return SEARCH_CHANGE_DIFFERENT;
+    }
+    return narrowed ? SEARCH_CHANGE_MORE_STRICT : SEARCH_CHANGE_LESS_STRICT;
+}
+
+gboolean search_index_matches(const SearchIndex* index, guint entry) {
+    if (index->levels->len == 0) {
+        return TRUE;
+    }
+    if (entry >= index->offsets->len) {
+        return FALSE;
+    }
+    return (index->match_bits[entry / 32] >> (entry % 32)) & 1;
+}
+
+guint search_index_get_n_entries(const SearchIndex* index) {
+    return index->offsets->len;
+}
+
+guint search_index_get_n_matches(const SearchIndex* index) {
+    if (index->levels->len == 0) {
+        return index->offsets->len;
+    }
+    SearchLevel* top = g_ptr_array_index(index->levels, index->levels->len - 1);
+    return top->matches->len;
+}
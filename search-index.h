@@ -0,0 +1,39 @@
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+#include <glib.h>
+
+// Precomputed, accent- and case-insensitive substring index over a fixed
+// set of entries. Each entry has one or more search keys (native name,
+// English name, code, ...) that are normalized once when added.
+//
+// Queries refine incrementally: typing more characters only rescans the
+// entries that matched the shorter query, and deleting characters goes
+// back to a cached earlier result instead of rescanning.
+
+typedef struct SearchIndex SearchIndex;
+
+// How the result set changed compared to the previous query, mirroring
+// GtkFilterChange so callers can pass it straight to gtk_filter_changed()
+typedef enum {
+    SEARCH_CHANGE_DIFFERENT,
+    SEARCH_CHANGE_LESS_STRICT,
+    SEARCH_CHANGE_MORE_STRICT,
+    SEARCH_CHANGE_NONE
+} SearchChange;
+
+SearchIndex* search_index_new(void);
+void search_index_free(SearchIndex* index);
+
+// Appends an entry with the given NULL-terminated list of keys and returns its number
+guint search_index_add(SearchIndex* index, const char* first_key, ...) G_GNUC_NULL_TERMINATED;
+
+SearchChange search_index_update(SearchIndex* index, const char* query);
+gboolean search_index_matches(const SearchIndex* index, guint entry);
+guint search_index_get_n_entries(const SearchIndex* index);
+guint search_index_get_n_matches(const SearchIndex* index);
+
+// Case folds, strips diacritics and transliterates ligatures ("Français" -> "francais")
+char* search_index_normalize(const char* text);
+
+#endif // SEARCH_INDEX_H
@@ -0,0 +1,500 @@
+#include "storage.h"
+#include "backend/iotune.h"
+#include "trace.h"
+#include <glib-unix.h>
+#include <errno.h>
+#include <linux/netlink.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define SECTOR_SIZE 512
+
+// Devices that are never installation targets
+static const char* const ignored_prefixes[] = {"loop", "ram", "zram", "fd", "dm-", "sr"};
+
+// Partition tables are only re-read when a device's size, disk sequence or
+// uevent generation changes
+static PartitionCache* partition_cache = NULL;
+static GHashTable* generations = NULL;  // kernel name -> uevent count
+static GMutex generations_lock;
+
+// A single thread, so speed probes never overlap
+static GThreadPool* speed_pool = NULL;
+
+const char* storage_get_root(void) {
+    const char* root = g_getenv("WAVE_STORAGE_ROOT");
+    return root ? root : "";
+}
+
+static char* build_root_path(const char* first, ...) G_GNUC_NULL_TERMINATED;
+
+static char* build_root_path(const char* first, ...) {
+    va_list args;
+    va_start(args, first);
+    char* relative = g_build_filename_valist(first, &args);
+    va_end(args);
+    
+    char* path = g_strconcat(storage_get_root(), "/", relative, NULL);
+    g_free(relative);
+    return path;
+}
+
+char* storage_get_device_node(const char* name) {
+    return build_root_path("dev", name, NULL);
+}
+
+static char* read_attribute(const char* device_dir, const char* attribute) {
+    char* path = g_build_filename(device_dir, attribute, NULL);
+    char* contents = NULL;
+    g_file_get_contents(path, &contents, NULL, NULL);
+    g_free(path);
+    return contents ? g_strstrip(contents) : NULL;
+}
+
+static guint64 read_number_attribute(const char* device_dir, const char* attribute) {
+    char* value = read_attribute(device_dir, attribute);
+    guint64 number = value ? g_ascii_strtoull(value, NULL, 10) : 0;
+    g_free(value);
+    return number;
+}
+
+static gboolean is_candidate_name(const char* name) {
+    if (name[0] == '.') {
+        return FALSE;
+    }
+    for (guint i = 0; i < G_N_ELEMENTS(ignored_prefixes); i++) {
+        if (g_str_has_prefix(name, ignored_prefixes[i])) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// "sda1" belongs to "sda" and "nvme0n1p2" to "nvme0n1"
+static gboolean is_partition_of(const char* device, const char* candidate) {
+    gsize length = strlen(device);
+    if (length == 0 || strncmp(candidate, device, length) != 0) {
+        return FALSE;
+    }
+    
+    const char* rest = candidate + length;
+    if (g_ascii_isdigit(device[length - 1])) {
+        if (*rest != 'p') {
+            return FALSE;
+        }
+        rest++;
+    }
+    if (*rest == '\0') {
+        return FALSE;
+    }
+    for (; *rest; rest++) {
+        if (!g_ascii_isdigit(*rest)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// /proc/partitions lines: "major minor #blocks name"
+static guint count_partitions(const char* name) {
+    char* path = build_root_path("proc", "partitions", NULL);
+    char* contents = NULL;
+    guint count = 0;
+    
+    if (g_file_get_contents(path, &contents, NULL, NULL)) {
+        char** lines = g_strsplit(contents, "\n", -1);
+        for (char** line = lines; *line; line++) {
+            char** fields = g_strsplit_set(g_strstrip(*line), " \t", -1);
+            guint n_fields = 0;
+            const char* last = NULL;
+            
+            for (char** field = fields; *field; field++) {
+                if (**field) {
+                    last = *field;
+                    n_fields++;
+                }
+            }
+            if (n_fields == 4 && is_partition_of(name, last)) {
+                count++;
+            }
+            g_strfreev(fields);
+        }
+        g_strfreev(lines);
+        g_free(contents);
+    }
+    
+    g_free(path);
+    return count;
+}
+
+static StorageTransport detect_transport(const char* name, const char* device_dir) {
+    if (g_str_has_prefix(name, "nvme")) {
+        return STORAGE_TRANSPORT_NVME;
+    }
+    if (g_str_has_prefix(name, "mmcblk")) {
+        return STORAGE_TRANSPORT_MMC;
+    }
+    if (g_str_has_prefix(name, "vd")) {
+        return STORAGE_TRANSPORT_VIRTIO;
+    }
+    
+    // /sys/block/sdb -> ../devices/pci0000:00/0000:00:14.0/usb2/2-1/.../block/sdb
+    StorageTransport transport = g_str_has_prefix(name, "sd") ? STORAGE_TRANSPORT_SATA : STORAGE_TRANSPORT_UNKNOWN;
+    char* target = g_file_read_link(device_dir, NULL);
+    if (target) {
+        if (strstr(target, "/usb")) {
+            transport = STORAGE_TRANSPORT_USB;
+        } else if (strstr(target, "/ata")) {
+            transport = STORAGE_TRANSPORT_SATA;
+        } else if (strstr(target, "/virtio")) {
+            transport = STORAGE_TRANSPORT_VIRTIO;
+        } else if (strstr(target, "/mmc")) {
+            transport = STORAGE_TRANSPORT_MMC;
+        }
+        g_free(target);
+    }
+    return transport;
+}
+
+static char* read_model(const char* device_dir) {
+    char* vendor = read_attribute(device_dir, "device/vendor");
+    char* model = read_attribute(device_dir, "device/model");
+    char* result = NULL;
+    
+    // libata reports "ATA" as the vendor of every SATA disk
+    if (vendor && (!*vendor || strcmp(vendor, "ATA") == 0)) {
+        g_clear_pointer(&vendor, g_free);
+    }
+    if (model && *model) {
+        result = vendor ? g_strdup_printf("%s %s", vendor, model) : g_strdup(model);
+    } else if (vendor) {
+        result = g_strdup(vendor);
+    }
+    
+    g_free(vendor);
+    g_free(model);
+    return result;
+}
+
+static int compare_names(gconstpointer a, gconstpointer b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static char** list_devices(void) {
+    char* block_dir = build_root_path("sys", "block", NULL);
+    GPtrArray* names = g_ptr_array_new();
+    GDir* dir = g_dir_open(block_dir, 0, NULL);
+    
+    if (dir) {
+        const char* name;
+        while ((name = g_dir_read_name(dir))) {
+            if (is_candidate_name(name)) {
+                g_ptr_array_add(names, g_strdup(name));
+            }
+        }
+        g_dir_close(dir);
+    }
+    
+    g_ptr_array_sort(names, compare_names);
+    g_ptr_array_add(names, NULL);
+    g_free(block_dir);
+    return (char**)g_ptr_array_free(names, FALSE);
+}
+
+static void list_devices_thread(GTask* task, gpointer source_object, gpointer task_data,
+                                GCancellable* cancellable) {
+    TRACE_BEGIN("storage_list");
+    char** names = list_devices();
+    TRACE_END("storage_list");
+    g_task_return_pointer(task, names, (GDestroyNotify)g_strfreev);
+}
+
+void storage_list_devices_async(GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data) {
+    GTask* task = g_task_new(NULL, cancellable, callback, user_data);
+    g_task_run_in_thread(task, list_devices_thread);
+    g_object_unref(task);
+}
+
+char** storage_list_devices_finish(GAsyncResult* result, GError** error) {
+    return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+static guint64 get_generation(const char* name) {
+    g_mutex_lock(&generations_lock);
+    gsize generation = generations ? GPOINTER_TO_SIZE(g_hash_table_lookup(generations, name)) : 0;
+    g_mutex_unlock(&generations_lock);
+    return generation;
+}
+
+static void bump_generation(const char* name) {
+    g_mutex_lock(&generations_lock);
+    if (!generations) {
+        generations = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    }
+    gsize generation = GPOINTER_TO_SIZE(g_hash_table_lookup(generations, name)) + 1;
+    g_hash_table_insert(generations, g_strdup(name), GSIZE_TO_POINTER(generation));
+    g_mutex_unlock(&generations_lock);
+}
+
+static PartitionTable* read_partition_table(const char* name) {
+    if (g_once_init_enter(&partition_cache)) {
+        g_once_init_leave(&partition_cache, partition_cache_new());
+    }
+    
+    char* path = storage_get_device_node(name);
+    PartitionTable* table = g_new(PartitionTable, 1);
+    gint64 start = g_get_monotonic_time();
+    
+    TRACE_BEGIN("partition_table_read");
+    int result = partition_cache_read(partition_cache, path, get_generation(name), table);
+    TRACE_END("partition_table_read");
+    
+    if (result < 0) {
+        // Usually EACCES when not running as root
+        g_debug("Cannot read the partition table of %s: %s", path, g_strerror(-result));
+        g_clear_pointer(&table, g_free);
+    } else {
+        g_debug("Read the partition table of %s in %.2f ms", path,
+                (g_get_monotonic_time() - start) / 1000.0);
+    }
+    
+    g_free(path);
+    return table;
+}
+
+static StorageDevice* probe_device(const char* name, GError** error) {
+    char* device_dir = build_root_path("sys", "block", name, NULL);
+    
+    if (!g_file_test(device_dir, G_FILE_TEST_IS_DIR)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "%s does not exist", device_dir);
+        g_free(device_dir);
+        return NULL;
+    }
+    
+    // Card readers without media report a size of 0
+    guint64 size = read_number_attribute(device_dir, "size") * SECTOR_SIZE;
+    if (size == 0 || read_number_attribute(device_dir, "ro")) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "%s is empty or read-only", name);
+        g_free(device_dir);
+        return NULL;
+    }
+    
+    StorageDevice* device = g_new0(StorageDevice, 1);
+    device->name = g_strdup(name);
+    device->size_bytes = size;
+    device->model = read_model(device_dir);
+    device->rotational = read_number_attribute(device_dir, "queue/rotational") != 0;
+    device->removable = read_number_attribute(device_dir, "removable") != 0;
+    device->transport = detect_transport(name, device_dir);
+    device->n_partitions = count_partitions(name);
+    device->table = read_partition_table(name);
+    
+    g_free(device_dir);
+    return device;
+}
+
+static void probe_device_thread(GTask* task, gpointer source_object, gpointer task_data,
+                                GCancellable* cancellable) {
+    GError* error = NULL;
+    TRACE_BEGIN("storage_probe");
+    StorageDevice* device = probe_device(task_data, &error);
+    TRACE_END("storage_probe");
+    
+    if (device) {
+        g_task_return_pointer(task, device, (GDestroyNotify)storage_device_free);
+    } else {
+        g_task_return_error(task, error);
+    }
+}
+
+void storage_probe_device_async(const char* name, GCancellable* cancellable,
+                                GAsyncReadyCallback callback, gpointer user_data) {
+    GTask* task = g_task_new(NULL, cancellable, callback, user_data);
+    g_task_set_task_data(task, g_strdup(name), g_free);
+    g_task_run_in_thread(task, probe_device_thread);
+    g_object_unref(task);
+}
+
+StorageDevice* storage_probe_device_finish(GAsyncResult* result, GError** error) {
+    return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+// Half the budget reading in order, half at random
+static void measure_speed(gpointer data, gpointer user_data) {
+    GTask* task = data;
+    if (g_task_return_error_if_cancelled(task)) {
+        g_object_unref(task);
+        return;
+    }
+    
+    char* path = storage_get_device_node(g_task_get_task_data(task));
+    StorageSpeed* speed = g_new0(StorageSpeed, 1);
+    gint64 start = g_get_monotonic_time();
+    
+    TRACE_BEGIN("disk_speed_probe");
+    int result = io_probe_sequential_reads(path, STORAGE_SPEED_BUDGET_MS / 2, &speed->read_bytes_per_second);
+    if (result == 0) {
+        result = io_probe_random_reads(path, IO_PROBE_THREADS, STORAGE_SPEED_BUDGET_MS / 2, &speed->random_iops);
+    }
+    TRACE_END("disk_speed_probe");
+    
+    if (result < 0) {
+        // Usually EACCES when not running as root
+        g_task_return_new_error(task, G_IO_ERROR, g_io_error_from_errno(-result), "Cannot measure %s: %s", path,
+                                g_strerror(-result));
+        g_free(speed);
+    } else {
+        g_debug("%s reads %.1f MB/s in order and %.0f blocks/s at random, measured in %.0f ms", path,
+                speed->read_bytes_per_second / 1e6, speed->random_iops, (g_get_monotonic_time() - start) / 1000.0);
+        g_task_return_pointer(task, speed, g_free);
+    }
+    g_free(path);
+    g_object_unref(task);
+}
+
+void storage_measure_speed_async(const char* name, GCancellable* cancellable,
+                                 GAsyncReadyCallback callback, gpointer user_data) {
+    if (!speed_pool) {
+        speed_pool = g_thread_pool_new(measure_speed, NULL, 1, FALSE, NULL);
+    }
+    
+    GTask* task = g_task_new(NULL, cancellable, callback, user_data);
+    g_task_set_task_data(task, g_strdup(name), g_free);
+    g_thread_pool_push(speed_pool, task, NULL);
+}
+
+StorageSpeed* storage_measure_speed_finish(GAsyncResult* result, GError** error) {
+    return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+void storage_device_free(StorageDevice* device) {
+    if (!device) {
+        return;
+    }
+    
+    g_free(device->name);
+    g_free(device->model);
+    g_free(device->table);
+    g_free(device);
+}
+
+char* storage_device_get_path(const StorageDevice* device) {
+    return g_strconcat("/dev/", device->name, NULL);
+}
+
+const char* storage_device_get_type_label(const StorageDevice* device) {
+    switch (device->transport) {
+    case STORAGE_TRANSPORT_NVME:
+        return "NVMe SSD";
+    case STORAGE_TRANSPORT_USB:
+        return device->rotational ? "External HDD" : "USB Storage";
+    case STORAGE_TRANSPORT_MMC:
+        return device->removable ? "SD Card" : "eMMC";
+    case STORAGE_TRANSPORT_VIRTIO:
+        return "Virtual Disk";
+    case STORAGE_TRANSPORT_SATA:
+        return device->rotational ? "SATA HDD" : "SATA SSD";
+    default:
+        return device->rotational ? "Hard Disk" : "Disk";
+    }
+}
+
+const char* storage_device_get_icon_name(const StorageDevice* device) {
+    switch (device->transport) {
+    case STORAGE_TRANSPORT_USB:
+        return device->rotational ? "drive-harddisk-usb" : "drive-removable-media";
+    case STORAGE_TRANSPORT_MMC:
+        return "media-flash";
+    default:
+        return device->rotational ? "drive-harddisk" : "drive-harddisk-solidstate";
+    }
+}
+
+typedef struct {
+    StorageEventFunc func;
+    gpointer user_data;
+} StorageMonitor;
+
+// Kernel uevents are "ACTION@DEVPATH" followed by NUL-separated KEY=VALUE pairs
+static void dispatch_uevent(StorageMonitor* monitor, const char* message, gsize length) {
+    const char* action = NULL;
+    const char* subsystem = NULL;
+    const char* devtype = NULL;
+    const char* devname = NULL;
+    gboolean media_change = FALSE;
+    
+    for (const char* field = message; field < message + length; field += strlen(field) + 1) {
+        if (g_str_has_prefix(field, "ACTION=")) {
+            action = field + strlen("ACTION=");
+        } else if (g_str_has_prefix(field, "SUBSYSTEM=")) {
+            subsystem = field + strlen("SUBSYSTEM=");
+        } else if (g_str_has_prefix(field, "DEVTYPE=")) {
+            devtype = field + strlen("DEVTYPE=");
+        } else if (g_str_has_prefix(field, "DEVNAME=")) {
+            devname = field + strlen("DEVNAME=");
+        } else if (strcmp(field, "DISK_MEDIA_CHANGE=1") == 0) {
+            media_change = TRUE;
+        }
+    }
+    
+    if (!action || !devname || g_strcmp0(subsystem, "block") != 0 || g_strcmp0(devtype, "disk") != 0 ||
+        !is_candidate_name(devname)) {
+        return;
+    }
+    
+    TRACE_INSTANT("storage_uevent");
+    bump_generation(devname);
+    if (strcmp(action, "add") == 0) {
+        monitor->func(devname, TRUE, monitor->user_data);
+    } else if (strcmp(action, "remove") == 0) {
+        monitor->func(devname, FALSE, monitor->user_data);
+    } else if (strcmp(action, "change") == 0) {
+        if (media_change) {
+            monitor->func(devname, FALSE, monitor->user_data);
+        }
+        monitor->func(devname, TRUE, monitor->user_data);
+    }
+}
+
+static gboolean on_uevent(gint fd, GIOCondition condition, gpointer user_data) {
+    StorageMonitor* monitor = user_data;
+    char buffer[8192];
+    struct sockaddr_nl sender;
+    socklen_t sender_length = sizeof(sender);
+    ssize_t length;
+    
+    while ((length = recvfrom(fd, buffer, sizeof(buffer) - 1, 0,
+                              (struct sockaddr*)&sender, &sender_length)) > 0) {
+        buffer[length] = '\0';
+        
+        // Only trust messages sent by the kernel itself
+        if (sender.nl_pid == 0) {
+            dispatch_uevent(monitor, buffer, (gsize)length);
+        }
+        sender_length = sizeof(sender);
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+guint storage_monitor_start(StorageEventFunc func, gpointer user_data) {
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0) {
+        g_debug("Disk hotplug disabled: %s", g_strerror(errno));
+        return 0;
+    }
+    
+    struct sockaddr_nl address = {0};
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = 1;  // kernel events, not the ones re-broadcast by udev
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        g_debug("Disk hotplug disabled: %s", g_strerror(errno));
+        close(fd);
+        return 0;
+    }
+    
+    StorageMonitor* monitor = g_new0(StorageMonitor, 1);
+    monitor->func = func;
+    monitor->user_data = user_data;
+    return g_unix_fd_add_full(G_PRIORITY_DEFAULT, fd, G_IO_IN, on_uevent, monitor, g_free);
+}
@@ -0,0 +1,79 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <gio/gio.h>
+#include "backend/parttable.h"
+
+typedef enum {
+    STORAGE_TRANSPORT_UNKNOWN,
+    STORAGE_TRANSPORT_SATA,
+    STORAGE_TRANSPORT_NVME,
+    STORAGE_TRANSPORT_USB,
+    STORAGE_TRANSPORT_MMC,
+    STORAGE_TRANSPORT_VIRTIO
+} StorageTransport;
+
+// One whole-disk block device as seen in sysfs
+typedef struct {
+    char* name;           // kernel name, e.g. "sda", "nvme0n1"
+    char* model;          // vendor and model, or NULL when sysfs has neither
+    guint64 size_bytes;
+    guint n_partitions;   // from /proc/partitions
+    StorageTransport transport;
+    gboolean rotational;
+    gboolean removable;
+    PartitionTable* table;  // read from the device itself; NULL when it cannot be opened
+} StorageDevice;
+
+// Everything is read below this root ("" for the live system), so the probe
+// can run against fixture trees containing sys/block/* and proc/partitions.
+// WAVE_STORAGE_ROOT overrides the default.
+const char* storage_get_root(void);
+
+// The device node to open for a kernel name, below the root
+char* storage_get_device_node(const char* name);
+
+// Lists the candidate disks (no loop, RAM, read-only or empty devices) on a
+// worker thread. The result is a NULL-terminated array of kernel names.
+void storage_list_devices_async(GCancellable* cancellable, GAsyncReadyCallback callback, gpointer user_data);
+char** storage_list_devices_finish(GAsyncResult* result, GError** error);
+
+// Reads one device's attributes and partition table on a worker thread, so a
+// slow device only delays its own card. The table is read from
+// <root>/dev/<name>, which may be a disk image in a fixture tree.
+void storage_probe_device_async(const char* name, GCancellable* cancellable,
+                                GAsyncReadyCallback callback, gpointer user_data);
+StorageDevice* storage_probe_device_finish(GAsyncResult* result, GError** error);
+
+#define STORAGE_SPEED_BUDGET_MS 400
+
+// How fast a disk reads, from a short probe that only reads
+typedef struct {
+    double read_bytes_per_second;   // 1 MiB O_DIRECT reads in order from the start of the disk
+    double random_iops;             // 4 KiB O_DIRECT reads at random offsets, 8 at once
+} StorageSpeed;
+
+// Measures how fast <root>/dev/<name> reads, which may be an image file in a
+// fixture tree. Measurements run one after another on a thread of their own,
+// so disks do not slow each other down, and each stops after about
+// STORAGE_SPEED_BUDGET_MS. Nothing is written.
+void storage_measure_speed_async(const char* name, GCancellable* cancellable,
+                                 GAsyncReadyCallback callback, gpointer user_data);
+StorageSpeed* storage_measure_speed_finish(GAsyncResult* result, GError** error);
+
+void storage_device_free(StorageDevice* device);
+char* storage_device_get_path(const StorageDevice* device);
+const char* storage_device_get_type_label(const StorageDevice* device);
+const char* storage_device_get_icon_name(const StorageDevice* device);
+
+// Called from the main loop for every block-device uevent
+typedef void (*StorageEventFunc)(const char* name, gboolean added, gpointer user_data);
+
+// Listens for disks being added, removed or changing media on the kernel
+// uevent netlink socket. Returns the source id, or 0 when netlink is not
+// available. A media change is reported as a removal followed by an addition,
+// any other change (e.g. a rewritten partition table) as an addition of a
+// device that is already known.
+guint storage_monitor_start(StorageEventFunc func, gpointer user_data);
+
+#endif // STORAGE_H
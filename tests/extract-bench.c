@@ -0,0 +1,246 @@
+// extract-bench: times the payload extractor on a synthetic tree of many
+// small files at 1, 4 and 16 writer threads.
+//
+//   extract-bench [-n files] [-s max size] [-r repetitions] [directory]
+//
+// The tar stream is generated on the fly and fed through
+// extractor_new_from_reader(), so neither the archive nor its reading is
+// part of what is measured. Every run extracts into a fresh subdirectory
+// of the directory (a new one under /tmp by default), syncs it like an
+// install does and removes it again. Plain C, like the extractor.
+
+#define _GNU_SOURCE
+#include "../backend/extract.h"
+#include <errno.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TAR_BLOCK 512
+#define FILES_PER_DIRECTORY 100
+#define MAX_FILE_SIZE_LIMIT (1024 * 1024)
+
+static const uint32_t writer_counts[] = {1, 4, 16};
+
+// Produces the archive one member at a time
+typedef struct {
+    uint32_t n_files;
+    uint32_t max_size;
+    uint32_t next;          // next file; its directory comes first when it starts one
+    int directory_done;
+    int trailer_done;
+    uint8_t* member;        // header and padded data of the current member
+    size_t length;
+    size_t position;
+} Generator;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: extract-bench [-n files] [-s max size] [-r repetitions] [directory]\n");
+    exit(2);
+}
+
+// Spread over 0 to max_size, the same for every run
+static uint32_t file_size(uint32_t file, uint32_t max_size) {
+    return max_size ? (uint32_t)(((uint64_t)file * 2654435761u) % (max_size + 1)) : 0;
+}
+
+static void write_header(uint8_t* header, const char* name, char type, uint32_t mode, uint64_t size) {
+    memset(header, 0, TAR_BLOCK);
+    snprintf((char*)header, 100, "%s", name);
+    snprintf((char*)header + 100, 8, "%07o", mode);
+    snprintf((char*)header + 108, 8, "%07o", 0);
+    snprintf((char*)header + 116, 8, "%07o", 0);
+    snprintf((char*)header + 124, 12, "%011llo", (unsigned long long)size);
+    snprintf((char*)header + 136, 12, "%011o", 1700000000u);
+    header[156] = (uint8_t)type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    
+    // The checksum is taken with its own field filled with spaces
+    memset(header + 148, ' ', 8);
+    uint32_t sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) {
+        sum += header[i];
+    }
+    snprintf((char*)header + 148, 8, "%06o", sum);
+    header[155] = ' ';
+}
+
+// Builds the next member into the buffer; returns 0 at the end of the archive
+static int generate_member(Generator* generator) {
+    char name[64];
+    generator->position = 0;
+    
+    if (generator->next >= generator->n_files) {
+        if (generator->trailer_done) {
+            generator->length = 0;
+            return 0;
+        }
+        memset(generator->member, 0, 2 * TAR_BLOCK);
+        generator->length = 2 * TAR_BLOCK;
+        generator->trailer_done = 1;
+        return 1;
+    }
+    
+    uint32_t directory = generator->next / FILES_PER_DIRECTORY;
+    if (generator->next % FILES_PER_DIRECTORY == 0 && !generator->directory_done) {
+        snprintf(name, sizeof(name), "d%05u/", directory);
+        write_header(generator->member, name, '5', 0755, 0);
+        generator->length = TAR_BLOCK;
+        generator->directory_done = 1;
+        return 1;
+    }
+    
+    uint32_t size = file_size(generator->next, generator->max_size);
+    snprintf(name, sizeof(name), "d%05u/f%07u", directory, generator->next);
+    write_header(generator->member, name, '0', 0644, size);
+    memset(generator->member + TAR_BLOCK, 'a' + generator->next % 26, size);
+    
+    size_t padded = ((size_t)size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    memset(generator->member + TAR_BLOCK + size, 0, padded - size);
+    generator->length = TAR_BLOCK + padded;
+    generator->next++;
+    generator->directory_done = 0;
+    return 1;
+}
+
+static ssize_t read_archive(void* user_data, void* buffer, size_t length) {
+    Generator* generator = user_data;
+    size_t done = 0;
+    
+    while (done < length) {
+        if (generator->position == generator->length && !generate_member(generator)) {
+            break;
+        }
+        size_t n = generator->length - generator->position;
+        if (n > length - done) {
+            n = length - done;
+        }
+        memcpy((uint8_t*)buffer + done, generator->member + generator->position, n);
+        generator->position += n;
+        done += n;
+    }
+    return (ssize_t)done;
+}
+
+static int remove_entry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return remove(path) == 0 ? 0 : -1;
+}
+
+// Extracts the whole tree once; returns the elapsed time or 0 on failure
+static uint64_t run_once(const char* root, uint32_t n_files, uint32_t max_size, uint32_t n_writers,
+                         ExtractStats* stats) {
+    Generator generator = {
+        .n_files = n_files,
+        .max_size = max_size,
+        .member = malloc(TAR_BLOCK + (size_t)max_size + TAR_BLOCK)
+    };
+    if (!generator.member || mkdir(root, 0755) != 0) {
+        fprintf(stderr, "extract-bench: %s: %s\n", root, strerror(errno));
+        free(generator.member);
+        return 0;
+    }
+    
+    // Fixed writer counts, so the disk profile must not override them
+    ExtractOptions options;
+    extract_options_init(&options);
+    options.n_writers = n_writers;
+    options.io_class = IO_CLASS_NONE;
+    options.format = EXTRACT_FORMAT_TAR;
+    
+    uint64_t start = now_ns();
+    Extractor* extractor = extractor_new_from_reader(read_archive, &generator, 0, root, &options);
+    int result = extractor ? extractor_run(extractor) : -ENOMEM;
+    uint64_t elapsed = now_ns() - start;
+    
+    if (extractor) {
+        extractor_get_stats(extractor, stats);
+        extractor_free(extractor);
+    }
+    free(generator.member);
+    
+    if (result < 0) {
+        fprintf(stderr, "extract-bench: extracting into %s: %s\n", root, strerror(-result));
+        elapsed = 0;
+    }
+    if (nftw(root, remove_entry, 64, FTW_DEPTH | FTW_PHYS) != 0) {
+        fprintf(stderr, "extract-bench: removing %s: %s\n", root, strerror(errno));
+    }
+    return elapsed;
+}
+
+int main(int argc, char** argv) {
+    uint32_t n_files = 100000;
+    uint32_t max_size = 8192;
+    uint32_t repetitions = 1;
+    
+    int option;
+    while ((option = getopt(argc, argv, "n:s:r:h")) != -1) {
+        switch (option) {
+        case 'n': n_files = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 's': max_size = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'r': repetitions = (uint32_t)strtoul(optarg, NULL, 10); break;
+        default: usage();
+        }
+    }
+    if (n_files == 0 || max_size > MAX_FILE_SIZE_LIMIT || repetitions == 0 || optind + 1 < argc) {
+        usage();
+    }
+    
+    char template[] = "/tmp/extract-bench.XXXXXX";
+    const char* directory = optind < argc ? argv[optind] : mkdtemp(template);
+    if (!directory) {
+        fprintf(stderr, "extract-bench: creating a directory under /tmp: %s\n", strerror(errno));
+        return 1;
+    }
+    
+    uint64_t total_bytes = 0;
+    for (uint32_t i = 0; i < n_files; i++) {
+        total_bytes += file_size(i, max_size);
+    }
+    printf("%u files in %u directories, %.1f MB, %ld CPUs, under %s\n", n_files,
+           (n_files + FILES_PER_DIRECTORY - 1) / FILES_PER_DIRECTORY, total_bytes / 1e6,
+           sysconf(_SC_NPROCESSORS_ONLN), directory);
+    printf("%8s %10s %12s %12s\n", "writers", "best s", "files/s", "MB/s");
+    
+    int result = 0;
+    for (size_t w = 0; w < sizeof(writer_counts) / sizeof(writer_counts[0]) && result == 0; w++) {
+        uint64_t best = 0;
+        ExtractStats stats = {0};
+        
+        for (uint32_t r = 0; r < repetitions; r++) {
+            char root[4096];
+            snprintf(root, sizeof(root), "%s/w%u.%u", directory, writer_counts[w], r);
+            uint64_t elapsed = run_once(root, n_files, max_size, writer_counts[w], &stats);
+            if (elapsed == 0) {
+                result = 1;
+                break;
+            }
+            if (best == 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+        if (result == 0) {
+            printf("%8u %10.3f %12.0f %12.1f\n", stats.n_writers, best / 1e9, n_files * 1e9 / best,
+                   total_bytes * 1e3 / best);
+        }
+    }
+    
+    if (optind >= argc) {
+        rmdir(directory);
+    }
+    return result;
+}
@@ -0,0 +1,280 @@
+// helper-test: drives wave-install-helper -s through the client in
+// backend/helper.c, the way the installer does, and checks its replies,
+// status, events and errors.
+//
+//   helper-test [path to wave-install-helper]
+//
+// The helper is started on one end of a SOCK_SEQPACKET socketpair, without
+// pkexec. A dry run of a payload install with settings must report its
+// stages and log lines through the shared ring and finish with success,
+// while the status shows it running; a second start meanwhile is refused.
+// Bad commands, a missing source and a damaged archive must each come back
+// as the matching error. Plain C, like the helper.
+
+#define _GNU_SOURCE
+#include "../backend/helper.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// A dry run's stages each wait about two seconds
+#define FINISH_TIMEOUT_MS 30000
+
+static int failures = 0;
+
+static void check(int condition, const char* what) {
+    printf("%s: %s\n", condition ? "ok" : "FAIL", what);
+    if (!condition) {
+        failures++;
+    }
+}
+
+static pid_t start_helper(const char* path, int* client_fd) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0) {
+        return -1;
+    }
+    
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDIN_FILENO);
+        execl(path, path, "-s", (char*)NULL);
+        fprintf(stderr, "helper-test: %s: %s\n", path, strerror(errno));
+        _exit(127);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+    *client_fd = fds[0];
+    return pid;
+}
+
+// Waits up to timeout_ms for the next message; returns 1, 0 on timeout or
+// when the helper went away, or a negative errno value
+static int receive(HelperClient* client, HelperMessage* message, int timeout_ms) {
+    struct pollfd pfd = { helper_client_get_fd(client), POLLIN, 0 };
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready <= 0) {
+        return ready < 0 ? -errno : 0;
+    }
+    return helper_client_receive(client, message);
+}
+
+// Sends a command and returns the reply's result, or INT32_MIN when there
+// was no reply. A FINISHED message that arrives first is kept in finished.
+static int32_t send_command(HelperClient* client, const HelperCommand* command, uint32_t* state,
+                            HelperMessage* finished, int* have_finished) {
+    if (helper_client_send(client, command) < 0) {
+        return INT32_MIN;
+    }
+    HelperMessage message;
+    while (receive(client, &message, 5000) == 1) {
+        if (message.type == HELPER_MESSAGE_REPLY) {
+            if (state) {
+                *state = message.state;
+            }
+            return message.result;
+        }
+        if (message.type == HELPER_MESSAGE_FINISHED && finished) {
+            *finished = message;
+            *have_finished = 1;
+        }
+    }
+    return INT32_MIN;
+}
+
+static int32_t send_simple(HelperClient* client, HelperCommandType type, uint32_t* state) {
+    HelperCommand command;
+    helper_command_init(&command, type);
+    return send_command(client, &command, state, NULL, NULL);
+}
+
+static void payload_command(HelperCommand* command, const char* source, const char* target, int dry_run) {
+    helper_command_init(command, HELPER_COMMAND_START);
+    command->job = HELPER_JOB_PAYLOAD;
+    command->dry_run = (uint32_t)dry_run;
+    command->payload_threads = 1;
+    command->extract_options.io_class = IO_CLASS_NONE;
+    command->extract_options.sync = 0;
+    snprintf(command->source, sizeof(command->source), "%s", source);
+    snprintf(command->target, sizeof(command->target), "%s", target);
+}
+
+// Collects events until the run's FINISHED message; returns its result, or
+// INT32_MIN when it never came
+static int32_t wait_finished(HelperClient* client, HelperMessage* finished, int have_finished,
+                             uint32_t* n_stages, uint32_t* n_logs, int* saw_running, char* log, size_t log_size) {
+    ProgressRing* events = helper_client_get_events(client);
+    HelperMessage message;
+    int waited = 0;
+    
+    for (;;) {
+        ProgressEvent event;
+        while (progress_ring_pop(events, &event)) {
+            if (event.kind == PROGRESS_EVENT_STAGE) {
+                (*n_stages)++;
+            } else {
+                (*n_logs)++;
+                size_t used = strlen(log);
+                snprintf(log + used, log_size - used, "%s\n", event.text);
+            }
+        }
+        HelperStatus status;
+        if (helper_client_get_status(client, &status) == 0 && status.state == HELPER_STATE_RUNNING) {
+            *saw_running = 1;
+        }
+        if (have_finished) {
+            return finished->result;
+        }
+        if (waited >= FINISH_TIMEOUT_MS) {
+            return INT32_MIN;
+        }
+        int received = receive(client, &message, 100);
+        waited += 100;
+        if (received < 0) {
+            return INT32_MIN;
+        }
+        if (received == 1 && message.type == HELPER_MESSAGE_FINISHED) {
+            *finished = message;
+            have_finished = 1;
+        }
+    }
+}
+
+static void test_commands(HelperClient* client) {
+    uint32_t state = UINT32_MAX;
+    check(send_simple(client, HELPER_COMMAND_QUERY, &state) == 0 && state == HELPER_STATE_IDLE,
+          "a new helper answers a query and is idle");
+    check(send_simple(client, HELPER_COMMAND_PAUSE, NULL) == -EINVAL, "pausing without a run is refused");
+    check(send_simple(client, HELPER_COMMAND_CANCEL, NULL) == -EINVAL, "cancelling without a run is refused");
+    check(send_simple(client, (HelperCommandType)99, NULL) == -EOPNOTSUPP, "an unknown command is refused");
+    
+    // A message of the wrong size is answered, not taken for a command
+    uint32_t junk = HELPER_COMMAND_QUERY;
+    HelperMessage reply = { 0 };
+    int sent = send(helper_client_get_fd(client), &junk, sizeof(junk), MSG_NOSIGNAL) == sizeof(junk);
+    check(sent && receive(client, &reply, 5000) == 1 && reply.type == HELPER_MESSAGE_REPLY &&
+          reply.result == -EPROTO, "a short message is answered with EPROTO");
+    
+    HelperCommand command;
+    payload_command(&command, "", "/nonexistent", 1);
+    check(send_command(client, &command, NULL, NULL, NULL) == -EINVAL, "a start without a source is refused");
+}
+
+static void test_dry_run(HelperClient* client) {
+    HelperCommand command;
+    payload_command(&command, "/nonexistent/payload.wpak", "/nonexistent/root", 1);
+    system_config_set(&command.config, "de_DE.UTF-8", "Europe/Berlin", "de", NULL);
+    
+    HelperMessage finished;
+    int have_finished = 0;
+    uint32_t state = UINT32_MAX;
+    int32_t result = send_command(client, &command, &state, &finished, &have_finished);
+    check(result == 0 && state == HELPER_STATE_RUNNING, "a dry run starts without opening its paths");
+    if (result != 0) {
+        return;
+    }
+    check(send_command(client, &command, NULL, &finished, &have_finished) == -EBUSY,
+          "a second start during a run is refused");
+    
+    uint32_t n_stages = 0;
+    uint32_t n_logs = 0;
+    int saw_running = 0;
+    char log[8192] = "";
+    result = wait_finished(client, &finished, have_finished, &n_stages, &n_logs, &saw_running, log, sizeof(log));
+    check(result == 0, "the dry run finishes with success");
+    check(saw_running, "the status shows the run while it goes");
+    check(n_stages >= 2, "the unpack and settings stages are announced");
+    check(strstr(log, "Unpacking /nonexistent/payload.wpak into /nonexistent/root (dry run)") != NULL,
+          "the run is logged as a dry run");
+    check(strstr(log, "unpack done in") != NULL, "the finished stage is logged");
+    check(strstr(log, " stages in ") != NULL, "the schedule is logged at the end");
+    
+    HelperStatus status;
+    check(helper_client_get_status(client, &status) == 0 && status.state == HELPER_STATE_FINISHED &&
+          status.result == 0, "the status shows the run finished");
+    printf("   %u stages, %u log lines\n", n_stages, n_logs);
+}
+
+static void test_errors(HelperClient* client, const char* directory) {
+    HelperCommand command;
+    payload_command(&command, "/nonexistent/payload.tar", directory, 0);
+    check(send_command(client, &command, NULL, NULL, NULL) == -ENOENT, "a missing payload is reported as ENOENT");
+    
+    // Not a tar archive: the header checksum cannot match
+    char archive[4096];
+    snprintf(archive, sizeof(archive), "%s/damaged.tar", directory);
+    char root[4096];
+    snprintf(root, sizeof(root), "%s/root", directory);
+    int fd = open(archive, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    char garbage[4096];
+    memset(garbage, 'x', sizeof(garbage));
+    int written = fd >= 0 && write(fd, garbage, sizeof(garbage)) == sizeof(garbage);
+    if (fd >= 0) {
+        close(fd);
+    }
+    check(written && mkdir(root, 0755) == 0, "the damaged archive and its root are created");
+    
+    payload_command(&command, archive, root, 0);
+    HelperMessage finished;
+    int have_finished = 0;
+    int32_t result = send_command(client, &command, NULL, &finished, &have_finished);
+    check(result == 0, "the damaged archive is accepted for a run");
+    if (result == 0) {
+        uint32_t n_stages = 0;
+        uint32_t n_logs = 0;
+        int saw_running = 0;
+        char log[8192] = "";
+        result = wait_finished(client, &finished, have_finished, &n_stages, &n_logs, &saw_running, log, sizeof(log));
+        check(result == -EBADMSG, "the run fails with EBADMSG");
+        check(strstr(log, "unpack failed after") != NULL, "the failed stage is logged");
+    }
+    
+    unlink(archive);
+    rmdir(root);
+}
+
+int main(int argc, char** argv) {
+    const char* path = argc > 1 ? argv[1] : "./wave-install-helper";
+    char directory[] = "/tmp/helper-test.XXXXXX";
+    if (!mkdtemp(directory)) {
+        fprintf(stderr, "helper-test: creating a directory under /tmp: %s\n", strerror(errno));
+        return 1;
+    }
+    
+    int fd;
+    pid_t pid = start_helper(path, &fd);
+    if (pid < 0) {
+        fprintf(stderr, "helper-test: starting %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    
+    HelperClient* client;
+    int result = helper_client_new(fd, &client);
+    check(result == 0, "the helper says hello and shares its memory");
+    if (result == 0) {
+        test_commands(client);
+        test_dry_run(client);
+        test_errors(client, directory);
+        
+        // Losing the client is how the installer tells the helper to quit
+        helper_client_free(client);
+    }
+    
+    int status = 0;
+    check(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+          "the helper exits cleanly once its client is gone");
+    rmdir(directory);
+    
+    printf("%d failed\n", failures);
+    return failures > 0;
+}
@@ -0,0 +1,115 @@
+// locale-bench: times building the language page's data at 20, 500 and
+// 5000 locales and reports how much the process grows for each.
+//
+//   locale-bench [repetitions]
+//
+// Each round builds a LocaleTable (strings, entry array and search index)
+// and the WaveIndexModel the list view is bound to, then fetches the rows
+// a freshly mapped list view would show. Names are synthesized from the
+// built-in table beforehand so only construction is timed. Needs GLib but
+// not GTK.
+
+#include "../index-model.h"
+#include "../locales.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Rows a list view of the language page's height creates on map
+#define VISIBLE_ROWS 20
+
+static const guint sizes[] = {20, 500, 5000};
+
+// Resident set size of this process in KiB, or 0 when /proc is unavailable
+static long read_rss_kib(void) {
+    char* status = NULL;
+    long rss = 0;
+    
+    if (g_file_get_contents("/proc/self/status", &status, NULL, NULL)) {
+        const char* line = strstr(status, "VmRSS:");
+        if (line) {
+            rss = strtol(line + strlen("VmRSS:"), NULL, 10);
+        }
+        g_free(status);
+    }
+    return rss;
+}
+
+// Makes n distinct entries by numbering copies of the built-in locales.
+// The strings are owned by the returned chunk.
+static LocaleInfo* synthesize_entries(guint n, GStringChunk* strings) {
+    LocaleTable* builtin = locale_table_new_builtin();
+    LocaleInfo* entries = g_new0(LocaleInfo, n);
+    
+    for (guint i = 0; i < n; i++) {
+        const LocaleInfo* base = &builtin->entries[i % builtin->n_entries];
+        guint copy = i / builtin->n_entries;
+        char* code = g_strdup_printf("%s@%u", base->code, copy);
+        char* native_name = g_strdup_printf("%s %u", base->native_name, copy);
+        char* english_name = g_strdup_printf("%s %u", base->english_name, copy);
+        
+        entries[i].code = g_string_chunk_insert(strings, code);
+        entries[i].native_name = g_string_chunk_insert(strings, native_name);
+        entries[i].english_name = g_string_chunk_insert(strings, english_name);
+        
+        g_free(code);
+        g_free(native_name);
+        g_free(english_name);
+    }
+    
+    locale_table_free(builtin);
+    return entries;
+}
+
+static void fetch_visible_rows(GListModel* model) {
+    guint n = MIN(g_list_model_get_n_items(model), VISIBLE_ROWS);
+    for (guint i = 0; i < n; i++) {
+        g_object_unref(g_list_model_get_item(model, i));
+    }
+}
+
+int main(int argc, char** argv) {
+    guint repetitions = argc > 1 ? (guint)strtoul(argv[1], NULL, 10) : 20;
+    if (repetitions == 0) {
+        repetitions = 1;
+    }
+    
+    printf("%8s %12s %12s %12s\n", "entries", "best ms", "mean ms", "RSS +KiB");
+    
+    for (guint s = 0; s < G_N_ELEMENTS(sizes); s++) {
+        guint n = sizes[s];
+        GStringChunk* strings = g_string_chunk_new(64 * 1024);
+        LocaleInfo* entries = synthesize_entries(n, strings);
+        gint64 best = G_MAXINT64;
+        gint64 total = 0;
+        long rss_growth = 0;
+        
+        for (guint r = 0; r < repetitions; r++) {
+            long rss_before = read_rss_kib();
+            gint64 start = g_get_monotonic_time();
+            
+            LocaleTable* table = locale_table_new_from(entries, n);
+            WaveIndexModel* model = wave_index_model_new(table->n_entries);
+            fetch_visible_rows(G_LIST_MODEL(model));
+            
+            gint64 elapsed = g_get_monotonic_time() - start;
+            best = MIN(best, elapsed);
+            total += elapsed;
+            
+            // The first round shows the growth; later ones reuse freed memory
+            if (r == 0) {
+                rss_growth = read_rss_kib() - rss_before;
+            }
+            
+            g_object_unref(model);
+            locale_table_free(table);
+        }
+        
+        printf("%8u %12.3f %12.3f %12ld\n", n, best / 1000.0, total / 1000.0 / repetitions, rss_growth);
+        
+        g_free(entries);
+        g_string_chunk_free(strings);
+    }
+    
+    return 0;
+}
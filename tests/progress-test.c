@@ -0,0 +1,162 @@
+// progress-test: runs a producer and a consumer thread against one
+// progress ring and checks that no event is lost, duplicated, reordered or
+// torn.
+//
+//   progress-test [events]
+//
+// In the first run the producer retries every event the full ring turned
+// down, so the consumer must see all of them, in order. In the second it
+// drops them as the install thread does, so the consumer must see an
+// increasing subsequence whose gaps add up to the dropped count. Each
+// event's text is filled to a length and pattern derived from its number,
+// which catches an event read while it was being written. Plain C, like
+// the ring.
+
+#define _GNU_SOURCE
+#include "../backend/progress.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    ProgressRing* ring;
+    uint64_t n_events;
+    int retry;                  // push again when the ring is full instead of dropping
+    uint64_t rejected;          // pushes the ring turned down
+    uint64_t producer_done;     // set once the last event is offered
+} Run;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// "<number> " followed by a filler letter, up to a length that varies with the number
+static size_t format_event(char* text, uint64_t number) {
+    int prefix = snprintf(text, PROGRESS_TEXT_SIZE, "%" PRIu64 " ", number);
+    size_t length = (size_t)prefix + number % (PROGRESS_TEXT_SIZE - 1 - (size_t)prefix);
+    memset(text + prefix, 'a' + (int)(number % 26), length - (size_t)prefix);
+    text[length] = '\0';
+    return length;
+}
+
+static void* produce(void* data) {
+    Run* run = data;
+    char text[PROGRESS_TEXT_SIZE];
+    
+    for (uint64_t i = 0; i < run->n_events; i++) {
+        format_event(text, i);
+        ProgressEventKind kind = i % 64 == 0 ? PROGRESS_EVENT_STAGE : PROGRESS_EVENT_LOG;
+        while (progress_ring_push(run->ring, kind, text) == -EAGAIN) {
+            run->rejected++;
+            if (!run->retry) {
+                break;
+            }
+            sched_yield();
+        }
+    }
+    __atomic_store_n(&run->producer_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Checks one popped event; returns its number, or -1 when it is corrupt
+static int64_t check_event(const ProgressEvent* event) {
+    char expected[PROGRESS_TEXT_SIZE];
+    char* end;
+    uint64_t number = strtoull(event->text, &end, 10);
+    
+    if (end == event->text || *end != ' ') {
+        return -1;
+    }
+    size_t length = format_event(expected, number);
+    ProgressEventKind kind = number % 64 == 0 ? PROGRESS_EVENT_STAGE : PROGRESS_EVENT_LOG;
+    if (event->length != length || event->kind != kind || memcmp(event->text, expected, length + 1) != 0) {
+        return -1;
+    }
+    return (int64_t)number;
+}
+
+static int run_test(const char* name, uint64_t n_events, int retry) {
+    ProgressRing* ring = malloc(sizeof(ProgressRing));
+    if (!ring) {
+        fprintf(stderr, "progress-test: %s\n", strerror(ENOMEM));
+        return 1;
+    }
+    progress_ring_init(ring);
+    
+    Run run = {.ring = ring, .n_events = n_events, .retry = retry};
+    pthread_t producer;
+    uint64_t start = now_ns();
+    int error = pthread_create(&producer, NULL, produce, &run);
+    if (error) {
+        fprintf(stderr, "progress-test: starting the producer: %s\n", strerror(error));
+        free(ring);
+        return 1;
+    }
+    
+    // The consumer side, polling like the progress page's tick callback
+    uint64_t received = 0;
+    uint64_t gaps = 0;
+    int64_t last = -1;
+    int failed = 0;
+    ProgressEvent event;
+    for (;;) {
+        int producer_done = __atomic_load_n(&run.producer_done, __ATOMIC_ACQUIRE);
+        int popped = 0;
+        while (!failed && progress_ring_pop(ring, &event)) {
+            int64_t number = check_event(&event);
+            if (number < 0) {
+                fprintf(stderr, "progress-test: %s: corrupt event after %" PRId64 ": \"%s\"\n", name, last, event.text);
+                failed = 1;
+            } else if (number <= last || (retry && number != last + 1)) {
+                fprintf(stderr, "progress-test: %s: event %" PRId64 " after %" PRId64 "\n", name, number, last);
+                failed = 1;
+            }
+            gaps += (uint64_t)(number - last - 1);
+            last = number;
+            received++;
+            popped = 1;
+        }
+        if (failed || (producer_done && !popped)) {
+            break;
+        }
+        if (!popped) {
+            sched_yield();
+        }
+    }
+    pthread_join(producer, NULL);
+    double seconds = (now_ns() - start) / 1e9;
+    
+    uint64_t dropped = progress_ring_get_dropped(ring);
+    gaps += n_events - 1 - (uint64_t)last;
+    if (!failed && (dropped != run.rejected || (retry && received != n_events) ||
+                    (!retry && (received + dropped != n_events || gaps != dropped)))) {
+        fprintf(stderr, "progress-test: %s: %" PRIu64 " offered, %" PRIu64 " received, %" PRIu64
+                " missing, %" PRIu64 " dropped, %" PRIu64 " turned down\n",
+                name, n_events, received, gaps, dropped, run.rejected);
+        failed = 1;
+    }
+    
+    printf("%s: %s, %" PRIu64 " events received, %" PRIu64 " dropped, %" PRIu64 " retried in %.3f s\n",
+           name, failed ? "FAIL" : "ok", received, retry ? 0 : dropped, retry ? run.rejected : 0, seconds);
+    free(ring);
+    return failed;
+}
+
+int main(int argc, char** argv) {
+    uint64_t n_events = argc > 1 ? strtoull(argv[1], NULL, 10) : 2000000;
+    if (n_events == 0) {
+        fprintf(stderr, "Usage: progress-test [events]\n");
+        return 2;
+    }
+    
+    int result = run_test("lossless", n_events, 1);
+    result |= run_test("dropping", n_events, 0);
+    return result;
+}
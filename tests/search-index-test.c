@@ -0,0 +1,178 @@
+// search-index-test: checks the incremental search index against a plain
+// scan and reports the time per keystroke.
+//
+// 5000 entries are added, 500 copies of each of ten locales, and a typed
+// query sequence is replayed through search_index_update(). Every step
+// checks the SearchChange and that exactly the entries a naive substring
+// scan finds are matched. Needs GLib but not GTK.
+
+#include "../search-index.h"
+#include <string.h>
+
+#define N_ENTRIES 5000
+#define TIMING_ROUNDS 50
+
+// Per-keystroke budget for the language page filter
+#define KEYSTROKE_BUDGET_US 1000
+
+static const char* const locales[][3] = {
+    {"Français (France)", "French (France)", "fr_FR"},
+    {"Deutsch (Deutschland)", "German (Germany)", "de_DE"},
+    {"Español (España)", "Spanish (Spain)", "es_ES"},
+    {"Português (Brasil)", "Portuguese (Brazil)", "pt_BR"},
+    {"Norsk bokmål (Norge)", "Norwegian Bokmål (Norway)", "nb_NO"},
+    {"Dansk (Danmark)", "Danish (Denmark)", "da_DK"},
+    {"Polski (Polska)", "Polish (Poland)", "pl_PL"},
+    {"Svenska (Sverige)", "Swedish (Sweden)", "sv_SE"},
+    {"Schweizerdeutsch (Schweiz)", "Swiss German (Switzerland)", "gsw_CH"},
+    {"Ελληνικά (Ελλάδα)", "Greek (Greece)", "el_GR"}
+};
+
+typedef struct {
+    const char* query;
+    SearchChange change;
+    guint n_matches;   // 0 means only compare against the plain scan
+} Keystroke;
+
+// Typing, deleting, retyping and replacing queries as a user would
+static const Keystroke keystrokes[] = {
+    {"", SEARCH_CHANGE_DIFFERENT, N_ENTRIES},
+    {"f", SEARCH_CHANGE_MORE_STRICT, 0},
+    {"fr", SEARCH_CHANGE_MORE_STRICT, 0},
+    {"fra", SEARCH_CHANGE_MORE_STRICT, 0},
+    {"fran", SEARCH_CHANGE_MORE_STRICT, 0},
+    {"franc", SEARCH_CHANGE_MORE_STRICT, 500},
+    {"franca", SEARCH_CHANGE_MORE_STRICT, 500},
+    {"francai", SEARCH_CHANGE_MORE_STRICT, 500},
+    {"Francais", SEARCH_CHANGE_MORE_STRICT, 500},
+    {"francai", SEARCH_CHANGE_LESS_STRICT, 500},
+    {"franc", SEARCH_CHANGE_LESS_STRICT, 500},
+    {"franz", SEARCH_CHANGE_DIFFERENT, 0},
+    {"fran", SEARCH_CHANGE_LESS_STRICT, 0},
+    {"", SEARCH_CHANGE_LESS_STRICT, N_ENTRIES},
+    {"", SEARCH_CHANGE_NONE, N_ENTRIES},
+    {"Deu", SEARCH_CHANGE_MORE_STRICT, 1000},
+    {"deutsch", SEARCH_CHANGE_MORE_STRICT, 1000},
+    {"ελλ", SEARCH_CHANGE_DIFFERENT, 500},
+    {"greek", SEARCH_CHANGE_DIFFERENT, 500},
+    {"swiss", SEARCH_CHANGE_DIFFERENT, 500},
+    {"swiss ger", SEARCH_CHANGE_MORE_STRICT, 500},
+    {"swiss germ", SEARCH_CHANGE_MORE_STRICT, 500},
+    {"bokmal", SEARCH_CHANGE_DIFFERENT, 500},
+    {"BOKMÅL", SEARCH_CHANGE_NONE, 500},
+    {"nb_no", SEARCH_CHANGE_DIFFERENT, 500}
+};
+
+static SearchIndex* build_index(void) {
+    SearchIndex* index = search_index_new();
+    for (guint i = 0; i < N_ENTRIES; i++) {
+        const char* const* locale = locales[i % G_N_ELEMENTS(locales)];
+        char* code = g_strdup_printf("%s_%u", locale[2], i);
+        guint entry = search_index_add(index, locale[0], locale[1], code, NULL);
+        g_assert_cmpuint(entry, ==, i);
+        g_free(code);
+    }
+    return index;
+}
+
+// Whether every word of the query is a substring of one of the entry's keys
+static gboolean naive_matches(guint entry, const char* query) {
+    const char* const* locale = locales[entry % G_N_ELEMENTS(locales)];
+    char* code = g_strdup_printf("%s_%u", locale[2], entry);
+    const char* keys[] = {locale[0], locale[1], code};
+    char* normalized_query = search_index_normalize(query);
+    char** words = g_strsplit(normalized_query, " ", -1);
+    gboolean matches = TRUE;
+    
+    for (char** word = words; *word && matches; word++) {
+        gboolean found = **word == '\0';
+        for (guint k = 0; k < G_N_ELEMENTS(keys) && !found; k++) {
+            char* key = search_index_normalize(keys[k]);
+            found = strstr(key, *word) != NULL;
+            g_free(key);
+        }
+        matches = found;
+    }
+    
+    g_strfreev(words);
+    g_free(normalized_query);
+    g_free(code);
+    return matches;
+}
+
+static void test_normalize(void) {
+    const char* cases[][2] = {
+        {"Français", "francais"},
+        {"Norsk bokmål", "norsk bokmal"},
+        {"Straße", "strasse"},
+        {"Ελληνικά", "ελληνικα"},
+        {"Œuvre", "oeuvre"}
+    };
+    
+    for (guint i = 0; i < G_N_ELEMENTS(cases); i++) {
+        char* normalized = search_index_normalize(cases[i][0]);
+        g_assert_cmpstr(normalized, ==, cases[i][1]);
+        g_free(normalized);
+    }
+}
+
+static void test_typed_queries(void) {
+    SearchIndex* index = build_index();
+    g_assert_cmpuint(search_index_get_n_entries(index), ==, N_ENTRIES);
+    g_assert_cmpuint(search_index_get_n_matches(index), ==, N_ENTRIES);
+    
+    for (guint k = 0; k < G_N_ELEMENTS(keystrokes); k++) {
+        const Keystroke* keystroke = &keystrokes[k];
+        SearchChange change = search_index_update(index, keystroke->query);
+        g_test_message("\"%s\": change %d, %u matches", keystroke->query, change,
+                       search_index_get_n_matches(index));
+        g_assert_cmpint(change, ==, keystroke->change);
+        
+        guint n_expected = 0;
+        for (guint entry = 0; entry < N_ENTRIES; entry++) {
+            gboolean expected = naive_matches(entry, keystroke->query);
+            g_assert_cmpint(search_index_matches(index, entry), ==, expected);
+            n_expected += expected;
+        }
+        g_assert_cmpuint(search_index_get_n_matches(index), ==, n_expected);
+        if (keystroke->n_matches) {
+            g_assert_cmpuint(n_expected, ==, keystroke->n_matches);
+        }
+    }
+    
+    search_index_free(index);
+}
+
+static void test_keystroke_time(void) {
+    SearchIndex* index = build_index();
+    gint64 total = 0;
+    gint64 worst = 0;
+    guint n = 0;
+    
+    for (guint round = 0; round < TIMING_ROUNDS; round++) {
+        for (guint k = 0; k < G_N_ELEMENTS(keystrokes); k++) {
+            gint64 start = g_get_monotonic_time();
+            search_index_update(index, keystrokes[k].query);
+            gint64 elapsed = g_get_monotonic_time() - start;
+            total += elapsed;
+            worst = MAX(worst, elapsed);
+            n++;
+        }
+    }
+    
+    g_test_message("%u keystrokes over %d entries: mean %.3f ms, worst %.3f ms (budget %.3f ms)",
+                   n, N_ENTRIES, total / 1000.0 / n, worst / 1000.0, KEYSTROKE_BUDGET_US / 1000.0);
+    if (total / n > KEYSTROKE_BUDGET_US) {
+        g_test_message("mean keystroke time is over budget");
+    }
+    
+    search_index_free(index);
+}
+
+int main(int argc, char** argv) {
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/search-index/normalize", test_normalize);
+    g_test_add_func("/search-index/typed-queries", test_typed_queries);
+    g_test_add_func("/search-index/keystroke-time", test_keystroke_time);
+    return g_test_run();
+}
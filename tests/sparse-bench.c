@@ -0,0 +1,211 @@
+// sparse-bench: compares the bytes the image writer writes with the size of
+// the image, for each way it has of skipping zeros.
+//
+//   sparse-bench [-s size in MiB] [-d data percent] [-b block device] [directory]
+//
+// The image is cut into 4 MiB extents, each starting with the given share of
+// data and ending in zeros, like a filesystem image with free space spread
+// through it. Every other extent has its zeros written out, the others leave
+// them as holes, so both ways of finding zeros are exercised. The image is
+// then written with zeros written like data, onto a new file (seek), onto a
+// file full of old data (punch-hole) and, with -b, onto a block device,
+// whose contents are lost. Zeros are found a 1 MiB block at a time, so a
+// block with any data in it is written whole and more is written than the
+// data share alone suggests. Files live under /tmp unless given a
+// directory; use one on the disk you want to measure. Plain C, like the
+// writer.
+
+#define _GNU_SOURCE
+#include "../backend/imagewriter.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIB (1024u * 1024u)
+#define EXTENT_SIZE (4 * MIB)
+#define BLOCK_SIZE MIB
+
+typedef struct {
+    const char* name;
+    int sparse;
+    int old_data;   // the target file is filled before the run
+} Method;
+
+static const Method methods[] = {
+    { "write", 0, 0 },
+    { "seek", 1, 0 },
+    { "punch-hole", 1, 1 }
+};
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: sparse-bench [-s size in MiB] [-d data percent] [-b block device] [directory]\n");
+    exit(2);
+}
+
+// Never zero, so a data block is never taken for a zero one
+static void fill_data(uint8_t* buffer, size_t length, uint64_t seed) {
+    uint64_t state = seed * 0x9e3779b97f4a7c15u + 1;
+    for (size_t i = 0; i < length; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        buffer[i] = (uint8_t)(state | 1);
+    }
+}
+
+static int write_all(int fd, const uint8_t* buffer, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t n = pwrite(fd, buffer, length, (off_t)offset);
+        if (n < 0) {
+            return -errno;
+        }
+        buffer += n;
+        length -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+// Builds the image, or with old_data a target that is data throughout
+static int create_file(const char* path, uint64_t size, uint32_t data_percent, int old_data) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -errno;
+    }
+    uint8_t* buffer = malloc(EXTENT_SIZE);
+    int result = buffer ? 0 : -ENOMEM;
+    size_t data_length = old_data ? EXTENT_SIZE : (size_t)EXTENT_SIZE * data_percent / 100 / 4096 * 4096;
+    
+    for (uint64_t extent = 0; result == 0 && extent < size / EXTENT_SIZE; extent++) {
+        fill_data(buffer, data_length, extent);
+        memset(buffer + data_length, 0, EXTENT_SIZE - data_length);
+        size_t length = extent % 2 == 0 ? EXTENT_SIZE : data_length;
+        result = write_all(fd, buffer, length, extent * EXTENT_SIZE);
+    }
+    if (result == 0 && ftruncate(fd, (off_t)size) != 0) {
+        result = -errno;
+    }
+    free(buffer);
+    close(fd);
+    return result;
+}
+
+// Returns 0 for anything but a regular file
+static int allocated_bytes(const char* path, uint64_t* bytes) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    *bytes = (uint64_t)st.st_blocks * 512;
+    return 1;
+}
+
+static int run_once(const char* name, const char* image, const char* target, int sparse) {
+    // Fixed block size and queue depth, so every method gets the same ones
+    ImageWriterOptions options;
+    image_writer_options_init(&options);
+    options.io_class = IO_CLASS_NONE;
+    options.block_size = BLOCK_SIZE;
+    options.sparse = sparse;
+    
+    uint64_t start = now_ns();
+    ImageWriter* writer = image_writer_new(image, target, &options);
+    int result = writer ? image_writer_run(writer) : -ENOMEM;
+    uint64_t elapsed = now_ns() - start;
+    if (result < 0) {
+        fprintf(stderr, "sparse-bench: writing %s: %s\n", target, strerror(-result));
+        image_writer_free(writer);
+        return result;
+    }
+    
+    ImageWriterStats stats;
+    image_writer_get_stats(writer, &stats);
+    image_writer_free(writer);
+    
+    uint64_t allocated;
+    char on_disk[32] = "-";
+    if (allocated_bytes(target, &allocated)) {
+        snprintf(on_disk, sizeof(on_disk), "%.1f", allocated / 1e6);
+    }
+    printf("%-12s %-11s %10.1f %10.1f %10.1f %10s %8.3f %10.1f\n", name, image_writer_skip_name(stats.skip),
+           stats.bytes_total / 1e6, stats.bytes_written / 1e6, stats.bytes_skipped / 1e6, on_disk,
+           elapsed / 1e9, stats.bytes_total * 1e3 / elapsed);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    uint32_t size_mib = 512;
+    uint32_t data_percent = 30;
+    const char* device = NULL;
+    
+    int option;
+    while ((option = getopt(argc, argv, "s:d:b:h")) != -1) {
+        switch (option) {
+        case 's': size_mib = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'd': data_percent = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'b': device = optarg; break;
+        default: usage();
+        }
+    }
+    if (size_mib < EXTENT_SIZE / MIB || data_percent > 100 || optind + 1 < argc) {
+        usage();
+    }
+    
+    char template[] = "/tmp/sparse-bench.XXXXXX";
+    const char* directory = optind < argc ? argv[optind] : mkdtemp(template);
+    if (!directory) {
+        fprintf(stderr, "sparse-bench: creating a directory under /tmp: %s\n", strerror(errno));
+        return 1;
+    }
+    char image[4096];
+    char target[4096];
+    snprintf(image, sizeof(image), "%s/image", directory);
+    snprintf(target, sizeof(target), "%s/target", directory);
+    
+    uint64_t size = (uint64_t)size_mib / (EXTENT_SIZE / MIB) * EXTENT_SIZE;
+    int result = create_file(image, size, data_percent, 0);
+    if (result < 0) {
+        fprintf(stderr, "sparse-bench: creating %s: %s\n", image, strerror(-result));
+        return 1;
+    }
+    uint64_t data_bytes = size / EXTENT_SIZE * ((uint64_t)EXTENT_SIZE * data_percent / 100 / 4096 * 4096);
+    uint64_t allocated = 0;
+    allocated_bytes(image, &allocated);
+    printf("%.1f MB image, %.1f MB of data, %.1f MB on disk, %u KiB blocks, under %s\n", size / 1e6,
+           data_bytes / 1e6, allocated / 1e6, BLOCK_SIZE / 1024, directory);
+    printf("%-12s %-11s %10s %10s %10s %10s %8s %10s\n", "method", "used", "logical MB", "written MB",
+           "skipped MB", "on disk MB", "s", "MB/s");
+    
+    for (size_t m = 0; m < sizeof(methods) / sizeof(methods[0]) && result == 0; m++) {
+        unlink(target);
+        if (methods[m].old_data) {
+            result = create_file(target, size, 100, 1);
+            if (result < 0) {
+                fprintf(stderr, "sparse-bench: creating %s: %s\n", target, strerror(-result));
+                break;
+            }
+        }
+        result = run_once(methods[m].name, image, target, methods[m].sparse);
+    }
+    if (result == 0 && device) {
+        result = run_once("device", image, device, 1);
+    }
+    
+    unlink(target);
+    unlink(image);
+    if (optind >= argc) {
+        rmdir(directory);
+    }
+    return result < 0;
+}
@@ -0,0 +1,232 @@
+// stages-test: checks the install stage scheduler on small plans.
+//
+//   stages-test
+//
+// Dry runs check that stages start in dependency order, that independent
+// ones overlap, and that a cancel before or during a run skips what has not
+// finished. Real stages check that the first failure cancels the stages
+// still running and skips the ones that depend on it. Plans with an input
+// nobody produces, a resource produced twice or a cycle must be rejected
+// before anything runs. Plain C, like the scheduler.
+
+#define _GNU_SOURCE
+#include "../backend/stages.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MS 1000000u
+
+static int failures = 0;
+
+static void check(int condition, const char* what) {
+    printf("%s: %s\n", condition ? "ok" : "FAIL", what);
+    if (!condition) {
+        failures++;
+    }
+}
+
+static void sleep_ms(uint32_t ms) {
+    struct timespec delay = { ms / 1000, (long)(ms % 1000) * 1000000 };
+    nanosleep(&delay, NULL);
+}
+
+// A real stage that returns its result after a while, or -ECANCELED early
+// once it is asked to stop
+typedef struct {
+    int result;
+    uint32_t ms;
+    int stop;
+    int ran;
+} Work;
+
+static int run_work(void* user_data) {
+    Work* work = user_data;
+    __atomic_store_n(&work->ran, 1, __ATOMIC_RELEASE);
+    for (uint32_t waited = 0; waited < work->ms; waited += 5) {
+        if (__atomic_load_n(&work->stop, __ATOMIC_ACQUIRE)) {
+            return -ECANCELED;
+        }
+        sleep_ms(5);
+    }
+    return work->result;
+}
+
+static void cancel_work(void* user_data) {
+    Work* work = user_data;
+    __atomic_store_n(&work->stop, 1, __ATOMIC_RELEASE);
+}
+
+static int add_stage(StageScheduler* scheduler, const char* name, const char* inputs, const char* outputs,
+                     uint32_t dry_run_ms, Work* work) {
+    Stage stage = { 0 };
+    stage.name = name;
+    stage.inputs = inputs;
+    stage.outputs = outputs;
+    stage.run = run_work;
+    stage.cancel = cancel_work;
+    stage.user_data = work;
+    stage.dry_run_ms = dry_run_ms;
+    return stage_scheduler_add(scheduler, &stage);
+}
+
+static StageState state_of(StageScheduler* scheduler, uint32_t index) {
+    StageTiming timing;
+    stage_scheduler_get_timing(scheduler, index, &timing);
+    return timing.state;
+}
+
+static void test_order(void) {
+    // unpack -> install-config, with render-config beside unpack
+    StageScheduler* scheduler = stage_scheduler_new(1);
+    Work work = { 0 };
+    add_stage(scheduler, "unpack", NULL, "root-files", 200, &work);
+    add_stage(scheduler, "render-config", NULL, "config", 100, &work);
+    add_stage(scheduler, "install-config", "root-files config", NULL, 50, &work);
+    ProgressRing* events = malloc(sizeof(ProgressRing));
+    progress_ring_init(events);
+    stage_scheduler_set_events(scheduler, events);
+    
+    check(stage_scheduler_run(scheduler) == 0, "a dry run of a valid plan succeeds");
+    StageTiming unpack, render, install;
+    stage_scheduler_get_timing(scheduler, 0, &unpack);
+    stage_scheduler_get_timing(scheduler, 1, &render);
+    stage_scheduler_get_timing(scheduler, 2, &install);
+    check(unpack.state == STAGE_DONE && render.state == STAGE_DONE && install.state == STAGE_DONE,
+          "every stage is done");
+    check(install.start_ns >= unpack.end_ns && install.start_ns >= render.end_ns,
+          "a stage starts only after the stages producing its inputs");
+    check(!__atomic_load_n(&work.ran, __ATOMIC_ACQUIRE), "a dry run does not call the stages");
+    
+    StageStats stats;
+    stage_scheduler_get_stats(scheduler, &stats);
+    check(stats.n_stages == 3 && stats.max_running == 2, "independent stages run at the same time");
+    check(stats.busy_ns > stats.elapsed_ns, "the overlap shortens the run");
+    printf("   %.3f s, %.3f s of work\n", stats.elapsed_ns / 1e9, stats.busy_ns / 1e9);
+    
+    int n_done = 0;
+    ProgressEvent event;
+    while (progress_ring_pop(events, &event)) {
+        n_done += event.kind == PROGRESS_EVENT_LOG && strstr(event.text, " done in ") != NULL;
+    }
+    check(n_done == 3, "each finished stage is logged");
+    free(events);
+    stage_scheduler_free(scheduler);
+}
+
+static void test_cancel_before_run(void) {
+    StageScheduler* scheduler = stage_scheduler_new(1);
+    add_stage(scheduler, "unpack", NULL, "root-files", 300, NULL);
+    add_stage(scheduler, "install-config", "root-files", NULL, 300, NULL);
+    stage_scheduler_cancel(scheduler);
+    
+    check(stage_scheduler_run(scheduler) == -ECANCELED, "a run cancelled before it starts returns ECANCELED");
+    check(state_of(scheduler, 0) == STAGE_SKIPPED && state_of(scheduler, 1) == STAGE_SKIPPED,
+          "a run cancelled before it starts skips every stage");
+    StageStats stats;
+    stage_scheduler_get_stats(scheduler, &stats);
+    check(stats.busy_ns == 0 && stats.elapsed_ns < 100 * MS, "a run cancelled before it starts runs nothing");
+    stage_scheduler_free(scheduler);
+}
+
+typedef struct {
+    StageScheduler* scheduler;
+    uint32_t delay_ms;
+} Canceller;
+
+static void* cancel_later(void* data) {
+    Canceller* canceller = data;
+    sleep_ms(canceller->delay_ms);
+    stage_scheduler_cancel(canceller->scheduler);
+    return NULL;
+}
+
+static void test_cancel_during_run(int dry_run) {
+    StageScheduler* scheduler = stage_scheduler_new(dry_run);
+    Work unpack = { .ms = 5000 };
+    Work install = { .ms = 10 };
+    add_stage(scheduler, "unpack", NULL, "root-files", 5000, &unpack);
+    add_stage(scheduler, "install-config", "root-files", NULL, 10, &install);
+    
+    Canceller canceller = { scheduler, 100 };
+    pthread_t thread;
+    pthread_create(&thread, NULL, cancel_later, &canceller);
+    int result = stage_scheduler_run(scheduler);
+    pthread_join(thread, NULL);
+    
+    StageStats stats;
+    stage_scheduler_get_stats(scheduler, &stats);
+    check(result == -ECANCELED, dry_run ? "a cancelled dry run returns ECANCELED" :
+                                          "a cancelled run returns ECANCELED");
+    check(stats.elapsed_ns < 1000 * MS, dry_run ? "a cancel stops a waiting dry-run stage" :
+                                                  "a cancel reaches the running stage");
+    check(state_of(scheduler, 0) == STAGE_SKIPPED && state_of(scheduler, 1) == STAGE_SKIPPED,
+          "the cancelled stage and the one after it are skipped");
+    check(!__atomic_load_n(&install.ran, __ATOMIC_ACQUIRE), "the stage after a cancel never runs");
+    stage_scheduler_free(scheduler);
+}
+
+static void test_failure(void) {
+    // unpack fails while render-config still runs; install-config needs both
+    StageScheduler* scheduler = stage_scheduler_new(0);
+    Work unpack = { .result = -EIO, .ms = 50 };
+    Work render = { .ms = 5000 };
+    Work install = { .ms = 10 };
+    add_stage(scheduler, "unpack", NULL, "root-files", 0, &unpack);
+    add_stage(scheduler, "render-config", NULL, "config", 0, &render);
+    add_stage(scheduler, "install-config", "root-files config", NULL, 0, &install);
+    
+    int result = stage_scheduler_run(scheduler);
+    StageStats stats;
+    stage_scheduler_get_stats(scheduler, &stats);
+    check(result == -EIO, "the run returns the first stage's failure");
+    check(state_of(scheduler, 0) == STAGE_FAILED, "the failing stage is marked failed");
+    check(state_of(scheduler, 1) == STAGE_SKIPPED && stats.elapsed_ns < 1000 * MS,
+          "a failure cancels the stages still running");
+    check(state_of(scheduler, 2) == STAGE_SKIPPED && !__atomic_load_n(&install.ran, __ATOMIC_ACQUIRE),
+          "a stage depending on a failed one is skipped");
+    stage_scheduler_free(scheduler);
+}
+
+static void test_bad_plans(void) {
+    StageScheduler* scheduler = stage_scheduler_new(1);
+    add_stage(scheduler, "install-config", "root-files", NULL, 10, NULL);
+    check(stage_scheduler_run(scheduler) == -EINVAL && state_of(scheduler, 0) == STAGE_PENDING,
+          "an input nobody produces is rejected before anything runs");
+    stage_scheduler_free(scheduler);
+    
+    scheduler = stage_scheduler_new(1);
+    add_stage(scheduler, "unpack", NULL, "root-files", 10, NULL);
+    add_stage(scheduler, "write-image", NULL, "root-files", 10, NULL);
+    check(stage_scheduler_run(scheduler) == -EINVAL, "a resource produced twice is rejected");
+    stage_scheduler_free(scheduler);
+    
+    scheduler = stage_scheduler_new(1);
+    add_stage(scheduler, "a", "z", "x", 10, NULL);
+    add_stage(scheduler, "b", "x", "y", 10, NULL);
+    add_stage(scheduler, "c", "y", "z", 10, NULL);
+    add_stage(scheduler, "d", NULL, "w", 10, NULL);
+    check(stage_scheduler_run(scheduler) == -ELOOP && state_of(scheduler, 3) == STAGE_PENDING,
+          "a cycle is rejected before anything runs");
+    stage_scheduler_free(scheduler);
+    
+    scheduler = stage_scheduler_new(1);
+    Stage stage = { .name = "no-run" };
+    check(stage_scheduler_add(scheduler, &stage) == -EINVAL, "a stage without a run function is refused");
+    stage_scheduler_free(scheduler);
+}
+
+int main(void) {
+    test_order();
+    test_cancel_before_run();
+    test_cancel_during_run(1);
+    test_cancel_during_run(0);
+    test_failure();
+    test_bad_plans();
+    
+    printf("%d failed\n", failures);
+    return failures > 0;
+}
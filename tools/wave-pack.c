@@ -0,0 +1,353 @@
+// wave-pack: packs an archive into the seekable payload format read by the
+// installer (see backend/payload.h), or checks and times an existing one.
+//
+//   wave-pack [-f frame size] [-l level] [-T threads] [-m manifest] [-o output] [input]
+//   wave-pack -t [-T threads] payload
+//   wave-pack -x path -m manifest payload
+//
+// Frames are compressed in parallel, a batch of one frame per thread at a
+// time, and written in order. -m also writes the manifest of the archive
+// (see backend/manifest.h); -x uses one to copy a single file to stdout.
+// -t decodes the payload with one thread and then with -T threads (one
+// per CPU by default) and compares the two.
+
+#define _GNU_SOURCE
+#include "../backend/manifest.h"
+#include "../backend/payload.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 64
+
+typedef struct {
+    uint8_t* input;
+    size_t length;
+    uint8_t* output;
+    size_t output_length;
+    uint32_t level;
+    int result;
+    pthread_t thread;
+    int started;
+} Frame;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: wave-pack [-f frame size] [-l level] [-T threads] [-m manifest] [-o output] [input]\n"
+                    "       wave-pack -t [-T threads] payload\n"
+                    "       wave-pack -x path -m manifest payload\n");
+    exit(2);
+}
+
+static uint64_t parse_size(const char* text) {
+    char* end;
+    uint64_t value = strtoull(text, &end, 10);
+    switch (*end) {
+    case 'K': case 'k': value <<= 10; break;
+    case 'M': case 'm': value <<= 20; break;
+    default: break;
+    }
+    return value;
+}
+
+// Fills buffer unless the input ends first; returns the bytes read or -1
+static ssize_t read_frame(int fd, uint8_t* buffer, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t result = read(fd, buffer + done, length - done);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (result == 0) {
+            break;
+        }
+        done += (size_t)result;
+    }
+    return (ssize_t)done;
+}
+
+static void* compress_thread(void* data) {
+    Frame* frame = data;
+    frame->result = payload_encode_frame(frame->input, frame->length, frame->level, frame->output,
+                                         &frame->output_length);
+    return NULL;
+}
+
+static int pack(int in_fd, int out_fd, uint32_t frame_size, uint32_t level, uint32_t n_threads) {
+    PayloadWriter* writer = payload_writer_new(out_fd, frame_size);
+    if (!writer) {
+        fprintf(stderr, "wave-pack: %s\n", strerror(errno));
+        return 1;
+    }
+    
+    Frame frames[MAX_THREADS] = { 0 };
+    for (uint32_t i = 0; i < n_threads; i++) {
+        frames[i].input = malloc(frame_size);
+        frames[i].output = malloc(payload_frame_bound(frame_size));
+        frames[i].level = level;
+        if (!frames[i].input || !frames[i].output) {
+            fprintf(stderr, "wave-pack: %s\n", strerror(ENOMEM));
+            return 1;
+        }
+    }
+    
+    uint64_t total = 0;
+    uint64_t compressed = 0;
+    int result = 0;
+    int end = 0;
+    while (!end && result == 0) {
+        uint32_t n_frames = 0;
+        for (; n_frames < n_threads; n_frames++) {
+            ssize_t length = read_frame(in_fd, frames[n_frames].input, frame_size);
+            if (length < 0) {
+                fprintf(stderr, "wave-pack: reading input: %s\n", strerror(errno));
+                result = -errno;
+                break;
+            }
+            frames[n_frames].length = (size_t)length;
+            if (length == 0) {
+                end = 1;
+                break;
+            }
+            if ((size_t)length < frame_size) {
+                end = 1;
+                n_frames++;
+                break;
+            }
+        }
+        
+        for (uint32_t i = 0; i < n_frames; i++) {
+            frames[i].started = pthread_create(&frames[i].thread, NULL, compress_thread, &frames[i]) == 0;
+            if (!frames[i].started) {
+                compress_thread(&frames[i]);
+            }
+        }
+        for (uint32_t i = 0; i < n_frames; i++) {
+            if (frames[i].started) {
+                pthread_join(frames[i].thread, NULL);
+            }
+            if (result == 0) {
+                result = frames[i].result;
+            }
+            if (result == 0) {
+                result = payload_writer_add_frame(writer, frames[i].output, frames[i].output_length,
+                                                  frames[i].length);
+            }
+            total += frames[i].length;
+            compressed += frames[i].output_length;
+        }
+    }
+    if (result == 0) {
+        result = payload_writer_finish(writer);
+    }
+    if (result < 0) {
+        fprintf(stderr, "wave-pack: %s\n", strerror(-result));
+    } else {
+        fprintf(stderr, "wave-pack: %llu bytes in %llu frames, compressed to %llu bytes (%.1f%%)\n",
+                (unsigned long long)total, (unsigned long long)((total + frame_size - 1) / frame_size),
+                (unsigned long long)compressed, total ? compressed * 100.0 / total : 0.0);
+    }
+    
+    for (uint32_t i = 0; i < n_threads; i++) {
+        free(frames[i].input);
+        free(frames[i].output);
+    }
+    payload_writer_free(writer);
+    return result < 0;
+}
+
+// Decodes the whole payload once with n_threads decoders and reports the
+// rate; returns the elapsed time, or 0 on failure
+static uint64_t decode(const char* path, uint32_t n_threads) {
+    PayloadReader* reader;
+    int result = payload_reader_open(path, n_threads, &reader);
+    if (result < 0) {
+        fprintf(stderr, "wave-pack: %s: %s\n", path, result == -EBADMSG ? "not a valid payload" : strerror(-result));
+        return 0;
+    }
+    
+    size_t buffer_size = 1024 * 1024;
+    uint8_t* buffer = malloc(buffer_size);
+    uint64_t start = now_ns();
+    uint64_t total = 0;
+    ssize_t length;
+    while (buffer && (length = payload_reader_read(reader, buffer, buffer_size)) > 0) {
+        total += (uint64_t)length;
+    }
+    uint64_t elapsed = now_ns() - start;
+    
+    if (!buffer || length < 0 || total != payload_reader_get_size(reader)) {
+        fprintf(stderr, "wave-pack: %s: %s\n", path, buffer && length < 0 ? strerror((int)-length) : "truncated");
+        elapsed = 0;
+    } else {
+        PayloadStats stats;
+        payload_reader_get_stats(reader, &stats);
+        printf("%s: %llu bytes in %u frames, %u threads: %.3f s, %.1f MB/s (%.1f MB/s per thread busy)\n",
+               path, (unsigned long long)total, payload_reader_get_n_frames(reader), stats.n_threads,
+               elapsed / 1e9, elapsed ? total * 1e3 / elapsed : 0.0,
+               stats.busy_ns ? stats.bytes_decoded * 1e3 / stats.busy_ns : 0.0);
+        elapsed = elapsed ? elapsed : 1;
+    }
+    
+    free(buffer);
+    payload_reader_free(reader);
+    return elapsed;
+}
+
+// Decodes the payload the way the installer does, first with a single
+// thread and then with n_threads (0: one per CPU), and reports the speedup
+static int test(const char* path, uint32_t n_threads) {
+    if (n_threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+    
+    uint64_t single = decode(path, 1);
+    if (single == 0) {
+        return 1;
+    }
+    if (n_threads == 1) {
+        return 0;
+    }
+    
+    uint64_t parallel = decode(path, n_threads);
+    if (parallel == 0) {
+        return 1;
+    }
+    printf("%s: %u threads are %.2fx as fast as 1 (%ld CPUs online)\n", path, n_threads,
+           (double)single / parallel, sysconf(_SC_NPROCESSORS_ONLN));
+    return 0;
+}
+
+// Copies one file out of the payload using only the frames that hold it
+static int extract_one(const char* payload, const char* manifest_path, const char* path) {
+    Manifest* manifest;
+    int result = manifest_open(manifest_path, &manifest);
+    if (result < 0) {
+        fprintf(stderr, "wave-pack: %s: %s\n", manifest_path,
+                result == -EBADMSG ? "not a valid manifest" : strerror(-result));
+        return 1;
+    }
+    
+    const ManifestEntry* entry = manifest_lookup(manifest, path);
+    if (!entry) {
+        fprintf(stderr, "wave-pack: %s: not in the manifest\n", path);
+        manifest_free(manifest);
+        return 1;
+    }
+    result = manifest_extract_file(entry, payload, STDOUT_FILENO);
+    if (result < 0) {
+        fprintf(stderr, "wave-pack: %s: %s\n", path,
+                result == -EBADMSG ? "does not match the manifest" : strerror(-result));
+    }
+    manifest_free(manifest);
+    return result < 0;
+}
+
+static int write_manifest(const char* archive, const char* manifest_path) {
+    int result = manifest_create(archive, manifest_path);
+    if (result < 0) {
+        fprintf(stderr, "wave-pack: writing the manifest of %s: %s\n", archive, strerror(-result));
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    uint64_t frame_size = PAYLOAD_DEFAULT_FRAME_SIZE;
+    uint32_t level = 6;
+    uint32_t n_threads = 0;
+    const char* output = NULL;
+    const char* manifest = NULL;
+    const char* extract_path = NULL;
+    int testing = 0;
+    
+    int option;
+    while ((option = getopt(argc, argv, "f:l:T:m:o:tx:h")) != -1) {
+        switch (option) {
+        case 'f': frame_size = parse_size(optarg); break;
+        case 'l': level = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'T': n_threads = (uint32_t)strtoul(optarg, NULL, 10); break;
+        case 'm': manifest = optarg; break;
+        case 'o': output = optarg; break;
+        case 't': testing = 1; break;
+        case 'x': extract_path = optarg; break;
+        default: usage();
+        }
+    }
+    if (frame_size == 0 || frame_size > PAYLOAD_MAX_FRAME_SIZE || level > 9 || optind + 1 < argc) {
+        usage();
+    }
+    
+    if (testing) {
+        if (optind >= argc) {
+            usage();
+        }
+        return test(argv[optind], n_threads);
+    }
+    if (extract_path) {
+        if (optind >= argc || !manifest) {
+            usage();
+        }
+        return extract_one(argv[optind], manifest, extract_path);
+    }
+    
+    // The manifest is read from the input archive, or from the packed
+    // payload when the archive comes from stdin
+    const char* input = optind < argc && strcmp(argv[optind], "-") != 0 ? argv[optind] : NULL;
+    if (manifest && !input && !output) {
+        fprintf(stderr, "wave-pack: -m needs an input file or -o\n");
+        return 1;
+    }
+    
+    if (n_threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = cpus > 0 ? (uint32_t)cpus : 1;
+    }
+    if (n_threads > MAX_THREADS) {
+        n_threads = MAX_THREADS;
+    }
+    
+    int in_fd = STDIN_FILENO;
+    if (input) {
+        in_fd = open(input, O_RDONLY | O_CLOEXEC);
+        if (in_fd < 0) {
+            fprintf(stderr, "wave-pack: %s: %s\n", input, strerror(errno));
+            return 1;
+        }
+    }
+    int out_fd = STDOUT_FILENO;
+    if (output) {
+        out_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out_fd < 0) {
+            fprintf(stderr, "wave-pack: %s: %s\n", output, strerror(errno));
+            return 1;
+        }
+    } else if (isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "wave-pack: refusing to write a payload to a terminal; use -o\n");
+        return 1;
+    }
+    
+    int result = pack(in_fd, out_fd, (uint32_t)frame_size, level, n_threads);
+    if (output && close(out_fd) != 0 && result == 0) {
+        fprintf(stderr, "wave-pack: %s: %s\n", output, strerror(errno));
+        result = 1;
+    }
+    if (result == 0 && manifest) {
+        result = write_manifest(input ? input : output, manifest);
+    }
+    return result;
+}
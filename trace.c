@@ -0,0 +1,154 @@
+#include "trace.h"
+#include <stdio.h>
+#include <unistd.h>
+
+// Upper bound on buffered events so a long session cannot grow without limit
+#define TRACE_MAX_EVENTS 1000000
+
+typedef struct {
+    const char* name;
+    const char* detail;
+    gint64 timestamp;
+    gint64 value;
+    guint thread_id;
+    char phase;
+} TraceEvent;
+
+gboolean trace_enabled = FALSE;
+
+static char* trace_path = NULL;
+static GArray* trace_events = NULL;
+static GMutex trace_mutex;
+static gboolean trace_truncated = FALSE;
+
+static guint current_thread_id(void) {
+    static GPrivate thread_key;
+    static gint next_id = 0;
+    
+    guint id = GPOINTER_TO_UINT(g_private_get(&thread_key));
+    if (id == 0) {
+        id = (guint)g_atomic_int_add(&next_id, 1) + 1;
+        g_private_set(&thread_key, GUINT_TO_POINTER(id));
+    }
+    return id;
+}
+
+static void record_event(char phase, const char* name, const char* detail,
+                         gint64 timestamp, gint64 value) {
+    TraceEvent event = {
+        .name = name,
+        .detail = detail,
+        .timestamp = timestamp,
+        .value = value,
+        .thread_id = current_thread_id(),
+        .phase = phase
+    };
+    
+    // A thread that saw trace_enabled just before trace_shutdown() cleared it
+    // finds the buffer gone
+    g_mutex_lock(&trace_mutex);
+    if (!trace_events) {
+        g_mutex_unlock(&trace_mutex);
+        return;
+    }
+    if (trace_events->len < TRACE_MAX_EVENTS) {
+        g_array_append_val(trace_events, event);
+    } else {
+        trace_truncated = TRUE;
+    }
+    g_mutex_unlock(&trace_mutex);
+}
+
+void trace_init(const char* output_path) {
+#ifdef WAVE_DISABLE_TRACE
+    return;
+#endif
+    if (trace_enabled || !output_path || !*output_path) {
+        return;
+    }
+    
+    trace_path = g_strdup(output_path);
+    trace_events = g_array_sized_new(FALSE, FALSE, sizeof(TraceEvent), 4096);
+    trace_enabled = TRUE;
+}
+
+void trace_begin_at(const char* name, const char* detail, gint64 timestamp) {
+    record_event('B', name, detail, timestamp, 0);
+}
+
+void trace_end(const char* name) {
+    record_event('E', name, NULL, g_get_monotonic_time(), 0);
+}
+
+void trace_counter(const char* name, gint64 value) {
+    record_event('C', name, NULL, g_get_monotonic_time(), value);
+}
+
+void trace_instant(const char* name) {
+    record_event('i', name, NULL, g_get_monotonic_time(), 0);
+}
+
+static void write_json_string(FILE* file, const char* text) {
+    fputc('"', file);
+    for (const char* p = text; *p; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c == '"' || c == '\\') {
+            fprintf(file, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(file, "\\u%04x", c);
+        } else {
+            fputc(c, file);
+        }
+    }
+    fputc('"', file);
+}
+
+// Holds the lock throughout, so worker threads still recording wait for the
+// buffer to be written and then drop their events
+void trace_shutdown(void) {
+    g_mutex_lock(&trace_mutex);
+    if (!trace_events) {
+        g_mutex_unlock(&trace_mutex);
+        return;
+    }
+    trace_enabled = FALSE;
+    
+    FILE* file = fopen(trace_path, "w");
+    if (!file) {
+        g_warning("Could not write trace to %s", trace_path);
+    } else {
+        int pid = (int)getpid();
+        
+        fputs("{\"traceEvents\":[\n", file);
+        for (guint i = 0; i < trace_events->len; i++) {
+            TraceEvent* event = &g_array_index(trace_events, TraceEvent, i);
+            
+            fputs(i > 0 ? ",\n{\"name\":" : "{\"name\":", file);
+            write_json_string(file, event->name);
+            fprintf(file, ",\"cat\":\"wave\",\"ph\":\"%c\",\"ts\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%u",
+                    event->phase, event->timestamp, pid, event->thread_id);
+            
+            if (event->phase == 'C') {
+                fprintf(file, ",\"args\":{\"value\":%" G_GINT64_FORMAT "}", event->value);
+            } else if (event->phase == 'i') {
+                fputs(",\"s\":\"p\"", file);
+            } else if (event->detail) {
+                fputs(",\"args\":{\"detail\":", file);
+                write_json_string(file, event->detail);
+                fputc('}', file);
+            }
+            fputc('}', file);
+        }
+        fputs("\n]}\n", file);
+        fclose(file);
+        
+        if (trace_truncated) {
+            g_warning("Trace buffer full, only the first %d events were written", TRACE_MAX_EVENTS);
+        }
+    }
+    
+    g_array_free(trace_events, TRUE);
+    trace_events = NULL;
+    g_clear_pointer(&trace_path, g_free);
+    g_mutex_unlock(&trace_mutex);
+}
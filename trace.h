@@ -0,0 +1,44 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <glib.h>
+
+// Lightweight span/counter tracing written as Chrome trace-event JSON,
+// viewable in chrome://tracing or ui.perfetto.dev.
+//
+// Enable at runtime with --trace=FILE or WAVE_TRACE=FILE. When tracing is
+// off every macro costs a single predictable branch; building with
+// -DWAVE_DISABLE_TRACE removes them entirely.
+//
+// Names and details must be string literals or otherwise outlive the trace.
+
+extern gboolean trace_enabled;
+
+void trace_init(const char* output_path);
+void trace_shutdown(void);
+
+void trace_begin_at(const char* name, const char* detail, gint64 timestamp);
+void trace_end(const char* name);
+void trace_counter(const char* name, gint64 value);
+void trace_instant(const char* name);
+
+#ifdef WAVE_DISABLE_TRACE
+#define TRACE_BEGIN(name) do { } while (0)
+#define TRACE_BEGIN_DETAIL(name, detail) do { } while (0)
+#define TRACE_END(name) do { } while (0)
+#define TRACE_COUNTER(name, value) do { } while (0)
+#define TRACE_INSTANT(name) do { } while (0)
+#else
+#define TRACE_BEGIN(name) \
+    do { if (G_UNLIKELY(trace_enabled)) trace_begin_at((name), NULL, g_get_monotonic_time()); } while (0)
+#define TRACE_BEGIN_DETAIL(name, detail) \
+    do { if (G_UNLIKELY(trace_enabled)) trace_begin_at((name), (detail), g_get_monotonic_time()); } while (0)
+#define TRACE_END(name) \
+    do { if (G_UNLIKELY(trace_enabled)) trace_end(name); } while (0)
+#define TRACE_COUNTER(name, value) \
+    do { if (G_UNLIKELY(trace_enabled)) trace_counter((name), (value)); } while (0)
+#define TRACE_INSTANT(name) \
+    do { if (G_UNLIKELY(trace_enabled)) trace_instant(name); } while (0)
+#endif
+
+#endif // TRACE_H
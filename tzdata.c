@@ -0,0 +1,396 @@
+#include "tzdata.h"
+#include "trace.h"
+#include <string.h>
+
+#define DEFAULT_TZDIR "/usr/share/zoneinfo"
+
+// tzdata.zi links may point at other links; real chains are one step long
+#define MAX_LINK_DEPTH 8
+
+static const char utc_name[] = "UTC";
+
+static GMappedFile* map_tz_file(const char* file_name) {
+    const char* tzdir = g_getenv("TZDIR");
+    char* path = g_build_filename(tzdir && *tzdir ? tzdir : DEFAULT_TZDIR, file_name, NULL);
+    GMappedFile* file = g_mapped_file_new(path, FALSE, NULL);
+    g_free(path);
+    return file;
+}
+
+// Returns the next line of the mapping and moves the cursor past it
+static gboolean next_line(const char** cursor, const char* end, const char** line, gsize* length) {
+    if (*cursor >= end) {
+        return FALSE;
+    }
+    
+    const char* newline = memchr(*cursor, '\n', end - *cursor);
+    const char* line_end = newline ? newline : end;
+    *line = *cursor;
+    *length = line_end - *cursor;
+    *cursor = newline ? newline + 1 : end;
+    return TRUE;
+}
+
+// Splits off the next field of a line, up to the separator
+static gboolean next_field(const char** cursor, const char* end, char separator, const char** field, gsize* length) {
+    if (*cursor >= end) {
+        return FALSE;
+    }
+    
+    const char* next = memchr(*cursor, separator, end - *cursor);
+    const char* field_end = next ? next : end;
+    *field = *cursor;
+    *length = field_end - *cursor;
+    *cursor = next ? next + 1 : end;
+    return TRUE;
+}
+
+// Parses one ISO 6709 component such as "+4230" (DDMM) or "-0744512" (DDDMMSS)
+static gint32 parse_coordinate(const char* text, gsize length, int degree_digits) {
+    int widths[3] = {degree_digits, 2, 2};
+    int values[3] = {0, 0, 0};
+    gsize pos = 1;
+    
+    for (int part = 0; part < 3 && pos + widths[part] <= length; part++) {
+        for (int i = 0; i < widths[part]; i++) {
+            char c = text[pos++];
+            if (!g_ascii_isdigit(c)) {
+                return 0;
+            }
+            values[part] = values[part] * 10 + (c - '0');
+        }
+    }
+    
+    gint32 seconds = values[0] * 3600 + values[1] * 60 + values[2];
+    return text[0] == '-' ? -seconds : seconds;
+}
+
+static void parse_coordinates(const char* text, gsize length, TimezoneInfo* info) {
+    // The longitude starts at the second sign character
+    for (gsize i = 1; i < length; i++) {
+        if (text[i] == '+' || text[i] == '-') {
+            info->latitude = parse_coordinate(text, i, 2);
+            info->longitude = parse_coordinate(text + i, length - i, 3);
+            return;
+        }
+    }
+}
+
+// Maps each name already in zones to its position, so a file read later
+// can add to an entry instead of repeating it
+static TimezoneInfo* find_seen(GArray* zones, GHashTable* seen, const char* name, gsize name_len) {
+    char* key = g_strndup(name, name_len);
+    gpointer index;
+    gboolean found = g_hash_table_lookup_extended(seen, key, NULL, &index);
+    g_free(key);
+    return found ? &g_array_index(zones, TimezoneInfo, GPOINTER_TO_UINT(index)) : NULL;
+}
+
+static void add_zone(GArray* zones, GHashTable* seen, const TimezoneInfo* info) {
+    g_hash_table_insert(seen, g_strndup(info->name, info->name_len), GUINT_TO_POINTER(zones->len));
+    g_array_append_vals(zones, info, 1);
+}
+
+// zone1970.tab / zone.tab lines: "CH,DE,LI<TAB>+4734+00832<TAB>Europe/Zurich[<TAB>comment]".
+// zone1970.tab is read first; zone.tab then adds the zones it lists for a
+// single country, such as Europe/Stockholm, that zone1970.tab merged away.
+static void parse_zone_tab(GMappedFile* file, GArray* zones, GHashTable* seen) {
+    const char* cursor = g_mapped_file_get_contents(file);
+    const char* end = cursor + g_mapped_file_get_length(file);
+    const char* line;
+    gsize length;
+    
+    while (next_line(&cursor, end, &line, &length)) {
+        if (length == 0 || line[0] == '#') {
+            continue;
+        }
+        
+        const char* field_cursor = line;
+        const char* line_end = line + length;
+        const char *countries, *coordinates, *name;
+        gsize countries_len, coordinates_len, name_len;
+        
+        if (!next_field(&field_cursor, line_end, '\t', &countries, &countries_len) ||
+            !next_field(&field_cursor, line_end, '\t', &coordinates, &coordinates_len) ||
+            !next_field(&field_cursor, line_end, '\t', &name, &name_len) ||
+            name_len == 0 || name_len > G_MAXUINT16 || countries_len > G_MAXUINT16 ||
+            find_seen(zones, seen, name, name_len)) {
+            continue;
+        }
+        
+        TimezoneInfo info = {0};
+        info.name = name;
+        info.name_len = (guint16)name_len;
+        info.countries = countries;
+        info.countries_len = (guint16)countries_len;
+        parse_coordinates(coordinates, coordinates_len, &info);
+        add_zone(zones, seen, &info);
+    }
+}
+
+// tzdata.zi declares every zone with a "Z <name> ..." line and every link
+// with "L <target> <name>". This picks up zones without a country, such as
+// Etc/GMT+5, and the links, which current tzdata uses for zones it merged
+// into another (Europe/Stockholm into Europe/Berlin). A link can be picked
+// as it is and takes the offset of its target.
+static void parse_zone_zi(GMappedFile* file, GArray* zones, GHashTable* seen) {
+    const char* cursor = g_mapped_file_get_contents(file);
+    const char* end = cursor + g_mapped_file_get_length(file);
+    const char* line;
+    gsize length;
+    
+    while (next_line(&cursor, end, &line, &length)) {
+        if (length < 3 || (line[0] != 'Z' && line[0] != 'L') || line[1] != ' ') {
+            continue;
+        }
+        
+        const char* field_cursor = line + 2;
+        const char* line_end = line + length;
+        const char* target = NULL;
+        gsize target_len = 0;
+        const char* name;
+        gsize name_len;
+        if ((line[0] == 'L' && !next_field(&field_cursor, line_end, ' ', &target, &target_len)) ||
+            !next_field(&field_cursor, line_end, ' ', &name, &name_len) ||
+            name_len == 0 || name_len > G_MAXUINT16 || target_len > G_MAXUINT16) {
+            continue;
+        }
+        
+        // zone.tab also lists some links, with their country
+        TimezoneInfo* seen_info = find_seen(zones, seen, name, name_len);
+        if (seen_info) {
+            if (target && target_len) {
+                seen_info->link_target = target;
+                seen_info->link_target_len = (guint16)target_len;
+            }
+            continue;
+        }
+        
+        TimezoneInfo info = {0};
+        info.name = name;
+        info.name_len = (guint16)name_len;
+        info.link_target = target_len ? target : NULL;
+        info.link_target_len = (guint16)target_len;
+        add_zone(zones, seen, &info);
+    }
+}
+
+static int compare_zone_names(gconstpointer a, gconstpointer b) {
+    const TimezoneInfo* za = a;
+    const TimezoneInfo* zb = b;
+    int result = memcmp(za->name, zb->name, MIN(za->name_len, zb->name_len));
+    return result != 0 ? result : (int)za->name_len - (int)zb->name_len;
+}
+
+// Everything after UTC is sorted by name
+static TimezoneInfo* find_zone(const TimezoneTable* table, const char* name, gsize name_len) {
+    TimezoneInfo key = {0};
+    key.name = name;
+    key.name_len = (guint16)name_len;
+    if (compare_zone_names(&key, &table->zones[0]) == 0) {
+        return &table->zones[0];
+    }
+    return bsearch(&key, table->zones + 1, table->n_zones - 1, sizeof(TimezoneInfo), compare_zone_names);
+}
+
+char* timezone_info_dup_name(const TimezoneInfo* info) {
+    return g_strndup(info->name, info->name_len);
+}
+
+void timezone_format_offset(gint32 utc_offset, char* buffer, gsize size) {
+    gint32 abs_offset = ABS(utc_offset);
+    g_snprintf(buffer, size, "UTC%c%02d:%02d", utc_offset < 0 ? '-' : '+',
+               abs_offset / 3600, (abs_offset / 60) % 60);
+}
+
+static SearchIndex* build_search_index(const TimezoneTable* table, gboolean with_offsets) {
+    SearchIndex* index = search_index_new();
+    
+    for (guint i = 0; i < table->n_zones; i++) {
+        const TimezoneInfo* info = &table->zones[i];
+        char* name = timezone_info_dup_name(info);
+        char* spaced_name = g_strdelimit(g_strdup(name), "/_", ' ');
+        char* countries = info->countries ? g_strndup(info->countries, info->countries_len) : g_strdup("");
+        char offset[16] = "";
+        char short_offsets[48] = "";
+        
+        if (with_offsets) {
+            // Both "UTC+05:30" and the short "UTC+5:30 GMT+5:30" spellings match
+            gint32 abs_offset = ABS(info->utc_offset);
+            char sign = info->utc_offset < 0 ? '-' : '+';
+            int hours = abs_offset / 3600;
+            int minutes = (abs_offset / 60) % 60;
+            
+            timezone_format_offset(info->utc_offset, offset, sizeof(offset));
+            if (minutes) {
+                g_snprintf(short_offsets, sizeof(short_offsets), "UTC%c%d:%02d GMT%c%d:%02d",
+                           sign, hours, minutes, sign, hours, minutes);
+            } else {
+                g_snprintf(short_offsets, sizeof(short_offsets), "UTC%c%d GMT%c%d", sign, hours, sign, hours);
+            }
+        }
+        
+        search_index_add(index, name, spaced_name, countries, offset, short_offsets,
+                         with_offsets ? info->abbreviation : "", NULL);
+        
+        g_free(name);
+        g_free(spaced_name);
+        g_free(countries);
+    }
+    
+    return index;
+}
+
+TimezoneTable* timezone_table_load(void) {
+    TRACE_BEGIN("timezone_table_load");
+    TimezoneTable* table = g_new0(TimezoneTable, 1);
+    
+    table->tab_file = map_tz_file("zone1970.tab");
+    table->country_file = map_tz_file("zone.tab");
+    table->zi_file = map_tz_file("tzdata.zi");
+    
+    GArray* zones = g_array_new(FALSE, TRUE, sizeof(TimezoneInfo));
+    GHashTable* seen = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    
+    // UTC always comes first
+    TimezoneInfo utc = {0};
+    utc.name = utc_name;
+    utc.name_len = (guint16)strlen(utc_name);
+    add_zone(zones, seen, &utc);
+    
+    if (table->tab_file) {
+        parse_zone_tab(table->tab_file, zones, seen);
+    }
+    if (table->country_file) {
+        parse_zone_tab(table->country_file, zones, seen);
+    }
+    if (table->zi_file) {
+        parse_zone_zi(table->zi_file, zones, seen);
+    }
+    g_hash_table_destroy(seen);
+    
+    if (zones->len > 2) {
+        qsort(&g_array_index(zones, TimezoneInfo, 1), zones->len - 1, sizeof(TimezoneInfo), compare_zone_names);
+    }
+    
+    table->n_zones = zones->len;
+    table->zones = (TimezoneInfo*)g_array_free(zones, FALSE);
+    table->search_index = build_search_index(table, FALSE);
+    
+    TRACE_COUNTER("timezones", table->n_zones);
+    TRACE_END("timezone_table_load");
+    return table;
+}
+
+void timezone_table_free(TimezoneTable* table) {
+    if (!table) {
+        return;
+    }
+    
+    g_free(table->zones);
+    search_index_free(table->search_index);
+    if (table->tab_file) {
+        g_mapped_file_unref(table->tab_file);
+    }
+    if (table->country_file) {
+        g_mapped_file_unref(table->country_file);
+    }
+    if (table->zi_file) {
+        g_mapped_file_unref(table->zi_file);
+    }
+    g_free(table);
+}
+
+int timezone_table_find(const TimezoneTable* table, const char* name) {
+    gsize length = strlen(name);
+    
+    for (guint i = 0; i < table->n_zones; i++) {
+        const TimezoneInfo* info = &table->zones[i];
+        if (info->name_len == length && memcmp(info->name, name, length) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static void compute_offset(TimezoneInfo* info, gint64 now) {
+    char* name = timezone_info_dup_name(info);
+    GTimeZone* tz = g_time_zone_new_identifier(name);
+    
+    if (tz) {
+        gint interval = g_time_zone_find_interval(tz, G_TIME_TYPE_UNIVERSAL, now);
+        if (interval >= 0) {
+            info->utc_offset = g_time_zone_get_offset(tz, interval);
+            g_strlcpy(info->abbreviation, g_time_zone_get_abbreviation(tz, interval),
+                      sizeof(info->abbreviation));
+        }
+        g_time_zone_unref(tz);
+    }
+    g_free(name);
+}
+
+// The zone at the end of a link's chain, or NULL when it is not in the table
+static const TimezoneInfo* resolve_link(const TimezoneTable* table, const TimezoneInfo* info) {
+    for (int depth = 0; info && info->link_target && depth < MAX_LINK_DEPTH; depth++) {
+        info = find_zone(table, info->link_target, info->link_target_len);
+    }
+    return info && !info->link_target ? info : NULL;
+}
+
+static void compute_offsets_thread(GTask* task, gpointer source_object, gpointer task_data,
+                                   GCancellable* cancellable) {
+    TimezoneTable* table = task_data;
+    TRACE_BEGIN("timezone_offsets");
+    
+    gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+    
+    for (guint i = 0; i < table->n_zones && !g_cancellable_is_cancelled(cancellable); i++) {
+        if (!table->zones[i].link_target) {
+            compute_offset(&table->zones[i], now);
+        }
+    }
+    
+    // Links show the offset of their target, which is already known
+    for (guint i = 0; i < table->n_zones && !g_cancellable_is_cancelled(cancellable); i++) {
+        TimezoneInfo* info = &table->zones[i];
+        if (!info->link_target) {
+            continue;
+        }
+        const TimezoneInfo* target = resolve_link(table, info);
+        if (target) {
+            info->utc_offset = target->utc_offset;
+            memcpy(info->abbreviation, target->abbreviation, sizeof(info->abbreviation));
+        } else {
+            compute_offset(info, now);
+        }
+    }
+    
+    if (g_task_return_error_if_cancelled(task)) {
+        TRACE_END("timezone_offsets");
+        return;
+    }
+    
+    SearchIndex* index = build_search_index(table, TRUE);
+    TRACE_END("timezone_offsets");
+    g_task_return_pointer(task, index, (GDestroyNotify)search_index_free);
+}
+
+void timezone_table_compute_offsets_async(TimezoneTable* table, GCancellable* cancellable,
+                                          GAsyncReadyCallback callback, gpointer user_data) {
+    GTask* task = g_task_new(NULL, cancellable, callback, user_data);
+    g_task_set_task_data(task, table, NULL);
+    g_task_run_in_thread(task, compute_offsets_thread);
+    g_object_unref(task);
+}
+
+gboolean timezone_table_compute_offsets_finish(TimezoneTable* table, GAsyncResult* result, GError** error) {
+    SearchIndex* index = g_task_propagate_pointer(G_TASK(result), error);
+    if (!index) {
+        return FALSE;
+    }
+    
+    search_index_free(table->search_index);
+    table->search_index = index;
+    table->offsets_ready = TRUE;
+    return TRUE;
+}
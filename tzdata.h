@@ -0,0 +1,50 @@
+#ifndef TZDATA_H
+#define TZDATA_H
+
+#include <gio/gio.h>
+#include "search-index.h"
+
+// One IANA time zone or link. Names point straight into the memory-mapped
+// zone1970.tab/zone.tab/tzdata.zi and are not NUL-terminated.
+typedef struct {
+    const char* name;         // e.g. "America/New_York"
+    const char* countries;    // e.g. "US" or "CH,DE,LI", NULL if unknown
+    const char* link_target;  // zone a tzdata.zi link points to, e.g. "Europe/Berlin"; NULL for a zone
+    guint16 name_len;
+    guint16 countries_len;
+    guint16 link_target_len;
+    gint32 latitude;          // arc seconds, north positive
+    gint32 longitude;         // arc seconds, east positive
+    gint32 utc_offset;        // seconds east of UTC, the target's for a link; valid once offsets_ready is set
+    char abbreviation[8];     // e.g. "EST", valid once offsets_ready is set
+} TimezoneInfo;
+
+typedef struct {
+    GMappedFile* tab_file;       // zone1970.tab
+    GMappedFile* country_file;   // zone.tab, one row per country
+    GMappedFile* zi_file;
+    TimezoneInfo* zones;
+    guint n_zones;
+    SearchIndex* search_index;   // one entry per zone, in table order
+    gboolean offsets_ready;
+} TimezoneTable;
+
+// Maps and parses the tz database. Only pointers into the mapping are
+// stored, which makes this cheap enough to call while building a page.
+// Links such as Europe/Stockholm, which current tzdata folds into another
+// zone, are listed under their own name too.
+TimezoneTable* timezone_table_load(void);
+void timezone_table_free(TimezoneTable* table);
+int timezone_table_find(const TimezoneTable* table, const char* name);
+char* timezone_info_dup_name(const TimezoneInfo* info);
+
+// Computes current UTC offsets and abbreviations on a worker thread, then
+// replaces the search index with one that also covers offsets ("UTC+2", "CEST")
+void timezone_table_compute_offsets_async(TimezoneTable* table, GCancellable* cancellable,
+                                          GAsyncReadyCallback callback, gpointer user_data);
+gboolean timezone_table_compute_offsets_finish(TimezoneTable* table, GAsyncResult* result, GError** error);
+
+// Formats an offset as "UTC+05:30"
+void timezone_format_offset(gint32 utc_offset, char* buffer, gsize size);
+
+#endif // TZDATA_H